@@ -2781,6 +2781,146 @@ common_params_context common_params_parser_init(common_params & params, llama_ex
             params.ssl_file_cert = value;
         }
     ).set_examples({LLAMA_EXAMPLE_SERVER}).set_env("LLAMA_ARG_SSL_CERT_FILE"));
+    add_opt(common_arg(
+        {"--ssl-session-timeout"}, "N",
+        string_format("lifetime of the resumable TLS sessions and session tickets in seconds (default: %d)", params.ssl_session_timeout),
+        [](common_params & params, int value) {
+            params.ssl_session_timeout = value;
+        }
+    ).set_examples({LLAMA_EXAMPLE_SERVER}).set_env("LLAMA_ARG_SSL_SESSION_TIMEOUT"));
+    add_opt(common_arg(
+        {"--attested-cert-ttl"}, "N",
+        string_format("validity window of the cached attested certificate served by /provide-quote in seconds, refreshed in the background before it ends, 0 = new certificate for each request (default: %d)", params.attested_cert_ttl),
+        [](common_params & params, int value) {
+            params.attested_cert_ttl = value;
+        }
+    ).set_examples({LLAMA_EXAMPLE_SERVER}).set_env("LLAMA_ARG_ATTESTED_CERT_TTL"));
+    add_opt(common_arg(
+        {"--acme-domain"}, "DOMAIN[,DOMAIN...]",
+        "renew the certificate of --ssl-cert-file with ACME for these domains, in the background; the http-01 challenges are served by the server, which must be reachable on port 80 of the domains or redirected to from there (default: no renewal)",
+        [](common_params & params, const std::string & value) {
+            for (const auto & domain : string_split<std::string>(value, ',')) {
+                if (!domain.empty()) {
+                    params.acme_domains.push_back(domain);
+                }
+            }
+        }
+    ).set_examples({LLAMA_EXAMPLE_SERVER}).set_env("LLAMA_ARG_ACME_DOMAIN"));
+    add_opt(common_arg(
+        {"--acme-account-key"}, "FNAME",
+        "path to the PEM-encoded ACME account key, generated if it does not exist (default: --ssl-key-file with an .acme-account suffix)",
+        [](common_params & params, const std::string & value) {
+            params.acme_account_key = value;
+        }
+    ).set_examples({LLAMA_EXAMPLE_SERVER}).set_env("LLAMA_ARG_ACME_ACCOUNT_KEY"));
+    add_opt(common_arg(
+        {"--acme-directory"}, "URL",
+        string_format("directory URL of the ACME CA (default: %s)", params.acme_directory.c_str()),
+        [](common_params & params, const std::string & value) {
+            params.acme_directory = value;
+        }
+    ).set_examples({LLAMA_EXAMPLE_SERVER}).set_env("LLAMA_ARG_ACME_DIRECTORY"));
+    add_opt(common_arg(
+        {"--acme-renew-before"}, "N",
+        string_format("renew the certificate when it expires within N days (default: %d)", params.acme_renew_before),
+        [](common_params & params, int value) {
+            params.acme_renew_before = value;
+        }
+    ).set_examples({LLAMA_EXAMPLE_SERVER}).set_env("LLAMA_ARG_ACME_RENEW_BEFORE"));
+    add_opt(common_arg(
+        {"--rag-embd-model"}, "FNAME",
+        "path to a dedicated embedding model for the RAG endpoints (default: use the generation model)",
+        [](common_params & params, const std::string & value) {
+            params.rag_embd_model = value;
+        }
+    ).set_examples({LLAMA_EXAMPLE_SERVER}).set_env("LLAMA_ARG_RAG_EMBD_MODEL"));
+    add_opt(common_arg(
+        {"--rag-rerank-model"}, "FNAME",
+        "path to a dedicated reranking model for the RAG endpoints (default: use the generation model)",
+        [](common_params & params, const std::string & value) {
+            params.rag_rerank_model = value;
+        }
+    ).set_examples({LLAMA_EXAMPLE_SERVER}).set_env("LLAMA_ARG_RAG_RERANK_MODEL"));
+    add_opt(common_arg(
+        {"--rag-parallel"}, "N",
+        string_format("number of slots of each dedicated RAG model (default: %d)", params.rag_n_parallel),
+        [](common_params & params, int value) {
+            params.rag_n_parallel = value;
+        }
+    ).set_examples({LLAMA_EXAMPLE_SERVER}).set_env("LLAMA_ARG_RAG_PARALLEL"));
+    add_opt(common_arg(
+        {"--rag-ctx-size"}, "N",
+        string_format("context size of each dedicated RAG model, shared by its slots (default: %d)", params.rag_n_ctx),
+        [](common_params & params, int value) {
+            params.rag_n_ctx = value;
+        }
+    ).set_examples({LLAMA_EXAMPLE_SERVER}).set_env("LLAMA_ARG_RAG_CTX_SIZE"));
+    add_opt(common_arg(
+        {"--rag-threads"}, "N",
+        "number of threads of each dedicated RAG model (default: same as --threads)",
+        [](common_params & params, int value) {
+            params.rag_n_threads = value;
+        }
+    ).set_examples({LLAMA_EXAMPLE_SERVER}).set_env("LLAMA_ARG_RAG_THREADS"));
+    add_opt(common_arg(
+        {"--rag-recipient-key-file"}, "FNAME",
+        "path to a file containing the hex private key the RAG chunks are encrypted for, used by the requests that do not send a recipient_private_key (default: none)",
+        [](common_params & params, const std::string & value) {
+            std::ifstream key_file(value);
+            if (!key_file) {
+                throw std::runtime_error(string_format("error: failed to open file '%s'\n", value.c_str()));
+            }
+            std::string key;
+            std::getline(key_file, key);
+            key.erase(std::remove_if(key.begin(), key.end(), ::isspace), key.end());
+            if (key.size() != 64) {
+                throw std::invalid_argument(string_format("error: '%s' does not contain a 64 hex digits key\n", value.c_str()));
+            }
+            params.rag_recipient_key = key;
+        }
+    ).set_examples({LLAMA_EXAMPLE_SERVER}).set_env("LLAMA_ARG_RAG_RECIPIENT_KEY_FILE"));
+    add_opt(common_arg(
+        {"--model-swap-timeout"}, "N",
+        string_format("time a model change waits for the requests using the model to finish, in seconds; new requests get a 503 meanwhile, and the change fails if they are not done in time (default: %d)", params.model_swap_timeout),
+        [](common_params & params, int value) {
+            params.model_swap_timeout = value;
+        }
+    ).set_examples({LLAMA_EXAMPLE_SERVER}).set_env("LLAMA_ARG_MODEL_SWAP_TIMEOUT"));
+    add_opt(common_arg(
+        {"--model-pool"}, "N",
+        string_format("serve the requests whose \"model\" field names another GGUF file of the directory of the model with that model, loaded on demand; the least recently used ones are unloaded to keep their files within N MiB (default: %d, 0 = disabled)", params.model_pool_mib),
+        [](common_params & params, int value) {
+            params.model_pool_mib = value;
+        }
+    ).set_examples({LLAMA_EXAMPLE_SERVER}).set_env("LLAMA_ARG_MODEL_POOL"));
+    add_opt(common_arg(
+        {"--model-pool-parallel"}, "N",
+        string_format("number of slots of each model of the model pool (default: %d)", params.model_pool_parallel),
+        [](common_params & params, int value) {
+            params.model_pool_parallel = value;
+        }
+    ).set_examples({LLAMA_EXAMPLE_SERVER}).set_env("LLAMA_ARG_MODEL_POOL_PARALLEL"));
+    add_opt(common_arg(
+        {"--model-pool-ctx-size"}, "N",
+        string_format("context size of each model of the model pool, shared by its slots (default: %d)", params.model_pool_n_ctx),
+        [](common_params & params, int value) {
+            params.model_pool_n_ctx = value;
+        }
+    ).set_examples({LLAMA_EXAMPLE_SERVER}).set_env("LLAMA_ARG_MODEL_POOL_CTX_SIZE"));
+    add_opt(common_arg(
+        {"--trace"}, "N",
+        string_format("trace the requests: keep their last N spans in memory, for GET /trace/{id} (default: %d, 0 = disabled)", params.trace_n_spans),
+        [](common_params & params, int value) {
+            params.trace_n_spans = value;
+        }
+    ).set_examples({LLAMA_EXAMPLE_SERVER}).set_env("LLAMA_ARG_TRACE"));
+    add_opt(common_arg(
+        {"--trace-file"}, "FNAME",
+        "with --trace, append the spans to FNAME in the Chrome trace format (default: none)",
+        [](common_params & params, const std::string & value) {
+            params.trace_file = value;
+        }
+    ).set_examples({LLAMA_EXAMPLE_SERVER}).set_env("LLAMA_ARG_TRACE_FILE"));
     add_opt(common_arg(
         {"-to", "--timeout"}, "N",
         string_format("server read/write timeout in seconds (default: %d)", params.timeout_read),
@@ -2789,6 +2929,20 @@ common_params_context common_params_parser_init(common_params & params, llama_ex
             params.timeout_write = value;
         }
     ).set_examples({LLAMA_EXAMPLE_SERVER}).set_env("LLAMA_ARG_TIMEOUT"));
+    add_opt(common_arg(
+        {"--keep-alive-timeout"}, "N",
+        string_format("HTTP keep-alive timeout in seconds, each idle connection holds an HTTP thread (default: %d)", params.keep_alive_timeout),
+        [](common_params & params, int value) {
+            params.keep_alive_timeout = value;
+        }
+    ).set_examples({LLAMA_EXAMPLE_SERVER}).set_env("LLAMA_ARG_KEEP_ALIVE_TIMEOUT"));
+    add_opt(common_arg(
+        {"--keep-alive-max"}, "N",
+        string_format("max number of requests per HTTP keep-alive connection (default: %d)", params.keep_alive_max),
+        [](common_params & params, int value) {
+            params.keep_alive_max = value;
+        }
+    ).set_examples({LLAMA_EXAMPLE_SERVER}).set_env("LLAMA_ARG_KEEP_ALIVE_MAX"));
     add_opt(common_arg(
         {"--threads-http"}, "N",
         string_format("number of threads used to process HTTP requests (default: %d)", params.n_threads_http),
@@ -2806,6 +2960,79 @@ common_params_context common_params_parser_init(common_params & params, llama_ex
             params.n_cache_reuse = value;
         }
     ).set_examples({LLAMA_EXAMPLE_SERVER}).set_env("LLAMA_ARG_CACHE_REUSE"));
+    add_opt(common_arg(
+        {"--kv-page-size"}, "N",
+        string_format("share the KV cache between the slots: each slot can grow up to the whole context by taking pages of N tokens from a common pool, the cached prompts of the idle slots are evicted when the pool is empty, and the requests wait for free pages (default: %d, 0 = fixed context of n_ctx / n_parallel per slot)", params.kv_page_size),
+        [](common_params & params, int value) {
+            if (value < 0) {
+                throw std::invalid_argument("--kv-page-size must be positive");
+            }
+            params.kv_page_size = value;
+        }
+    ).set_examples({LLAMA_EXAMPLE_SERVER}).set_env("LLAMA_ARG_KV_PAGE_SIZE"));
+    add_opt(common_arg(
+        {"--no-prefix-cache"},
+        string_format("only reuse the prompt cached by the slot itself, rather than the longest prefix cached by any slot (default: %s)", params.prefix_cache ? "any slot" : "own slot"),
+        [](common_params & params) {
+            params.prefix_cache = false;
+        }
+    ).set_examples({LLAMA_EXAMPLE_SERVER}).set_env("LLAMA_ARG_NO_PREFIX_CACHE"));
+    add_opt(common_arg(
+        {"--kv-spill-ram"}, "N",
+        string_format("keep the prompt caches that the slots drop in N MiB of host RAM, and load them back when a later prompt starts with them (default: %d, 0 = disabled)", params.kv_spill_ram_mib),
+        [](common_params & params, int value) {
+            params.kv_spill_ram_mib = value;
+        }
+    ).set_examples({LLAMA_EXAMPLE_SERVER}).set_env("LLAMA_ARG_KV_SPILL_RAM"));
+    add_opt(common_arg(
+        {"--kv-spill-dir"}, "PATH",
+        "directory where the prompt caches are written when --kv-spill-ram is full (default: none, the least recently used ones are dropped)",
+        [](common_params & params, const std::string & value) {
+            params.kv_spill_dir = value;
+        }
+    ).set_examples({LLAMA_EXAMPLE_SERVER}).set_env("LLAMA_ARG_KV_SPILL_DIR"));
+    add_opt(common_arg(
+        {"--kv-spill-disk"}, "N",
+        string_format("max disk space of the prompt caches in --kv-spill-dir in MiB, the least recently used ones are deleted (default: %d)", params.kv_spill_disk_mib),
+        [](common_params & params, int value) {
+            params.kv_spill_disk_mib = value;
+        }
+    ).set_examples({LLAMA_EXAMPLE_SERVER}).set_env("LLAMA_ARG_KV_SPILL_DISK"));
+    add_opt(common_arg(
+        {"--kv-spill-encrypt"},
+        "encrypt the prompt caches written to --kv-spill-dir with AES-GCM, under a key that is only held in memory (default: disabled)",
+        [](common_params & params) {
+            params.kv_spill_encrypt = true;
+        }
+    ).set_examples({LLAMA_EXAMPLE_SERVER}).set_env("LLAMA_ARG_KV_SPILL_ENCRYPT"));
+    add_opt(common_arg(
+        {"--prefill-budget"}, "N",
+        string_format("max number of prompt tokens evaluated with each token of the generating slots, so that long prompts are prefilled in chunks between them (default: %d, 0 = n_ubatch, -1 = n_batch)", params.n_prefill_budget),
+        [](common_params & params, int value) {
+            params.n_prefill_budget = value;
+        }
+    ).set_examples({LLAMA_EXAMPLE_SERVER}).set_env("LLAMA_ARG_PREFILL_BUDGET"));
+    add_opt(common_arg(
+        {"--target-itl"}, "N",
+        string_format("target inter-token latency of the generating slots in ms while prompts are prefilled: the prefill budget shrinks when the batches take longer, and grows back up to --prefill-budget (default: %d, 0 = fixed budget)", params.target_itl_ms),
+        [](common_params & params, int value) {
+            params.target_itl_ms = value;
+        }
+    ).set_examples({LLAMA_EXAMPLE_SERVER}).set_env("LLAMA_ARG_TARGET_ITL"));
+    add_opt(common_arg(
+        {"--queue-max"}, "N",
+        string_format("max number of requests waiting for a slot in each priority class (interactive, batch, background), the next ones are rejected (default: %d, 0 = unlimited)", params.n_queue_max),
+        [](common_params & params, int value) {
+            params.n_queue_max = value;
+        }
+    ).set_examples({LLAMA_EXAMPLE_SERVER}).set_env("LLAMA_ARG_QUEUE_MAX"));
+    add_opt(common_arg(
+        {"--slo-ttft"}, "N",
+        string_format("time to first token objective of the interactive requests in ms: the interactive requests that cannot start in time are rejected, and so are the batch and background requests while the interactive ones miss it (default: %d, 0 = none)", params.slo_ttft_ms),
+        [](common_params & params, int value) {
+            params.slo_ttft_ms = value;
+        }
+    ).set_examples({LLAMA_EXAMPLE_SERVER}).set_env("LLAMA_ARG_SLO_TTFT"));
     add_opt(common_arg(
         {"--metrics"},
         string_format("enable prometheus compatible metrics endpoint (default: %s)", params.endpoint_metrics ? "enabled" : "disabled"),
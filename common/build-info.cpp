@@ -1,4 +1,4 @@
-int LLAMA_BUILD_NUMBER = 16;
-char const *LLAMA_COMMIT = "7c735fc";
-char const *LLAMA_COMPILER = "cc (Ubuntu 11.4.0-1ubuntu1~22.04) 11.4.0";
+int LLAMA_BUILD_NUMBER = 41;
+char const *LLAMA_COMMIT = "041485f";
+char const *LLAMA_COMPILER = "cc (Debian 12.2.0-14+deb12u1) 12.2.0";
 char const *LLAMA_BUILD_TARGET = "x86_64-linux-gnu";
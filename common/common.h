@@ -359,7 +359,19 @@ struct common_params {
     int32_t timeout_read   = 600;          // http read timeout in seconds
     int32_t timeout_write  = timeout_read; // http write timeout in seconds
     int32_t n_threads_http = -1;           // number of threads to process HTTP requests (TODO: support threadpool)
+    int32_t keep_alive_timeout = 15;       // http keep-alive timeout in seconds (an idle connection holds an HTTP thread)
+    int32_t keep_alive_max     = 1000;     // max number of requests per keep-alive connection
     int32_t n_cache_reuse  = 0;            // min chunk size to reuse from the cache via KV shifting
+    int32_t kv_page_size   = 0;            // share the KV cache between the slots in pages of this many tokens (0 = n_ctx / n_parallel per slot)
+    bool    prefix_cache   = true;         // start the prompts from the longest prefix cached by any slot
+    int32_t kv_spill_ram_mib  = 0;         // host RAM for the prompt caches dropped by the slots in MiB (0 = disabled)
+    int32_t kv_spill_disk_mib = 10240;     // disk space for the prompt caches spilled from the RAM in MiB
+    bool    kv_spill_encrypt  = false;     // encrypt the spilled prompt caches on disk
+    std::string kv_spill_dir  = "";        // directory of the prompt caches spilled from the RAM (empty = no disk tier) // NOLINT
+    int32_t n_prefill_budget = 0;          // max prompt tokens per batch while other slots generate (0 = n_ubatch, -1 = n_batch)
+    int32_t target_itl_ms    = 0;          // adapt the prefill budget to this inter-token latency in ms (0 = fixed budget)
+    int32_t n_queue_max      = 0;          // max requests waiting for a slot per priority class (0 = unlimited)
+    int32_t slo_ttft_ms      = 0;          // time to first token objective of the interactive requests in ms (0 = none)
 
     std::string hostname      = "127.0.0.1";
     std::string public_path   = "";                                                                         // NOLINT
@@ -373,6 +385,38 @@ struct common_params {
     std::string ssl_file_key  = "";                                                                         // NOLINT
     std::string ssl_file_cert = "";                                                                         // NOLINT
     std::string ssl_self_cert_common = "";
+    int32_t ssl_session_timeout = 7200; // lifetime of the resumable TLS sessions (session cache and tickets) in seconds
+    int32_t attested_cert_ttl   = 3600; // validity window of the cached attested certificate of /provide-quote in seconds
+
+    // certificate of ssl_file_cert renewed in the background with ACME (empty = no renewal)
+    std::vector<std::string> acme_domains;
+    std::string acme_account_key = "";                                                                      // NOLINT
+    std::string acme_directory   = "https://acme-v02.api.letsencrypt.org/directory";                        // NOLINT
+    int32_t acme_renew_before    = 30;   // renew when the certificate expires within this many days
+
+    // dedicated models for the RAG endpoints (empty = use the generation model)
+    std::string rag_embd_model   = "";                                                                      // NOLINT
+    std::string rag_rerank_model = "";                                                                      // NOLINT
+    int32_t rag_n_parallel = 2;    // number of slots of each RAG model
+    int32_t rag_n_ctx      = 4096; // context size of each RAG model, shared by its slots
+    int32_t rag_n_threads  = -1;   // threads of each RAG model (-1 = same as the generation model)
+
+    // hex private key the RAG chunks are encrypted for, when a request does not carry its own (empty = required)
+    std::string rag_recipient_key = "";                                                                     // NOLINT
+
+    // a model change waits at most this long for the requests using the model to finish, in seconds
+    int32_t model_swap_timeout = 30;
+
+    // models loaded on demand next to the generation model, for the requests whose "model" field names another
+    // GGUF file of its directory (0 = disabled)
+    int32_t model_pool_mib      = 0;    // memory budget of these models (GGUF sizes), least recently used unloaded first
+    int32_t model_pool_parallel = 2;    // number of slots of each of them
+    int32_t model_pool_n_ctx    = 4096; // context size of each of them, shared by its slots
+
+    // request tracing: the spans are kept in a ring buffer of trace_n_spans (0 = disabled), and appended to
+    // trace_file (Chrome trace format) if set
+    int32_t     trace_n_spans = 0;
+    std::string trace_file    = ""; // NOLINT
 
     // "advanced" endpoints are disabled by default for better security
     bool webui            = true;
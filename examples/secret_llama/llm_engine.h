@@ -2,12 +2,19 @@
  
 #include <vector>
 #include <cstdint>
+#include <condition_variable>
+#include <deque>
+#include <list>
+#include <map>
+#include <mutex>
+#include <thread>
  
 //#include <sdk_v3/route_reflection.h>//OWL WAS HERE
  
 //#include <secret_llama/secret_llama.h>//OWL WAS HERE
 #include <secret_llama.h>
 #include <common/chat.h>//OWL WAS HERE
+#include <crypto_utils.h>
  
 namespace secret_llama
 {
@@ -44,11 +51,16 @@ namespace v1_0
     class llama_cpp_loaded_model : public loaded_model
     {
         llama_model* model_ = nullptr;
+
+        // parsed chat templates, shared by all the sessions of the model, by template override ("" for the model's own)
+        std::mutex chat_templates_mutex_;
+        std::map<std::string, std::shared_ptr<common_chat_templates>> chat_templates_;
     public:
         llama_cpp_loaded_model(llama_model* model, const llm_model& model_config);
         virtual ~llama_cpp_loaded_model(); 
         llama_model* get() const;
         int32_t get_n_embd() const override;
+        std::shared_ptr<common_chat_templates> get_chat_templates(const std::string& chat_template_override);
     };
     
     struct context_deleter
@@ -61,6 +73,8 @@ namespace v1_0
         void operator()(llama_sampler* ptr) const;
     };
 
+    class llama_cpp_batch_engine;
+
      
     struct llama_cpp_context : public chat_context
     {
@@ -80,22 +94,27 @@ namespace v1_0
         };
         std::list<chat_message> msg_strs_;
         bool use_jinja_ = false;
-        int prev_len_ = 0;
- 
-        std::vector<char> formatted_;
+        // render only the messages of the last turn instead of the whole history, see render_turn
+        bool incremental_template_ = true;
  
         llama_batch batch_;
         llama_token new_token_id_;
-        common_chat_templates_ptr chat_templates_;
+        std::shared_ptr<common_chat_templates> chat_templates_;
         // std::vector<std::string> stop_strs_; // To hold stop strings from configuration
  
         std::string current_response_;
  
         std::vector<llama_token> batch_tokens_;
+        // embedding of position 0 of the sequence, for aggregation_rule::FIRST (empty if it had no output)
+        std::vector<float> first_embedding_;
  
         bool user_turn_ = true;
         bool first_pass_ = true;
         uint64_t context_id_;
+
+        // set when the session runs on a shared llama_cpp_batch_engine, ctx_ is then unused
+        std::shared_ptr<llama_cpp_batch_engine> engine_;
+        uint64_t session_id_ = 0;
  
         virtual ~llama_cpp_context(); 
         error_types init();
@@ -115,11 +134,12 @@ namespace v1_0
         // Add a message to `messages` and store its content in `msg_strs`
         void add_message(const char* role, const std::string& text);
  
-        // Helper function to apply the chat template and handle errors
-        int apply_chat_template_with_error_handling(const common_chat_templates* tmpls, const bool append, int& output_length);
+        // Function to apply the chat template to the messages [first, last)
+        int apply_chat_template(const struct common_chat_templates* tmpls, std::list<chat_message>::const_iterator first,
+            std::list<chat_message>::const_iterator last, const bool append, std::string& output);
 
-        // Function to apply the chat template and resize `formatted` if needed
-        int apply_chat_template(const struct common_chat_templates* tmpls, const bool append);
+        // Render the text of the last turn: the end of the previous answer, the new user message and the generation prompt
+        int render_turn(const struct common_chat_templates* tmpls, std::string& output);
 
         // Function to tokenize the prompt
         int tokenize_prompt(const std::string& prompt);
@@ -145,6 +165,107 @@ namespace v1_0
         int ingest(const std::vector<int32_t>& token_ids) override;
 
     };
+
+    /**
+     * @brief Continuous batching for the chat sessions of a model.
+     *
+     * All the sessions share one llama_context, an active session owning one of its sequences. The get_piece
+     * calls pending at a given time are decoded together in one llama_decode, then each session samples
+     * its next token with its own sampler. Single tokens (generation) are scheduled before prompts, and
+     * prompts larger than the remaining batch are split over several steps.
+     *
+     * A session idle for longer than the inactivity timeout is hibernated: its KV state is encrypted with
+     * the session key (held in memory only) and spilled to disk, and its sequence is given back. It is
+     * restored on its next decode. When all the sequences are taken, the least recently used idle session
+     * is hibernated early, so the number of sessions is not bounded by n_seq_max.
+     */
+    class llama_cpp_batch_engine : public std::enable_shared_from_this<llama_cpp_batch_engine>
+    {
+    public:
+        llama_cpp_batch_engine(std::shared_ptr<llama_cpp_loaded_model> model, uint32_t n_seq_max, uint32_t n_ctx_seq, uint32_t n_batch,
+            const std::string& spill_dir = "", uint64_t idle_timeout_ms = 0);
+        ~llama_cpp_batch_engine();
+
+        error_types init();
+
+        // create a chat session of the engine
+        error_types create_context(uint64_t seed, uint64_t context_id, std::shared_ptr<llama_cpp_context>& context);
+
+        uint64_t open_session();
+        void close_session(uint64_t session_id);
+        error_types heart_beat(uint64_t session_id);
+
+        int32_t n_past(uint64_t session_id);
+        uint32_t n_ctx_seq() const { return n_ctx_seq_; }
+        size_t n_hibernated();
+
+        // queue the tokens of a session, blocks until they are decoded and the next token is sampled
+        error_types decode(uint64_t session_id, const llama_token* tokens, int32_t n_tokens, llama_sampler* sampler, llama_token& new_token);
+
+    private:
+        struct session
+        {
+            uint64_t id;
+            llama_seq_id seq_id = -1;   // -1 when not resident
+            int32_t n_past = 0;
+            int64_t t_last_us = 0;
+            bool busy = false;
+            bool hibernated = false;
+
+            aes256_key key;
+            aes_gcm_nonce nonce;
+            aes_gcm_tag tag;
+        };
+
+        struct request
+        {
+            session* sess;
+            const llama_token* tokens;
+            int32_t n_tokens;
+            int32_t n_done = 0;
+            llama_sampler* sampler;
+            llama_token new_token = -1;
+            error_types err = error_types::OK;
+            bool done = false;
+        };
+
+        void loop();
+        void step(std::vector<request*>& requests);
+
+        // the callers hold ctx_mutex_
+        error_types make_resident(session& sess);
+        error_types hibernate(session& sess);
+        error_types restore(session& sess);
+
+        // takes ctx_mutex_
+        void hibernate_idle();
+
+        std::string spill_path(const session& sess) const;
+
+        std::shared_ptr<llama_cpp_loaded_model> model_;
+        std::unique_ptr<llama_context, context_deleter> ctx_;
+        llama_batch batch_{};
+
+        uint32_t n_seq_max_;
+        uint32_t n_ctx_seq_;
+        uint32_t n_batch_;
+        std::string spill_dir_;
+        uint64_t idle_timeout_ms_;
+
+        // guards the llama_context, held during the decode steps and the hibernation
+        std::mutex ctx_mutex_;
+
+        std::mutex mutex_;
+        std::condition_variable cv_pending_;
+        std::condition_variable cv_done_;
+        std::deque<request*> pending_;
+        std::map<uint64_t, std::unique_ptr<session>> sessions_;
+        std::vector<llama_seq_id> free_seqs_;
+        uint64_t next_session_id_ = 1;
+        bool stop_ = false;
+
+        std::thread worker_;
+    };
     //OWL END
    
     class loaded_tokenizer
@@ -6,6 +6,7 @@
 #include <algorithm>
 #include <cstdio>
 #include <string>
+#include <thread>
 #include <vector>
 
 #include "secret_llama.h"
@@ -98,11 +99,9 @@ int main(int argc, char ** argv) {
     ctx0.sampler_ = std::unique_ptr<llama_sampler, secret_llama::v1_0::sampler_deleter>(smpl, secret_llama::v1_0::sampler_deleter{});
     ctx0.msg_strs_ = std::list<secret_llama::v1_0::llama_cpp_context::chat_message>();
     ctx0.use_jinja_ = false;
-    ctx0.prev_len_ = 0;
-    ctx0.formatted_ = std::vector<char>();
     ctx0.batch_ = llama_batch();
     ctx0.new_token_id_ = llama_token() ;
-    ctx0.chat_templates_ = common_chat_templates_ptr();
+    ctx0.chat_templates_ = nullptr;
     // std::vector<std::string> stop_strs_; // To hold stop strings from configuration
  
     ctx0.current_response_ = std::string();
@@ -148,6 +147,49 @@ int main(int argc, char ** argv) {
         LOG("%s", common_token_to_piece(ctx, id).c_str());
     }
     LOG("\n");
+
+    // parallel chats, decoded together through one shared context
+    if (n_parallel > 1) {
+        auto engine = std::make_shared<secret_llama::v1_0::llama_cpp_batch_engine>(p_secret_llama_model, n_parallel, params.n_ctx, params.n_batch);
+        if (engine->init() != secret_llama::v1_0::error_types::OK) {
+            LOG_ERR("%s: error: failed to create the batch engine\n", __func__);
+            return 1;
+        }
+
+        std::vector<std::shared_ptr<secret_llama::v1_0::llama_cpp_context>> chats(n_parallel);
+        std::vector<std::string> responses(n_parallel);
+        for (int i = 0; i < n_parallel; i++) {
+            if (engine->create_context(params.sampling.seed + i, i + 1, chats[i]) != secret_llama::v1_0::error_types::OK) {
+                LOG_ERR("%s: error: failed to create chat %d\n", __func__, i);
+                return 1;
+            }
+        }
+
+        const int64_t t_start = ggml_time_us();
+        std::vector<std::thread> threads;
+        for (int i = 0; i < n_parallel; i++) {
+            threads.emplace_back([&, i]() {
+                chats[i]->add_prompt(std::vector<uint8_t>(params.prompt.begin(), params.prompt.end()));
+                bool complete = false;
+                for (int n = 0; n < n_predict && !complete; n++) {
+                    std::vector<uint8_t> piece;
+                    if (chats[i]->get_piece(piece, complete) != 0) {
+                        break;
+                    }
+                    responses[i].append(piece.begin(), piece.end());
+                }
+            });
+        }
+        for (auto & th : threads) {
+            th.join();
+        }
+        const int64_t t_end = ggml_time_us();
+
+        for (int i = 0; i < n_parallel; i++) {
+            LOG("\nchat %d: %s\n", i, responses[i].c_str());
+        }
+        LOG_INF("\n%s: %d parallel chats in %.2f s\n", __func__, n_parallel, (t_end - t_start) / 1e6f);
+    }
     llama_perf_sampler_print(smpl);
     llama_perf_context_print(ctx);
 
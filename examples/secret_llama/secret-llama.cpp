@@ -12,7 +12,11 @@
 #include <string.h>
 #include <common.h>
 #include <chat.h>
+#include <log.h>
 #include <atomic>//OWL WAS HERE
+#include <cinttypes>
+#include <filesystem>
+#include <fstream>
  
 #define FILE int
  
@@ -48,6 +52,16 @@ inline namespace v1_0
     {
         return model_ ? llama_n_embd(model_) : 0;
     }
+
+    std::shared_ptr<common_chat_templates> llama_cpp_loaded_model::get_chat_templates(const std::string& chat_template_override)
+    {
+        // parsing a jinja template is costly, it is done once per model instead of once per session
+        std::lock_guard<std::mutex> lock(chat_templates_mutex_);
+        auto& tmpls = chat_templates_[chat_template_override];
+        if (!tmpls)
+            tmpls = common_chat_templates_init(model_, chat_template_override);
+        return tmpls;
+    }
  
     void context_deleter::operator()(llama_context* ptr) const
     {
@@ -85,6 +99,8 @@ inline namespace v1_0
         llama_cpp_context::~llama_cpp_context()
         {
             // APP_DEBUG("[CTX {}] DESTRUCTOR: Freeing context.", std::to_string(context_id_));//OWL WAS HERE
+            if (engine_)
+                engine_->close_session(session_id_);
         }
  
         error_types llama_cpp_context::init()
@@ -94,7 +110,7 @@ inline namespace v1_0
             {
                 // initialize the context
                 ctx_params_ = llama_context_default_params();
-                ctx_params_.n_ctx = ctx_params_.n_batch;
+                ctx_params_.n_ctx = engine_ ? engine_->n_ctx_seq() : ctx_params_.n_batch;
  
                 // just the basics for now
                 /*OWL WAS HERE
@@ -143,8 +159,10 @@ inline namespace v1_0
                     }
                 }
                 OWL WAS HERE */ 
-                ctx_ = std::unique_ptr<llama_context, context_deleter>(llama_init_from_model(model_->get(), ctx_params_));
-                if (!ctx_)
+                // sessions of a batch engine decode through the shared context
+                if (!engine_)
+                    ctx_ = std::unique_ptr<llama_context, context_deleter>(llama_init_from_model(model_->get(), ctx_params_));
+                if (!ctx_ && !engine_)
                 {
                     // APP_ERR("[CTX {}] failed to create the llama_context", std::to_string(context_id_));//OWL WAS HERE
                     return error_types::INVALID_CONTEXT;
@@ -205,12 +223,11 @@ inline namespace v1_0
                 }
 */
 
-                chat_templates_ = common_chat_templates_init(model_->get(), chat_template_str);
+                chat_templates_ = model_->get_chat_templates(chat_template_str);
                 // APP_INFO("[CTX {}] Chat template: is explicit {}, value: \"{}\"", std::to_string(context_id_),
                 //     common_chat_templates_was_explicit(chat_templates_.get()) ? "true" : "false",
                 //     common_chat_templates_source(chat_templates_.get()));//OWL WAS HERE
- 
-                formatted_.resize(llama_n_ctx(ctx_.get()));
+
                 // APP_DEBUG("[CTX {}] Initialization complete. Context size: {}", std::to_string(context_id_),
                 //     llama_n_ctx(ctx_.get()));//OWL WAS HERE
                 return error_types::OK;
@@ -276,45 +293,97 @@ inline namespace v1_0
         // Add a message to `messages` and store its content in `msg_strs`
         void llama_cpp_context::add_message(const char* role, const std::string& text) { msg_strs_.push_back({role, std::move(text)}); }
  
-        // Helper function to apply the chat template and handle errors
-        int llama_cpp_context::apply_chat_template_with_error_handling(const common_chat_templates* tmpls, const bool append, int& output_length)
-        {
-            const int new_len = apply_chat_template(tmpls, append);
-            if (new_len < 0)
-            {
-                // APP_ERR("failed to apply the chat template");//OWL WAS HERE
-                return -1;
-            }
-            output_length = new_len;
-            return 0;
-        }
- 
-        // Function to apply the chat template and resize `formatted` if needed
-        int llama_cpp_context::apply_chat_template(const struct common_chat_templates* tmpls, const bool append)
+        // Function to apply the chat template to the messages [first, last)
+        int llama_cpp_context::apply_chat_template(const struct common_chat_templates* tmpls, std::list<chat_message>::const_iterator first,
+            std::list<chat_message>::const_iterator last, const bool append, std::string& output)
         {
             common_chat_templates_inputs inputs;
-            for (const auto& msg : msg_strs_)
+            for (auto it = first; it != last; ++it)
             {
                 common_chat_msg cmsg;
-                cmsg.role = msg.role;
-                cmsg.content = msg.content;
-                inputs.messages.push_back(cmsg);
+                cmsg.role = it->role;
+                cmsg.content = it->content;
+                inputs.messages.push_back(std::move(cmsg));
             }
             inputs.add_generation_prompt = append;
             inputs.use_jinja = use_jinja_;
  
-            auto chat_params = common_chat_templates_apply(tmpls, inputs);
-            auto result = chat_params.prompt;
-            formatted_.resize(result.size() + 1);
-            memcpy(formatted_.data(), result.c_str(), result.size() + 1);
-            return result.size();
+            try
+            {
+                output = common_chat_templates_apply(tmpls, inputs).prompt;
+            }
+            catch (const std::exception& e)
+            {
+                // APP_ERR("failed to apply the chat template: {}", e.what());//OWL WAS HERE
+                return -1;
+            }
+            return output.size();
+        }
+
+        // Render the text of the last turn: the end of the previous answer, the new user message and the generation prompt
+        //
+        // The turn is the difference between the rendering of the history with the new user message (and the generation
+        // prompt) and the rendering of the history without it. Rendering the whole history on every turn makes each
+        // turn slower than the previous one, so by default only a window starting at the previous user message is
+        // rendered: it ends with the same turn as long as the template renders a message independently of the messages
+        // before it, and it keeps the user/assistant alternation that some templates enforce.
+        int llama_cpp_context::render_turn(const struct common_chat_templates* tmpls, std::string& output)
+        {
+            const auto last = std::prev(msg_strs_.end());
+            if (last == msg_strs_.begin() || strcmp(std::prev(last)->role, "assistant") != 0)
+            {
+                // first turn, everything is new
+                return apply_chat_template(tmpls, msg_strs_.begin(), msg_strs_.end(), true, output);
+            }
+
+            auto render_from = [&](std::list<chat_message>::const_iterator first, std::string& turn)
+            {
+                std::string history;
+                std::string full;
+                if (apply_chat_template(tmpls, first, last, false, history) < 0
+                    || apply_chat_template(tmpls, first, msg_strs_.end(), true, full) < 0
+                    || full.compare(0, history.size(), history) != 0)
+                {
+                    return false;
+                }
+                turn = full.substr(history.size());
+                return true;
+            };
+
+            if (incremental_template_ && msg_strs_.size() >= 3)
+            {
+                const auto first = std::prev(last, 2);
+                std::string turn;
+                if (strcmp(first->role, "user") == 0 && render_from(first, turn))
+                {
+#ifndef NDEBUG
+                    std::string expected;
+                    if (!render_from(msg_strs_.begin(), expected) || expected != turn)
+                    {
+                        LOG_WRN("%s: [CTX %" PRIu64 "] the incremental rendering of the chat template differs from the full one, "
+                            "falling back to full renderings\n", __func__, context_id_);
+                        incremental_template_ = false;
+                        output = std::move(expected);
+                        return output.size();
+                    }
+#endif
+                    output = std::move(turn);
+                    return output.size();
+                }
+                // the window did not render as a suffix of the history, this template needs all of it
+                incremental_template_ = false;
+            }
+
+            if (!render_from(msg_strs_.begin(), output))
+                return -1;
+            return output.size();
         }
  
         // Function to tokenize the prompt
         int llama_cpp_context::tokenize_prompt(const std::string& prompt)
         {
             const llama_vocab* vocab = llama_model_get_vocab(model_->get());
-            const bool is_first = llama_kv_self_used_cells(ctx_.get()) == 0;
+            const bool is_first = engine_ ? engine_->n_past(session_id_) == 0 : llama_kv_self_used_cells(ctx_.get()) == 0;
  
             const int n_prompt_tokens = -llama_tokenize(vocab, prompt.c_str(), prompt.size(), NULL, 0, is_first, true);
             batch_tokens_.resize(n_prompt_tokens);
@@ -331,8 +400,8 @@ inline namespace v1_0
         // Check if we have enough space in the context to evaluate this batch
         int llama_cpp_context::check_context_size()
         {
-            const int n_ctx = llama_n_ctx(ctx_.get());
-            const int n_ctx_used = llama_kv_self_used_cells(ctx_.get());
+            const int n_ctx = engine_ ? (int)engine_->n_ctx_seq() : llama_n_ctx(ctx_.get());
+            const int n_ctx_used = engine_ ? engine_->n_past(session_id_) : llama_kv_self_used_cells(ctx_.get());
             if (n_ctx_used + batch_.n_tokens > n_ctx)
             {
                 // APP_ERR("[CTX {}] LOG: context size exceeded. Used: {}, Batch: {}, Total Ctx: {}",
@@ -383,12 +452,6 @@ inline namespace v1_0
                     //     std::to_string(context_id_), current_response_.c_str());//OWL WAS HERE
                     add_message("assistant", current_response_);
                     current_response_.clear();
-                    if (apply_chat_template_with_error_handling(chat_templates_.get(), false, prev_len_) < 0)
-                    {
-                        // APP_ERR("[CTX {}] Unable to apply chat template for assistant message.",
-                        //     std::to_string(context_id_));//OWL WAS HERE
-                        return to_standard_return_type(error_types::UNABLE_TO_APPLY_CHAT_TEMPLATE);
-                    }
                 }
  
                 if (first_pass_)
@@ -412,16 +475,12 @@ inline namespace v1_0
                 // APP_DEBUG("[CTX {}] Adding user message: \"{}\"", std::to_string(context_id_), prompt_str.c_str());//OWL WAS HERE
                 add_message("user", prompt_str);
  
-                int new_len;
-                if (apply_chat_template_with_error_handling(chat_templates_.get(), true, new_len) < 0)
+                std::string prompt_to_tokenize;
+                if (render_turn(chat_templates_.get(), prompt_to_tokenize) < 0)
                 {
                     // APP_ERR("[CTX {}] Unable to apply chat template for user message.", std::to_string(context_id_));//OWl WAS HERE
                     return to_standard_return_type(error_types::UNABLE_TO_APPLY_CHAT_TEMPLATE);
                 }
-                // APP_DEBUG("[CTX {}] Chat template applied. prev_len_={}, new_len={}", std::to_string(context_id_),
-                //     prev_len_, new_len);//OWL WAS HERE
- 
-                std::string prompt_to_tokenize(formatted_.begin() + prev_len_, formatted_.begin() + new_len);
                 // APP_DEBUG("[CTX {}] Final prompt segment to tokenize: \"{}\"", std::to_string(context_id_),
                 //     prompt_to_tokenize.c_str());//OWL WAS HERE
  
@@ -437,10 +496,6 @@ inline namespace v1_0
                 batch_ = llama_batch_get_one(batch_tokens_.data(), batch_tokens_.size());
                 // APP_DEBUG("[CTX {}] Batch created. n_tokens={}", 1, batch_.n_tokens);//OWL WAS HERE
  
-                // Update prev_len_ with the latest total length so the *next* call to add_prompt
-                // has the correct starting point for slicing.
-                prev_len_ = new_len;
- 
                 first_pass_ = false;
                 user_turn_ = false;
                 // APP_DEBUG("[CTX {}] END", std::to_string(context_id_));//OWL WAS HERE
@@ -481,17 +536,30 @@ inline namespace v1_0
                 // APP_DEBUG("Decoding batch... n_tokens={}, KV cache used={}", 1, batch_.n_tokens,
                 //     (int)llama_kv_self_used_cells(ctx_.get()));//OWL WAS HERE
  
-                // Process the batch (the full prompt on the first call, then one token at a time).
-                if (llama_decode(ctx_.get(), batch_))
+                if (engine_)
                 {
-                    // APP_ERR("[CTX {}] llama_decode failed.", std::to_string(context_id_));//OWl WAS HERE
-                    return to_standard_return_type(error_types::DECODE_FAILURE);
+                    // decoded together with the pending tokens of the other sessions, and sampled
+                    auto err = engine_->decode(session_id_, batch_.token, batch_.n_tokens, sampler_.get(), new_token_id_);
+                    if (err != error_types::OK)
+                        return to_standard_return_type(err);
                 }
-                // APP_DEBUG("[CTX {}] Decode successful. KV cache now used={}", std::to_string(context_id_),
-                //     (int)llama_kv_self_used_cells(ctx_.get()));//OWL WAS HERE
+                else
+                {
+                    // Process the batch (the full prompt on the first call, then one token at a time).
+                    // Only the last token has an output here, so a new sequence has no row for aggregation_rule::FIRST
+                    if (llama_kv_self_n_tokens(ctx_.get()) == 0)
+                        first_embedding_.clear();
+                    if (llama_decode(ctx_.get(), batch_))
+                    {
+                        // APP_ERR("[CTX {}] llama_decode failed.", std::to_string(context_id_));//OWl WAS HERE
+                        return to_standard_return_type(error_types::DECODE_FAILURE);
+                    }
+                    // APP_DEBUG("[CTX {}] Decode successful. KV cache now used={}", std::to_string(context_id_),
+                    //     (int)llama_kv_self_used_cells(ctx_.get()));//OWL WAS HERE
  
-                // Sample the next token from the logits produced by llama_decode.
-                new_token_id_ = llama_sampler_sample(sampler_.get(), ctx_.get(), -1);
+                    // Sample the next token from the logits produced by llama_decode.
+                    new_token_id_ = llama_sampler_sample(sampler_.get(), ctx_.get(), -1);
+                }
                 // APP_DEBUG("[CTX {}] Sampled token ID: {}", std::to_string(context_id_), new_token_id_);//OWL WAS HERE
  
                 const llama_vocab* vocab = llama_model_get_vocab(model_->get());
@@ -567,6 +635,9 @@ inline namespace v1_0
  
         int llama_cpp_context::get_aggregate_embeddings(uint32_t window_size, aggregation_rule agg_rule, std::vector<float>& embeddings)
         {
+            // the shared context of a batch engine does not keep the embeddings
+            if (!ctx_)
+                return to_standard_return_type(error_types::INVALID_CONTEXT);
             int n_embd = llama_model_n_embd(model_->get());
             switch (agg_rule)
             {
@@ -599,12 +670,55 @@ inline namespace v1_0
                     embeddings = std::move(average);
                     break;
                 }
-                // Implement other aggregation rules as needed
+                case aggregation_rule::FIRST:
+                {
+                    // row of position 0, kept by ingest() since the window only holds the outputs of the last batch
+                    if (first_embedding_.empty())
+                        return to_standard_return_type(error_types::INVALID_INTERACTION_TYPE);
+                    embeddings = first_embedding_;
+                    break;
+                }
                 case aggregation_rule::MAXIMUM:
                 case aggregation_rule::MINIMUM:
                 case aggregation_rule::MEDIAN:
+                {
+                    // rows of the window, oldest token first
+                    std::vector<const float*> rows;
+                    for(int i = -(int)window_size; i <= -1; i++)
+                        {
+                            auto embeddings_ptr = llama_get_embeddings_ith(ctx_.get(),i);
+                            if (!embeddings_ptr) {
+                                throw std::runtime_error("Failed to get embeddings. Embeddings might not be available or 'embedding' parameter not set.");
+                            }
+                            rows.push_back(embeddings_ptr);
+                        }
+                    if (rows.empty())
+                        return to_standard_return_type(error_types::INVALID_INTERACTION_TYPE);
+                    std::vector<float> aggregate(rows.front(), rows.front() + n_embd);
+                    if (agg_rule == aggregation_rule::MAXIMUM || agg_rule == aggregation_rule::MINIMUM)
+                    {
+                        for (size_t r = 1; r < rows.size(); r++)
+                            for (int j = 0; j < n_embd; j++)
+                                aggregate[j] = (agg_rule == aggregation_rule::MAXIMUM) ? std::max(aggregate[j], rows[r][j]) : std::min(aggregate[j], rows[r][j]);
+                    }
+                    else if (agg_rule == aggregation_rule::MEDIAN)
+                    {
+                        std::vector<float> column(rows.size());
+                        const size_t mid = rows.size() / 2;
+                        for (int j = 0; j < n_embd; j++)
+                        {
+                            for (size_t r = 0; r < rows.size(); r++)
+                                column[r] = rows[r][j];
+                            std::nth_element(column.begin(), column.begin() + mid, column.end());
+                            aggregate[j] = column[mid];
+                            if (rows.size() % 2 == 0)
+                                aggregate[j] = (aggregate[j] + *std::max_element(column.begin(), column.begin() + mid)) / 2.0f;
+                        }
+                    }
+                    embeddings = std::move(aggregate);
+                    break;
+                }
                 case aggregation_rule::ANY:
-                case aggregation_rule::FIRST:
                 default:
                     return to_standard_return_type(error_types::INVALID_INTERACTION_TYPE);
             }
@@ -680,6 +794,9 @@ inline namespace v1_0
         int llama_cpp_context::ingest(const std::vector<int32_t>& token_ids)
         {
             // This method should ingest the provided token IDs into the context.
+            if (!ctx_) {
+                return to_standard_return_type(error_types::INVALID_CONTEXT);
+            }
             if (token_ids.empty()) {
                 return to_standard_return_type(error_types::INVALID_TOKENS);
             }
@@ -705,12 +822,442 @@ inline namespace v1_0
                 llama_batch_free(batch_);
                 throw std::runtime_error("Failed to decode tokens.");
             }
+            if (pos0 == 0)
+            {
+                auto embeddings_ptr = llama_get_embeddings_ith(ctx_.get(), 0);
+                if (embeddings_ptr)
+                    first_embedding_.assign(embeddings_ptr, embeddings_ptr + llama_model_n_embd(model_->get()));
+                else
+                    first_embedding_.clear();
+            }
  
             llama_batch_free(batch_);
  
             return to_standard_return_type(error_types::OK);
         }
  
+        llama_cpp_batch_engine::llama_cpp_batch_engine(std::shared_ptr<llama_cpp_loaded_model> model, uint32_t n_seq_max,
+            uint32_t n_ctx_seq, uint32_t n_batch, const std::string& spill_dir, uint64_t idle_timeout_ms)
+            : model_(model), n_seq_max_(std::max(1u, n_seq_max)), n_ctx_seq_(n_ctx_seq), n_batch_(std::max(1u, n_batch)),
+              spill_dir_(spill_dir), idle_timeout_ms_(idle_timeout_ms)
+        {
+            if (spill_dir_.empty())
+                spill_dir_ = (std::filesystem::temp_directory_path() / "secret_llama").string();
+            // llm_model::inactivitiy_timeout is in seconds
+            if (idle_timeout_ms_ == 0)
+                idle_timeout_ms_ = model_->get_config().inactivitiy_timeout * 1000;
+        }
+
+        llama_cpp_batch_engine::~llama_cpp_batch_engine()
+        {
+            {
+                std::lock_guard<std::mutex> lock(mutex_);
+                stop_ = true;
+            }
+            cv_pending_.notify_all();
+            if (worker_.joinable())
+                worker_.join();
+            if (batch_.token)
+                llama_batch_free(batch_);
+
+            std::error_code ec;
+            for (auto& it : sessions_)
+                if (it.second->hibernated)
+                    std::filesystem::remove(spill_path(*it.second), ec);
+        }
+
+        error_types llama_cpp_batch_engine::init()
+        {
+            try
+            {
+                // one KV cache for all the sessions, instead of one full cache per session
+                llama_context_params ctx_params = llama_context_default_params();
+                ctx_params.n_ctx = n_seq_max_ * n_ctx_seq_;
+                ctx_params.n_seq_max = n_seq_max_;
+                ctx_params.n_batch = n_batch_;
+                ctx_params.n_ubatch = std::min(n_batch_, ctx_params.n_ubatch);
+
+                ctx_ = std::unique_ptr<llama_context, context_deleter>(llama_init_from_model(model_->get(), ctx_params));
+                if (!ctx_)
+                    return error_types::INVALID_CONTEXT;
+
+                std::filesystem::create_directories(spill_dir_);
+
+                batch_ = llama_batch_init(n_batch_, 0, 1);
+                for (llama_seq_id seq_id = n_seq_max_ - 1; seq_id >= 0; seq_id--)
+                    free_seqs_.push_back(seq_id);
+
+                worker_ = std::thread([this]() { loop(); });
+                return error_types::OK;
+            }
+            catch (const std::exception& e)
+            {
+                return error_types::EXCEPTION_THROWN;
+            }
+        }
+
+        error_types llama_cpp_batch_engine::create_context(uint64_t seed, uint64_t context_id, std::shared_ptr<llama_cpp_context>& context)
+        {
+            auto ctx = std::make_shared<llama_cpp_context>();
+            ctx->seed_ = seed;
+            ctx->model_ = model_;
+            ctx->context_id_ = context_id;
+            ctx->engine_ = shared_from_this();
+            try
+            {
+                ctx->session_id_ = open_session();
+            }
+            catch (const std::exception& e)
+            {
+                return error_types::RANDOM_NUMBER_GENERATOR_FAILED;
+            }
+
+            auto ret = ctx->init();
+            if (ret != error_types::OK)
+                return ret;
+            context = ctx;
+            return error_types::OK;
+        }
+
+        uint64_t llama_cpp_batch_engine::open_session()
+        {
+            // the sequence is only taken on the first decode
+            auto sess = std::make_unique<session>();
+            // a fresh key per session, it never leaves the enclave
+            if (RAND_bytes(sess->key.data(), sess->key.size()) != 1)
+                throw std::runtime_error("RAND_bytes failed");
+            sess->t_last_us = ggml_time_us();
+
+            std::lock_guard<std::mutex> lock(mutex_);
+            sess->id = next_session_id_++;
+            const uint64_t id = sess->id;
+            sessions_[id] = std::move(sess);
+            return id;
+        }
+
+        void llama_cpp_batch_engine::close_session(uint64_t session_id)
+        {
+            std::lock_guard<std::mutex> ctx_lock(ctx_mutex_);
+            std::unique_ptr<session> sess;
+            {
+                std::lock_guard<std::mutex> lock(mutex_);
+                auto it = sessions_.find(session_id);
+                if (it == sessions_.end())
+                    return;
+                sess = std::move(it->second);
+                sessions_.erase(it);
+                if (sess->seq_id >= 0)
+                    free_seqs_.push_back(sess->seq_id);
+            }
+            if (sess->seq_id >= 0)
+                llama_kv_self_seq_rm(ctx_.get(), sess->seq_id, -1, -1);
+            if (sess->hibernated)
+            {
+                std::error_code ec;
+                std::filesystem::remove(spill_path(*sess), ec);
+            }
+            OPENSSL_cleanse(sess->key.data(), sess->key.size());
+        }
+
+        error_types llama_cpp_batch_engine::heart_beat(uint64_t session_id)
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            auto it = sessions_.find(session_id);
+            if (it == sessions_.end())
+                return error_types::CONTEXT_MISSING;
+            it->second->t_last_us = ggml_time_us();
+            return error_types::OK;
+        }
+
+        int32_t llama_cpp_batch_engine::n_past(uint64_t session_id)
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            auto it = sessions_.find(session_id);
+            return it == sessions_.end() ? 0 : it->second->n_past;
+        }
+
+        size_t llama_cpp_batch_engine::n_hibernated()
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            return std::count_if(sessions_.begin(), sessions_.end(), [](const auto& it) { return it.second->hibernated; });
+        }
+
+        std::string llama_cpp_batch_engine::spill_path(const session& sess) const
+        {
+            char name[64];
+            snprintf(name, sizeof(name), "%p-%" PRIu64 ".kv", (const void*)this, sess.id);
+            return (std::filesystem::path(spill_dir_) / name).string();
+        }
+
+        error_types llama_cpp_batch_engine::hibernate(session& sess)
+        {
+            const size_t size = llama_state_seq_get_size(ctx_.get(), sess.seq_id);
+            std::vector<uint8_t> state(size);
+            if (llama_state_seq_get_data(ctx_.get(), state.data(), state.size(), sess.seq_id) != size)
+                return error_types::UNABLE_TO_SAVE_RECORD;
+
+            // the session id is authenticated, so that a spill file cannot be swapped for another session's
+            const std::vector<uint8_t> aad((const uint8_t*)&sess.id, (const uint8_t*)&sess.id + sizeof(sess.id));
+            std::vector<uint8_t> ciphertext;
+            sess.nonce = CryptoUtils::generateNonce();
+            CryptoUtils::aes256GcmEncrypt(state, sess.key, sess.nonce, aad, ciphertext, sess.tag);
+            OPENSSL_cleanse(state.data(), state.size());
+
+            std::ofstream file(spill_path(sess), std::ios::binary | std::ios::trunc);
+            file.write((const char*)ciphertext.data(), ciphertext.size());
+            if (!file)
+                return error_types::UNABLE_TO_SAVE_RECORD;
+            file.close();
+
+            llama_kv_self_seq_rm(ctx_.get(), sess.seq_id, -1, -1);
+
+            std::lock_guard<std::mutex> lock(mutex_);
+            free_seqs_.push_back(sess.seq_id);
+            sess.seq_id = -1;
+            sess.hibernated = true;
+            return error_types::OK;
+        }
+
+        error_types llama_cpp_batch_engine::restore(session& sess)
+        {
+            const std::string path = spill_path(sess);
+            std::ifstream file(path, std::ios::binary);
+            std::vector<uint8_t> ciphertext((std::istreambuf_iterator<char>(file)), std::istreambuf_iterator<char>());
+            if (!file.good() && !file.eof())
+                return error_types::UNABLE_TO_LOAD_RECORD;
+            file.close();
+
+            const std::vector<uint8_t> aad((const uint8_t*)&sess.id, (const uint8_t*)&sess.id + sizeof(sess.id));
+            std::vector<uint8_t> state;
+            if (!CryptoUtils::aes256GcmDecrypt(ciphertext, sess.tag, sess.key, sess.nonce, aad, state))
+                return error_types::UNABLE_TO_LOAD_RECORD;
+
+            const size_t n_read = llama_state_seq_set_data(ctx_.get(), state.data(), state.size(), sess.seq_id);
+            OPENSSL_cleanse(state.data(), state.size());
+            if (n_read == 0)
+                return error_types::UNABLE_TO_LOAD_RECORD;
+
+            std::error_code ec;
+            std::filesystem::remove(path, ec);
+            sess.hibernated = false;
+            return error_types::OK;
+        }
+
+        error_types llama_cpp_batch_engine::make_resident(session& sess)
+        {
+            session* victim = nullptr;
+            {
+                std::lock_guard<std::mutex> lock(mutex_);
+                if (sess.seq_id >= 0)
+                    return error_types::OK;
+                if (free_seqs_.empty())
+                {
+                    // all the sequences are taken, the least recently used idle session makes room
+                    for (auto& it : sessions_)
+                    {
+                        session* other = it.second.get();
+                        if (other->seq_id >= 0 && !other->busy && (!victim || other->t_last_us < victim->t_last_us))
+                            victim = other;
+                    }
+                    if (!victim)
+                        return error_types::MAX_CONTEXTS_EXCEEDED;
+                }
+            }
+            if (victim)
+            {
+                auto err = hibernate(*victim);
+                if (err != error_types::OK)
+                    return err;
+            }
+
+            {
+                std::lock_guard<std::mutex> lock(mutex_);
+                sess.seq_id = free_seqs_.back();
+                free_seqs_.pop_back();
+            }
+            if (!sess.hibernated)
+                return error_types::OK;
+
+            auto err = restore(sess);
+            if (err != error_types::OK)
+            {
+                // the state is lost, the session cannot continue
+                llama_kv_self_seq_rm(ctx_.get(), sess.seq_id, -1, -1);
+                std::lock_guard<std::mutex> lock(mutex_);
+                free_seqs_.push_back(sess.seq_id);
+                sess.seq_id = -1;
+            }
+            return err;
+        }
+
+        void llama_cpp_batch_engine::hibernate_idle()
+        {
+            if (idle_timeout_ms_ == 0)
+                return;
+
+            std::lock_guard<std::mutex> ctx_lock(ctx_mutex_);
+            std::vector<session*> idle;
+            {
+                const int64_t t_now = ggml_time_us();
+                std::lock_guard<std::mutex> lock(mutex_);
+                for (auto& it : sessions_)
+                {
+                    session* sess = it.second.get();
+                    if (sess->seq_id >= 0 && !sess->busy && (uint64_t)(t_now - sess->t_last_us) > idle_timeout_ms_ * 1000)
+                        idle.push_back(sess);
+                }
+            }
+            // sessions are only erased under ctx_mutex_, the pointers stay valid
+            for (auto* sess : idle)
+                hibernate(*sess);
+        }
+
+        error_types llama_cpp_batch_engine::decode(
+            uint64_t session_id, const llama_token* tokens, int32_t n_tokens, llama_sampler* sampler, llama_token& new_token)
+        {
+            if (n_tokens <= 0)
+                return error_types::INVALID_TOKENS;
+
+            request req;
+            req.tokens = tokens;
+            req.n_tokens = n_tokens;
+            req.sampler = sampler;
+
+            {
+                std::lock_guard<std::mutex> ctx_lock(ctx_mutex_);
+                {
+                    std::lock_guard<std::mutex> lock(mutex_);
+                    auto it = sessions_.find(session_id);
+                    if (it == sessions_.end())
+                        return error_types::CONTEXT_MISSING;
+                    req.sess = it->second.get();
+                    req.sess->busy = true;
+                    req.sess->t_last_us = ggml_time_us();
+                }
+                auto err = make_resident(*req.sess);
+                if (err != error_types::OK)
+                {
+                    std::lock_guard<std::mutex> lock(mutex_);
+                    req.sess->busy = false;
+                    return err;
+                }
+            }
+
+            std::unique_lock<std::mutex> lock(mutex_);
+            if (stop_)
+            {
+                req.sess->busy = false;
+                return error_types::ENGINE_NOT_LOADED;
+            }
+            pending_.push_back(&req);
+            cv_pending_.notify_one();
+            cv_done_.wait(lock, [&req]() { return req.done; });
+
+            req.sess->busy = false;
+            req.sess->t_last_us = ggml_time_us();
+            new_token = req.new_token;
+            return req.err;
+        }
+
+        void llama_cpp_batch_engine::loop()
+        {
+            std::vector<request*> requests;
+            while (true)
+            {
+                {
+                    std::unique_lock<std::mutex> lock(mutex_);
+                    // wake up regularly to hibernate the idle sessions
+                    cv_pending_.wait_for(lock, std::chrono::seconds(1), [this]() { return stop_ || !pending_.empty(); });
+                    if (stop_)
+                    {
+                        // wake up the sessions still waiting
+                        for (auto* req : pending_)
+                        {
+                            req->err = error_types::ENGINE_NOT_LOADED;
+                            req->done = true;
+                        }
+                        pending_.clear();
+                        cv_done_.notify_all();
+                        return;
+                    }
+                    // everything queued while the previous step was running goes into this one
+                    requests.assign(pending_.begin(), pending_.end());
+                }
+
+                if (requests.empty())
+                {
+                    hibernate_idle();
+                    continue;
+                }
+
+                step(requests);
+
+                {
+                    std::lock_guard<std::mutex> lock(mutex_);
+                    pending_.erase(std::remove_if(pending_.begin(), pending_.end(), [](const request* req) { return req->done; }), pending_.end());
+                }
+                cv_done_.notify_all();
+            }
+        }
+
+        void llama_cpp_batch_engine::step(std::vector<request*>& requests)
+        {
+            // generation first, so that the sessions streaming tokens are not held up by long prompts
+            std::stable_partition(requests.begin(), requests.end(), [](const request* req) { return req->n_tokens - req->n_done == 1; });
+
+            struct slice
+            {
+                request* req;
+                int32_t n_past;
+                int32_t n;
+                int32_t i_logits;
+            };
+            std::vector<slice> slices;
+
+            std::lock_guard<std::mutex> ctx_lock(ctx_mutex_);
+            common_batch_clear(batch_);
+            {
+                std::lock_guard<std::mutex> lock(mutex_);
+                for (auto* req : requests)
+                {
+                    const int32_t n = std::min<int32_t>(req->n_tokens - req->n_done, n_batch_ - batch_.n_tokens);
+                    if (n <= 0)
+                        break;
+                    // a prompt larger than the rest of the batch continues in the next step, without logits until then
+                    const bool last = req->n_done + n == req->n_tokens;
+                    const int32_t pos0 = req->sess->n_past;
+                    for (int32_t i = 0; i < n; i++)
+                        common_batch_add(batch_, req->tokens[req->n_done + i], pos0 + i, {req->sess->seq_id}, last && i == n - 1);
+                    slices.push_back({req, pos0, n, last ? batch_.n_tokens - 1 : -1});
+                }
+            }
+
+            const int ret = llama_decode(ctx_.get(), batch_);
+
+            std::lock_guard<std::mutex> lock(mutex_);
+            for (auto& s : slices)
+            {
+                session* sess = s.req->sess;
+                if (ret != 0)
+                {
+                    // drop the whole request, including the parts of a prompt decoded in the previous steps
+                    const int32_t pos0 = s.n_past - s.req->n_done;
+                    llama_kv_self_seq_rm(ctx_.get(), sess->seq_id, pos0, -1);
+                    sess->n_past = pos0;
+                    s.req->err = ret == 1 ? error_types::CONTEXT_SIZE_EXCEEDED : error_types::DECODE_FAILURE;
+                    s.req->done = true;
+                    continue;
+                }
+                sess->n_past = s.n_past + s.n;
+                s.req->n_done += s.n;
+                if (s.i_logits >= 0)
+                {
+                    s.req->new_token = llama_sampler_sample(s.req->sampler, ctx_.get(), s.i_logits);
+                    s.req->done = true;
+                }
+            }
+        }
+
     class llama_cpp_engine : public llm_engine
     {
         std::atomic<uint64_t> count_;
@@ -737,15 +1284,41 @@ inline namespace v1_0
         {
             try
             {
-                std::ignore = modl;
- 
                 llama_model_params model_params = llama_model_default_params();
                 // The goal is to prevent the large, static model weights from displacing the smaller, more frequently
                 // accessed KV Cache from the L3 cache. You will treat the EPC as a "streaming source" for weights.
                 model_params.n_gpu_layers = 0;
  
-    
-                llama_model* model = nullptr; // OWL WAS HERE :llama_model_load_from_blob((const uint8_t*)data, size, model_params);
+                llama_model* model = nullptr;
+                if (modl.hash_type == hash_type::GGUE_SHA2_256)
+                {
+                    // GGUE containers are decrypted from disk straight into the model buffers, data is not used.
+                    // Other models keep the legacy path: data holds the image the caller already decrypted.
+                    llama_model_encryption enc{};
+                    switch (modl.encryption_type)
+                    {
+                    case encryption_type::AES_GCM:
+                        enc.cipher = LLAMA_MODEL_CIPHER_AES_256_GCM;
+                        break;
+                    case encryption_type::AES_CTR:
+                        enc.cipher = LLAMA_MODEL_CIPHER_AES_256_CTR;
+                        break;
+                    default:
+                        // AES_ECB leaks the patterns of the weights, it is not supported
+                        return error_types::UNABLE_TO_LOAD_MODEL;
+                    }
+                    if (modl.encryption_key.size() != 32 || modl.hash.size() != 32 || modl.local_path.empty())
+                        return error_types::UNABLE_TO_LOAD_MODEL;
+                    enc.key = modl.encryption_key.data();
+                    enc.hash = modl.hash.data();
+                    model = llama_model_load_from_encrypted_file(modl.local_path.c_str(), &enc, model_params);
+                }
+                else
+                {
+                    // the tensors are copied out of the decrypted image: the caller releases data once the model is parsed
+                    model_params.use_mmap = false;
+                    model = llama_model_load_from_buffer(data, size, model_params);
+                }
                 if (model == NULL)
                 {
                     return error_types::UNABLE_TO_LOAD_RECORD;
@@ -157,6 +157,8 @@ namespace secret_llama
 			SHA3_512 = 7,
 			MD5 = 8,
 			CMAC_128 = 11,
+			// GGUE container (llama_model_encrypt_file): SHA-256 of the SHA-256 of its plaintext chunks
+			GGUE_SHA2_256 = 12,
 		};
 		enum class access
 		{
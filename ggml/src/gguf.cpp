@@ -217,13 +217,46 @@ struct gguf_context {
 };
 
 struct gguf_reader {
-    FILE * file;
+    FILE * file = nullptr;
+
+    // alternatively, read from a memory buffer
+    const uint8_t * buf      = nullptr;
+    size_t          buf_size = 0;
+    mutable size_t  buf_pos  = 0;
 
     gguf_reader(FILE * file) : file(file) {}
+    gguf_reader(const void * data, size_t size) : buf((const uint8_t *) data), buf_size(size) {}
+
+    bool read_raw(void * dst, const size_t size) const {
+        if (file) {
+            return fread(dst, 1, size, file) == size;
+        }
+        if (size > buf_size - buf_pos) {
+            return false;
+        }
+        memcpy(dst, buf + buf_pos, size);
+        buf_pos += size;
+        return true;
+    }
+
+    size_t tell() const {
+        return file ? (size_t) ftell(file) : buf_pos;
+    }
+
+    bool seek(const size_t offset) const {
+        if (file) {
+            return fseek(file, offset, SEEK_SET) == 0;
+        }
+        if (offset > buf_size) {
+            return false;
+        }
+        buf_pos = offset;
+        return true;
+    }
 
     template <typename T>
     bool read(T & dst) const {
-        return fread(&dst, 1, sizeof(dst), file) == sizeof(dst);
+        return read_raw(&dst, sizeof(dst));
     }
 
     template <typename T>
@@ -277,12 +310,15 @@ struct gguf_reader {
         if (!read(size)) {
             return false;
         }
+        if (buf && size > buf_size - buf_pos) {
+            return false;
+        }
         dst.resize(size);
-        return fread(dst.data(), 1, dst.length(), file) == dst.length();
+        return read_raw(dst.data(), dst.length());
     }
 
     bool read(void * dst, const size_t size) const {
-        return fread(dst, 1, size, file) == size;
+        return read_raw(dst, size);
     }
 };
 
@@ -316,8 +352,7 @@ bool gguf_read_emplace_helper(const struct gguf_reader & gr, std::vector<struct
     return true;
 }
 
-struct gguf_context * gguf_init_from_file_impl(FILE * file, struct gguf_init_params params) {
-    const struct gguf_reader gr(file);
+static struct gguf_context * gguf_init_impl(const struct gguf_reader & gr, struct gguf_init_params params) {
     struct gguf_context * ctx = new gguf_context;
 
     bool ok = true;
@@ -589,14 +624,14 @@ struct gguf_context * gguf_init_from_file_impl(FILE * file, struct gguf_init_par
     GGML_ASSERT(int64_t(ctx->info.size()) == n_tensors);
 
     // we require the data section to be aligned, so take into account any padding
-    if (fseek(file, GGML_PAD(ftell(file), ctx->alignment), SEEK_SET) != 0) {
+    if (!gr.seek(GGML_PAD(gr.tell(), ctx->alignment))) {
         fprintf(stderr, "%s: failed to seek to beginning of data section\n", __func__);
         gguf_free(ctx);
         return nullptr;
     }
 
     // store the current file offset - this is where the data section starts
-    ctx->offset = ftell(file);
+    ctx->offset = gr.tell();
 
     // compute the total size of the data section, taking into account the alignment
     {
@@ -702,6 +737,10 @@ struct gguf_context * gguf_init_from_file_impl(FILE * file, struct gguf_init_par
     return ctx;
 }
 
+struct gguf_context * gguf_init_from_file_impl(FILE * file, struct gguf_init_params params) {
+    return gguf_init_impl(gguf_reader(file), params);
+}
+
 struct gguf_context * gguf_init_from_file(const char * fname, struct gguf_init_params params) {
     FILE * file = ggml_fopen(fname, "rb");
 
@@ -715,6 +754,15 @@ struct gguf_context * gguf_init_from_file(const char * fname, struct gguf_init_p
     return result;
 }
 
+struct gguf_context * gguf_init_from_buffer(const void * data, size_t size, struct gguf_init_params params) {
+    if (data == nullptr) {
+        fprintf(stderr, "%s: no GGUF buffer provided\n", __func__);
+        return nullptr;
+    }
+
+    return gguf_init_impl(gguf_reader(data, size), params);
+}
+
 void gguf_free(struct gguf_context * ctx) {
     if (ctx == nullptr) {
         return;
@@ -222,6 +222,12 @@ extern "C" {
         LLAMA_SPLIT_MODE_ROW   = 2, // split layers and KV across GPUs, use tensor parallelism if supported
     };
 
+    enum llama_model_cipher {
+        LLAMA_MODEL_CIPHER_NONE        = 0,
+        LLAMA_MODEL_CIPHER_AES_256_GCM = 1, // each chunk is authenticated
+        LLAMA_MODEL_CIPHER_AES_256_CTR = 2, // integrity only through the model hash
+    };
+
     // TODO: simplify (https://github.com/ggml-org/llama.cpp/pull/9294#pullrequestreview-2286561979)
     typedef struct llama_token_data {
         llama_token id; // token id
@@ -383,6 +389,15 @@ extern "C" {
         void * tensor_types;                  // pointer to vector containing tensor types
     } llama_model_quantize_params;
 
+    // encrypted model parameters, see llama_model_encrypt_file
+    typedef struct llama_model_encryption {
+        enum llama_model_cipher cipher;
+        const uint8_t * key;        // 32 bytes
+        const uint8_t * hash;       // optional, 32 bytes, checked once the tensors are loaded
+        uint32_t chunk_size;        // encryption only, 0 = 1 MiB
+        int32_t  n_threads;         // number of decryption threads, if <=0 will use std::thread::hardware_concurrency()
+    } llama_model_encryption;
+
     typedef struct llama_logit_bias {
         llama_token token;
         float bias;
@@ -446,6 +461,42 @@ extern "C" {
                                  size_t    n_paths,
               struct llama_model_params    params);
 
+    // Load the model from a GGUF image held in memory (single split)
+    // The tensors are referenced in place when params.use_mmap is set and the buffer is 32 bytes aligned,
+    // the buffer must then outlive the model. Otherwise they are copied and the buffer can be released after the call
+    LLAMA_API struct llama_model * llama_model_load_from_buffer(
+                             const void * data,
+                                 size_t   size,
+              struct llama_model_params   params);
+
+    // Fills dst with up to size bytes of the model stream, returns the number of bytes written (0 on error)
+    typedef size_t (*llama_model_read_chunk_callback)(void * dst, size_t size, void * user_data);
+
+    // Load the model from a GGUF image of `size` bytes produced chunk by chunk (e.g. decrypted on the fly)
+    // The chunks are assembled once into an aligned buffer owned by the model, and wiped when the model is freed
+    LLAMA_API struct llama_model * llama_model_load_from_chunks(
+        llama_model_read_chunk_callback   read_chunk,
+                                   void * user_data,
+                                 size_t   size,
+              struct llama_model_params   params);
+
+    // Load the model from an encrypted GGUF, without writing the plaintext anywhere
+    // The tensor data is decrypted in parallel chunks straight into the model buffers (mmap is not used)
+    LLAMA_API struct llama_model * llama_model_load_from_encrypted_file(
+                             const char * path_model,
+    const struct llama_model_encryption * enc,
+              struct llama_model_params   params);
+
+    // Encrypt a GGUF for llama_model_load_from_encrypted_file
+    // The file is cut in chunks encrypted independently, the chunk index being part of the IV
+    // hash_out (optional, 32 bytes) receives the model hash: the SHA-256 of the SHA-256 of the plaintext chunks
+    // Returns 0 on success
+    LLAMA_API uint32_t llama_model_encrypt_file(
+                             const char * fname_inp,
+                             const char * fname_out,
+    const struct llama_model_encryption * enc,
+                                uint8_t * hash_out);
+
     LLAMA_API void llama_model_save_to_file(
             const struct llama_model * model,
                         const char * path_model);
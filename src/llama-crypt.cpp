@@ -0,0 +1,489 @@
+#include "llama-crypt.h"
+
+#include "llama-impl.h"
+#include "llama-mmap.h"
+
+#include "gguf.h"
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <cstring>
+#include <exception>
+#include <mutex>
+#include <stdexcept>
+#include <thread>
+#include <vector>
+
+#ifdef LLAMA_USE_OPENSSL
+#include <openssl/crypto.h>
+#include <openssl/evp.h>
+#include <openssl/rand.h>
+#endif
+
+static const char     LLAMA_CRYPT_MAGIC[4]       = { 'G', 'G', 'U', 'E' };
+static const uint32_t LLAMA_CRYPT_VERSION        = 1;
+static const size_t   LLAMA_CRYPT_HEADER_SIZE    = 48;
+static const size_t   LLAMA_CRYPT_NONCE_SIZE     = 12;
+static const size_t   LLAMA_CRYPT_TAG_SIZE       = 16;
+static const size_t   LLAMA_CRYPT_HASH_SIZE      = 32;
+static const uint32_t LLAMA_CRYPT_CHUNK_SIZE     = 1024*1024;
+static const uint32_t LLAMA_CRYPT_CHUNK_SIZE_MAX = 256*1024*1024;
+
+using llama_crypt_digest = std::array<uint8_t, LLAMA_CRYPT_HASH_SIZE>;
+
+struct llama_crypt_header {
+    uint32_t cipher     = LLAMA_MODEL_CIPHER_NONE;
+    uint32_t chunk_size = 0;
+    uint64_t size       = 0;
+    uint64_t meta_size  = 0;
+    std::array<uint8_t, LLAMA_CRYPT_NONCE_SIZE> nonce = {};
+
+    size_t tag_size() const { return cipher == LLAMA_MODEL_CIPHER_AES_256_GCM ? LLAMA_CRYPT_TAG_SIZE : 0; }
+    size_t n_chunks() const { return (size + chunk_size - 1) / chunk_size; }
+
+    size_t chunk_len (size_t idx) const { return std::min<size_t>(chunk_size, size - idx*chunk_size); }
+    size_t chunk_offs(size_t idx) const { return LLAMA_CRYPT_HEADER_SIZE + idx*(chunk_size + tag_size()); }
+    size_t file_size() const { return LLAMA_CRYPT_HEADER_SIZE + size + n_chunks()*tag_size(); }
+
+    std::array<uint8_t, LLAMA_CRYPT_HEADER_SIZE> serialize() const {
+        std::array<uint8_t, LLAMA_CRYPT_HEADER_SIZE> buf = {};
+        uint8_t * p = buf.data();
+        memcpy(p, LLAMA_CRYPT_MAGIC,     4); p += 4;
+        memcpy(p, &LLAMA_CRYPT_VERSION,  4); p += 4;
+        memcpy(p, &cipher,               4); p += 4;
+        memcpy(p, &chunk_size,           4); p += 4;
+        memcpy(p, &size,                 8); p += 8;
+        memcpy(p, &meta_size,            8); p += 8;
+        memcpy(p, nonce.data(), nonce.size());
+        return buf;
+    }
+
+    static llama_crypt_header parse(const uint8_t * buf) {
+        if (memcmp(buf, LLAMA_CRYPT_MAGIC, 4) != 0) {
+            throw std::runtime_error("not an encrypted GGUF (bad magic)");
+        }
+        uint32_t version = 0;
+        llama_crypt_header hdr;
+        const uint8_t * p = buf + 4;
+        memcpy(&version,        p, 4); p += 4;
+        memcpy(&hdr.cipher,     p, 4); p += 4;
+        memcpy(&hdr.chunk_size, p, 4); p += 4;
+        memcpy(&hdr.size,       p, 8); p += 8;
+        memcpy(&hdr.meta_size,  p, 8); p += 8;
+        memcpy(hdr.nonce.data(), p, hdr.nonce.size());
+
+        if (version != LLAMA_CRYPT_VERSION) {
+            throw std::runtime_error(format("unsupported encrypted GGUF version %u", version));
+        }
+        hdr.validate();
+        if (hdr.meta_size > hdr.size) {
+            throw std::runtime_error("corrupted encrypted GGUF header");
+        }
+        return hdr;
+    }
+
+    void validate() const {
+        if (cipher != LLAMA_MODEL_CIPHER_AES_256_GCM && cipher != LLAMA_MODEL_CIPHER_AES_256_CTR) {
+            throw std::runtime_error(format("unsupported cipher %u", cipher));
+        }
+        // CTR chunks must start on a block boundary
+        if (chunk_size == 0 || chunk_size > LLAMA_CRYPT_CHUNK_SIZE_MAX || chunk_size % 16 != 0) {
+            throw std::runtime_error(format("invalid chunk size %u", chunk_size));
+        }
+    }
+};
+
+#ifdef LLAMA_USE_OPENSSL
+
+struct llama_evp_cipher_ctx_deleter {
+    void operator()(EVP_CIPHER_CTX * ctx) const { EVP_CIPHER_CTX_free(ctx); }
+};
+
+typedef std::unique_ptr<EVP_CIPHER_CTX, llama_evp_cipher_ctx_deleter> llama_evp_cipher_ctx_ptr;
+
+static llama_evp_cipher_ctx_ptr llama_evp_cipher_ctx_new() {
+    llama_evp_cipher_ctx_ptr ctx(EVP_CIPHER_CTX_new());
+    if (!ctx) {
+        throw std::runtime_error("failed to create the cipher context");
+    }
+    return ctx;
+}
+
+static void llama_crypt_sha256(const uint8_t * data, size_t len, uint8_t * md) {
+    if (EVP_Digest(data, len, md, nullptr, EVP_sha256(), nullptr) != 1) {
+        throw std::runtime_error("SHA-256 failed");
+    }
+}
+
+// the model hash: SHA-256 over the chunk digests, in chunk order
+static llama_crypt_digest llama_crypt_model_hash(const std::vector<llama_crypt_digest> & digests) {
+    llama_crypt_digest hash;
+    llama_crypt_sha256(digests.empty() ? nullptr : digests[0].data(), digests.size()*LLAMA_CRYPT_HASH_SIZE, hash.data());
+    return hash;
+}
+
+// en/decrypt one chunk, the IV is derived from the nonce and the chunk index
+//   AES-GCM: nonce with the chunk index xor-ed into its last 8 bytes, the header is the AAD
+//   AES-CTR: nonce || 0 (32 bits) incremented by the index of the first block of the chunk
+static void llama_crypt_chunk(
+        EVP_CIPHER_CTX * ctx,
+        const llama_crypt_header & hdr,
+        const uint8_t * aad,
+        const uint8_t * key,
+        size_t idx,
+        const uint8_t * inp,
+        uint8_t * out,
+        uint8_t * tag,
+        bool encrypt) {
+    const bool gcm = hdr.cipher == LLAMA_MODEL_CIPHER_AES_256_GCM;
+
+    uint8_t iv[16] = {};
+    memcpy(iv, hdr.nonce.data(), hdr.nonce.size());
+    if (gcm) {
+        for (int i = 0; i < 8; ++i) {
+            iv[LLAMA_CRYPT_NONCE_SIZE - 1 - i] ^= (uint8_t) (idx >> (8*i));
+        }
+    } else {
+        uint64_t block = (uint64_t) idx * (hdr.chunk_size / 16);
+        for (int i = 15; i >= 0 && block != 0; --i) {
+            const uint64_t sum = iv[i] + (block & 0xff);
+            iv[i] = (uint8_t) sum;
+            block = (block >> 8) + (sum >> 8);
+        }
+    }
+
+    const size_t n = hdr.chunk_len(idx);
+    int len = 0;
+    if (EVP_CipherInit_ex(ctx, gcm ? EVP_aes_256_gcm() : EVP_aes_256_ctr(), nullptr, key, iv, encrypt ? 1 : 0) != 1) {
+        throw std::runtime_error("failed to initialize the cipher");
+    }
+    if (gcm && EVP_CipherUpdate(ctx, nullptr, &len, aad, (int) LLAMA_CRYPT_HEADER_SIZE) != 1) {
+        throw std::runtime_error("failed to authenticate the header");
+    }
+    if (EVP_CipherUpdate(ctx, out, &len, inp, (int) n) != 1) {
+        throw std::runtime_error(format("failed to process chunk %zu", idx));
+    }
+    if (gcm && !encrypt && EVP_CIPHER_CTX_ctrl(ctx, EVP_CTRL_GCM_SET_TAG, (int) LLAMA_CRYPT_TAG_SIZE, tag) != 1) {
+        throw std::runtime_error("failed to set the tag");
+    }
+    int len_final = 0;
+    if (EVP_CipherFinal_ex(ctx, out + len, &len_final) != 1) {
+        throw std::runtime_error(format("chunk %zu failed authentication, wrong key or corrupted model", idx));
+    }
+    if (gcm && encrypt && EVP_CIPHER_CTX_ctrl(ctx, EVP_CTRL_GCM_GET_TAG, (int) LLAMA_CRYPT_TAG_SIZE, tag) != 1) {
+        throw std::runtime_error("failed to get the tag");
+    }
+}
+
+struct llama_crypt_file::impl {
+    impl(const char * fname, const llama_model_encryption & enc) : raw(fname, "rb") {
+        if (enc.key == nullptr) {
+            throw std::runtime_error("missing model key");
+        }
+        if (raw.size() < LLAMA_CRYPT_HEADER_SIZE) {
+            throw std::runtime_error("not an encrypted GGUF (file too small)");
+        }
+        raw.read_raw(aad.data(), aad.size());
+        hdr = llama_crypt_header::parse(aad.data());
+
+        if (hdr.cipher != (uint32_t) enc.cipher) {
+            throw std::runtime_error(format("cipher mismatch, the model uses cipher %u but %d was requested", hdr.cipher, (int) enc.cipher));
+        }
+        if (raw.size() != hdr.file_size()) {
+            throw std::runtime_error(format("truncated or corrupted model, %zu bytes expected but the file has %zu", hdr.file_size(), raw.size()));
+        }
+
+        memcpy(key.data(), enc.key, key.size());
+
+        has_hash = enc.hash != nullptr;
+        if (has_hash) {
+            memcpy(hash.data(), enc.hash, hash.size());
+            digests.resize(hdr.n_chunks());
+            hashed.resize(hdr.n_chunks(), 0);
+        }
+
+        n_threads = enc.n_threads > 0 ? enc.n_threads : (int) std::thread::hardware_concurrency();
+        n_threads = std::max(n_threads, 1);
+
+        ctx = llama_evp_cipher_ctx_new();
+    }
+
+    ~impl() {
+        OPENSSL_cleanse(key.data(), key.size());
+        if (!cache.empty()) {
+            OPENSSL_cleanse(cache.data(), cache.size());
+        }
+    }
+
+    llama_file raw;
+
+    llama_crypt_header hdr;
+    std::array<uint8_t, LLAMA_CRYPT_HEADER_SIZE> aad;
+    std::array<uint8_t, 32> key;
+
+    bool               has_hash = false;
+    llama_crypt_digest hash;
+
+    // plaintext digest of each chunk, filled as the chunks are decrypted
+    mutable std::vector<llama_crypt_digest> digests;
+    mutable std::vector<uint8_t>            hashed;
+
+    int n_threads = 1;
+
+    llama_evp_cipher_ctx_ptr ctx;
+
+    // last chunk read partially
+    mutable size_t               cache_idx = SIZE_MAX;
+    mutable std::vector<uint8_t> cache;
+
+    // ciphertext of the batch being decrypted and of the next one
+    mutable std::vector<uint8_t> scratch[2];
+
+    size_t stride() const { return hdr.chunk_size + hdr.tag_size(); }
+
+    void decrypt_chunk(EVP_CIPHER_CTX * cctx, size_t idx, const uint8_t * ct, uint8_t * pt) const {
+        const size_t n = hdr.chunk_len(idx);
+        llama_crypt_chunk(cctx, hdr, aad.data(), key.data(), idx, ct, pt, const_cast<uint8_t *>(ct + n), false);
+        if (has_hash && !hashed[idx]) {
+            llama_crypt_sha256(pt, n, digests[idx].data());
+            hashed[idx] = 1;
+        }
+    }
+
+    void read_ciphertext(size_t c0, size_t c1, std::vector<uint8_t> & buf) const {
+        const size_t n = hdr.chunk_offs(c1 - 1) + hdr.chunk_len(c1 - 1) + hdr.tag_size() - hdr.chunk_offs(c0);
+        buf.resize(n);
+        raw.seek(hdr.chunk_offs(c0), SEEK_SET);
+        raw.read_raw(buf.data(), n);
+    }
+
+    // decrypt the whole chunks [c0, c1) into dst
+    // the ciphertext is read in batches, the next batch being read while the workers decrypt the current one
+    void decrypt_run(size_t c0, size_t c1, uint8_t * dst) const {
+        const size_t batch = std::max<size_t>(16, 4*(size_t) n_threads);
+
+        read_ciphertext(c0, std::min(c0 + batch, c1), scratch[0]);
+
+        for (size_t b0 = c0, k = 0; b0 < c1; b0 += batch, k ^= 1) {
+            const size_t b1 = std::min(b0 + batch, c1);
+            const uint8_t * ct = scratch[k].data();
+
+            std::atomic<size_t> next { b0 };
+            std::exception_ptr  err;
+            std::mutex          err_mutex;
+
+            auto worker = [&]() {
+                try {
+                    llama_evp_cipher_ctx_ptr wctx = llama_evp_cipher_ctx_new();
+                    for (size_t i = next++; i < b1; i = next++) {
+                        decrypt_chunk(wctx.get(), i, ct + (i - b0)*stride(), dst + (i - c0)*hdr.chunk_size);
+                    }
+                } catch (...) {
+                    std::lock_guard<std::mutex> lock(err_mutex);
+                    if (!err) {
+                        err = std::current_exception();
+                    }
+                }
+            };
+
+            const size_t n_workers = std::min<size_t>(n_threads, b1 - b0);
+            std::vector<std::thread> workers;
+            workers.reserve(n_workers);
+            for (size_t i = 0; i < n_workers; ++i) {
+                workers.emplace_back(worker);
+            }
+
+            std::exception_ptr err_read;
+            if (b1 < c1) {
+                try {
+                    read_ciphertext(b1, std::min(b1 + batch, c1), scratch[k ^ 1]);
+                } catch (...) {
+                    err_read = std::current_exception();
+                }
+            }
+
+            for (auto & w : workers) {
+                w.join();
+            }
+            if (err) {
+                std::rethrow_exception(err);
+            }
+            if (err_read) {
+                std::rethrow_exception(err_read);
+            }
+        }
+    }
+
+    const uint8_t * load_chunk(size_t idx) const {
+        if (cache_idx != idx) {
+            read_ciphertext(idx, idx + 1, scratch[0]);
+            cache.resize(hdr.chunk_size);
+            cache_idx = SIZE_MAX;
+            decrypt_chunk(ctx.get(), idx, scratch[0].data(), cache.data());
+            cache_idx = idx;
+        }
+        return cache.data();
+    }
+
+    void read(size_t offs, uint8_t * dst, size_t len) const {
+        if (offs > hdr.size || len > hdr.size - offs) {
+            throw std::runtime_error("unexpectedly reached end of file");
+        }
+
+        const size_t end = offs + len;
+        for (size_t pos = offs; pos < end; ) {
+            const size_t idx   = pos / hdr.chunk_size;
+            const size_t begin = idx*hdr.chunk_size;
+            if (pos == begin && begin + hdr.chunk_len(idx) <= end) {
+                // run of whole chunks, decrypted in place
+                const size_t c1 = end == hdr.size ? hdr.n_chunks() : end / hdr.chunk_size;
+                decrypt_run(idx, c1, dst + (pos - offs));
+                pos = std::min<size_t>(c1*hdr.chunk_size, hdr.size);
+            } else {
+                const size_t n = std::min(begin + hdr.chunk_len(idx), end) - pos;
+                memcpy(dst + (pos - offs), load_chunk(idx) + (pos - begin), n);
+                pos += n;
+            }
+        }
+    }
+
+    void verify() const {
+        if (!has_hash) {
+            return;
+        }
+
+        // the chunks the loader did not need (alignment padding, unused tensors)
+        std::vector<uint8_t> buf;
+        const size_t batch = std::max<size_t>(16, 4*(size_t) n_threads);
+        for (size_t c0 = 0; c0 < hdr.n_chunks(); ) {
+            if (hashed[c0]) {
+                c0++;
+                continue;
+            }
+            size_t c1 = c0 + 1;
+            while (c1 < hdr.n_chunks() && c1 - c0 < batch && !hashed[c1]) {
+                c1++;
+            }
+            buf.resize((c1 - c0)*hdr.chunk_size);
+            decrypt_run(c0, c1, buf.data());
+            c0 = c1;
+        }
+        if (!buf.empty()) {
+            OPENSSL_cleanse(buf.data(), buf.size());
+        }
+
+        const llama_crypt_digest actual = llama_crypt_model_hash(digests);
+        if (CRYPTO_memcmp(actual.data(), hash.data(), hash.size()) != 0) {
+            throw std::runtime_error("model hash mismatch");
+        }
+    }
+};
+
+void llama_crypt_file::encrypt(const char * fname_inp, const char * fname_out, const llama_model_encryption & enc, uint8_t * hash_out) {
+    if (enc.key == nullptr) {
+        throw std::runtime_error("missing model key");
+    }
+
+    // the loader decrypts the GGUF header on its own to parse it
+    size_t meta_size = 0;
+    {
+        struct gguf_init_params params = {
+            /*.no_alloc = */ true,
+            /*.ctx      = */ nullptr,
+        };
+        gguf_context * meta = gguf_init_from_file(fname_inp, params);
+        if (!meta) {
+            throw std::runtime_error(format("failed to load GGUF from %s", fname_inp));
+        }
+        meta_size = gguf_get_data_offset(meta);
+        gguf_free(meta);
+    }
+
+    llama_file inp(fname_inp,  "rb");
+    llama_file out(fname_out, "wb");
+
+    llama_crypt_header hdr;
+    hdr.cipher     = enc.cipher;
+    hdr.chunk_size = enc.chunk_size ? enc.chunk_size : LLAMA_CRYPT_CHUNK_SIZE;
+    hdr.size       = inp.size();
+    hdr.meta_size  = meta_size;
+    hdr.validate();
+    if (RAND_bytes(hdr.nonce.data(), (int) hdr.nonce.size()) != 1) {
+        throw std::runtime_error("failed to generate the nonce");
+    }
+
+    const auto aad = hdr.serialize();
+    out.write_raw(aad.data(), aad.size());
+
+    llama_evp_cipher_ctx_ptr ctx = llama_evp_cipher_ctx_new();
+    std::vector<uint8_t> pt(hdr.chunk_size);
+    std::vector<uint8_t> ct(hdr.chunk_size + LLAMA_CRYPT_TAG_SIZE);
+    std::vector<llama_crypt_digest> digests(hdr.n_chunks());
+
+    for (size_t idx = 0; idx < hdr.n_chunks(); ++idx) {
+        const size_t n = hdr.chunk_len(idx);
+        inp.read_raw(pt.data(), n);
+        llama_crypt_sha256(pt.data(), n, digests[idx].data());
+        llama_crypt_chunk(ctx.get(), hdr, aad.data(), enc.key, idx, pt.data(), ct.data(), ct.data() + n, true);
+        out.write_raw(ct.data(), n + hdr.tag_size());
+    }
+    OPENSSL_cleanse(pt.data(), pt.size());
+
+    if (hash_out) {
+        const llama_crypt_digest hash = llama_crypt_model_hash(digests);
+        memcpy(hash_out, hash.data(), hash.size());
+    }
+
+    LLAMA_LOG_INFO("%s: %s -> %s, %zu chunks of %u bytes\n", __func__, fname_inp, fname_out, hdr.n_chunks(), hdr.chunk_size);
+}
+
+#else
+
+struct llama_crypt_file::impl {
+    impl(const char *, const llama_model_encryption &) {
+        throw std::runtime_error("encrypted models are not supported, llama was built with LLAMA_OPENSSL=OFF");
+    }
+
+    void read(size_t, uint8_t *, size_t) const {}
+    void verify() const {}
+
+    llama_crypt_header hdr;
+};
+
+void llama_crypt_file::encrypt(const char *, const char *, const llama_model_encryption &, uint8_t *) {
+    throw std::runtime_error("encrypted models are not supported, llama was built with LLAMA_OPENSSL=OFF");
+}
+
+#endif // LLAMA_USE_OPENSSL
+
+llama_crypt_file::llama_crypt_file(const char * fname, const llama_model_encryption & enc) : pimpl(std::make_unique<impl>(fname, enc)) {
+    if (enc.hash == nullptr && enc.cipher == LLAMA_MODEL_CIPHER_AES_256_CTR) {
+        LLAMA_LOG_WARN("%s: AES-CTR model loaded without hash, its integrity is not checked\n", __func__);
+    }
+}
+llama_crypt_file::~llama_crypt_file() = default;
+
+size_t llama_crypt_file::size()      const { return pimpl->hdr.size; }
+size_t llama_crypt_file::meta_size() const { return pimpl->hdr.meta_size; }
+
+void llama_crypt_file::read(size_t offs, void * dst, size_t len) const { pimpl->read(offs, (uint8_t *) dst, len); }
+void llama_crypt_file::verify() const { pimpl->verify(); }
+
+uint32_t llama_model_encrypt_file(
+        const char * fname_inp,
+        const char * fname_out,
+        const llama_model_encryption * enc,
+        uint8_t * hash_out) {
+    try {
+        if (enc == nullptr) {
+            throw std::runtime_error("missing encryption parameters");
+        }
+        llama_crypt_file::encrypt(fname_inp, fname_out, *enc, hash_out);
+    } catch (const std::exception & err) {
+        LLAMA_LOG_ERROR("%s: failed to encrypt: %s\n", __func__, err.what());
+        return 1;
+    }
+
+    return 0;
+}
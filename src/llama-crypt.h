@@ -0,0 +1,46 @@
+#pragma once
+
+#include "llama.h"
+
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+
+//
+// encrypted GGUF container
+//
+//   header, 48 bytes (additional authenticated data of every AES-GCM chunk)
+//     char     magic[4]    "GGUE"
+//     uint32_t version     1
+//     uint32_t cipher      enum llama_model_cipher
+//     uint32_t chunk_size  plaintext bytes per chunk
+//     uint64_t size        plaintext GGUF size
+//     uint64_t meta_size   GGUF header size, i.e. offset of the tensor data
+//     uint8_t  nonce[12]
+//     uint32_t reserved
+//   chunks, each followed by its 16 bytes tag with AES-GCM
+//
+// The chunk index is part of the IV, so that the chunks can be decrypted in any order and in parallel.
+// The model hash is the SHA-256 of the concatenated SHA-256 of the plaintext chunks, which can be
+// computed incrementally in whatever order the loader reads the tensors.
+//
+
+struct llama_crypt_file {
+    llama_crypt_file(const char * fname, const llama_model_encryption & enc);
+    ~llama_crypt_file();
+
+    size_t size() const;
+    size_t meta_size() const;
+
+    // decrypt [offs, offs + len) of the GGUF
+    void read(size_t offs, void * dst, size_t len) const;
+
+    // hash the chunks that were not read and compare with the expected model hash, if any
+    void verify() const;
+
+    static void encrypt(const char * fname_inp, const char * fname_out, const llama_model_encryption & enc, uint8_t * hash_out);
+
+private:
+    struct impl;
+    std::unique_ptr<impl> pimpl;
+};
@@ -1,5 +1,6 @@
 #include "llama-mmap.h"
 
+#include "llama-crypt.h"
 #include "llama-impl.h"
 
 #include "ggml.h"
@@ -242,12 +243,33 @@ struct llama_file::impl {
 };
 
 llama_file::llama_file(const char * fname, const char * mode) : pimpl(std::make_unique<impl>(fname, mode)) {}
+llama_file::llama_file(const void * data, size_t size, std::shared_ptr<void> owner)
+    : mem_data((const uint8_t *) data), mem_size(size), mem_owner(std::move(owner)) {
+    if (data == nullptr) {
+        throw std::runtime_error("memory-backed file without data");
+    }
+}
+llama_file::llama_file(const char * fname, const llama_model_encryption & enc) : crypt(std::make_unique<llama_crypt_file>(fname, enc)) {}
 llama_file::~llama_file() = default;
 
-size_t llama_file::tell() const { return pimpl->tell(); }
-size_t llama_file::size() const { return pimpl->size; }
+size_t llama_file::tell() const {
+    if (is_encrypted()) {
+        return crypt_pos;
+    }
+    return is_memory() ? mem_pos : pimpl->tell();
+}
+
+size_t llama_file::size() const {
+    if (is_encrypted()) {
+        return crypt->size();
+    }
+    return is_memory() ? mem_size : pimpl->size;
+}
 
 int llama_file::file_id() const {
+    if (is_memory() || is_encrypted()) {
+        return -1;
+    }
 #ifdef _WIN32
     return _fileno(pimpl->fp);
 #else
@@ -259,13 +281,58 @@ int llama_file::file_id() const {
 #endif
 }
 
-void llama_file::seek(size_t offset, int whence) const { pimpl->seek(offset, whence); }
-void llama_file::read_raw(void * ptr, size_t len) const { pimpl->read_raw(ptr, len); }
+void llama_file::seek(size_t offset, int whence) const {
+    if (!is_memory() && !is_encrypted()) {
+        pimpl->seek(offset, whence);
+        return;
+    }
+    size_t & pos = is_encrypted() ? crypt_pos : mem_pos;
+    size_t base = whence == SEEK_CUR ? pos : whence == SEEK_END ? size() : 0;
+    if (base + offset > size()) {
+        throw std::runtime_error("seek error: offset out of bounds");
+    }
+    pos = base + offset;
+}
+
+void llama_file::read_raw(void * ptr, size_t len) const {
+    if (is_encrypted()) {
+        crypt->read(crypt_pos, ptr, len);
+        crypt_pos += len;
+        return;
+    }
+    if (!is_memory()) {
+        pimpl->read_raw(ptr, len);
+        return;
+    }
+    if (len > mem_size - mem_pos) {
+        throw std::runtime_error("unexpectedly reached end of file");
+    }
+    std::memcpy(ptr, mem_data + mem_pos, len);
+    mem_pos += len;
+}
+
+uint32_t llama_file::read_u32() const {
+    if (!is_memory() && !is_encrypted()) {
+        return pimpl->read_u32();
+    }
+    uint32_t val;
+    read_raw(&val, sizeof(val));
+    return val;
+}
 
-uint32_t llama_file::read_u32() const { return pimpl->read_u32(); }
+void llama_file::write_raw(const void * ptr, size_t len) const {
+    if (is_memory() || is_encrypted()) {
+        throw std::runtime_error("memory-backed and encrypted files are read-only");
+    }
+    pimpl->write_raw(ptr, len);
+}
 
-void llama_file::write_raw(const void * ptr, size_t len) const { pimpl->write_raw(ptr, len); }
-void llama_file::write_u32(uint32_t val) const { pimpl->write_u32(val); }
+void llama_file::write_u32(uint32_t val) const {
+    if (is_memory() || is_encrypted()) {
+        throw std::runtime_error("memory-backed and encrypted files are read-only");
+    }
+    pimpl->write_u32(val);
+}
 
 // llama_mmap
 
@@ -438,13 +505,32 @@ struct llama_mmap::impl {
     size_t size;
 };
 
-llama_mmap::llama_mmap(struct llama_file * file, size_t prefetch, bool numa) : pimpl(std::make_unique<impl>(file, prefetch, numa)) {}
+llama_mmap::llama_mmap(struct llama_file * file, size_t prefetch, bool numa) {
+    // a memory-backed file has no file descriptor to map, see from_memory()
+    GGML_ASSERT(!file->is_memory());
+    pimpl = std::make_unique<impl>(file, prefetch, numa);
+}
 llama_mmap::~llama_mmap() = default;
 
-size_t llama_mmap::size() const { return pimpl->size; }
-void * llama_mmap::addr() const { return pimpl->addr; }
+// the tensors are only read, the const of the caller buffer is dropped to fit the mapping interface
+std::unique_ptr<llama_mmap> llama_mmap::from_memory(const struct llama_file * file) {
+    GGML_ASSERT(file->is_memory());
+    std::unique_ptr<llama_mmap> mapping(new llama_mmap());
+    mapping->mem_addr  = const_cast<void *>(file->data());
+    mapping->mem_size  = file->size();
+    mapping->mem_owner = file->owner();
+    return mapping;
+}
 
-void llama_mmap::unmap_fragment(size_t first, size_t last) { pimpl->unmap_fragment(first, last); }
+size_t llama_mmap::size() const { return pimpl ? pimpl->size : mem_size; }
+void * llama_mmap::addr() const { return pimpl ? pimpl->addr : mem_addr; }
+
+void llama_mmap::unmap_fragment(size_t first, size_t last) {
+    // memory regions belong to the caller (or to their owner), nothing to release here
+    if (pimpl) {
+        pimpl->unmap_fragment(first, last);
+    }
+}
 
 #if defined(_POSIX_MEMLOCK_RANGE) || defined(_WIN32)
 const bool llama_mmap::SUPPORTED  = true;
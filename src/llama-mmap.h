@@ -4,8 +4,10 @@
 #include <memory>
 #include <vector>
 
+struct llama_crypt_file;
 struct llama_file;
 struct llama_mmap;
+struct llama_model_encryption;
 struct llama_mlock;
 
 using llama_files  = std::vector<std::unique_ptr<llama_file>>;
@@ -14,8 +16,21 @@ using llama_mlocks = std::vector<std::unique_ptr<llama_mlock>>;
 
 struct llama_file {
     llama_file(const char * fname, const char * mode);
+    // read-only view over a memory region, `owner` (optional) keeps the region alive
+    llama_file(const void * data, size_t size, std::shared_ptr<void> owner = nullptr);
+    // encrypted GGUF container (see llama-crypt.h), reads return the plaintext
+    llama_file(const char * fname, const llama_model_encryption & enc);
     ~llama_file();
 
+    // memory-backed files only
+    bool is_memory() const { return mem_data != nullptr; }
+    const void * data() const { return mem_data; }
+    const std::shared_ptr<void> & owner() const { return mem_owner; }
+
+    // encrypted files only
+    bool is_encrypted() const { return crypt != nullptr; }
+    const llama_crypt_file * crypt_file() const { return crypt.get(); }
+
     size_t tell() const;
     size_t size() const;
 
@@ -32,6 +47,14 @@ struct llama_file {
 private:
     struct impl;
     std::unique_ptr<impl> pimpl;
+
+    const uint8_t *       mem_data = nullptr;
+    size_t                mem_size = 0;
+    mutable size_t        mem_pos  = 0;
+    std::shared_ptr<void> mem_owner;
+
+    std::unique_ptr<llama_crypt_file> crypt;
+    mutable size_t                    crypt_pos = 0;
 };
 
 struct llama_mmap {
@@ -39,6 +62,9 @@ struct llama_mmap {
     llama_mmap(struct llama_file * file, size_t prefetch = (size_t) -1, bool numa = false);
     ~llama_mmap();
 
+    // "maps" a memory-backed file in place, without copy
+    static std::unique_ptr<llama_mmap> from_memory(const struct llama_file * file);
+
     size_t size() const;
     void * addr() const;
 
@@ -47,8 +73,14 @@ struct llama_mmap {
     static const bool SUPPORTED;
 
 private:
+    llama_mmap() = default;
+
     struct impl;
     std::unique_ptr<impl> pimpl;
+
+    void *                mem_addr = nullptr;
+    size_t                mem_size = 0;
+    std::shared_ptr<void> mem_owner;
 };
 
 struct llama_mlock {
@@ -1,5 +1,7 @@
 #include "llama-model-loader.h"
 
+#include "llama-crypt.h"
+
 #include "ggml.h"
 
 #include <array>
@@ -440,25 +442,39 @@ namespace GGUFMeta {
     template bool llama_model_loader::get_key_or_arr<std::array<int, 4>>(enum llm_kv kid, std::array<int, 4> & result, uint32_t n, bool required);
     template bool llama_model_loader::get_key_or_arr<std::array<uint32_t, 512>>(enum llm_kv kid, std::array<uint32_t, 512> & result, uint32_t n, bool required);
 
+// open a model file, plain or encrypted, and parse its GGUF header
+static gguf_context * llama_gguf_open(const char * fname, const llama_model_encryption * enc, gguf_init_params params, std::unique_ptr<llama_file> & file) {
+    if (!enc) {
+        gguf_context * ctx = gguf_init_from_file(fname, params);
+        if (ctx) {
+            file.reset(new llama_file(fname, "rb"));
+        }
+        return ctx;
+    }
+
+    file.reset(new llama_file(fname, *enc));
+
+    std::vector<uint8_t> head(file->crypt_file()->meta_size());
+    file->read_raw(head.data(), head.size());
+    gguf_context * ctx = gguf_init_from_buffer(head.data(), head.size(), params);
+    std::fill(head.begin(), head.end(), 0);
+    return ctx;
+}
+
 llama_model_loader::llama_model_loader(
         const std::string & fname,
         std::vector<std::string> & splits,
         bool use_mmap,
         bool check_tensors,
         const llama_model_kv_override * param_overrides_p,
-        const llama_model_tensor_buft_override * param_tensor_buft_overrides_p) {
+        const llama_model_tensor_buft_override * param_tensor_buft_overrides_p,
+        const llama_model_encryption * enc) {
     int trace = 0;
     if (getenv("LLAMA_TRACE")) {
         trace = atoi(getenv("LLAMA_TRACE"));
     }
 
-    if (param_overrides_p != nullptr) {
-        for (const struct llama_model_kv_override * p = param_overrides_p; p->key[0] != 0; p++) {
-            kv_overrides.insert({std::string(p->key), *p});
-        }
-    }
-
-    tensor_buft_overrides = param_tensor_buft_overrides_p;
+    init_overrides(param_overrides_p, param_tensor_buft_overrides_p);
 
     // Load the main GGUF
     struct ggml_context * ctx = NULL;
@@ -467,7 +483,8 @@ llama_model_loader::llama_model_loader(
         /*.ctx      = */ &ctx,
     };
 
-    meta.reset(gguf_init_from_file(fname.c_str(), params));
+    std::unique_ptr<llama_file> file;
+    meta.reset(llama_gguf_open(fname.c_str(), enc, params, file));
     if (!meta) {
         throw std::runtime_error(format("%s: failed to load model from %s\n", __func__, fname.c_str()));
     }
@@ -475,7 +492,7 @@ llama_model_loader::llama_model_loader(
     get_key(llm_kv(LLM_KV_GENERAL_ARCHITECTURE), arch_name, false);
     llm_kv = LLM_KV(llm_arch_from_string(arch_name));
 
-    files.emplace_back(new llama_file(fname.c_str(), "rb"));
+    files.emplace_back(std::move(file));
     contexts.emplace_back(ctx);
 
     // Save tensors data offset of the main file.
@@ -526,7 +543,8 @@ llama_model_loader::llama_model_loader(
                 /*.no_alloc = */ true,
                 /*.ctx      = */ &ctx,
             };
-            gguf_context_ptr ctx_gguf { gguf_init_from_file(fname_split, split_params) };
+            std::unique_ptr<llama_file> file_split;
+            gguf_context_ptr ctx_gguf { llama_gguf_open(fname_split, enc, split_params, file_split) };
             if (!ctx_gguf) {
                 throw std::runtime_error(format("%s: failed to load GGUF split from %s\n", __func__, fname_split));
             }
@@ -543,7 +561,7 @@ llama_model_loader::llama_model_loader(
                 }
             }
 
-            files.emplace_back(new llama_file(fname_split, "rb"));
+            files.emplace_back(std::move(file_split));
             contexts.emplace_back(ctx);
 
             // Save tensors data offset info of the shard.
@@ -572,13 +590,113 @@ llama_model_loader::llama_model_loader(
         LLAMA_LOG_INFO("%s: additional %d GGUFs metadata loaded.\n",  __func__, n_split - 1);
     }
 
+    init_summary(fname, trace);
+
+    if (!llama_mmap::SUPPORTED) {
+        LLAMA_LOG_WARN("%s: mmap is not supported on this platform\n", __func__);
+        use_mmap = false;
+    }
+
+    // the plaintext only exists in the model buffers
+    if (enc && use_mmap) {
+        LLAMA_LOG_INFO("%s: encrypted model, mmap disabled\n", __func__);
+        use_mmap = false;
+    }
+
+    this->use_mmap = use_mmap;
+    this->check_tensors = check_tensors;
+}
+
+llama_model_loader::llama_model_loader(
+        const void * data,
+        size_t size,
+        std::shared_ptr<void> owner,
+        bool use_mmap,
+        bool check_tensors,
+        const llama_model_kv_override * param_overrides_p,
+        const llama_model_tensor_buft_override * param_tensor_buft_overrides_p) {
+    int trace = 0;
+    if (getenv("LLAMA_TRACE")) {
+        trace = atoi(getenv("LLAMA_TRACE"));
+    }
+
+    init_overrides(param_overrides_p, param_tensor_buft_overrides_p);
+
+    struct ggml_context * ctx = NULL;
+    struct gguf_init_params params = {
+        /*.no_alloc = */ true,
+        /*.ctx      = */ &ctx,
+    };
+
+    meta.reset(gguf_init_from_buffer(data, size, params));
+    if (!meta) {
+        throw std::runtime_error(format("%s: failed to load model from a %zu bytes buffer\n", __func__, size));
+    }
+
+    get_key(llm_kv(LLM_KV_GENERAL_ARCHITECTURE), arch_name, false);
+    llm_kv = LLM_KV(llm_arch_from_string(arch_name));
+
+    files.emplace_back(new llama_file(data, size, std::move(owner)));
+    contexts.emplace_back(ctx);
+
+    for (ggml_tensor * cur = ggml_get_first_tensor(ctx); cur; cur = ggml_get_next_tensor(ctx, cur)) {
+        std::string tensor_name = std::string(cur->name);
+        if (weights_map.find(tensor_name) != weights_map.end()) {
+            throw std::runtime_error(format("invalid model: tensor '%s' is duplicated", ggml_get_name(cur)));
+        }
+        n_elements += ggml_nelements(cur);
+        n_bytes    += ggml_nbytes(cur);
+        weights_map.emplace(tensor_name, llama_tensor_weight(files.back().get(), 0, meta.get(), cur));
+    }
+
+    uint16_t n_split = 0;
+    get_key(llm_kv(LLM_KV_SPLIT_COUNT), n_split, false);
+    if (n_split > 1) {
+        throw std::runtime_error(format("%s: split models (%d GGUFs) cannot be loaded from a buffer, merge them first", __func__, n_split));
+    }
+
+    init_summary(format("a %zu bytes buffer", size), trace);
+
+    // the backends wrap host memory as-is, tensors can only be referenced in place if they keep the
+    // ggml tensor alignment (the data section offset is a multiple of the GGUF alignment)
+    const size_t tensor_alignment = 32;
+    if (use_mmap && ((uintptr_t) data % tensor_alignment != 0 || gguf_get_alignment(meta.get()) % tensor_alignment != 0)) {
+        LLAMA_LOG_WARN("%s: buffer is not %zu bytes aligned, tensors will be copied\n", __func__, tensor_alignment);
+        use_mmap = false;
+    }
+
+    this->use_mmap = use_mmap;
+    this->check_tensors = check_tensors;
+}
+
+void llama_model_loader::init_overrides(
+        const llama_model_kv_override * param_overrides_p,
+        const llama_model_tensor_buft_override * param_tensor_buft_overrides_p) {
+    if (param_overrides_p != nullptr) {
+        for (const struct llama_model_kv_override * p = param_overrides_p; p->key[0] != 0; p++) {
+            kv_overrides.insert({std::string(p->key), *p});
+        }
+    }
+
+    tensor_buft_overrides = param_tensor_buft_overrides_p;
+}
+
+void llama_model_loader::verify_files() const {
+    for (const auto & file : files) {
+        if (file->is_encrypted()) {
+            file->crypt_file()->verify();
+        }
+    }
+}
+
+void llama_model_loader::init_summary(const std::string & source, int trace) {
     n_kv      = gguf_get_n_kv(meta.get());
     n_tensors = weights_map.size();
 
     fver = (enum llama_fver) gguf_get_version(meta.get());
 
     LLAMA_LOG_INFO("%s: loaded meta data with %d key-value pairs and %d tensors from %s (version %s)\n",
-            __func__, n_kv, n_tensors, fname.c_str(), llama_file_version_name(fver));
+            __func__, n_kv, n_tensors, source.c_str(), llama_file_version_name(fver));
 
     // determine file type based on the number of tensors for each quantization and print meta data
     // TODO: make optional
@@ -680,14 +798,6 @@ llama_model_loader::llama_model_loader(
             LLAMA_LOG_INFO("%s: - type %4s: %4d tensors\n", __func__, ggml_type_name(kv.first), kv.second);
         }
     }
-
-    if (!llama_mmap::SUPPORTED) {
-        LLAMA_LOG_WARN("%s: mmap is not supported on this platform\n", __func__);
-        use_mmap = false;
-    }
-
-    this->use_mmap = use_mmap;
-    this->check_tensors = check_tensors;
 }
 
 std::string llama_model_loader::get_arch_name() const {
@@ -833,7 +943,10 @@ void llama_model_loader::init_mappings(bool prefetch, llama_mlocks * mlock_mmaps
                 }
             }
 
-            std::unique_ptr<llama_mmap> mapping = std::make_unique<llama_mmap>(file.get(), prefetch ? -1 : 0, is_numa);
+            // a memory-backed file is mapped in place, the others mmap() their file descriptor
+            std::unique_ptr<llama_mmap> mapping = file->is_memory()
+                ? llama_mmap::from_memory(file.get())
+                : std::make_unique<llama_mmap>(file.get(), prefetch ? -1 : 0, is_numa);
             mmaps_used.emplace_back(mapping->size(), 0);
             if (mlock_mmaps) {
                 std::unique_ptr<llama_mlock> mlock_mmap(new llama_mlock());
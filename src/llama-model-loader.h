@@ -97,8 +97,30 @@ struct llama_model_loader {
         bool use_mmap,
         bool check_tensors,
         const llama_model_kv_override * param_overrides_p,
+        const llama_model_tensor_buft_override * param_tensor_buft_overrides_p,
+        const llama_model_encryption * enc = nullptr); // all the splits share the key
+
+    // GGUF image held in memory (single split), tensors are referenced in place when use_mmap is set
+    // `owner` (optional) keeps the memory alive as long as the mappings
+    llama_model_loader(
+        const void * data,
+        size_t size,
+        std::shared_ptr<void> owner,
+        bool use_mmap,
+        bool check_tensors,
+        const llama_model_kv_override * param_overrides_p,
         const llama_model_tensor_buft_override * param_tensor_buft_overrides_p);
 
+    void init_overrides(
+        const llama_model_kv_override * param_overrides_p,
+        const llama_model_tensor_buft_override * param_tensor_buft_overrides_p);
+
+    // counts, file type guess and metadata dump, once all the GGUFs are indexed
+    void init_summary(const std::string & source, int trace);
+
+    // check the hash of the encrypted files, once the tensors are loaded
+    void verify_files() const;
+
     template<typename T>
     typename std::enable_if<std::is_integral<T>::value, bool>::type
     get_arr_n(const std::string & key, T & result, bool required = true);
@@ -16,6 +16,8 @@
 #include <cstdio>
 #include <cstring>
 #include <ctime>
+#include <memory>
+#include <new>
 
 #if defined(_MSC_VER)
 #pragma warning(disable: 4244 4267) // possible loss of data
@@ -83,8 +85,15 @@ int64_t llama_time_us(void) {
     return ggml_time_us();
 }
 
+// GGUF image held in memory, `owner` (optional) is kept alive by the model mappings
+struct llama_model_blob {
+    const void * data = nullptr;
+    size_t       size = 0;
+    std::shared_ptr<void> owner;
+};
+
 // Returns 0 on success, -1 on error, and -2 on cancellation via llama_progress_callback
-static int llama_model_load(const std::string & fname, std::vector<std::string> & splits, llama_model & model, llama_model_params & params) {
+static int llama_model_load(const std::string & fname, std::vector<std::string> & splits, const llama_model_blob * blob, const llama_model_encryption * enc, llama_model & model, llama_model_params & params) {
     // loading time will be recalculated after the first eval, so
     // we take page faults deferred by mmap() into consideration
     model.t_load_us = 0;
@@ -93,7 +102,10 @@ static int llama_model_load(const std::string & fname, std::vector<std::string>
     model.t_start_us = tm.t_start_us;
 
     try {
-        llama_model_loader ml(fname, splits, params.use_mmap, params.check_tensors, params.kv_overrides, params.tensor_buft_overrides);
+        std::unique_ptr<llama_model_loader> ml_ptr = blob
+            ? std::make_unique<llama_model_loader>(blob->data, blob->size, blob->owner, params.use_mmap, params.check_tensors, params.kv_overrides, params.tensor_buft_overrides)
+            : std::make_unique<llama_model_loader>(fname, splits, params.use_mmap, params.check_tensors, params.kv_overrides, params.tensor_buft_overrides, enc);
+        llama_model_loader & ml = *ml_ptr;
 
         ml.print_info();
 
@@ -126,6 +138,12 @@ static int llama_model_load(const std::string & fname, std::vector<std::string>
         if (!model.load_tensors(ml)) {
             return -2;
         }
+
+        try {
+            ml.verify_files();
+        } catch(const std::exception & e) {
+            throw std::runtime_error("error verifying model: " + std::string(e.what()));
+        }
     } catch (const std::exception & err) {
         LLAMA_LOG_ERROR("%s: error loading model: %s\n", __func__, err.what());
         return -1;
@@ -137,6 +155,8 @@ static int llama_model_load(const std::string & fname, std::vector<std::string>
 static struct llama_model * llama_model_load_from_file_impl(
         const std::string & path_model,
         std::vector<std::string> & splits,
+        const llama_model_blob * blob,
+        const llama_model_encryption * enc,
         struct llama_model_params params) {
     ggml_time_init();
 
@@ -209,7 +229,7 @@ static struct llama_model * llama_model_load_from_file_impl(
         LLAMA_LOG_INFO("%s: using device %s (%s) - %zu MiB free\n", __func__, ggml_backend_dev_name(dev), ggml_backend_dev_description(dev), free/1024/1024);
     }
 
-    const int status = llama_model_load(path_model, splits, *model, params);
+    const int status = llama_model_load(path_model, splits, blob, enc, *model, params);
     GGML_ASSERT(status <= 0);
     if (status < 0) {
         if (status == -1) {
@@ -236,7 +256,7 @@ struct llama_model * llama_model_load_from_file(
         const char * path_model,
         struct llama_model_params params) {
     std::vector<std::string> splits = {};
-    return llama_model_load_from_file_impl(path_model, splits, params);
+    return llama_model_load_from_file_impl(path_model, splits, nullptr, nullptr, params);
 }
 
 struct llama_model * llama_model_load_from_splits(
@@ -251,7 +271,72 @@ struct llama_model * llama_model_load_from_splits(
     for (size_t i = 0; i < n_paths; ++i) {
         splits.push_back(paths[i]);
     }
-    return llama_model_load_from_file_impl(splits.front(), splits, params);
+    return llama_model_load_from_file_impl(splits.front(), splits, nullptr, nullptr, params);
+}
+
+struct llama_model * llama_model_load_from_encrypted_file(
+        const char * path_model,
+        const llama_model_encryption * enc,
+        struct llama_model_params params) {
+    if (enc == nullptr || enc->cipher == LLAMA_MODEL_CIPHER_NONE) {
+        return llama_model_load_from_file(path_model, params);
+    }
+    std::vector<std::string> splits = {};
+    return llama_model_load_from_file_impl(path_model, splits, nullptr, enc, params);
+}
+
+struct llama_model * llama_model_load_from_buffer(
+        const void * data,
+        size_t size,
+        struct llama_model_params params) {
+    if (data == nullptr || size == 0) {
+        LLAMA_LOG_ERROR("%s: empty model buffer\n", __func__);
+        return nullptr;
+    }
+    std::vector<std::string> splits;
+    llama_model_blob blob = { data, size, nullptr };
+    return llama_model_load_from_file_impl("", splits, &blob, nullptr, params);
+}
+
+struct llama_model * llama_model_load_from_chunks(
+        llama_model_read_chunk_callback read_chunk,
+        void * user_data,
+        size_t size,
+        struct llama_model_params params) {
+    if (read_chunk == nullptr || size == 0) {
+        LLAMA_LOG_ERROR("%s: no model chunks to read\n", __func__);
+        return nullptr;
+    }
+
+    // aligned so that the tensors can be referenced in place, the buffer is wiped on release
+    // since the model may have been decrypted into it
+    const std::align_val_t alignment { 64 };
+    uint8_t * buf = static_cast<uint8_t *>(::operator new(size, alignment, std::nothrow));
+    if (buf == nullptr) {
+        LLAMA_LOG_ERROR("%s: failed to allocate %zu bytes\n", __func__, size);
+        return nullptr;
+    }
+    std::shared_ptr<void> owner(buf, [size, alignment](void * p) {
+        volatile uint8_t * v = static_cast<volatile uint8_t *>(p);
+        for (size_t i = 0; i < size; ++i) {
+            v[i] = 0;
+        }
+        ::operator delete(p, alignment);
+    });
+
+    size_t n_read = 0;
+    while (n_read < size) {
+        const size_t n = read_chunk(buf + n_read, size - n_read, user_data);
+        if (n == 0 || n > size - n_read) {
+            LLAMA_LOG_ERROR("%s: model stream ended after %zu of %zu bytes\n", __func__, n_read, size);
+            return nullptr;
+        }
+        n_read += n;
+    }
+
+    std::vector<std::string> splits;
+    llama_model_blob blob = { buf, size, std::move(owner) };
+    return llama_model_load_from_file_impl("", splits, &blob, nullptr, params);
 }
 
 void llama_model_save_to_file(const struct llama_model * model, const char * path_model) {
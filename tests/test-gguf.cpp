@@ -1064,10 +1064,10 @@ static bool same_tensor_data(const struct ggml_context * orig, const struct ggml
     return ok;
 }
 
-static std::pair<int, int> test_roundtrip(ggml_backend_dev_t dev, const unsigned int seed, const bool only_meta) {
+static std::pair<int, int> test_roundtrip(ggml_backend_dev_t dev, const unsigned int seed, const bool only_meta, const bool from_buffer) {
     ggml_backend_t backend = ggml_backend_dev_init(dev, nullptr);
-    printf("%s: device=%s, backend=%s, only_meta=%s\n",
-        __func__, ggml_backend_dev_description(dev), ggml_backend_name(backend), only_meta ? "yes" : "no");
+    printf("%s: device=%s, backend=%s, only_meta=%s, from_buffer=%s\n",
+        __func__, ggml_backend_dev_description(dev), ggml_backend_name(backend), only_meta ? "yes" : "no", from_buffer ? "yes" : "no");
 
     int npass = 0;
     int ntest = 0;
@@ -1094,19 +1094,42 @@ static std::pair<int, int> test_roundtrip(ggml_backend_dev_t dev, const unsigned
     GGML_ASSERT(file);
 #endif // _WIN32
 
-    {
-        std::vector<int8_t> buf;
-        gguf_write_to_buf(gguf_ctx_0, buf, only_meta);
-        GGML_ASSERT(fwrite(buf.data(), 1, buf.size(), file) == buf.size());
-        rewind(file);
-    }
+    std::vector<int8_t> buf;
+    gguf_write_to_buf(gguf_ctx_0, buf, only_meta);
+    GGML_ASSERT(fwrite(buf.data(), 1, buf.size(), file) == buf.size());
+    rewind(file);
 
     struct ggml_context * ctx_1 = nullptr;
     struct gguf_init_params gguf_params = {
         /*no_alloc =*/ false,
         /*ctx      =*/ only_meta ? nullptr : &ctx_1,
     };
-    struct gguf_context * gguf_ctx_1 = gguf_init_from_file_impl(file, gguf_params);
+    struct gguf_context * gguf_ctx_1 = from_buffer ?
+        gguf_init_from_buffer(buf.data(), buf.size(), gguf_params) : gguf_init_from_file_impl(file, gguf_params);
+
+    if (from_buffer) {
+        // the tensor data is copied into ctx_1: the buffer can go away
+        std::fill(buf.begin(), buf.end(), 0);
+
+        printf("%s: truncated_buffer_rejected: ", __func__);
+        struct ggml_context * ctx_2 = nullptr;
+        struct gguf_init_params gguf_params_2 = {
+            /*no_alloc =*/ false,
+            /*ctx      =*/ only_meta ? nullptr : &ctx_2,
+        };
+        std::vector<int8_t> buf_2;
+        gguf_write_to_buf(gguf_ctx_0, buf_2, only_meta);
+        struct gguf_context * gguf_ctx_2 = gguf_init_from_buffer(buf_2.data(), buf_2.size() - 1, gguf_params_2);
+        if (gguf_ctx_2 == nullptr) {
+            printf("\033[1;32mOK\033[0m\n");
+            npass++;
+        } else {
+            printf("\033[1;31mFAIL\033[0m\n");
+        }
+        ntest++;
+        ggml_free(ctx_2);
+        gguf_free(gguf_ctx_2);
+    }
 
     printf("%s: same_version: ", __func__);
     if (gguf_get_version(gguf_ctx_0) == gguf_get_version(gguf_ctx_1)) {
@@ -1316,9 +1339,11 @@ int main(int argc, char ** argv) {
         ggml_backend_dev_t dev = ggml_backend_dev_get(i);
 
         for (bool only_meta : {true, false}) {
-            std::pair<int, int> result = test_roundtrip(dev, seed, only_meta);
-            npass += result.first;
-            ntest += result.second;
+            for (bool from_buffer : {false, true}) {
+                std::pair<int, int> result = test_roundtrip(dev, seed, only_meta, from_buffer);
+                npass += result.first;
+                ntest += result.second;
+            }
         }
 
         {
@@ -0,0 +1,287 @@
+// loads a tiny random llama model through the in-memory and encrypted entry points and checks that it computes
+// the same logits as the model loaded from the file
+#include "llama.h"
+#include "gguf.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <cstdio>
+#include <filesystem>
+#include <fstream>
+#include <iterator>
+#include <random>
+#include <string>
+#include <vector>
+
+constexpr int n_vocab = 32;
+constexpr int n_embd  = 32;
+constexpr int n_head  = 4;
+constexpr int n_ff    = 64;
+constexpr int n_ctx   = 64;
+
+static bool write_tiny_model(const std::string & path, const unsigned int seed) {
+    std::mt19937 rng(seed);
+    std::uniform_real_distribution<float> dist(-0.1f, 0.1f);
+
+    struct ggml_init_params ggml_params = {
+        /*.mem_size   =*/ 1024*1024,
+        /*.mem_buffer =*/ nullptr,
+        /*.no_alloc   =*/ false,
+    };
+    struct ggml_context * ctx = ggml_init(ggml_params);
+    struct gguf_context * gguf_ctx = gguf_init_empty();
+
+    gguf_set_val_str(gguf_ctx, "general.architecture", "llama");
+    gguf_set_val_u32(gguf_ctx, "llama.context_length", n_ctx);
+    gguf_set_val_u32(gguf_ctx, "llama.embedding_length", n_embd);
+    gguf_set_val_u32(gguf_ctx, "llama.block_count", 1);
+    gguf_set_val_u32(gguf_ctx, "llama.feed_forward_length", n_ff);
+    gguf_set_val_u32(gguf_ctx, "llama.attention.head_count", n_head);
+    gguf_set_val_f32(gguf_ctx, "llama.attention.layer_norm_rms_epsilon", 1e-5f);
+    gguf_set_val_u32(gguf_ctx, "llama.vocab_size", n_vocab);
+    gguf_set_val_str(gguf_ctx, "tokenizer.ggml.model", "no_vocab");
+
+    const auto add_tensor = [&](const char * name, int64_t ne0, int64_t ne1, bool is_norm) {
+        struct ggml_tensor * t = ne1 > 0 ? ggml_new_tensor_2d(ctx, GGML_TYPE_F32, ne0, ne1) : ggml_new_tensor_1d(ctx, GGML_TYPE_F32, ne0);
+        ggml_set_name(t, name);
+        float * data = (float *) t->data;
+        for (int64_t i = 0; i < ggml_nelements(t); i++) {
+            data[i] = is_norm ? 1.0f : dist(rng);
+        }
+        gguf_add_tensor(gguf_ctx, t);
+    };
+    add_tensor("token_embd.weight",       n_embd, n_vocab, false);
+    add_tensor("output_norm.weight",      n_embd, 0,       true);
+    add_tensor("blk.0.attn_norm.weight",  n_embd, 0,       true);
+    add_tensor("blk.0.attn_q.weight",     n_embd, n_embd,  false);
+    add_tensor("blk.0.attn_k.weight",     n_embd, n_embd,  false);
+    add_tensor("blk.0.attn_v.weight",     n_embd, n_embd,  false);
+    add_tensor("blk.0.attn_output.weight", n_embd, n_embd, false);
+    add_tensor("blk.0.ffn_norm.weight",   n_embd, 0,       true);
+    add_tensor("blk.0.ffn_gate.weight",   n_embd, n_ff,    false);
+    add_tensor("blk.0.ffn_down.weight",   n_ff,   n_embd,  false);
+    add_tensor("blk.0.ffn_up.weight",     n_embd, n_ff,    false);
+
+    const bool ok = gguf_write_to_file(gguf_ctx, path.c_str(), false);
+    gguf_free(gguf_ctx);
+    ggml_free(ctx);
+    return ok;
+}
+
+static std::vector<uint8_t> read_file(const std::string & path) {
+    std::ifstream file(path, std::ios::binary);
+    return std::vector<uint8_t>(std::istreambuf_iterator<char>(file), std::istreambuf_iterator<char>());
+}
+
+// logits of the last token of a short prompt, empty if the model could not be evaluated
+static std::vector<float> eval_logits(struct llama_model * model) {
+    if (model == nullptr) {
+        return {};
+    }
+    llama_context_params cparams = llama_context_default_params();
+    cparams.n_ctx     = 16;
+    cparams.n_batch   = 16;
+    cparams.n_threads = 1;
+    struct llama_context * ctx = llama_init_from_model(model, cparams);
+    if (ctx == nullptr) {
+        return {};
+    }
+    std::vector<llama_token> tokens = { 1, 5, 7, 11 };
+    std::vector<float> logits;
+    if (llama_decode(ctx, llama_batch_get_one(tokens.data(), tokens.size())) == 0) {
+        const float * out = llama_get_logits_ith(ctx, -1);
+        logits.assign(out, out + n_vocab);
+    }
+    llama_free(ctx);
+    return logits;
+}
+
+static bool same_logits(const std::vector<float> & a, const std::vector<float> & b) {
+    if (a.empty() || a.size() != b.size()) {
+        return false;
+    }
+    for (size_t i = 0; i < a.size(); i++) {
+        if (std::fabs(a[i] - b[i]) > 1e-5f) {
+            return false;
+        }
+    }
+    return true;
+}
+
+static llama_model_params get_model_params(bool use_mmap) {
+    llama_model_params mparams = llama_model_default_params();
+    mparams.n_gpu_layers = 0;
+    mparams.use_mmap     = use_mmap;
+    return mparams;
+}
+
+struct chunk_reader {
+    const std::vector<uint8_t> * data;
+    size_t pos;
+    size_t step;
+};
+
+static size_t read_chunk(void * dst, size_t size, void * user_data) {
+    chunk_reader * reader = (chunk_reader *) user_data;
+    const size_t n = std::min({ size, reader->step, reader->data->size() - reader->pos });
+    std::copy(reader->data->begin() + reader->pos, reader->data->begin() + reader->pos + n, (uint8_t *) dst);
+    reader->pos += n;
+    return n;
+}
+
+static void report(const char * name, bool ok, int & npass, int & ntest) {
+    printf("%s: ", name);
+    if (ok) {
+        printf("\033[1;32mOK\033[0m\n");
+        npass++;
+    } else {
+        printf("\033[1;31mFAIL\033[0m\n");
+    }
+    ntest++;
+}
+
+static void test_buffer(const std::string & path, const std::vector<float> & expected, int & npass, int & ntest) {
+    std::vector<uint8_t> image = read_file(path);
+
+    // without mmap the tensors are copied: the caller's buffer can be wiped and released right away
+    struct llama_model * model = llama_model_load_from_buffer(image.data(), image.size(), get_model_params(false));
+    std::fill(image.begin(), image.end(), 0xAA);
+    image.clear();
+    image.shrink_to_fit();
+    report("buffer_copied_same_logits", same_logits(eval_logits(model), expected), npass, ntest);
+    llama_model_free(model);
+
+    image = read_file(path);
+    model = llama_model_load_from_buffer(image.data(), image.size() / 2, get_model_params(false));
+    report("buffer_truncated_rejected", model == nullptr, npass, ntest);
+    llama_model_free(model);
+}
+
+static void test_chunks(const std::string & path, const std::vector<float> & expected, int & npass, int & ntest) {
+    const std::vector<uint8_t> image = read_file(path);
+
+    // an odd step so that the chunks never line up with the GGUF sections
+    chunk_reader reader = { &image, 0, 1237 };
+    struct llama_model * model = llama_model_load_from_chunks(read_chunk, &reader, image.size(), get_model_params(true));
+    report("chunks_same_logits", same_logits(eval_logits(model), expected), npass, ntest);
+    llama_model_free(model);
+
+    // the stream ends before the announced size
+    reader = { &image, 0, 1237 };
+    model = llama_model_load_from_chunks(read_chunk, &reader, image.size() + 1, get_model_params(true));
+    report("chunks_short_stream_rejected", model == nullptr, npass, ntest);
+    llama_model_free(model);
+}
+
+static void write_file(const std::string & path, const std::vector<uint8_t> & data) {
+    std::ofstream file(path, std::ios::binary);
+    file.write((const char *) data.data(), data.size());
+}
+
+static void test_encrypted(const std::string & path, const std::vector<float> & expected, enum llama_model_cipher cipher, int & npass, int & ntest) {
+    const std::string name = cipher == LLAMA_MODEL_CIPHER_AES_256_GCM ? "gcm" : "ctr";
+    const std::string path_enc = path + "." + name + ".ggue";
+
+    uint8_t key[32];
+    for (int i = 0; i < 32; i++) {
+        key[i] = (uint8_t) (i * 7 + 3);
+    }
+    uint8_t hash[32] = {};
+
+    llama_model_encryption enc = {};
+    enc.cipher     = cipher;
+    enc.key        = key;
+    enc.chunk_size = 4096; // several chunks for a tiny model
+    enc.n_threads  = 2;
+    if (llama_model_encrypt_file(path.c_str(), path_enc.c_str(), &enc, hash) != 0) {
+        // built without LLAMA_OPENSSL
+        printf("%s: encryption not available, skipping\n", name.c_str());
+        return;
+    }
+
+    enc.hash = hash;
+    struct llama_model * model = llama_model_load_from_encrypted_file(path_enc.c_str(), &enc, get_model_params(false));
+    report((name + "_same_logits").c_str(), same_logits(eval_logits(model), expected), npass, ntest);
+    llama_model_free(model);
+
+    uint8_t wrong_hash[32];
+    std::copy(hash, hash + 32, wrong_hash);
+    wrong_hash[0] ^= 1;
+    enc.hash = wrong_hash;
+    model = llama_model_load_from_encrypted_file(path_enc.c_str(), &enc, get_model_params(false));
+    report((name + "_wrong_hash_rejected").c_str(), model == nullptr, npass, ntest);
+    llama_model_free(model);
+
+    uint8_t wrong_key[32];
+    std::copy(key, key + 32, wrong_key);
+    wrong_key[31] ^= 1;
+    enc.hash = hash;
+    enc.key  = wrong_key;
+    model = llama_model_load_from_encrypted_file(path_enc.c_str(), &enc, get_model_params(false));
+    report((name + "_wrong_key_rejected").c_str(), model == nullptr, npass, ntest);
+    llama_model_free(model);
+    enc.key = key;
+
+    // flip one byte in the last chunk, which only holds tensor data: the GGUF header still parses
+    const std::vector<uint8_t> image = read_file(path_enc);
+    std::vector<uint8_t> tampered = image;
+    tampered[tampered.size() - 24] ^= 0x5A;
+    write_file(path_enc, tampered);
+    model = llama_model_load_from_encrypted_file(path_enc.c_str(), &enc, get_model_params(false));
+    report((name + "_tampered_chunk_rejected").c_str(), model == nullptr, npass, ntest);
+    llama_model_free(model);
+
+    // and one in the first chunk, right after the 48 bytes container header
+    tampered = image;
+    tampered[48 + 16] ^= 0x5A;
+    write_file(path_enc, tampered);
+    model = llama_model_load_from_encrypted_file(path_enc.c_str(), &enc, get_model_params(false));
+    report((name + "_tampered_header_rejected").c_str(), model == nullptr, npass, ntest);
+    llama_model_free(model);
+
+    std::filesystem::remove(path_enc);
+}
+
+int main(int argc, char ** argv) {
+    std::random_device rd;
+    const unsigned int seed = argc < 2 ? rd() : std::stoi(argv[1]);
+
+    llama_backend_init();
+    llama_log_set([](ggml_log_level level, const char * text, void * /*user_data*/) {
+        if (level == GGML_LOG_LEVEL_ERROR) {
+            fputs(text, stderr);
+        }
+    }, nullptr);
+
+    const std::string path = (std::filesystem::temp_directory_path() / ("test-model-load-" + std::to_string(seed) + ".gguf")).string();
+    if (!write_tiny_model(path, seed)) {
+        printf("failed to write %s\n", path.c_str());
+        return 1;
+    }
+
+    struct llama_model * model = llama_model_load_from_file(path.c_str(), get_model_params(false));
+    const std::vector<float> expected = eval_logits(model);
+    llama_model_free(model);
+
+    int npass = 0;
+    int ntest = 0;
+    report("file_reference_logits", !expected.empty(), npass, ntest);
+    if (!expected.empty()) {
+        test_buffer(path, expected, npass, ntest);
+        test_chunks(path, expected, npass, ntest);
+        test_encrypted(path, expected, LLAMA_MODEL_CIPHER_AES_256_GCM, npass, ntest);
+        test_encrypted(path, expected, LLAMA_MODEL_CIPHER_AES_256_CTR, npass, ntest);
+    }
+
+    std::filesystem::remove(path);
+    llama_backend_free();
+
+    printf("%d/%d tests passed\n", npass, ntest);
+    if (npass != ntest) {
+        printf("\033[1;31mFAIL\033[0m\n");
+        return 1;
+    }
+    printf("\033[1;32mOK\033[0m\n");
+    return 0;
+}
@@ -0,0 +1,164 @@
+// checks the radix tree that the server uses to find the longest prefix of a prompt cached by any slot,
+// on hand-made cases and against a brute force search on random sequences
+#include "utils.hpp"
+
+#include <cstdio>
+#include <random>
+#include <string>
+#include <vector>
+
+static void report(const char * name, bool ok, int & npass, int & ntest) {
+    printf("%s: ", name);
+    if (ok) {
+        printf("\033[1;32mOK\033[0m\n");
+        npass++;
+    } else {
+        printf("\033[1;31mFAIL\033[0m\n");
+    }
+    ntest++;
+}
+
+static bool any_seq(llama_seq_id) {
+    return true;
+}
+
+static bool expect_match(const server_prefix_tree & tree, const llama_tokens & tokens, llama_seq_id prefer,
+        size_t n_expected, llama_seq_id seq_expected, const std::function<bool(llama_seq_id)> & usable = any_seq) {
+    llama_seq_id seq = -2;
+    const size_t n_match = tree.match(tokens, prefer, usable, seq);
+    return n_match == n_expected && seq == seq_expected;
+}
+
+static void test_basic(int & npass, int & ntest) {
+    server_prefix_tree tree;
+    report("empty_tree_no_match", expect_match(tree, { 1, 2, 3 }, 0, 0, -1), npass, ntest);
+
+    tree.insert(0, { 1, 2, 3, 4, 5 });
+    report("partial_edge_match", expect_match(tree, { 1, 2, 3, 9 }, 0, 3, 0), npass, ntest);
+    report("prompt_shorter_than_edge", expect_match(tree, { 1, 2 }, 1, 2, 0), npass, ntest);
+    report("no_common_first_token", expect_match(tree, { 7, 1, 2 }, 0, 0, -1), npass, ntest);
+
+    // splits the edge of seq 0 after { 1, 2 }
+    tree.insert(1, { 1, 2, 7, 8 });
+    report("split_longest_branch_1", expect_match(tree, { 1, 2, 7, 8, 9 }, 0, 4, 1), npass, ntest);
+    report("split_longest_branch_0", expect_match(tree, { 1, 2, 3, 4, 5, 6 }, 1, 5, 0), npass, ntest);
+    report("shared_prefix_prefers_0", expect_match(tree, { 1, 2 }, 0, 2, 0), npass, ntest);
+    report("shared_prefix_prefers_1", expect_match(tree, { 1, 2 }, 1, 2, 1), npass, ntest);
+
+    // a sequence that cannot be used stops the match where only it holds the tokens
+    const auto not_0 = [](llama_seq_id seq) { return seq != 0; };
+    report("unusable_seq_skipped", expect_match(tree, { 1, 2, 3, 4 }, 0, 2, 1, not_0), npass, ntest);
+
+    // removing seq 1 merges the split edge back
+    tree.remove(1);
+    report("removed_seq_not_matched", expect_match(tree, { 1, 2, 7, 8 }, 1, 2, 0), npass, ntest);
+    report("merged_after_remove", tree.root.children.size() == 1 && tree.root.children.at(1)->edge == llama_tokens({ 1, 2, 3, 4, 5 }), npass, ntest);
+
+    // inserting again replaces what the sequence held
+    tree.insert(0, { 9, 9 });
+    report("insert_replaces", expect_match(tree, { 1, 2 }, 0, 0, -1) && expect_match(tree, { 9, 9, 9 }, 0, 2, 0), npass, ntest);
+
+    tree.insert(0, {});
+    report("insert_empty_removes", tree.root.children.empty() && tree.paths.empty(), npass, ntest);
+}
+
+// the longest common prefix of tokens with the sequences accepted by usable
+static size_t brute_force_match(const std::vector<llama_tokens> & held, const llama_tokens & tokens, const std::function<bool(llama_seq_id)> & usable) {
+    size_t best = 0;
+    for (size_t s = 0; s < held.size(); s++) {
+        if (!usable((llama_seq_id) s)) {
+            continue;
+        }
+        size_t n = 0;
+        while (n < held[s].size() && n < tokens.size() && held[s][n] == tokens[n]) {
+            n++;
+        }
+        best = std::max(best, n);
+    }
+    return best;
+}
+
+static void test_random(const unsigned int seed, int & npass, int & ntest) {
+    std::mt19937 rng(seed);
+    const int n_seq  = 6;
+    const int n_iter = 2000;
+
+    // a small vocabulary and a few common stems so that the sequences share long prefixes
+    std::vector<llama_tokens> stems(3);
+    for (auto & stem : stems) {
+        for (int i = 0; i < 16; i++) {
+            stem.push_back(rng() % 4);
+        }
+    }
+    const auto random_tokens = [&]() {
+        const llama_tokens & stem = stems[rng() % stems.size()];
+        llama_tokens tokens(stem.begin(), stem.begin() + rng() % (stem.size() + 1));
+        const size_t n_tail = rng() % 12;
+        for (size_t i = 0; i < n_tail; i++) {
+            tokens.push_back(rng() % 4);
+        }
+        return tokens;
+    };
+
+    server_prefix_tree tree;
+    std::vector<llama_tokens> held(n_seq);
+    bool ok = true;
+    for (int iter = 0; iter < n_iter && ok; iter++) {
+        const llama_seq_id seq = rng() % n_seq;
+        if (rng() % 4 == 0) {
+            tree.remove(seq);
+            held[seq].clear();
+        } else {
+            held[seq] = random_tokens();
+            tree.insert(seq, held[seq]);
+        }
+
+        const unsigned int mask = rng() % (1u << n_seq);
+        const auto usable = [&](llama_seq_id s) { return (mask >> s) & 1; };
+        const llama_tokens prompt = random_tokens();
+        const llama_seq_id prefer = rng() % n_seq;
+
+        llama_seq_id holder = -1;
+        const size_t n_match = tree.match(prompt, prefer, usable, holder);
+        const size_t n_expected = brute_force_match(held, prompt, usable);
+        if (n_match != n_expected) {
+            printf("iteration %d: match = %zu, expected %zu\n", iter, n_match, n_expected);
+            ok = false;
+        } else if (n_match > 0) {
+            // the holder is usable, holds the matched tokens, and is the preferred sequence when that one does
+            const bool holds = holder >= 0 && usable(holder) && held[holder].size() >= n_match &&
+                std::equal(prompt.begin(), prompt.begin() + n_match, held[holder].begin());
+            const bool prefer_holds = usable(prefer) && held[prefer].size() >= n_match &&
+                std::equal(prompt.begin(), prompt.begin() + n_match, held[prefer].begin());
+            if (!holds || (prefer_holds && holder != prefer)) {
+                printf("iteration %d: holder = %d, prefer = %d\n", iter, holder, prefer);
+                ok = false;
+            }
+        }
+    }
+    report("random_matches_brute_force", ok, npass, ntest);
+
+    for (llama_seq_id seq = 0; seq < n_seq; seq++) {
+        tree.remove(seq);
+    }
+    report("random_all_removed", tree.root.children.empty() && tree.paths.empty(), npass, ntest);
+}
+
+int main(int argc, char ** argv) {
+    std::random_device rd;
+    const unsigned int seed = argc < 2 ? rd() : std::stoi(argv[1]);
+    printf("seed = %u\n", seed);
+
+    int npass = 0;
+    int ntest = 0;
+    test_basic(npass, ntest);
+    test_random(seed, npass, ntest);
+
+    printf("%d/%d tests passed\n", npass, ntest);
+    if (npass != ntest) {
+        printf("\033[1;31mFAIL\033[0m\n");
+        return 1;
+    }
+    printf("\033[1;32mOK\033[0m\n");
+    return 0;
+}
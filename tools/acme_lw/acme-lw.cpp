@@ -691,8 +691,11 @@ Certificate AcmeClient::issueCertificate(const std::list<std::string>& domainNam
 
 void AcmeClient::init(Environment env)
 {
-    const char * directoryUrl = (env == Environment::PRODUCTION ? productionDirectoryUrl : stagingDirectoryUrl);
+    init(env == Environment::PRODUCTION ? productionDirectoryUrl : stagingDirectoryUrl);
+}
 
+void AcmeClient::init(const string& directoryUrl)
+{
     initHttp();
 
     verifyRandomness();
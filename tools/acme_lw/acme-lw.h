@@ -104,6 +104,12 @@ public:
     */
     static void init(Environment env = Environment::PRODUCTION);
 
+    /**
+        Same as above, against the acme CA at 'directoryUrl', e.g. a
+        local test CA. May be called again to switch to another CA.
+    */
+    static void init(const std::string& directoryUrl);
+
     // Call once before application shutdown.
     static void teardown();
 
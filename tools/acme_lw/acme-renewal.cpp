@@ -0,0 +1,351 @@
+#include "acme-renewal.h"
+
+#include <openssl/err.h>
+#include <openssl/evp.h>
+#include <openssl/pem.h>
+#include <openssl/rsa.h>
+#include <openssl/ssl.h>
+#include <openssl/x509.h>
+#include <openssl/x509v3.h>
+
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <fstream>
+#include <iostream>
+#include <sstream>
+
+using namespace std;
+
+namespace
+{
+
+const char * productionDirectoryUrl = "https://acme-v02.api.letsencrypt.org/directory";
+
+string readFile(const string& path)
+{
+    ifstream file(path, ios::binary);
+    if (!file)
+    {
+        return "";
+    }
+    stringstream contents;
+    contents << file.rdbuf();
+    return contents.str();
+}
+
+// Replace 'path' with a rename, so that the server (or its next start) never reads a half written file.
+void writeFile(const string& path, const string& contents, mode_t mode)
+{
+    string tmp = path + ".tmp";
+    int fd = ::open(tmp.c_str(), O_WRONLY | O_CREAT | O_TRUNC, mode);
+    if (fd < 0)
+    {
+        throw acme_lw::AcmeException("Unable to open "s + tmp);
+    }
+    size_t written = 0;
+    while (written < contents.size())
+    {
+        ssize_t n = ::write(fd, contents.data() + written, contents.size() - written);
+        if (n <= 0)
+        {
+            ::close(fd);
+            throw acme_lw::AcmeException("Unable to write "s + tmp);
+        }
+        written += n;
+    }
+    if (::fsync(fd) != 0 || ::close(fd) != 0 || ::rename(tmp.c_str(), path.c_str()) != 0)
+    {
+        throw acme_lw::AcmeException("Unable to replace "s + path);
+    }
+}
+
+// A self-signed certificate is a placeholder (e.g. from the first start of the server): it is replaced right away.
+bool isSelfIssued(const string& pem)
+{
+    unique_ptr<BIO, decltype(&BIO_free_all)> bio(BIO_new_mem_buf(pem.data(), static_cast<int>(pem.size())), BIO_free_all);
+    unique_ptr<X509, decltype(&X509_free)> cert(bio ? PEM_read_bio_X509(bio.get(), nullptr, nullptr, nullptr) : nullptr, X509_free);
+    return cert && X509_check_issued(cert.get(), cert.get()) == X509_V_OK;
+}
+
+string generateAccountKey()
+{
+    unique_ptr<EVP_PKEY_CTX, decltype(&EVP_PKEY_CTX_free)> ctx(EVP_PKEY_CTX_new_id(EVP_PKEY_RSA, nullptr), EVP_PKEY_CTX_free);
+    EVP_PKEY * key = nullptr;
+    if (!ctx ||
+        EVP_PKEY_keygen_init(ctx.get()) <= 0 ||
+        EVP_PKEY_CTX_set_rsa_keygen_bits(ctx.get(), 4096) <= 0 ||
+        EVP_PKEY_keygen(ctx.get(), &key) <= 0)
+    {
+        throw acme_lw::AcmeException("Unable to generate the acme account key");
+    }
+    unique_ptr<EVP_PKEY, decltype(&EVP_PKEY_free)> keyPtr(key, EVP_PKEY_free);
+
+    unique_ptr<BIO, decltype(&BIO_free_all)> bio(BIO_new(BIO_s_mem()), BIO_free_all);
+    if (!bio || PEM_write_bio_PrivateKey(bio.get(), key, nullptr, nullptr, 0, nullptr, nullptr) != 1)
+    {
+        throw acme_lw::AcmeException("Unable to write the acme account key");
+    }
+    char * data = nullptr;
+    long len = BIO_get_mem_data(bio.get(), &data);
+    return string(data, len);
+}
+
+}
+
+namespace acme_lw
+{
+
+RenewalService::RenewalService(const RenewalConfig& config, RenewedCallback onRenewed)
+    : config_(config), onRenewed_(move(onRenewed))
+{
+    if (config_.domainNames.empty())
+    {
+        throw AcmeException("There must be at least one domain name to renew");
+    }
+}
+
+RenewalService::~RenewalService()
+{
+    stop();
+}
+
+void RenewalService::start()
+{
+    if (!thread_.joinable())
+    {
+        stopping_ = false;
+        thread_ = thread(&RenewalService::run, this);
+    }
+}
+
+void RenewalService::stop()
+{
+    {
+        lock_guard<mutex> lock(mutex_);
+        stopping_ = true;
+    }
+    cv_.notify_all();
+    if (thread_.joinable())
+    {
+        thread_.join();
+    }
+}
+
+void RenewalService::checkNow()
+{
+    {
+        lock_guard<mutex> lock(mutex_);
+        checkRequested_ = true;
+    }
+    cv_.notify_all();
+}
+
+bool RenewalService::challengeResponse(const string& token, string& keyAuthorization) const
+{
+    lock_guard<mutex> lock(mutex_);
+    auto it = challenges_.find(token);
+    if (it == challenges_.end())
+    {
+        return false;
+    }
+    keyAuthorization = it->second;
+    return true;
+}
+
+::time_t RenewalService::expiry() const
+{
+    lock_guard<mutex> lock(mutex_);
+    return expiry_;
+}
+
+size_t RenewalService::renewals() const
+{
+    lock_guard<mutex> lock(mutex_);
+    return renewals_;
+}
+
+void RenewalService::run()
+{
+    bool initialized = false;
+    unique_lock<mutex> lock(mutex_);
+    while (!stopping_)
+    {
+        checkRequested_ = false;
+        lock.unlock();
+
+        chrono::seconds wait = config_.retryInterval;
+        try
+        {
+            if (!initialized)
+            {
+                AcmeClient::init(config_.directoryUrl.empty() ? productionDirectoryUrl : config_.directoryUrl);
+                initialized = true;
+            }
+            wait = checkAndRenew();
+        }
+        catch (const exception& e)
+        {
+            cerr << "acme renewal of " << config_.domainNames.front() << " failed: " << e.what() << endl;
+        }
+
+        lock.lock();
+        cv_.wait_for(lock, wait, [this] { return stopping_ || checkRequested_; });
+    }
+    lock.unlock();
+
+    if (initialized)
+    {
+        AcmeClient::teardown();
+    }
+}
+
+chrono::seconds RenewalService::checkAndRenew()
+{
+    Certificate current;
+    current.fullchain = readFile(config_.certificatePath);
+    ::time_t expiry = 0;
+    if (!current.fullchain.empty() && !isSelfIssued(current.fullchain))
+    {
+        try
+        {
+            expiry = current.getExpiry();
+        }
+        catch (const exception&)
+        {
+            // not a certificate: replace it
+        }
+    }
+    {
+        lock_guard<mutex> lock(mutex_);
+        expiry_ = expiry;
+    }
+
+    ::time_t now = ::time(nullptr);
+    if (expiry - config_.renewBefore.count() <= now)
+    {
+        renew();
+        expiry = this->expiry();
+        now = ::time(nullptr);
+    }
+
+    // sleep until the certificate enters its renewal window, but check at least every checkInterval
+    chrono::seconds untilRenewal(expiry - config_.renewBefore.count() - now);
+    return std::clamp<chrono::seconds>(untilRenewal, chrono::seconds(1), max(config_.checkInterval, chrono::seconds(1)));
+}
+
+void RenewalService::renew()
+{
+    string accountKey = readFile(config_.accountKeyPath);
+    if (accountKey.empty())
+    {
+        accountKey = generateAccountKey();
+        writeFile(config_.accountKeyPath, accountKey, 0600);
+    }
+
+    struct ChallengesGuard
+    {
+        RenewalService& service;
+        ~ChallengesGuard()
+        {
+            lock_guard<mutex> lock(service.mutex_);
+            service.challenges_.clear();
+        }
+    } guard { *this };
+
+    AcmeClient client(accountKey);
+    Certificate certificate = client.issueCertificate(config_.domainNames,
+        [this](const string&, const string& url, const string& keyAuthorization)
+        {
+            // url is http://<domain>/.well-known/acme-challenge/<token>
+            lock_guard<mutex> lock(mutex_);
+            challenges_[url.substr(url.rfind('/') + 1)] = keyAuthorization;
+        });
+
+    // the key first: a certificate is never on disk without its key
+    writeFile(config_.privateKeyPath, certificate.privkey, 0600);
+    writeFile(config_.certificatePath, certificate.fullchain, 0644);
+
+    {
+        lock_guard<mutex> lock(mutex_);
+        expiry_ = certificate.getExpiry();
+        ++renewals_;
+    }
+    cerr << "acme certificate of " << config_.domainNames.front() << " renewed, valid until " << certificate.getExpiryDisplay() << endl;
+
+    if (onRenewed_)
+    {
+        onRenewed_(certificate);
+    }
+}
+
+struct CertificateSwap::Current
+{
+    X509 *            leaf  = nullptr;
+    EVP_PKEY *        key   = nullptr;
+    STACK_OF(X509) *  chain = nullptr;
+
+    ~Current()
+    {
+        X509_free(leaf);
+        EVP_PKEY_free(key);
+        sk_X509_pop_free(chain, X509_free);
+    }
+};
+
+CertificateSwap::CertificateSwap() = default;
+
+CertificateSwap::~CertificateSwap() = default;
+
+void CertificateSwap::install(SSL_CTX * ctx)
+{
+    SSL_CTX_set_cert_cb(ctx, &CertificateSwap::certificateCallback, this);
+}
+
+void CertificateSwap::update(const string& fullchain, const string& privkey)
+{
+    auto next = make_shared<Current>();
+
+    unique_ptr<BIO, decltype(&BIO_free_all)> chainBio(BIO_new_mem_buf(fullchain.data(), static_cast<int>(fullchain.size())), BIO_free_all);
+    next->leaf = chainBio ? PEM_read_bio_X509(chainBio.get(), nullptr, nullptr, nullptr) : nullptr;
+    next->chain = sk_X509_new_null();
+    if (!next->leaf || !next->chain)
+    {
+        throw AcmeException("Unable to read the certificate");
+    }
+    while (X509 * intermediate = PEM_read_bio_X509(chainBio.get(), nullptr, nullptr, nullptr))
+    {
+        sk_X509_push(next->chain, intermediate);
+    }
+    ERR_clear_error();      // end of the chain
+
+    unique_ptr<BIO, decltype(&BIO_free_all)> keyBio(BIO_new_mem_buf(privkey.data(), static_cast<int>(privkey.size())), BIO_free_all);
+    next->key = keyBio ? PEM_read_bio_PrivateKey(keyBio.get(), nullptr, nullptr, nullptr) : nullptr;
+    if (!next->key || X509_check_private_key(next->leaf, next->key) != 1)
+    {
+        ERR_clear_error();
+        throw AcmeException("The private key does not match the certificate");
+    }
+
+    lock_guard<mutex> lock(mutex_);
+    current_ = move(next);
+}
+
+int CertificateSwap::certificateCallback(SSL * ssl, void * arg)
+{
+    CertificateSwap * self = static_cast<CertificateSwap *>(arg);
+    shared_ptr<const Current> current;
+    {
+        lock_guard<mutex> lock(self->mutex_);
+        current = self->current_;
+    }
+    if (!current)
+    {
+        return 1;
+    }
+    return SSL_use_cert_and_key(ssl, current->leaf, current->key, current->chain, 1) == 1 ? 1 : 0;
+}
+
+}
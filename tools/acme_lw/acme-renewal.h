@@ -0,0 +1,130 @@
+#pragma once
+
+#include "acme-lw.h"
+
+#include <chrono>
+#include <condition_variable>
+#include <ctime>
+#include <functional>
+#include <list>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+
+typedef struct ssl_ctx_st SSL_CTX;
+typedef struct ssl_st SSL;
+
+namespace acme_lw
+{
+
+struct RenewalConfig
+{
+    std::list<std::string> domainNames;
+
+    // Acme account private key (RSA, pem). Generated if the file does not exist.
+    std::string accountKeyPath;
+
+    // Where the certificate (fullchain) and its private key are read at start and written on renewal.
+    // A missing or self-signed certificate is replaced at start.
+    std::string certificatePath;
+    std::string privateKeyPath;
+
+    // Directory of the acme CA, e.g. a local test CA. Empty is Let's Encrypt production.
+    std::string directoryUrl;
+
+    // Renew when the certificate expires within 'renewBefore'.
+    std::chrono::seconds renewBefore   = std::chrono::hours(24 * 30);
+    // Longest sleep between two expiry checks.
+    std::chrono::seconds checkInterval = std::chrono::hours(12);
+    // Wait after a failed order before the next attempt.
+    std::chrono::seconds retryInterval = std::chrono::hours(1);
+};
+
+/**
+ * Keeps the certificate of a running server valid: a background thread tracks
+ * its expiry and runs the acme order when it comes close, so that the server
+ * never has to restart for a new certificate.
+ *
+ * Only http-01 challenges are supported: the server answers them with
+ * 'challengeResponse' on /.well-known/acme-challenge/<token>.
+ */
+class RenewalService
+{
+public:
+    // Called from the renewal thread, after the new files were written.
+    typedef std::function<void (const Certificate&)> RenewedCallback;
+
+    RenewalService(const RenewalConfig& config, RenewedCallback onRenewed);
+
+    // Stops the thread. An order in progress is finished first.
+    ~RenewalService();
+
+    void start();
+    void stop();
+
+    // Check (and renew if needed) now rather than at the next check.
+    void checkNow();
+
+    // The key authorization of a pending http-01 challenge, false if there is none for 'token'.
+    bool challengeResponse(const std::string& token, std::string& keyAuthorization) const;
+
+    // Expiry of the current certificate (epoch time), 0 if there is none.
+    ::time_t expiry() const;
+
+    // Number of certificates issued since start.
+    size_t renewals() const;
+
+private:
+    void run();
+    std::chrono::seconds checkAndRenew();
+    void renew();
+
+    RenewalConfig   config_;
+    RenewedCallback onRenewed_;
+
+    mutable std::mutex      mutex_;
+    std::condition_variable cv_;
+    bool                    stopping_ = false;
+    bool                    checkRequested_ = false;
+    ::time_t                expiry_ = 0;
+    size_t                  renewals_ = 0;
+    std::map<std::string, std::string> challenges_;     // token -> key authorization
+
+    std::thread thread_;
+};
+
+/**
+ * Certificate of the handshakes of an SSL_CTX, replaced at runtime without
+ * touching the connections already established: each new handshake picks the
+ * current certificate from the certificate callback. Until the first 'update',
+ * the certificate loaded in the SSL_CTX is used.
+ */
+class CertificateSwap
+{
+public:
+    CertificateSwap();
+    ~CertificateSwap();
+
+    // Set the certificate callback of 'ctx'. 'ctx' must not outlive this object.
+    void install(SSL_CTX * ctx);
+
+    /**
+        Replace the certificate of the next handshakes by 'fullchain' (leaf
+        first, then the intermediates) and its 'privkey', both pem.
+
+        throws acme_lw::AcmeException if they do not parse or do not match.
+    */
+    void update(const std::string& fullchain, const std::string& privkey);
+
+private:
+    struct Current;
+
+    static int certificateCallback(SSL * ssl, void * arg);
+
+    std::mutex mutex_;
+    std::shared_ptr<const Current> current_;
+};
+
+}
@@ -0,0 +1,335 @@
+// tools/acme_lw_test/acme_stub_server.h
+//
+// A local stand-in for an ACME CA (in the spirit of Pebble), to exercise acme_lw without Let's Encrypt:
+// directory, nonces (replayed or unknown nonces get a badNonce), accounts, orders, http-01 challenges
+// (fetched from a configurable host, as a CA would), finalization with a CSR, and certificates signed by
+// a throwaway CA with a short, configurable validity. JWS signatures are not verified.
+
+#pragma once
+
+#include "httplib.h"
+#include "json.hpp"
+
+#include <openssl/ec.h>
+#include <openssl/evp.h>
+#include <openssl/pem.h>
+#include <openssl/rand.h>
+#include <openssl/x509.h>
+
+#include <atomic>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <set>
+#include <string>
+#include <thread>
+#include <vector>
+
+class acme_stub_server {
+public:
+    struct pem_certificate {
+        std::string fullchain;
+        std::string privkey;
+    };
+
+    // validity: lifetime of the issued certificates; challenge_port: where the http-01 challenges are fetched
+    acme_stub_server(long validity_seconds, int challenge_port)
+        : validity_seconds_(validity_seconds), challenge_port_(challenge_port) {
+        ca_key_ = generate_key();
+        ca_cert_ = make_certificate("acme stub CA", ca_key_.get(), nullptr, ca_key_.get(), 3600);
+        routes();
+        port_ = svr_.bind_to_any_port("127.0.0.1");
+        thread_ = std::thread([this] { svr_.listen_after_bind(); });
+        svr_.wait_until_ready();
+    }
+
+    ~acme_stub_server() {
+        svr_.stop();
+        thread_.join();
+    }
+
+    std::string directory_url() const { return base() + "/directory"; }
+
+    int challenges_validated() const { return challenges_validated_; }
+    int certificates_issued() const { return certificates_issued_; }
+    int bad_nonces() const { return bad_nonces_; }
+
+    // a certificate for common_name signed by the stub CA, with a new key
+    pem_certificate issue(const std::string & common_name, long validity_seconds) {
+        auto key = generate_key();
+        auto cert = make_certificate(common_name, key.get(), ca_cert_.get(), ca_key_.get(), validity_seconds);
+        return { to_pem(cert.get()) + to_pem(ca_cert_.get()), to_pem(key.get()) };
+    }
+
+private:
+    using key_ptr  = std::unique_ptr<EVP_PKEY, decltype(&EVP_PKEY_free)>;
+    using cert_ptr = std::unique_ptr<X509, decltype(&X509_free)>;
+
+    struct order {
+        std::vector<std::string> domains;
+        std::vector<int> authzs;
+        std::string certificate; // fullchain, once finalized
+    };
+
+    struct authz {
+        std::string domain;
+        std::string token;
+        bool valid = false;
+    };
+
+    std::string base() const { return "http://127.0.0.1:" + std::to_string(port_); }
+
+    static key_ptr generate_key() {
+        EVP_PKEY * key = EVP_EC_gen("P-256");
+        return key_ptr(key, EVP_PKEY_free);
+    }
+
+    static cert_ptr make_certificate(const std::string & common_name, EVP_PKEY * key, X509 * issuer, EVP_PKEY * issuer_key, long validity_seconds) {
+        cert_ptr cert(X509_new(), X509_free);
+        static std::atomic<long> serial{1};
+        X509_set_version(cert.get(), 2);
+        ASN1_INTEGER_set(X509_get_serialNumber(cert.get()), serial++);
+        X509_gmtime_adj(X509_getm_notBefore(cert.get()), 0);
+        X509_gmtime_adj(X509_getm_notAfter(cert.get()), validity_seconds);
+        X509_NAME * name = X509_get_subject_name(cert.get());
+        X509_NAME_add_entry_by_txt(name, "CN", MBSTRING_ASC, reinterpret_cast<const unsigned char *>(common_name.c_str()), -1, -1, 0);
+        X509_set_issuer_name(cert.get(), issuer ? X509_get_subject_name(issuer) : name);
+        X509_set_pubkey(cert.get(), key);
+        X509_sign(cert.get(), issuer_key, EVP_sha256());
+        return cert;
+    }
+
+    template <class T>
+    static std::string to_pem(T * object) {
+        std::unique_ptr<BIO, decltype(&BIO_free_all)> bio(BIO_new(BIO_s_mem()), BIO_free_all);
+        if constexpr (std::is_same_v<T, X509>) {
+            PEM_write_bio_X509(bio.get(), object);
+        } else {
+            PEM_write_bio_PrivateKey(bio.get(), object, nullptr, nullptr, 0, nullptr, nullptr);
+        }
+        char * data = nullptr;
+        long len = BIO_get_mem_data(bio.get(), &data);
+        return std::string(data, len);
+    }
+
+    static std::string base64url_decode(const std::string & in) {
+        std::string b64 = in;
+        for (auto & c : b64) {
+            c = c == '-' ? '+' : c == '_' ? '/' : c;
+        }
+        while (b64.size() % 4) {
+            b64 += '=';
+        }
+        std::string out(b64.size() / 4 * 3, '\0');
+        int len = EVP_DecodeBlock(reinterpret_cast<unsigned char *>(&out[0]), reinterpret_cast<const unsigned char *>(b64.data()), (int) b64.size());
+        // EVP_DecodeBlock counts the padding as zero bytes
+        out.resize(len < 0 ? 0 : len - (b64.size() - in.size()));
+        return out;
+    }
+
+    std::string new_nonce() {
+        unsigned char bytes[16];
+        RAND_bytes(bytes, sizeof(bytes));
+        std::string nonce;
+        for (unsigned char b : bytes) {
+            nonce += "0123456789abcdef"[b >> 4];
+            nonce += "0123456789abcdef"[b & 15];
+        }
+        std::lock_guard<std::mutex> lock(mutex_);
+        nonces_.insert(nonce);
+        return nonce;
+    }
+
+    // the JWS payload, or nothing (and a badNonce error) if its nonce was not issued or was already used
+    bool read_jws(const httplib::Request & req, httplib::Response & res, nlohmann::json & payload) {
+        auto jws = nlohmann::json::parse(req.body);
+        auto protected_header = nlohmann::json::parse(base64url_decode(jws.at("protected").get<std::string>()));
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            if (nonces_.erase(protected_header.value("nonce", "")) == 0) {
+                bad_nonces_++;
+                res.status = 400;
+                res.set_content(R"({"type": "urn:ietf:params:acme:error:badNonce", "detail": "unknown nonce"})", "application/problem+json");
+                return false;
+            }
+        }
+        std::string body = base64url_decode(jws.at("payload").get<std::string>());
+        payload = body.empty() ? nlohmann::json() : nlohmann::json::parse(body);
+        return true;
+    }
+
+    void reply(httplib::Response & res, int status, const nlohmann::json & body) {
+        res.status = status;
+        res.set_content(body.dump(), "application/json");
+    }
+
+    void routes() {
+        svr_.set_post_routing_handler([this](const httplib::Request &, httplib::Response & res) {
+            res.set_header("Replay-Nonce", new_nonce());
+        });
+
+        svr_.Get("/directory", [this](const httplib::Request &, httplib::Response & res) {
+            reply(res, 200, {
+                {"newNonce",   base() + "/new-nonce"},
+                {"newAccount", base() + "/new-account"},
+                {"newOrder",   base() + "/new-order"},
+            });
+        });
+
+        svr_.Get("/new-nonce", [](const httplib::Request &, httplib::Response & res) {
+            res.status = 200;
+        });
+
+        svr_.Post("/new-account", [this](const httplib::Request & req, httplib::Response & res) {
+            nlohmann::json payload;
+            if (read_jws(req, res, payload)) {
+                res.set_header("Location", base() + "/account/1");
+                reply(res, 201, {{"status", "valid"}});
+            }
+        });
+
+        svr_.Post("/new-order", [this](const httplib::Request & req, httplib::Response & res) {
+            nlohmann::json payload;
+            if (!read_jws(req, res, payload)) {
+                return;
+            }
+            std::lock_guard<std::mutex> lock(mutex_);
+            int id = (int) orders_.size();
+            order o;
+            nlohmann::json authz_urls = nlohmann::json::array();
+            for (const auto & identifier : payload.at("identifiers")) {
+                authz a;
+                a.domain = identifier.at("value");
+                a.token = "token" + std::to_string(authzs_.size());
+                o.domains.push_back(a.domain);
+                o.authzs.push_back((int) authzs_.size());
+                authz_urls.push_back(base() + "/authz/" + std::to_string(authzs_.size()));
+                authzs_.push_back(a);
+            }
+            orders_.push_back(o);
+            res.set_header("Location", base() + "/order/" + std::to_string(id));
+            reply(res, 201, {
+                {"status", "pending"},
+                {"authorizations", authz_urls},
+                {"finalize", base() + "/finalize/" + std::to_string(id)},
+            });
+        });
+
+        svr_.Post(R"(/authz/(\d+))", [this](const httplib::Request & req, httplib::Response & res) {
+            nlohmann::json payload;
+            if (!read_jws(req, res, payload)) {
+                return;
+            }
+            std::lock_guard<std::mutex> lock(mutex_);
+            int id = std::stoi(req.matches[1]);
+            const authz & a = authzs_.at(id);
+            reply(res, 200, {
+                {"status", a.valid ? "valid" : "pending"},
+                {"identifier", {{"type", "dns"}, {"value", a.domain}}},
+                {"challenges", {{
+                    {"type", "http-01"},
+                    {"url", base() + "/chall/" + std::to_string(id)},
+                    {"token", a.token},
+                }}},
+            });
+        });
+
+        svr_.Post(R"(/chall/(\d+))", [this](const httplib::Request & req, httplib::Response & res) {
+            nlohmann::json payload;
+            if (!read_jws(req, res, payload)) {
+                return;
+            }
+            int id = std::stoi(req.matches[1]);
+            std::string token;
+            {
+                std::lock_guard<std::mutex> lock(mutex_);
+                token = authzs_.at(id).token;
+            }
+            // fetch the key authorization like a CA would, from the challenge host
+            httplib::Client cli("127.0.0.1", challenge_port_);
+            auto answer = cli.Get("/.well-known/acme-challenge/" + token);
+            if (!answer || answer->status != 200 || answer->body.rfind(token + ".", 0) != 0) {
+                reply(res, 403, {{"type", "urn:ietf:params:acme:error:unauthorized"}, {"detail", "challenge failed"}});
+                return;
+            }
+            {
+                std::lock_guard<std::mutex> lock(mutex_);
+                authzs_.at(id).valid = true;
+            }
+            challenges_validated_++;
+            reply(res, 200, {{"status", "valid"}, {"url", base() + "/chall/" + std::to_string(id)}});
+        });
+
+        svr_.Post(R"(/finalize/(\d+))", [this](const httplib::Request & req, httplib::Response & res) {
+            nlohmann::json payload;
+            if (!read_jws(req, res, payload)) {
+                return;
+            }
+            int id = std::stoi(req.matches[1]);
+            std::string der = base64url_decode(payload.at("csr").get<std::string>());
+            const unsigned char * p = reinterpret_cast<const unsigned char *>(der.data());
+            std::unique_ptr<X509_REQ, decltype(&X509_REQ_free)> csr(d2i_X509_REQ(nullptr, &p, (long) der.size()), X509_REQ_free);
+            std::lock_guard<std::mutex> lock(mutex_);
+            order & o = orders_.at(id);
+            for (int a : o.authzs) {
+                if (!authzs_.at(a).valid) {
+                    reply(res, 403, {{"type", "urn:ietf:params:acme:error:orderNotReady"}});
+                    return;
+                }
+            }
+            if (!csr) {
+                reply(res, 400, {{"type", "urn:ietf:params:acme:error:badCSR"}});
+                return;
+            }
+            EVP_PKEY * key = X509_REQ_get0_pubkey(csr.get());
+            auto cert = make_certificate(o.domains.front(), key, ca_cert_.get(), ca_key_.get(), validity_seconds_);
+            o.certificate = to_pem(cert.get()) + to_pem(ca_cert_.get());
+            certificates_issued_++;
+            reply(res, 200, {{"status", "processing"}});
+        });
+
+        svr_.Post(R"(/order/(\d+))", [this](const httplib::Request & req, httplib::Response & res) {
+            nlohmann::json payload;
+            if (!read_jws(req, res, payload)) {
+                return;
+            }
+            std::lock_guard<std::mutex> lock(mutex_);
+            int id = std::stoi(req.matches[1]);
+            const order & o = orders_.at(id);
+            nlohmann::json body = {{"status", o.certificate.empty() ? "pending" : "valid"}};
+            if (!o.certificate.empty()) {
+                body["certificate"] = base() + "/cert/" + std::to_string(id);
+            }
+            reply(res, 200, body);
+        });
+
+        svr_.Post(R"(/cert/(\d+))", [this](const httplib::Request & req, httplib::Response & res) {
+            nlohmann::json payload;
+            if (!read_jws(req, res, payload)) {
+                return;
+            }
+            std::lock_guard<std::mutex> lock(mutex_);
+            res.status = 200;
+            res.set_content(orders_.at(std::stoi(req.matches[1])).certificate, "application/pem-certificate-chain");
+        });
+    }
+
+    long validity_seconds_;
+    int challenge_port_;
+    int port_ = 0;
+
+    key_ptr ca_key_ = key_ptr(nullptr, EVP_PKEY_free);
+    cert_ptr ca_cert_ = cert_ptr(nullptr, X509_free);
+
+    std::mutex mutex_;
+    std::set<std::string> nonces_;
+    std::vector<order> orders_;
+    std::vector<authz> authzs_;
+
+    std::atomic<int> challenges_validated_{0};
+    std::atomic<int> certificates_issued_{0};
+    std::atomic<int> bad_nonces_{0};
+
+    httplib::Server svr_;
+    std::thread thread_;
+};
@@ -0,0 +1,292 @@
+// tools/acme_lw_test/test_acme_lw.cpp
+
+#define CPPHTTPLIB_OPENSSL_SUPPORT
+#include "acme_stub_server.h"
+
+#include "acme-lw.h"
+#include "acme-renewal.h"
+
+#include <openssl/ssl.h>
+#include <openssl/x509.h>
+
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <chrono>
+#include <cstdio>
+#include <filesystem>
+#include <fstream>
+#include <functional>
+#include <iostream>
+#include <string>
+#include <thread>
+
+// Helper for logging using standard cout
+#define TEST_LOG_RAW(...) \
+    do { \
+        std::cout << "[" << __FILE__ << ":" << __LINE__ << "] " ; \
+        printf(__VA_ARGS__); \
+        std::cout << std::endl; \
+    } while (0)
+
+// Assertion macro
+#define TEST_ASSERT(condition, message) \
+    do { \
+        if (!(condition)) { \
+            TEST_LOG_RAW("FAIL: %s - %s", #condition, message); \
+            return false; \
+        } \
+    } while (0)
+
+#define TEST_SUCCESS(message) \
+    TEST_LOG_RAW("PASS: %s", message); \
+    return true;
+
+static bool wait_for(const std::function<bool()> & condition, std::chrono::seconds timeout) {
+    const auto deadline = std::chrono::steady_clock::now() + timeout;
+    while (!condition()) {
+        if (std::chrono::steady_clock::now() > deadline) {
+            return false;
+        }
+        std::this_thread::sleep_for(std::chrono::milliseconds(50));
+    }
+    return true;
+}
+
+static std::string temp_path(const std::string & name) {
+    return (std::filesystem::temp_directory_path() / ("acme_lw_test_" + std::to_string(getpid()) + "_" + name)).string();
+}
+
+static void write_file(const std::string & path, const std::string & contents) {
+    std::ofstream(path, std::ios::binary) << contents;
+}
+
+// Serves the pending http-01 challenges of a RenewalService, as llama-server does on its own port.
+struct challenge_server {
+    httplib::Server svr;
+    std::thread thread;
+    int port = 0;
+    acme_lw::RenewalService * service = nullptr;
+
+    challenge_server() {
+        svr.Get(R"(/\.well-known/acme-challenge/([A-Za-z0-9_-]+))", [this](const httplib::Request & req, httplib::Response & res) {
+            std::string key_authorization;
+            if (service && service->challengeResponse(req.matches[1], key_authorization)) {
+                res.set_content(key_authorization, "text/plain");
+            } else {
+                res.status = 404;
+            }
+        });
+        port = svr.bind_to_any_port("127.0.0.1");
+        thread = std::thread([this] { svr.listen_after_bind(); });
+        svr.wait_until_ready();
+    }
+
+    ~challenge_server() {
+        svr.stop();
+        thread.join();
+    }
+};
+
+// A TLS connection to 127.0.0.1:port, without certificate verification.
+struct tls_connection {
+    SSL_CTX * ctx = nullptr;
+    SSL * ssl = nullptr;
+    int fd = -1;
+
+    explicit tls_connection(int port) {
+        ctx = SSL_CTX_new(TLS_client_method());
+        SSL_CTX_set_verify(ctx, SSL_VERIFY_NONE, nullptr);
+        fd = socket(AF_INET, SOCK_STREAM, 0);
+        sockaddr_in addr = {};
+        addr.sin_family = AF_INET;
+        addr.sin_port = htons(port);
+        addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+        if (connect(fd, reinterpret_cast<sockaddr *>(&addr), sizeof(addr)) != 0) {
+            return;
+        }
+        ssl = SSL_new(ctx);
+        SSL_set_fd(ssl, fd);
+        if (SSL_connect(ssl) != 1) {
+            SSL_free(ssl);
+            ssl = nullptr;
+        }
+    }
+
+    ~tls_connection() {
+        if (ssl) {
+            SSL_shutdown(ssl);
+            SSL_free(ssl);
+        }
+        if (fd >= 0) {
+            close(fd);
+        }
+        SSL_CTX_free(ctx);
+    }
+
+    std::string peer_common_name() const {
+        X509 * cert = SSL_get1_peer_certificate(ssl);
+        if (!cert) {
+            return "";
+        }
+        char cn[256] = {};
+        X509_NAME_get_text_by_NID(X509_get_subject_name(cert), NID_commonName, cn, sizeof(cn));
+        X509_free(cert);
+        return cn;
+    }
+
+    int peer_chain_length() const {
+        STACK_OF(X509) * chain = SSL_get_peer_cert_chain(ssl);
+        return chain ? sk_X509_num(chain) : 0;
+    }
+
+    // a request on the connection, true if it is answered with a 200
+    bool get_ok() {
+        const std::string request = "GET /ping HTTP/1.1\r\nHost: localhost\r\n\r\n";
+        if (SSL_write(ssl, request.data(), (int) request.size()) <= 0) {
+            return false;
+        }
+        char buffer[1024];
+        int n = SSL_read(ssl, buffer, sizeof(buffer) - 1);
+        return n > 0 && std::string(buffer, n).rfind("HTTP/1.1 200", 0) == 0;
+    }
+};
+
+// =========================================================================
+// Certificate hot swap
+// =========================================================================
+
+static bool test_certificate_swap() {
+    acme_stub_server ca(3600, 0);
+    auto initial = ca.issue("initial.test", 3600);
+    auto renewed = ca.issue("renewed.test", 3600);
+
+    const std::string cert_path = temp_path("swap_cert.pem");
+    const std::string key_path = temp_path("swap_key.pem");
+    write_file(cert_path, initial.fullchain);
+    write_file(key_path, initial.privkey);
+
+    httplib::SSLServer svr(cert_path.c_str(), key_path.c_str());
+    TEST_ASSERT(svr.is_valid(), "The TLS server should load its initial certificate.");
+    acme_lw::CertificateSwap swap;
+    swap.install(svr.ssl_context());
+    svr.Get("/ping", [](const httplib::Request &, httplib::Response & res) {
+        res.set_content("pong", "text/plain");
+    });
+    int port = svr.bind_to_any_port("127.0.0.1");
+    std::thread thread([&svr] { svr.listen_after_bind(); });
+    svr.wait_until_ready();
+
+    bool ok = true;
+    {
+        tls_connection before(port);
+        ok &= before.ssl != nullptr && before.peer_common_name() == "initial.test";
+
+        swap.update(renewed.fullchain, renewed.privkey);
+
+        // the new handshakes use the new certificate, with its chain
+        tls_connection after(port);
+        ok &= after.ssl != nullptr && after.peer_common_name() == "renewed.test" && after.peer_chain_length() == 2;
+        ok &= after.get_ok();
+
+        // the connection established before the swap keeps being served
+        ok &= before.get_ok();
+    }
+
+    bool mismatch_rejected = false;
+    try {
+        swap.update(renewed.fullchain, initial.privkey);
+    } catch (const acme_lw::AcmeException &) {
+        mismatch_rejected = true;
+    }
+
+    svr.stop();
+    thread.join();
+    std::remove(cert_path.c_str());
+    std::remove(key_path.c_str());
+
+    TEST_ASSERT(ok, "Handshakes should switch to the new certificate without dropping established connections.");
+    TEST_ASSERT(mismatch_rejected, "A key that does not match the certificate should be rejected.");
+    TEST_SUCCESS("certificate_swap");
+}
+
+// =========================================================================
+// Renewal service against the stub CA
+// =========================================================================
+
+static bool test_renewal_service() {
+    challenge_server challenges;
+    // short-lived certificates: renewed 3s before their expiry, i.e. 3s after their issuance
+    acme_stub_server ca(6, challenges.port);
+
+    acme_lw::RenewalConfig config;
+    config.domainNames = {"llama.test"};
+    config.accountKeyPath = temp_path("account.pem");
+    config.certificatePath = temp_path("cert.pem");
+    config.privateKeyPath = temp_path("key.pem");
+    config.directoryUrl = ca.directory_url();
+    config.renewBefore = std::chrono::seconds(3);
+    config.checkInterval = std::chrono::seconds(3600);
+    config.retryInterval = std::chrono::seconds(1);
+
+    std::atomic<int> renewed{0};
+    std::string last_fullchain;
+    std::mutex last_mutex;
+    acme_lw::RenewalService service(config, [&](const acme_lw::Certificate & certificate) {
+        std::lock_guard<std::mutex> lock(last_mutex);
+        last_fullchain = certificate.fullchain;
+        renewed++;
+    });
+    challenges.service = &service;
+    service.start();
+
+    // no certificate yet: one is ordered right away
+    bool first = wait_for([&] { return renewed >= 1; }, std::chrono::seconds(120));
+    std::string key_authorization;
+    bool challenges_cleared = !service.challengeResponse("token0", key_authorization);
+    ::time_t expiry = service.expiry();
+    bool files_written = false;
+    {
+        std::ifstream cert_file(config.certificatePath);
+        std::string on_disk((std::istreambuf_iterator<char>(cert_file)), std::istreambuf_iterator<char>());
+        std::lock_guard<std::mutex> lock(last_mutex);
+        files_written = !on_disk.empty() && on_disk == last_fullchain && std::filesystem::exists(config.privateKeyPath);
+    }
+
+    // then renewed from the expiry alone, without checkNow
+    bool second = wait_for([&] { return renewed >= 2; }, std::chrono::seconds(120));
+    service.stop();
+
+    for (const auto & path : {config.accountKeyPath, config.certificatePath, config.privateKeyPath}) {
+        std::remove(path.c_str());
+    }
+
+    TEST_ASSERT(first, "A certificate should be issued at start.");
+    TEST_ASSERT(ca.challenges_validated() >= 1, "The http-01 challenge should be answered.");
+    TEST_ASSERT(challenges_cleared, "The challenges should be forgotten once the order completes.");
+    TEST_ASSERT(files_written, "The certificate and its key should be written.");
+    TEST_ASSERT(expiry > ::time(nullptr) - 60 && expiry <= ::time(nullptr) + 6, "The expiry should be the one of the issued certificate.");
+    TEST_ASSERT(second, "The certificate should be renewed before its expiry.");
+    TEST_ASSERT((size_t) ca.certificates_issued() == service.renewals(), "Every issued certificate should be picked up.");
+    TEST_SUCCESS("renewal_service");
+}
+
+int main() {
+    int failed_tests = 0;
+
+    std::cout << "Running certificate swap Tests..." << std::endl;
+    if (!test_certificate_swap()) failed_tests++;
+
+    std::cout << "\nRunning ACME renewal Tests..." << std::endl;
+    if (!test_renewal_service()) failed_tests++;
+
+    if (failed_tests == 0) {
+        std::cout << "\nAll tests passed!" << std::endl;
+        return 0;
+    } else {
+        std::cout << "\n" << failed_tests << " test(s) failed." << std::endl;
+        return 1;
+    }
+}
@@ -0,0 +1,619 @@
+// RAG retrieval benchmark: ingest throughput, searchNearest latency and recall@k against brute force,
+// through the rag_database API, for the postgres (pgvector) and in-memory backends.
+
+#include "ggml.h"
+#include "llama.h"
+#include "memory_client.h"
+#include "postgres_client.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <map>
+#include <random>
+#include <set>
+#include <sstream>
+#include <string>
+#include <vector>
+
+struct cmd_params {
+    std::vector<std::string> backends = {"memory"};
+    std::vector<std::string> indexes  = {"none"};
+    std::vector<std::string> quants   = {"f32"};
+    std::vector<int>         n_chunks = {1, 5, 10, 20};
+    std::vector<int>         ef_search = {0};
+    std::vector<int>         probes    = {0};
+
+    std::string corpus_file;
+    std::string queries_file;
+    int n_docs     = 10000;
+    int n_embd     = 384;
+    int n_clusters = 64;
+    int n_queries  = 100;
+    int chunks_per_document = 100;
+    float query_noise = 0.1f;
+    uint32_t seed  = 42;
+
+    DistanceMetric metric = DistanceMetric::COSINE;
+    int hnsw_m = 16;
+    int hnsw_ef_construction = 64;
+    int ivfflat_lists = 100;
+
+    std::string host = "localhost";
+    int port = 5432;
+    std::string db_name = "klave_rag";
+    std::string user = "postgres";
+    std::string password = "admin";
+    std::string collection = "rag_bench";
+    bool keep = false;
+
+    std::string output = "md";
+};
+
+static void print_usage(int /* argc */, char ** argv) {
+    cmd_params d;
+    printf("usage: %s [options]\n", argv[0]);
+    printf("\n");
+    printf("options:\n");
+    printf("  -h, --help\n");
+    printf("  --backend <memory|postgres>      (default: memory)\n");
+    printf("  --index <none|hnsw|ivfflat>      (default: none)\n");
+    printf("  --quant <f32|f16|q8>             precision of the stored vectors (default: f32)\n");
+    printf("  -k, --n-rag-chunks <n>           (default: 1,5,10,20)\n");
+    printf("  --ef-search <n>                  hnsw.ef_search, 0 = server default (default: 0)\n");
+    printf("  --probes <n>                     ivfflat.probes, 0 = server default (default: 0)\n");
+    printf("  --metric <cosine|l2|ip>          (default: cosine)\n");
+    printf("  --hnsw-m <n>                     (default: %d)\n", d.hnsw_m);
+    printf("  --hnsw-ef-construction <n>       (default: %d)\n", d.hnsw_ef_construction);
+    printf("  --ivfflat-lists <n>              (default: %d)\n", d.ivfflat_lists);
+    printf("\n");
+    printf("corpus (synthetic unless --corpus is given):\n");
+    printf("  --corpus <file>                  JSONL, one {\"embedding\": [...], \"content\": \"...\"} per line\n");
+    printf("  --queries <file>                 JSONL, one {\"embedding\": [...]} per line\n");
+    printf("  --n-docs <n>                     number of synthetic chunks (default: %d)\n", d.n_docs);
+    printf("  --n-embd <n>                     synthetic embedding size (default: %d)\n", d.n_embd);
+    printf("  --n-clusters <n>                 synthetic topic clusters (default: %d)\n", d.n_clusters);
+    printf("  --n-queries <n>                  (default: %d)\n", d.n_queries);
+    printf("  --query-noise <f>                noise added to corpus vectors to make queries (default: %.2f)\n", d.query_noise);
+    printf("  --chunks-per-document <n>        (default: %d)\n", d.chunks_per_document);
+    printf("  --seed <n>                       (default: %u)\n", d.seed);
+    printf("\n");
+    printf("postgres:\n");
+    printf("  --host <host>                    (default: %s)\n", d.host.c_str());
+    printf("  --port <port>                    (default: %d)\n", d.port);
+    printf("  --db <name>                      (default: %s)\n", d.db_name.c_str());
+    printf("  --user <user>                    (default: %s)\n", d.user.c_str());
+    printf("  --password <password>\n");
+    printf("  --collection <name>              collection used for the run, dropped afterwards (default: %s)\n", d.collection.c_str());
+    printf("  --keep                           do not drop the collection at the end\n");
+    printf("\n");
+    printf("  -o, --output <md|csv|json>       (default: %s)\n", d.output.c_str());
+    printf("\n");
+    printf("Multiple values can be given for each of --backend, --index, --quant, -k, --ef-search and --probes,\n");
+    printf("either comma separated or by repeating the option.\n");
+}
+
+static std::vector<std::string> split_str(const std::string & str, char delim) {
+    std::vector<std::string> values;
+    std::stringstream ss(str);
+    std::string value;
+    while (std::getline(ss, value, delim)) {
+        values.push_back(value);
+    }
+    return values;
+}
+
+static std::vector<int> split_int(const std::string & str, char delim) {
+    std::vector<int> values;
+    for (const auto & v : split_str(str, delim)) {
+        values.push_back(std::stoi(v));
+    }
+    return values;
+}
+
+static cmd_params parse_cmd_params(int argc, char ** argv) {
+    cmd_params params;
+    cmd_params defaults;
+    bool invalid_param = false;
+
+    const auto append_str = [](std::vector<std::string> & dst, const std::vector<std::string> & def, const std::string & value) {
+        if (dst == def) {
+            dst.clear();
+        }
+        for (const auto & v : split_str(value, ',')) {
+            dst.push_back(v);
+        }
+    };
+    const auto append_int = [](std::vector<int> & dst, const std::vector<int> & def, const std::string & value) {
+        if (dst == def) {
+            dst.clear();
+        }
+        for (int v : split_int(value, ',')) {
+            dst.push_back(v);
+        }
+    };
+
+    for (int i = 1; i < argc; i++) {
+        std::string arg = argv[i];
+        if (arg == "-h" || arg == "--help") {
+            print_usage(argc, argv);
+            exit(0);
+        }
+        if (arg == "--keep") {
+            params.keep = true;
+            continue;
+        }
+        if (++i >= argc) {
+            invalid_param = true;
+            break;
+        }
+        const std::string value = argv[i];
+        try {
+            if (arg == "--backend") {
+                append_str(params.backends, defaults.backends, value);
+            } else if (arg == "--index") {
+                append_str(params.indexes, defaults.indexes, value);
+            } else if (arg == "--quant") {
+                append_str(params.quants, defaults.quants, value);
+            } else if (arg == "-k" || arg == "--n-rag-chunks") {
+                append_int(params.n_chunks, defaults.n_chunks, value);
+            } else if (arg == "--ef-search") {
+                append_int(params.ef_search, defaults.ef_search, value);
+            } else if (arg == "--probes") {
+                append_int(params.probes, defaults.probes, value);
+            } else if (arg == "--metric") {
+                if (value == "cosine") {
+                    params.metric = DistanceMetric::COSINE;
+                } else if (value == "l2") {
+                    params.metric = DistanceMetric::L2;
+                } else if (value == "ip") {
+                    params.metric = DistanceMetric::IP;
+                } else {
+                    invalid_param = true;
+                }
+            } else if (arg == "--hnsw-m") {
+                params.hnsw_m = std::stoi(value);
+            } else if (arg == "--hnsw-ef-construction") {
+                params.hnsw_ef_construction = std::stoi(value);
+            } else if (arg == "--ivfflat-lists") {
+                params.ivfflat_lists = std::stoi(value);
+            } else if (arg == "--corpus") {
+                params.corpus_file = value;
+            } else if (arg == "--queries") {
+                params.queries_file = value;
+            } else if (arg == "--n-docs") {
+                params.n_docs = std::stoi(value);
+            } else if (arg == "--n-embd") {
+                params.n_embd = std::stoi(value);
+            } else if (arg == "--n-clusters") {
+                params.n_clusters = std::stoi(value);
+            } else if (arg == "--n-queries") {
+                params.n_queries = std::stoi(value);
+            } else if (arg == "--query-noise") {
+                params.query_noise = std::stof(value);
+            } else if (arg == "--chunks-per-document") {
+                params.chunks_per_document = std::stoi(value);
+            } else if (arg == "--seed") {
+                params.seed = (uint32_t) std::stoul(value);
+            } else if (arg == "--host") {
+                params.host = value;
+            } else if (arg == "--port") {
+                params.port = std::stoi(value);
+            } else if (arg == "--db") {
+                params.db_name = value;
+            } else if (arg == "--user") {
+                params.user = value;
+            } else if (arg == "--password") {
+                params.password = value;
+            } else if (arg == "--collection") {
+                params.collection = value;
+            } else if (arg == "-o" || arg == "--output") {
+                params.output = value;
+            } else {
+                fprintf(stderr, "error: unknown argument: %s\n", arg.c_str());
+                print_usage(argc, argv);
+                exit(1);
+            }
+        } catch (const std::exception &) {
+            invalid_param = true;
+        }
+        if (invalid_param) {
+            break;
+        }
+    }
+
+    for (const auto & b : params.backends) {
+        invalid_param |= b != "memory" && b != "postgres";
+    }
+    for (const auto & x : params.indexes) {
+        invalid_param |= x != "none" && x != "hnsw" && x != "ivfflat";
+    }
+    for (const auto & q : params.quants) {
+        invalid_param |= q != "f32" && q != "f16" && q != "q8";
+    }
+    invalid_param |= params.output != "md" && params.output != "csv" && params.output != "json";
+    invalid_param |= params.n_chunks.empty() || params.n_queries <= 0 || params.chunks_per_document <= 0;
+
+    if (invalid_param) {
+        fprintf(stderr, "error: invalid parameter\n");
+        print_usage(argc, argv);
+        exit(1);
+    }
+    return params;
+}
+
+//
+// corpus
+//
+
+struct corpus {
+    std::vector<std::vector<float>> embeddings;
+    std::vector<std::string> contents;
+    std::vector<std::vector<float>> queries;
+};
+
+static std::vector<std::vector<float>> read_embeddings(const std::string & fname, std::vector<std::string> * contents) {
+    std::ifstream file(fname);
+    if (!file) {
+        throw std::runtime_error("failed to open " + fname);
+    }
+    std::vector<std::vector<float>> embeddings;
+    std::string line;
+    while (std::getline(file, line)) {
+        if (line.empty()) {
+            continue;
+        }
+        const json j = json::parse(line);
+        embeddings.push_back(j.at("embedding").get<std::vector<float>>());
+        if (contents) {
+            contents->push_back(j.value("content", std::string()));
+        }
+        if (embeddings.back().size() != embeddings.front().size()) {
+            throw std::runtime_error(fname + ": all embeddings must have the same size");
+        }
+    }
+    return embeddings;
+}
+
+static void normalize(std::vector<float> & v) {
+    double sum = 0.0;
+    for (float x : v) {
+        sum += (double) x * x;
+    }
+    const float norm = sum > 0.0 ? (float) (1.0 / std::sqrt(sum)) : 0.0f;
+    for (float & x : v) {
+        x *= norm;
+    }
+}
+
+static corpus load_corpus(const cmd_params & params) {
+    corpus c;
+    std::mt19937 rng(params.seed);
+    std::normal_distribution<float> gauss(0.0f, 1.0f);
+
+    if (!params.corpus_file.empty()) {
+        c.embeddings = read_embeddings(params.corpus_file, &c.contents);
+    } else {
+        // gaussian topic clusters: neighbours are neither trivially separable nor uniformly spread
+        std::vector<std::vector<float>> centers(std::max(1, params.n_clusters), std::vector<float>(params.n_embd));
+        for (auto & center : centers) {
+            for (float & x : center) {
+                x = gauss(rng);
+            }
+            normalize(center);
+        }
+        std::uniform_int_distribution<size_t> pick(0, centers.size() - 1);
+        c.embeddings.resize(params.n_docs, std::vector<float>(params.n_embd));
+        for (auto & e : c.embeddings) {
+            const auto & center = centers[pick(rng)];
+            for (int i = 0; i < params.n_embd; i++) {
+                e[i] = center[i] + 0.5f * gauss(rng) / std::sqrt((float) params.n_embd);
+            }
+            normalize(e);
+        }
+        c.contents.resize(c.embeddings.size());
+    }
+    if (c.embeddings.empty()) {
+        throw std::runtime_error("empty corpus");
+    }
+    // contents must be unique: results are matched back to the corpus by content hash
+    for (size_t i = 0; i < c.contents.size(); i++) {
+        c.contents[i] = "chunk " + std::to_string(i) + (c.contents[i].empty() ? "" : ": " + c.contents[i]);
+    }
+
+    if (!params.queries_file.empty()) {
+        c.queries = read_embeddings(params.queries_file, nullptr);
+        if (!c.queries.empty() && c.queries.front().size() != c.embeddings.front().size()) {
+            throw std::runtime_error("queries and corpus embeddings have different sizes");
+        }
+    } else {
+        const size_t n_embd = c.embeddings.front().size();
+        std::uniform_int_distribution<size_t> pick(0, c.embeddings.size() - 1);
+        c.queries.resize(params.n_queries, std::vector<float>(n_embd));
+        for (auto & q : c.queries) {
+            const auto & e = c.embeddings[pick(rng)];
+            for (size_t i = 0; i < n_embd; i++) {
+                q[i] = e[i] + params.query_noise * gauss(rng) / std::sqrt((float) n_embd);
+            }
+            normalize(q);
+        }
+    }
+    return c;
+}
+
+// round trip through the storage precision: recall then reflects the loss of a quantized column
+static std::vector<float> quantize(const std::vector<float> & v, const std::string & quant) {
+    std::vector<float> res(v.size());
+    if (quant == "f16") {
+        for (size_t i = 0; i < v.size(); i++) {
+            res[i] = ggml_fp16_to_fp32(ggml_fp32_to_fp16(v[i]));
+        }
+    } else if (quant == "q8") {
+        float amax = 0.0f;
+        for (float x : v) {
+            amax = std::max(amax, std::fabs(x));
+        }
+        const float d = amax / 127.0f;
+        for (size_t i = 0; i < v.size(); i++) {
+            res[i] = d > 0.0f ? std::round(v[i] / d) * d : 0.0f;
+        }
+    } else {
+        res = v;
+    }
+    return res;
+}
+
+//
+// measurements
+//
+
+struct bench_result {
+    std::string backend;
+    std::string quant;
+    std::string index;
+    int ef_search = 0;
+    int probes = 0;
+    int k = 0;
+    size_t n_docs = 0;
+    size_t n_embd = 0;
+    double ingest_per_s = 0.0;
+    double index_build_s = 0.0;
+    double p50_ms = 0.0;
+    double p95_ms = 0.0;
+    double p99_ms = 0.0;
+    double recall = 0.0;
+};
+
+static int64_t time_us() {
+    return std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+static double percentile(std::vector<double> values, double p) {
+    if (values.empty()) {
+        return 0.0;
+    }
+    // nearest-rank
+    std::sort(values.begin(), values.end());
+    const size_t rank = (size_t) std::ceil(p * values.size());
+    return values[std::min(values.size(), std::max<size_t>(rank, 1)) - 1];
+}
+
+// exact top-k over the unquantized corpus
+static std::vector<std::vector<size_t>> ground_truth(const corpus & c, int k, DistanceMetric metric) {
+    std::vector<std::vector<size_t>> truth(c.queries.size());
+    std::vector<std::pair<float, size_t>> scored(c.embeddings.size());
+    for (size_t q = 0; q < c.queries.size(); q++) {
+        for (size_t i = 0; i < c.embeddings.size(); i++) {
+            scored[i] = {memory_client::distance(c.embeddings[i], c.queries[q], metric), i};
+        }
+        const size_t n = std::min(scored.size(), (size_t) k);
+        std::partial_sort(scored.begin(), scored.begin() + n, scored.end());
+        for (size_t i = 0; i < n; i++) {
+            truth[q].push_back(scored[i].second);
+        }
+    }
+    return truth;
+}
+
+static std::shared_ptr<rag_database> open_backend(const std::string & backend, const cmd_params & params) {
+    std::shared_ptr<rag_database> db;
+    if (backend == "memory") {
+        db = std::make_shared<memory_client>(params.collection);
+    } else {
+        db = postgres_client::for_collection(params.host, params.port, params.db_name, params.collection);
+    }
+    db->connect(params.user, params.password);
+    return db;
+}
+
+static void print_header(const cmd_params & params) {
+    if (params.output == "md") {
+        printf("| %-8s | %-5s | %-7s | %6s | %6s | %4s | %8s | %10s | %8s | %8s | %8s | %8s | %8s |\n",
+               "backend", "quant", "index", "ef", "probes", "k", "n_docs", "ingest/s", "index s", "p50 ms", "p95 ms", "p99 ms", "recall");
+        printf("|----------|-------|---------|--------|--------|------|----------|------------|----------|----------|----------|----------|----------|\n");
+    } else if (params.output == "csv") {
+        printf("backend,quant,index,ef_search,probes,k,n_docs,n_embd,ingest_per_s,index_build_s,p50_ms,p95_ms,p99_ms,recall\n");
+    }
+}
+
+static void print_result(const cmd_params & params, const bench_result & r) {
+    if (params.output == "md") {
+        printf("| %-8s | %-5s | %-7s | %6d | %6d | %4d | %8zu | %10.1f | %8.3f | %8.3f | %8.3f | %8.3f | %8.4f |\n",
+               r.backend.c_str(), r.quant.c_str(), r.index.c_str(), r.ef_search, r.probes, r.k, r.n_docs,
+               r.ingest_per_s, r.index_build_s, r.p50_ms, r.p95_ms, r.p99_ms, r.recall);
+    } else if (params.output == "csv") {
+        printf("%s,%s,%s,%d,%d,%d,%zu,%zu,%.1f,%.3f,%.3f,%.3f,%.3f,%.4f\n",
+               r.backend.c_str(), r.quant.c_str(), r.index.c_str(), r.ef_search, r.probes, r.k, r.n_docs, r.n_embd,
+               r.ingest_per_s, r.index_build_s, r.p50_ms, r.p95_ms, r.p99_ms, r.recall);
+    } else {
+        const json j = {
+            {"backend",       r.backend},
+            {"quant",         r.quant},
+            {"index",         r.index},
+            {"ef_search",     r.ef_search},
+            {"probes",        r.probes},
+            {"k",             r.k},
+            {"n_docs",        r.n_docs},
+            {"n_embd",        r.n_embd},
+            {"ingest_per_s",  r.ingest_per_s},
+            {"index_build_s", r.index_build_s},
+            {"p50_ms",        r.p50_ms},
+            {"p95_ms",        r.p95_ms},
+            {"p99_ms",        r.p99_ms},
+            {"recall",        r.recall},
+        };
+        printf("%s\n", j.dump().c_str());
+    }
+    fflush(stdout);
+}
+
+static void run_backend(const cmd_params & params, const std::string & backend, const std::string & quant,
+                        const corpus & c, const std::vector<std::vector<std::vector<size_t>>> & truths) {
+    const size_t n_embd = c.embeddings.front().size();
+    auto db = open_backend(backend, params);
+    if (db->hasSchema()) {
+        db->destroySchema();
+    }
+    db->createSchema(n_embd);
+
+    // contents are sealed with ECIES on insertion (part of ingest/s) under a fixed recipient key, so that runs are comparable
+    ecc256_private_key recipient_sk = postgres_client::hex_to_byte_array<32>(std::string(64, '1'));
+    ecc256_public_key controller_pk = CryptoUtils::computePublicKey(recipient_sk);
+
+    std::map<std::string, size_t> hash_to_index;
+    for (size_t i = 0; i < c.contents.size(); i++) {
+        const std::vector<uint8_t> bytes(c.contents[i].begin(), c.contents[i].end());
+        hash_to_index[postgres_client::contentHashHex(bytes, recipient_sk)] = i;
+    }
+
+    const int64_t t_ingest_start = time_us();
+    std::string document_id;
+    for (size_t i = 0; i < c.embeddings.size(); i++) {
+        if (i % params.chunks_per_document == 0) {
+            const int doc = (int) (i / params.chunks_per_document);
+            document_id = db->createOrRetrieveDocument("2025-01-01", "1", "text/plain", "bench://document/" + std::to_string(doc), params.chunks_per_document).document_id;
+        }
+        const std::vector<uint8_t> contents(c.contents[i].begin(), c.contents[i].end());
+        db->insertRagEntry(document_id, quantize(c.embeddings[i], quant), contents, controller_pk, recipient_sk);
+    }
+    const double ingest_s = (time_us() - t_ingest_start) / 1e6;
+
+    for (const auto & index : params.indexes) {
+        bench_result r;
+        r.backend = backend;
+        r.quant = quant;
+        r.index = backend == "memory" ? "flat" : index;
+        r.n_docs = c.embeddings.size();
+        r.n_embd = n_embd;
+        r.ingest_per_s = ingest_s > 0.0 ? c.embeddings.size() / ingest_s : 0.0;
+
+        if (backend == "memory" && index != params.indexes.front()) {
+            fprintf(stderr, "%s: the memory backend always searches exactly, skipping index '%s'\n", __func__, index.c_str());
+            continue;
+        }
+        if (index == "none" && backend != "memory") {
+            // an index built by a previous entry of --index would otherwise serve the exact scan
+            db->dropIndex();
+        } else if (backend != "memory") {
+            rag_index_params index_params;
+            index_params.type = index;
+            index_params.metric = params.metric;
+            index_params.m = params.hnsw_m;
+            index_params.ef_construction = params.hnsw_ef_construction;
+            index_params.lists = params.ivfflat_lists;
+            const int64_t t_index_start = time_us();
+            db->createIndex(index_params);
+            r.index_build_s = (time_us() - t_index_start) / 1e6;
+        }
+
+        // only the knob of the index being measured is swept
+        const std::vector<int> no_knob = {0};
+        const auto & ef_values    = index == "hnsw"    && backend != "memory" ? params.ef_search : no_knob;
+        const auto & probe_values = index == "ivfflat" && backend != "memory" ? params.probes    : no_knob;
+        for (int ef : ef_values) {
+            for (int probes : probe_values) {
+                // a session setting: applied here, outside of the timed searches
+                db->setSearchParams(ef, probes);
+                r.ef_search = ef;
+                r.probes = probes;
+                for (size_t ik = 0; ik < params.n_chunks.size(); ik++) {
+                    const int k = params.n_chunks[ik];
+                    r.k = k;
+
+                    // warm up caches and the query plan
+                    db->searchNearest(c.queries.front(), k, nullptr, params.metric);
+
+                    std::vector<double> latencies_ms;
+                    latencies_ms.reserve(c.queries.size());
+                    double recall_sum = 0.0;
+                    for (size_t q = 0; q < c.queries.size(); q++) {
+                        const int64_t t_start = time_us();
+                        const auto results = db->searchNearest(c.queries[q], k, nullptr, params.metric);
+                        latencies_ms.push_back((time_us() - t_start) / 1e3);
+
+                        const auto & truth = truths[ik][q];
+                        const std::set<size_t> expected(truth.begin(), truth.end());
+                        size_t hits = 0;
+                        for (const auto & result : results) {
+                            auto it = hash_to_index.find(std::get<2>(result));
+                            if (it != hash_to_index.end() && expected.count(it->second)) {
+                                hits++;
+                            }
+                        }
+                        recall_sum += truth.empty() ? 1.0 : (double) hits / truth.size();
+                    }
+                    r.p50_ms = percentile(latencies_ms, 0.50);
+                    r.p95_ms = percentile(latencies_ms, 0.95);
+                    r.p99_ms = percentile(latencies_ms, 0.99);
+                    r.recall = recall_sum / c.queries.size();
+                    print_result(params, r);
+                }
+            }
+        }
+    }
+
+    if (!params.keep) {
+        db->destroySchema();
+    }
+    db->disconnect();
+}
+
+int main(int argc, char ** argv) {
+    cmd_params params = parse_cmd_params(argc, argv);
+
+    // initializes the fp16 conversion tables used by --quant f16
+    llama_backend_init();
+
+    corpus c;
+    try {
+        c = load_corpus(params);
+    } catch (const std::exception & e) {
+        fprintf(stderr, "error: failed to load corpus: %s\n", e.what());
+        return 1;
+    }
+    fprintf(stderr, "corpus: %zu chunks, %zu queries, n_embd = %zu\n", c.embeddings.size(), c.queries.size(), c.embeddings.front().size());
+
+    std::vector<std::vector<std::vector<size_t>>> truths;
+    for (int k : params.n_chunks) {
+        truths.push_back(ground_truth(c, k, params.metric));
+    }
+
+    print_header(params);
+    for (const auto & backend : params.backends) {
+        for (const auto & quant : params.quants) {
+            try {
+                run_backend(params, backend, quant, c, truths);
+            } catch (const std::exception & e) {
+                fprintf(stderr, "error: %s backend (%s): %s\n", backend.c_str(), quant.c_str(), e.what());
+                llama_backend_free();
+                return 1;
+            }
+        }
+    }
+    llama_backend_free();
+    return 0;
+}
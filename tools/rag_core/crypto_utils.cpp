@@ -9,6 +9,106 @@ void EVP_CIPHER_CTX_Deleter::operator()(EVP_CIPHER_CTX* ptr) const {
     EVP_CIPHER_CTX_free(ptr);
 }
 
+void EC_GROUP_Deleter::operator()(EC_GROUP* ptr) const {
+    EC_GROUP_free(ptr);
+}
+
+void BN_CTX_Deleter::operator()(BN_CTX* ptr) const {
+    BN_CTX_free(ptr);
+}
+
+// Per-thread crypto context
+
+CryptoContext::CryptoContext()
+    : group_(EC_GROUP_new_by_curve_name(NID_X9_62_prime256v1)),
+      bn_ctx_(BN_CTX_new()) {
+    if (!group_ || !bn_ctx_) {
+        ERR_print_errors_fp(stderr);
+        throw std::runtime_error("Failed to create EC_GROUP or BN_CTX for secp256r1.");
+    }
+#if OPENSSL_VERSION_NUMBER >= 0x30000000L
+    // explicit fetch, instead of an implicit one on every EVP_EncryptInit_ex
+    fetched_aes256_gcm_ = EVP_CIPHER_fetch(nullptr, "AES-256-GCM", nullptr);
+    aes256_gcm_ = fetched_aes256_gcm_;
+#else
+    aes256_gcm_ = EVP_aes_256_gcm();
+    // OpenSSL 3 already has precomputed generator tables for P-256 and no longer uses this
+    if (EC_GROUP_precompute_mult(group_.get(), bn_ctx_.get()) != 1) {
+        ERR_print_errors_fp(stderr);
+        throw std::runtime_error("Failed to precompute secp256r1 generator multiples.");
+    }
+#endif
+    if (!aes256_gcm_) {
+        ERR_print_errors_fp(stderr);
+        throw std::runtime_error("Failed to fetch AES-256-GCM.");
+    }
+    encrypt_.ctx.reset(EVP_CIPHER_CTX_new());
+    decrypt_.ctx.reset(EVP_CIPHER_CTX_new());
+    if (!encrypt_.ctx || !decrypt_.ctx) {
+        ERR_print_errors_fp(stderr);
+        throw std::runtime_error("Failed to create EVP_CIPHER_CTX.");
+    }
+}
+
+CryptoContext::~CryptoContext() {
+    OPENSSL_cleanse(encrypt_.key.data(), encrypt_.key.size());
+    OPENSSL_cleanse(decrypt_.key.data(), decrypt_.key.size());
+#if OPENSSL_VERSION_NUMBER >= 0x30000000L
+    EVP_CIPHER_free(fetched_aes256_gcm_);
+#endif
+}
+
+CryptoContext& CryptoContext::get() {
+    thread_local CryptoContext context;
+    return context;
+}
+
+EVP_CIPHER_CTX* CryptoContext::init(cipher_state& state, bool encrypt, const aes256_key& key, const aes_gcm_nonce& nonce) {
+    EVP_CIPHER_CTX* ctx = state.ctx.get();
+    if (state.keyed && CRYPTO_memcmp(state.key.data(), key.data(), key.size()) == 0) {
+        // same key: keep the key schedule, only restart with the new nonce
+        if (EVP_CipherInit_ex(ctx, nullptr, nullptr, nullptr, nonce.data(), encrypt ? 1 : 0) != 1) {
+            ERR_print_errors_fp(stderr);
+            state.keyed = false;
+            throw std::runtime_error("Failed to set the IV of the AES-GCM context.");
+        }
+        return ctx;
+    }
+
+    state.keyed = false;
+    if (EVP_CipherInit_ex(ctx, aes256_gcm_, nullptr, nullptr, nullptr, encrypt ? 1 : 0) != 1) {
+        ERR_print_errors_fp(stderr);
+        throw std::runtime_error("Failed to initialize AES-GCM context.");
+    }
+    if (EVP_CIPHER_CTX_ctrl(ctx, EVP_CTRL_GCM_SET_IVLEN, nonce.size(), nullptr) != 1) {
+        ERR_print_errors_fp(stderr);
+        throw std::runtime_error("Failed to set AES-GCM IV length.");
+    }
+    if (EVP_CipherInit_ex(ctx, nullptr, nullptr, key.data(), nonce.data(), encrypt ? 1 : 0) != 1) {
+        ERR_print_errors_fp(stderr);
+        throw std::runtime_error("Failed to set key and IV for AES-GCM.");
+    }
+    state.key = key;
+    state.keyed = true;
+    return ctx;
+}
+
+EVP_CIPHER_CTX* CryptoContext::encryptInit(const aes256_key& key, const aes_gcm_nonce& nonce) {
+    return init(encrypt_, true, key, nonce);
+}
+
+EVP_CIPHER_CTX* CryptoContext::decryptInit(const aes256_key& key, const aes_gcm_nonce& nonce) {
+    return init(decrypt_, false, key, nonce);
+}
+
+void CryptoContext::reset() {
+    encrypt_.keyed = false;
+    decrypt_.keyed = false;
+    OPENSSL_cleanse(encrypt_.key.data(), encrypt_.key.size());
+    OPENSSL_cleanse(decrypt_.key.data(), decrypt_.key.size());
+}
+
+
 // Implementations of CryptoUtils methods
 
 std::vector<unsigned char> CryptoUtils::export_public_key_to_bytes(EC_KEY* ec_key, point_conversion_form_t format) {
@@ -56,35 +156,41 @@ std::vector<unsigned char> CryptoUtils::export_public_key_to_bytes(EC_KEY* ec_ke
 
 sha256_hash CryptoUtils::computeSha256Bytes(const std::vector<uint8_t>& data) {
     sha256_hash hash;
-    SHA256_CTX sha256;
-    SHA256_Init(&sha256);
-    SHA256_Update(&sha256, data.data(), data.size());
-    SHA256_Final(hash.data(), &sha256);
+    SHA256(data.data(), data.size(), hash.data());
     return hash;
 }
 
-
-ecc256_private_key CryptoUtils::generatePrivateKey() {
-    std::unique_ptr<EC_KEY, EC_KEY_Deleter> ec_key(EC_KEY_new_by_curve_name(NID_X9_62_prime256v1));
-    if (!ec_key) {
+sha256_hash CryptoUtils::computeHmacSha256(const std::vector<uint8_t>& key, const std::vector<uint8_t>& data) {
+    sha256_hash mac;
+    unsigned int mac_len = 0;
+    if (HMAC(EVP_sha256(), key.data(), (int) key.size(), data.data(), data.size(), mac.data(), &mac_len) == nullptr ||
+        mac_len != mac.size()) {
         ERR_print_errors_fp(stderr);
-        throw std::runtime_error("Failed to create EC_KEY for secp256r1.");
+        throw std::runtime_error("Failed to compute HMAC-SHA256.");
     }
+    return mac;
+}
 
-    if (EC_KEY_generate_key(ec_key.get()) != 1) {
-        ERR_print_errors_fp(stderr);
-        throw std::runtime_error("Failed to generate EC private key.");
-    }
 
-    const BIGNUM* priv_bn = EC_KEY_get0_private_key(ec_key.get());
+ecc256_private_key CryptoUtils::generatePrivateKey() {
+    const EC_GROUP* group = CryptoContext::get().group();
+
+    // A private key is a random scalar in [1, order - 1]
+    std::unique_ptr<BIGNUM, decltype(&BN_clear_free)> priv_bn(BN_secure_new(), BN_clear_free);
     if (!priv_bn) {
         ERR_print_errors_fp(stderr);
-        throw std::runtime_error("Failed to get private key BIGNUM.");
+        throw std::runtime_error("Failed to create private key BIGNUM.");
     }
+    do {
+        if (BN_priv_rand_range(priv_bn.get(), EC_GROUP_get0_order(group)) != 1) {
+            ERR_print_errors_fp(stderr);
+            throw std::runtime_error("Failed to generate EC private key.");
+        }
+    } while (BN_is_zero(priv_bn.get()));
 
     ecc256_private_key private_key_bytes;
-    int num_bytes = BN_bn2binpad(priv_bn, private_key_bytes.data(), private_key_bytes.size());
-    if (num_bytes != private_key_bytes.size()) { // Use size() directly from the alias
+    int num_bytes = BN_bn2binpad(priv_bn.get(), private_key_bytes.data(), private_key_bytes.size());
+    if (num_bytes != (int)private_key_bytes.size()) {
         ERR_print_errors_fp(stderr);
         throw std::runtime_error("Failed to convert private key BIGNUM to bytes with correct padding.");
     }
@@ -93,59 +199,37 @@ ecc256_private_key CryptoUtils::generatePrivateKey() {
 }
 
 ecc256_public_key CryptoUtils::computePublicKey(const ecc256_private_key& private_key) {
-    std::unique_ptr<EC_KEY, EC_KEY_Deleter> ec_key(EC_KEY_new_by_curve_name(NID_X9_62_prime256v1));
-    if (!ec_key) {
-        ERR_print_errors_fp(stderr);
-        throw std::runtime_error("Failed to create EC_KEY for secp256r1.");
-    }
+    CryptoContext& context = CryptoContext::get();
+    const EC_GROUP* group = context.group();
 
-    // Set the private key
-    std::unique_ptr<BIGNUM, decltype(&BN_free)> priv_bn(BN_bin2bn(private_key.data(), private_key.size(), nullptr), BN_free);
+    std::unique_ptr<BIGNUM, decltype(&BN_clear_free)> priv_bn(BN_bin2bn(private_key.data(), private_key.size(), nullptr), BN_clear_free);
     if (!priv_bn) {
         ERR_print_errors_fp(stderr);
         throw std::runtime_error("Failed to convert private key bytes to BIGNUM.");
     }
-    if (EC_KEY_set_private_key(ec_key.get(), priv_bn.get()) != 1) {
-        ERR_print_errors_fp(stderr);
-        throw std::runtime_error("Failed to set EC private key.");
-    }
 
-    // Compute the public key
-    const EC_GROUP* group = EC_KEY_get0_group(ec_key.get());
-    if (!group) {
-        ERR_print_errors_fp(stderr);
-        throw std::runtime_error("Failed to get EC group.");
-    }
+    // Compute the public key: priv * G, with the precomputed multiples of the generator
     std::unique_ptr<EC_POINT, decltype(&EC_POINT_free)> pub_point(EC_POINT_new(group), EC_POINT_free);
     if (!pub_point) {
         ERR_print_errors_fp(stderr);
         throw std::runtime_error("Failed to create EC_POINT.");
     }
-    if (EC_POINT_mul(group, pub_point.get(), priv_bn.get(), nullptr, nullptr, nullptr) != 1) {
+    if (EC_POINT_mul(group, pub_point.get(), priv_bn.get(), nullptr, nullptr, context.bnCtx()) != 1) {
         ERR_print_errors_fp(stderr);
         throw std::runtime_error("Failed to compute public key point.");
     }
-    if (EC_KEY_set_public_key(ec_key.get(), pub_point.get()) != 1) {
-        ERR_print_errors_fp(stderr);
-        throw std::runtime_error("Failed to set EC public key.");
-    }
 
     // Export public key in compressed form
     ecc256_public_key public_key_bytes;
-    std::vector<unsigned char> raw_public_key_bytes = export_public_key_to_bytes(ec_key.get(), POINT_CONVERSION_COMPRESSED);
-    if (raw_public_key_bytes.size() == 0) {
-        ERR_print_errors_fp(stderr);
-        throw std::runtime_error("Failed to export public key (export_public_key_to_bytes returned a null vector).");
-    }
-    // Now check for size mismatch
-    if (raw_public_key_bytes.size() != (long)public_key_bytes.size()) { // Cast public_key_bytes.size() to long for comparison
+    size_t len = EC_POINT_point2oct(group, pub_point.get(), POINT_CONVERSION_COMPRESSED,
+                                    public_key_bytes.data(), public_key_bytes.size(), context.bnCtx());
+    if (len != public_key_bytes.size()) {
         ERR_print_errors_fp(stderr);
         std::string error_message = "Failed to export public key in compressed form or size mismatch. #1";
-        error_message += "Actual length: " + std::to_string(raw_public_key_bytes.size());
+        error_message += "Actual length: " + std::to_string(len);
         error_message += ", Expected length: " + std::to_string(public_key_bytes.size());
         throw std::runtime_error(error_message);
     }
-    std::copy(std::begin(raw_public_key_bytes),std::end(raw_public_key_bytes),std::begin(public_key_bytes));
     return public_key_bytes;
 }
 
@@ -153,16 +237,9 @@ ecc256_public_key CryptoUtils::scalarMultiply(
     const ecc256_private_key& private_key_scalar,
     const ecc256_public_key& public_key_point) {
 
-    // You don't need ec_key_base if you are directly manipulating EC_POINTs.
-    // However, you do need the EC_GROUP.
-    // A convenient way to get the group is to create a dummy EC_KEY, or directly
-    // EC_GROUP_new_by_curve_name(NID_X9_62_prime256v1).
-    std::unique_ptr<EC_GROUP, decltype(&EC_GROUP_free)> group_ptr(EC_GROUP_new_by_curve_name(NID_X9_62_prime256v1), EC_GROUP_free);
-    if (!group_ptr) {
-        ERR_print_errors_fp(stderr);
-        throw std::runtime_error("Failed to create EC_GROUP for secp256r1.");
-    }
-    const EC_GROUP* group = group_ptr.get();
+    // You don't need an EC_KEY if you are directly manipulating EC_POINTs, only the (cached) EC_GROUP.
+    CryptoContext& context = CryptoContext::get();
+    const EC_GROUP* group = context.group();
 
 
     // Convert the input public_key_point bytes to an EC_POINT
@@ -174,13 +251,13 @@ ecc256_public_key CryptoUtils::scalarMultiply(
 
     // EC_POINT_oct2point returns 1 on success, 0 on failure
     if (EC_POINT_oct2point(group, base_point.get(),
-                           public_key_point.data(), public_key_point.size(), nullptr) != 1) {
+                           public_key_point.data(), public_key_point.size(), context.bnCtx()) != 1) {
         ERR_print_errors_fp(stderr);
         throw std::runtime_error("Failed to convert input public key bytes to EC_POINT (oct2point failed).");
     }
 
     // Convert the private_key_scalar bytes to a BIGNUM
-    std::unique_ptr<BIGNUM, decltype(&BN_free)> scalar_bn(BN_bin2bn(private_key_scalar.data(), private_key_scalar.size(), nullptr), BN_free);
+    std::unique_ptr<BIGNUM, decltype(&BN_clear_free)> scalar_bn(BN_bin2bn(private_key_scalar.data(), private_key_scalar.size(), nullptr), BN_clear_free);
     if (!scalar_bn) {
         ERR_print_errors_fp(stderr);
         throw std::runtime_error("Failed to convert private key scalar bytes to BIGNUM.");
@@ -194,7 +271,7 @@ ecc256_public_key CryptoUtils::scalarMultiply(
     }
     // EC_POINT_mul(group, r, n, Q, m, ctx) computes r = n*G + m*Q, where G is the generator
     // We want r = scalar_bn * base_point, so n=0, Q=base_point, m=scalar_bn
-    if (EC_POINT_mul(group, result_point.get(), nullptr, base_point.get(), scalar_bn.get(), nullptr) != 1) {
+    if (EC_POINT_mul(group, result_point.get(), nullptr, base_point.get(), scalar_bn.get(), context.bnCtx()) != 1) {
         ERR_print_errors_fp(stderr);
         throw std::runtime_error("Failed to perform scalar multiplication (EC_POINT_mul).");
     }
@@ -203,7 +280,7 @@ ecc256_public_key CryptoUtils::scalarMultiply(
 
     // Determine the required length for the compressed public key
     // For secp256r1 compressed, it should be 33 bytes (0x02/0x03 || X)
-    size_t len = EC_POINT_point2oct(group, result_point.get(), POINT_CONVERSION_COMPRESSED, nullptr, 0, nullptr);
+    size_t len = EC_POINT_point2oct(group, result_point.get(), POINT_CONVERSION_COMPRESSED, nullptr, 0, context.bnCtx());
     if (len == 0) {
         ERR_print_errors_fp(stderr);
         throw std::runtime_error("Failed to determine required buffer length for public key export (EC_POINT_point2oct pre-call).");
@@ -222,7 +299,7 @@ ecc256_public_key CryptoUtils::scalarMultiply(
 
     // Export the result public key into the array
     size_t actual_len_written = EC_POINT_point2oct(group, result_point.get(), POINT_CONVERSION_COMPRESSED,
-                                                   public_key_bytes.data(), public_key_bytes.size(), nullptr);
+                                                   public_key_bytes.data(), public_key_bytes.size(), context.bnCtx());
 
     if (actual_len_written == 0 || actual_len_written != public_key_bytes.size()) {
         ERR_print_errors_fp(stderr);
@@ -240,149 +317,71 @@ sha256_hash CryptoUtils::computeEcdhSharedSecretSha256(
     const ecc256_private_key& private_key_local,
     const ecc256_public_key& public_key_remote) {
 
-    // 0. Get the EC_GROUP object for secp256r1
-    std::unique_ptr<EC_GROUP, decltype(&EC_GROUP_free)> group_ptr(EC_GROUP_new_by_curve_name(NID_X9_62_prime256v1), EC_GROUP_free);
-    if (!group_ptr) {
-        ERR_print_errors_fp(stderr);
-        throw std::runtime_error("Failed to create EC_GROUP for secp256r1.");
-    }
-    const EC_GROUP* group = group_ptr.get();
-
-    // 1. Create EC_KEY object for the local private key
-    std::unique_ptr<EC_KEY, EC_KEY_Deleter> ec_key_local(EC_KEY_new()); // Create empty EC_KEY
-    if (!ec_key_local) {
-        ERR_print_errors_fp(stderr);
-        throw std::runtime_error("Failed to create EC_KEY for local private key.");
-    }
-    // Set the group for the EC_KEY first
-    if (EC_KEY_set_group(ec_key_local.get(), group) != 1) {
-        ERR_print_errors_fp(stderr);
-        throw std::runtime_error("Failed to set EC_GROUP for local EC_KEY.");
-    }
-
-    std::unique_ptr<BIGNUM, decltype(&BN_free)> priv_bn_local(BN_bin2bn(private_key_local.data(), private_key_local.size(), nullptr), BN_free);
-    if (!priv_bn_local) {
-        ERR_print_errors_fp(stderr);
-        throw std::runtime_error("Failed to convert local private key bytes to BIGNUM.");
-    }
-
-    if (EC_KEY_set_private_key(ec_key_local.get(), priv_bn_local.get()) != 1) {
-        ERR_print_errors_fp(stderr);
-        throw std::runtime_error("Failed to set local EC private key.");
-    }
-
-    // It's crucial to compute and set the public key for the local EC_KEY
-    // based on the private key. ECDH_compute_key will need it.
-    std::unique_ptr<EC_POINT, decltype(&EC_POINT_free)> pub_point_local(EC_POINT_new(group), EC_POINT_free);
-    if (!pub_point_local) {
-        ERR_print_errors_fp(stderr);
-        throw std::runtime_error("Failed to create EC_POINT for local public key.");
-    }
-    // pub_point_local = priv_bn_local * G (generator point)
-    if (EC_POINT_mul(group, pub_point_local.get(), priv_bn_local.get(), nullptr, nullptr, nullptr) != 1) {
-        ERR_print_errors_fp(stderr);
-        throw std::runtime_error("Failed to compute local public key from private key.");
-    }
-    if (EC_KEY_set_public_key(ec_key_local.get(), pub_point_local.get()) != 1) {
-        ERR_print_errors_fp(stderr);
-        throw std::runtime_error("Failed to set local EC public key.");
-    }
+    CryptoContext& context = CryptoContext::get();
 
+    // The shared secret is the x coordinate of private_key_local * public_key_remote, 32 bytes for secp256r1.
+    std::array<uint8_t, 32> shared_secret_buffer;
+    size_t secret_len = shared_secret_buffer.size();
 
-    // 2. Create EC_POINT object for the remote public key from its bytes
+    const EC_GROUP* group = context.group();
     std::unique_ptr<EC_POINT, decltype(&EC_POINT_free)> pub_point_remote(EC_POINT_new(group), EC_POINT_free);
-    if (!pub_point_remote) {
+    std::unique_ptr<EC_POINT, decltype(&EC_POINT_free)> shared_point(EC_POINT_new(group), EC_POINT_free);
+    std::unique_ptr<BIGNUM, decltype(&BN_clear_free)> priv_bn_local(BN_bin2bn(private_key_local.data(), private_key_local.size(), nullptr), BN_clear_free);
+    std::unique_ptr<BIGNUM, decltype(&BN_free)> x(BN_new(), BN_free);
+    if (!pub_point_remote || !shared_point || !priv_bn_local || !x) {
         ERR_print_errors_fp(stderr);
-        throw std::runtime_error("Failed to create EC_POINT for remote public key.");
+        throw std::runtime_error("Failed to allocate the ECDH intermediates.");
     }
-
-    // Use EC_POINT_oct2point to convert public_key_remote bytes to EC_POINT
-    // o2i_ECPublicKey is for populating an EC_KEY, not an EC_POINT.
     if (EC_POINT_oct2point(group, pub_point_remote.get(),
-                           public_key_remote.data(), public_key_remote.size(), nullptr) != 1) {
+                           public_key_remote.data(), public_key_remote.size(), context.bnCtx()) != 1) {
         ERR_print_errors_fp(stderr);
         throw std::runtime_error("Failed to convert remote public key bytes to EC_POINT (EC_POINT_oct2point failed). This might indicate malformed public key bytes or wrong curve format.");
     }
-
-    // 3. Compute the shared secret
-    // The shared secret length for secp256r1 is 32 bytes (size of the private key).
-    std::vector<uint8_t> shared_secret_buffer(private_key_local.size()); // Allocate 32 bytes for the secret
-
-    int secret_len = ECDH_compute_key(
-        shared_secret_buffer.data(),      // buffer for shared secret
-        shared_secret_buffer.size(),      // size of buffer
-        pub_point_remote.get(),           // remote public key point
-        ec_key_local.get(),               // local EC_KEY (contains private key)
-        nullptr);                         // kdf (optional)
-
-    if (secret_len <= 0) {
+    if (EC_POINT_mul(group, shared_point.get(), nullptr, pub_point_remote.get(), priv_bn_local.get(), context.bnCtx()) != 1
+        || EC_POINT_is_at_infinity(group, shared_point.get())
+        || EC_POINT_get_affine_coordinates(group, shared_point.get(), x.get(), nullptr, context.bnCtx()) != 1
+        || BN_bn2binpad(x.get(), shared_secret_buffer.data(), shared_secret_buffer.size()) != (int)shared_secret_buffer.size()) {
         ERR_print_errors_fp(stderr);
         throw std::runtime_error("Failed to compute ECDH shared secret. Check input keys for validity (e.g., malformed, point at infinity).");
     }
-    // No need to resize if buffer was already allocated to exact expected size.
-    // shared_secret_buffer.resize(secret_len); // This line is not necessary if size is exactly 32
 
-    // 4. Hash the shared secret (using SHA256 as a KDF for this example)
+    // Hash the shared secret (using SHA256 as a KDF)
     sha256_hash shared_secret_hash;
-    SHA256(shared_secret_buffer.data(), secret_len, shared_secret_hash.data()); // Use secret_len for actual data size
+    SHA256(shared_secret_buffer.data(), secret_len, shared_secret_hash.data());
+    OPENSSL_cleanse(shared_secret_buffer.data(), shared_secret_buffer.size());
 
     return shared_secret_hash;
 }
 
 
-void CryptoUtils::aes256GcmEncrypt(
+// Encrypts one message with a context already set up with its key and nonce
+static void aes256GcmEncryptWith(
+    EVP_CIPHER_CTX* ctx,
     const std::vector<uint8_t>& plaintext,
-    const aes256_key& key,
-    const aes_gcm_nonce& nonce,
     const std::vector<uint8_t>& additional_authenticated_data,
     std::vector<uint8_t>& ciphertext,
     aes_gcm_tag& tag) {
 
-    std::unique_ptr<EVP_CIPHER_CTX, EVP_CIPHER_CTX_Deleter> ctx(EVP_CIPHER_CTX_new());
-    if (!ctx) {
-        ERR_print_errors_fp(stderr);
-        throw std::runtime_error("Failed to create EVP_CIPHER_CTX.");
-    }
-
-    // Initialize encryption operation
-    if (EVP_EncryptInit_ex(ctx.get(), EVP_aes_256_gcm(), nullptr, nullptr, nullptr) != 1) {
-        ERR_print_errors_fp(stderr);
-        throw std::runtime_error("Failed to initialize AES-GCM encryption context.");
-    }
-
-    // Set IV length (nonce length)
-    if (EVP_CIPHER_CTX_ctrl(ctx.get(), EVP_CTRL_GCM_SET_IVLEN, nonce.size(), nullptr) != 1) {
-        ERR_print_errors_fp(stderr);
-        throw std::runtime_error("Failed to set AES-GCM IV length.");
-    }
-
-    // Set key and IV (nonce)
-    if (EVP_EncryptInit_ex(ctx.get(), nullptr, nullptr, key.data(), nonce.data()) != 1) {
-        ERR_print_errors_fp(stderr);
-        throw std::runtime_error("Failed to set key and IV for AES-GCM encryption.");
-    }
-
     // Provide AAD (Additional Authenticated Data) if any
     int len;
     if (!additional_authenticated_data.empty()) {
-        if (EVP_EncryptUpdate(ctx.get(), nullptr, &len, additional_authenticated_data.data(), additional_authenticated_data.size()) != 1) {
+        if (EVP_EncryptUpdate(ctx, nullptr, &len, additional_authenticated_data.data(), additional_authenticated_data.size()) != 1) {
             ERR_print_errors_fp(stderr);
             throw std::runtime_error("Failed to provide AAD for AES-GCM encryption.");
         }
     }
 
     // Provide the plaintext data
-    // Max possible size for ciphertext is plaintext size + block size - 1 (for padding) + tag size
-    // For GCM, no explicit padding, but some internal buffering. Safe to over-allocate slightly.
-    ciphertext.resize(plaintext.size() + aes256_key{}.size()); // Max possible size (plaintext + max overhead)
-    if (EVP_EncryptUpdate(ctx.get(), ciphertext.data(), &len, plaintext.data(), plaintext.size()) != 1) {
+    // GCM is a stream mode: the ciphertext has the size of the plaintext.
+    ciphertext.resize(plaintext.size());
+    if (EVP_EncryptUpdate(ctx, ciphertext.data(), &len, plaintext.data(), plaintext.size()) != 1) {
         ERR_print_errors_fp(stderr);
         throw std::runtime_error("Failed to encrypt plaintext data.");
     }
     int ciphertext_len = len;
 
-    // Finalize encryption (handle padding and generate tag)
-    if (EVP_EncryptFinal_ex(ctx.get(), ciphertext.data() + ciphertext_len, &len) != 1) {
+    // Finalize encryption (generate tag)
+    if (EVP_EncryptFinal_ex(ctx, ciphertext.data() + ciphertext_len, &len) != 1) {
         ERR_print_errors_fp(stderr);
         throw std::runtime_error("Failed to finalize AES-GCM encryption.");
     }
@@ -390,56 +389,33 @@ void CryptoUtils::aes256GcmEncrypt(
     ciphertext.resize(ciphertext_len); // Trim to actual size
 
     // Get the authentication tag
-    if (EVP_CIPHER_CTX_ctrl(ctx.get(), EVP_CTRL_GCM_GET_TAG, tag.size(), tag.data()) != 1) {
+    if (EVP_CIPHER_CTX_ctrl(ctx, EVP_CTRL_GCM_GET_TAG, tag.size(), tag.data()) != 1) {
         ERR_print_errors_fp(stderr);
         throw std::runtime_error("Failed to get AES-GCM authentication tag.");
     }
 }
 
-bool CryptoUtils::aes256GcmDecrypt(
-    const std::vector<uint8_t>& ciphertext,
+// Decrypts one message with a context already set up with its key and nonce, false if the tag does not match.
+// GCM is a stream mode: plaintext receives exactly ciphertext_len bytes, and is wiped on failure.
+static bool aes256GcmDecryptWith(
+    EVP_CIPHER_CTX* ctx,
+    const uint8_t* ciphertext,
+    size_t ciphertext_len,
     const aes_gcm_tag& tag,
-    const aes256_key& key,
-    const aes_gcm_nonce& nonce,
     const std::vector<uint8_t>& additional_authenticated_data,
-    std::vector<uint8_t>& plaintext) {
-
-    std::unique_ptr<EVP_CIPHER_CTX, EVP_CIPHER_CTX_Deleter> ctx(EVP_CIPHER_CTX_new());
-    if (!ctx) {
-        ERR_print_errors_fp(stderr);
-        throw std::runtime_error("Failed to create EVP_CIPHER_CTX.");
-    }
-
-    // Initialize decryption operation
-    if (EVP_DecryptInit_ex(ctx.get(), EVP_aes_256_gcm(), nullptr, nullptr, nullptr) != 1) {
-        ERR_print_errors_fp(stderr);
-        throw std::runtime_error("Failed to initialize AES-GCM decryption context.");
-    }
-
-    // Set IV length (nonce length)
-    if (EVP_CIPHER_CTX_ctrl(ctx.get(), EVP_CTRL_GCM_SET_IVLEN, nonce.size(), nullptr) != 1) {
-        ERR_print_errors_fp(stderr);
-        throw std::runtime_error("Failed to set AES-GCM IV length for decryption.");
-    }
-
-    // Set key and IV (nonce)
-    if (EVP_DecryptInit_ex(ctx.get(), nullptr, nullptr, key.data(), nonce.data()) != 1) {
-        ERR_print_errors_fp(stderr);
-        throw std::runtime_error("Failed to set key and IV for AES-GCM decryption.");
-    }
+    uint8_t* plaintext) {
 
     // Provide AAD (Additional Authenticated Data) if any
     int len;
     if (!additional_authenticated_data.empty()) {
-        if (EVP_DecryptUpdate(ctx.get(), nullptr, &len, additional_authenticated_data.data(), additional_authenticated_data.size()) != 1) {
+        if (EVP_DecryptUpdate(ctx, nullptr, &len, additional_authenticated_data.data(), additional_authenticated_data.size()) != 1) {
             ERR_print_errors_fp(stderr);
             throw std::runtime_error("Failed to provide AAD for AES-GCM decryption.");
         }
     }
 
     // Provide the ciphertext data
-    plaintext.resize(ciphertext.size()); // Plaintext size will be no more than ciphertext size
-    if (EVP_DecryptUpdate(ctx.get(), plaintext.data(), &len, ciphertext.data(), ciphertext.size()) != 1) {
+    if (EVP_DecryptUpdate(ctx, plaintext, &len, ciphertext, ciphertext_len) != 1) {
         ERR_print_errors_fp(stderr);
         throw std::runtime_error("Failed to decrypt ciphertext data.");
     }
@@ -447,25 +423,141 @@ bool CryptoUtils::aes256GcmDecrypt(
 
     // Set the expected authentication tag
     // Corrected: EVP_CIPHER_CTX_ctrl expects a void* for the data pointer
-    if (EVP_CIPHER_CTX_ctrl(ctx.get(), EVP_CTRL_GCM_SET_TAG, tag.size(), const_cast<void*>(static_cast<const void*>(tag.data()))) != 1) {
+    if (EVP_CIPHER_CTX_ctrl(ctx, EVP_CTRL_GCM_SET_TAG, tag.size(), const_cast<void*>(static_cast<const void*>(tag.data()))) != 1) {
         ERR_print_errors_fp(stderr);
         throw std::runtime_error("Failed to set AES-GCM authentication tag for verification.");
     }
 
     // Finalize decryption and verify tag
     // EVP_DecryptFinal_ex returns 1 on success (tag matches), 0 on failure (tag mismatch)
-    if (EVP_DecryptFinal_ex(ctx.get(), plaintext.data() + plaintext_len, &len) > 0) {
-        plaintext_len += len;
-        plaintext.resize(plaintext_len); // Trim to actual size
+    if (EVP_DecryptFinal_ex(ctx, plaintext + plaintext_len, &len) > 0 && (size_t)(plaintext_len + len) == ciphertext_len) {
         return true; // Decryption and tag verification successful
     } else {
         // Tag mismatch or other finalization error
         ERR_print_errors_fp(stderr); // Print errors to stderr
-        plaintext.clear(); // Clear plaintext as it's untrustworthy
+        OPENSSL_cleanse(plaintext, ciphertext_len); // the plaintext is untrustworthy
         return false; // Tag verification failed
     }
 }
 
+static bool aes256GcmDecryptWith(
+    EVP_CIPHER_CTX* ctx,
+    const std::vector<uint8_t>& ciphertext,
+    const aes_gcm_tag& tag,
+    const std::vector<uint8_t>& additional_authenticated_data,
+    std::vector<uint8_t>& plaintext) {
+
+    plaintext.resize(ciphertext.size());
+    if (!aes256GcmDecryptWith(ctx, ciphertext.data(), ciphertext.size(), tag, additional_authenticated_data, plaintext.data())) {
+        plaintext.clear();
+        return false;
+    }
+    return true;
+}
+
+void CryptoUtils::aes256GcmEncrypt(
+    const std::vector<uint8_t>& plaintext,
+    const aes256_key& key,
+    const aes_gcm_nonce& nonce,
+    const std::vector<uint8_t>& additional_authenticated_data,
+    std::vector<uint8_t>& ciphertext,
+    aes_gcm_tag& tag) {
+
+    CryptoContext& context = CryptoContext::get();
+    try {
+        aes256GcmEncryptWith(context.encryptInit(key, nonce), plaintext, additional_authenticated_data, ciphertext, tag);
+    } catch (...) {
+        context.reset();
+        throw;
+    }
+}
+
+bool CryptoUtils::aes256GcmDecrypt(
+    const std::vector<uint8_t>& ciphertext,
+    const aes_gcm_tag& tag,
+    const aes256_key& key,
+    const aes_gcm_nonce& nonce,
+    const std::vector<uint8_t>& additional_authenticated_data,
+    std::vector<uint8_t>& plaintext) {
+
+    CryptoContext& context = CryptoContext::get();
+    try {
+        return aes256GcmDecryptWith(context.decryptInit(key, nonce), ciphertext, tag, additional_authenticated_data, plaintext);
+    } catch (...) {
+        context.reset();
+        throw;
+    }
+}
+
+bool CryptoUtils::aes256GcmDecrypt(
+    const uint8_t* ciphertext,
+    size_t ciphertext_len,
+    const aes_gcm_tag& tag,
+    const aes256_key& key,
+    const aes_gcm_nonce& nonce,
+    const std::vector<uint8_t>& additional_authenticated_data,
+    uint8_t* plaintext) {
+
+    CryptoContext& context = CryptoContext::get();
+    try {
+        return aes256GcmDecryptWith(context.decryptInit(key, nonce), ciphertext, ciphertext_len, tag, additional_authenticated_data, plaintext);
+    } catch (...) {
+        context.reset();
+        throw;
+    }
+}
+
+void CryptoUtils::aes256GcmEncryptBatch(
+    const std::vector<std::vector<uint8_t>>& plaintexts,
+    const aes256_key& key,
+    const std::vector<aes_gcm_nonce>& nonces,
+    const std::vector<uint8_t>& additional_authenticated_data,
+    std::vector<std::vector<uint8_t>>& ciphertexts,
+    std::vector<aes_gcm_tag>& tags) {
+
+    if (nonces.size() != plaintexts.size()) {
+        throw std::runtime_error("aes256GcmEncryptBatch: one nonce per plaintext is required.");
+    }
+    ciphertexts.resize(plaintexts.size());
+    tags.resize(plaintexts.size());
+
+    CryptoContext& context = CryptoContext::get();
+    try {
+        for (size_t i = 0; i < plaintexts.size(); ++i) {
+            aes256GcmEncryptWith(context.encryptInit(key, nonces[i]), plaintexts[i], additional_authenticated_data, ciphertexts[i], tags[i]);
+        }
+    } catch (...) {
+        context.reset();
+        throw;
+    }
+}
+
+bool CryptoUtils::aes256GcmDecryptBatch(
+    const std::vector<std::vector<uint8_t>>& ciphertexts,
+    const std::vector<aes_gcm_tag>& tags,
+    const aes256_key& key,
+    const std::vector<aes_gcm_nonce>& nonces,
+    const std::vector<uint8_t>& additional_authenticated_data,
+    std::vector<std::vector<uint8_t>>& plaintexts) {
+
+    if (nonces.size() != ciphertexts.size() || tags.size() != ciphertexts.size()) {
+        throw std::runtime_error("aes256GcmDecryptBatch: one nonce and one tag per ciphertext are required.");
+    }
+    plaintexts.resize(ciphertexts.size());
+
+    CryptoContext& context = CryptoContext::get();
+    bool all_ok = true;
+    try {
+        for (size_t i = 0; i < ciphertexts.size(); ++i) {
+            all_ok &= aes256GcmDecryptWith(context.decryptInit(key, nonces[i]), ciphertexts[i], tags[i], additional_authenticated_data, plaintexts[i]);
+        }
+    } catch (...) {
+        context.reset();
+        throw;
+    }
+    return all_ok;
+}
+
 aes_gcm_nonce CryptoUtils::generateNonce() {
     aes_gcm_nonce nonce;
     if (RAND_bytes(nonce.data(), nonce.size()) != 1) {
@@ -5,8 +5,11 @@
 #include <openssl/obj_mac.h> // For NID_secp256r1
 #include <openssl/rand.h>
 #include <openssl/sha.h>     // For SHA256
+#include <openssl/hmac.h>    // For HMAC
 #include <openssl/evp.h>     // For AES-GCM
 #include <openssl/err.h>     // For OpenSSL error handling
+#include <openssl/bn.h>      // For BN_CTX
+#include <openssl/crypto.h>  // For OPENSSL_cleanse, CRYPTO_memcmp
 
 #include <vector>
 #include <array>
@@ -25,6 +28,14 @@ struct EVP_CIPHER_CTX_Deleter {
     void operator()(EVP_CIPHER_CTX* ptr) const;
 };
 
+struct EC_GROUP_Deleter {
+    void operator()(EC_GROUP* ptr) const;
+};
+
+struct BN_CTX_Deleter {
+    void operator()(BN_CTX* ptr) const;
+};
+
 // Using declarations for type aliases
 // ECC (Elliptic Curve Cryptography) types for secp256r1
 using ecc256_private_key = std::array<uint8_t, 32>; // secp256r1 private key size
@@ -38,6 +49,54 @@ using aes256_key = std::array<uint8_t, 32>;  // AES-256 key size
 using aes_gcm_nonce = std::array<uint8_t, 12>; // AES-GCM recommended nonce size
 using aes_gcm_tag = std::array<uint8_t, 16>;  // AES-GCM tag size
 
+/**
+ * @brief Per-thread cache of the OpenSSL objects used by CryptoUtils.
+ *
+ * Building an EC_GROUP, fetching a cipher implementation or allocating a cipher context costs more than
+ * the operation itself on small inputs (a RAG chunk, a key). Each thread keeps its own instance, so no
+ * locking is needed: the secp256r1 group (with its generator precomputation), a BN_CTX, the AES-256-GCM
+ * implementation and one encryption and one decryption context. The key schedule of a cipher context is
+ * kept while the same key is used, so consecutive operations under one key only set a new nonce.
+ */
+class CryptoContext {
+public:
+    ~CryptoContext();
+
+    // the instance of the calling thread
+    static CryptoContext& get();
+
+    const EC_GROUP* group() const { return group_.get(); }
+    BN_CTX* bnCtx() { return bn_ctx_.get(); }
+
+    // returns the encryption (decryption) context, ready for a new message under key and nonce
+    EVP_CIPHER_CTX* encryptInit(const aes256_key& key, const aes_gcm_nonce& nonce);
+    EVP_CIPHER_CTX* decryptInit(const aes256_key& key, const aes_gcm_nonce& nonce);
+
+    // forget the cached key schedules, after an error leaves a context in an unknown state
+    void reset();
+
+private:
+    CryptoContext();
+    CryptoContext(const CryptoContext&) = delete;
+    CryptoContext& operator=(const CryptoContext&) = delete;
+
+    struct cipher_state {
+        std::unique_ptr<EVP_CIPHER_CTX, EVP_CIPHER_CTX_Deleter> ctx;
+        aes256_key key{};
+        bool keyed = false;
+    };
+    EVP_CIPHER_CTX* init(cipher_state& state, bool encrypt, const aes256_key& key, const aes_gcm_nonce& nonce);
+
+    std::unique_ptr<EC_GROUP, EC_GROUP_Deleter> group_;
+    std::unique_ptr<BN_CTX, BN_CTX_Deleter> bn_ctx_;
+    const EVP_CIPHER* aes256_gcm_ = nullptr;
+#if OPENSSL_VERSION_NUMBER >= 0x30000000L
+    EVP_CIPHER* fetched_aes256_gcm_ = nullptr;
+#endif
+    cipher_state encrypt_;
+    cipher_state decrypt_;
+};
+
 class CryptoUtils {
 public:
     static std::vector<unsigned char> export_public_key_to_bytes(EC_KEY* ec_key, point_conversion_form_t format);
@@ -51,6 +110,15 @@ public:
 
     static sha256_hash computeSha256Bytes(const std::vector<uint8_t>& data);
 
+    /**
+     * @brief Computes the HMAC-SHA256 of data.
+     * @param key The MAC key.
+     * @param data The data to authenticate.
+     * @return The MAC as a `sha256_hash`.
+     * @throws std::runtime_error if the MAC computation fails.
+     */
+    static sha256_hash computeHmacSha256(const std::vector<uint8_t>& key, const std::vector<uint8_t>& data);
+
     /**
      * @brief Generates a new secp256r1 private key.
      * @return An `ecc256_private_key` representing the private key.
@@ -129,6 +197,61 @@ public:
         const std::vector<uint8_t>& additional_authenticated_data,
         std::vector<uint8_t>& plaintext);
 
+    /**
+     * @brief Decrypts into a caller-owned buffer, e.g. a region of a larger arena, instead of a new vector.
+     * @param plaintext Output parameter: at least ciphertext_len bytes, receives exactly ciphertext_len bytes
+     *        (wiped if the tag does not match). It may be the ciphertext buffer itself.
+     * @return true if decryption and tag verification succeed, false otherwise.
+     * @throws std::runtime_error if decryption setup fails (but returns false for tag mismatch).
+     */
+    static bool aes256GcmDecrypt(
+        const uint8_t* ciphertext,
+        size_t ciphertext_len,
+        const aes_gcm_tag& tag,
+        const aes256_key& key,
+        const aes_gcm_nonce& nonce,
+        const std::vector<uint8_t>& additional_authenticated_data,
+        uint8_t* plaintext);
+
+    /**
+     * @brief Encrypts several buffers under the same key with AES-256-GCM.
+     * The key schedule is set up once for the whole batch, each buffer only sets its nonce. The output
+     * of each buffer is the same as with aes256GcmEncrypt.
+     * @param plaintexts The buffers to encrypt.
+     * @param key The `aes256_key`.
+     * @param nonces One unique `aes_gcm_nonce` per buffer.
+     * @param additional_authenticated_data (AAD) Optional additional data, authenticated with every buffer.
+     * @param ciphertexts Output parameter: The encrypted buffers.
+     * @param tags Output parameter: The `aes_gcm_tag` of each buffer.
+     * @throws std::runtime_error if the sizes do not match or the encryption fails.
+     */
+    static void aes256GcmEncryptBatch(
+        const std::vector<std::vector<uint8_t>>& plaintexts,
+        const aes256_key& key,
+        const std::vector<aes_gcm_nonce>& nonces,
+        const std::vector<uint8_t>& additional_authenticated_data,
+        std::vector<std::vector<uint8_t>>& ciphertexts,
+        std::vector<aes_gcm_tag>& tags);
+
+    /**
+     * @brief Decrypts several buffers encrypted under the same key with AES-256-GCM.
+     * @param ciphertexts The encrypted buffers.
+     * @param tags The `aes_gcm_tag` of each buffer.
+     * @param key The `aes256_key`.
+     * @param nonces The `aes_gcm_nonce` of each buffer.
+     * @param additional_authenticated_data (AAD) Optional additional data authenticated with every buffer.
+     * @param plaintexts Output parameter: The decrypted buffers, empty for the buffers that failed verification.
+     * @return true if all the buffers were decrypted and verified, false otherwise.
+     * @throws std::runtime_error if the sizes do not match or the decryption setup fails.
+     */
+    static bool aes256GcmDecryptBatch(
+        const std::vector<std::vector<uint8_t>>& ciphertexts,
+        const std::vector<aes_gcm_tag>& tags,
+        const aes256_key& key,
+        const std::vector<aes_gcm_nonce>& nonces,
+        const std::vector<uint8_t>& additional_authenticated_data,
+        std::vector<std::vector<uint8_t>>& plaintexts);
+
     /**
      * @brief Generates a cryptographically secure random nonce.
      * @return An `aes_gcm_nonce` containing the random nonce.
@@ -0,0 +1,135 @@
+#include "data_key_cache.h"
+
+#include <algorithm>
+#include <new>
+#include <vector>
+
+data_key_cache::data_key_cache(std::chrono::seconds ttl, size_t max_entries)
+    : ttl_(ttl), max_entries_(std::max<size_t>(1, max_entries)) {
+    // 1 MiB of locked memory holds far more than max_entries keys. Without it (e.g. RLIMIT_MEMLOCK too low),
+    // OPENSSL_secure_malloc falls back to the regular heap, and the keys are still wiped when freed.
+    if (!CRYPTO_secure_malloc_initialized()) {
+        CRYPTO_secure_malloc_init(1 << 20, 32);
+    }
+}
+
+data_key_cache& data_key_cache::get() {
+    static data_key_cache cache;
+    return cache;
+}
+
+data_key_cache::key_ptr data_key_cache::secureKey(const aes256_key& key) {
+    void* p = OPENSSL_secure_malloc(sizeof(aes256_key));
+    if (!p) {
+        throw std::runtime_error("Failed to allocate a data key in the secure heap.");
+    }
+    return key_ptr(new (p) aes256_key(key), [](const aes256_key* k) {
+        OPENSSL_secure_clear_free(const_cast<aes256_key*>(k), sizeof(aes256_key));
+    });
+}
+
+void data_key_cache::purgeExpired(clock::time_point now) {
+    auto purge = [now](auto& map) {
+        for (auto it = map.begin(); it != map.end();) {
+            it = it->second.expiry <= now ? map.erase(it) : std::next(it);
+        }
+    };
+    purge(sealing_);
+    purge(opening_);
+}
+
+template <class Map>
+void data_key_cache::insert(Map& map, const typename Map::key_type& id, entry e) {
+    if (map.size() >= max_entries_) {
+        purgeExpired(clock::now());
+    }
+    if (map.size() >= max_entries_) {
+        // still full: drop the key closest to its expiry
+        auto oldest = std::min_element(map.begin(), map.end(), [](const auto& a, const auto& b) {
+            return a.second.expiry < b.second.expiry;
+        });
+        map.erase(oldest);
+    }
+    map[id] = std::move(e);
+}
+
+data_key_cache::sealing_key data_key_cache::sealingKey(const std::string& document_id, const ecc256_public_key& recipient_public_key) {
+    const auto id = std::make_pair(document_id, recipient_public_key);
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        auto it = sealing_.find(id);
+        if (it != sealing_.end() && it->second.expiry > clock::now()) {
+            ++hits_;
+            return {it->second.ephemeral_public_key, it->second.key};
+        }
+        ++misses_;
+    }
+
+    // the key agreement runs outside of the lock; two threads may race on the same document, they then
+    // each encrypt with their own (valid) key and the last one is kept
+    ecc256_private_key ephemeral_private_key = CryptoUtils::generatePrivateKey();
+    entry e;
+    e.ephemeral_public_key = CryptoUtils::computePublicKey(ephemeral_private_key);
+    sha256_hash data_key = CryptoUtils::computeEcdhSharedSecretSha256(ephemeral_private_key, recipient_public_key);
+    OPENSSL_cleanse(ephemeral_private_key.data(), ephemeral_private_key.size());
+    e.key = secureKey(data_key);
+    OPENSSL_cleanse(data_key.data(), data_key.size());
+
+    std::lock_guard<std::mutex> lock(mutex_);
+    e.expiry = clock::now() + ttl_;
+    sealing_key result = {e.ephemeral_public_key, e.key};
+    insert(sealing_, id, std::move(e));
+    return result;
+}
+
+data_key_cache::key_ptr data_key_cache::openingKey(const ecc256_public_key& ephemeral_public_key, const ecc256_private_key& recipient_private_key) {
+    const auto id = std::make_pair(ephemeral_public_key,
+        CryptoUtils::computeSha256Bytes(std::vector<uint8_t>(recipient_private_key.begin(), recipient_private_key.end())));
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        auto it = opening_.find(id);
+        if (it != opening_.end() && it->second.expiry > clock::now()) {
+            ++hits_;
+            return it->second.key;
+        }
+        ++misses_;
+    }
+
+    sha256_hash data_key = CryptoUtils::computeEcdhSharedSecretSha256(recipient_private_key, ephemeral_public_key);
+    entry e;
+    e.ephemeral_public_key = ephemeral_public_key;
+    e.key = secureKey(data_key);
+    OPENSSL_cleanse(data_key.data(), data_key.size());
+
+    std::lock_guard<std::mutex> lock(mutex_);
+    e.expiry = clock::now() + ttl_;
+    key_ptr result = e.key;
+    insert(opening_, id, std::move(e));
+    return result;
+}
+
+void data_key_cache::setTtl(std::chrono::seconds ttl) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    ttl_ = ttl;
+}
+
+void data_key_cache::clear() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    sealing_.clear();
+    opening_.clear();
+}
+
+size_t data_key_cache::size() const {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return sealing_.size() + opening_.size();
+}
+
+uint64_t data_key_cache::hits() const {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return hits_;
+}
+
+uint64_t data_key_cache::misses() const {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return misses_;
+}
@@ -0,0 +1,90 @@
+#ifndef DATA_KEY_CACHE_H
+#define DATA_KEY_CACHE_H
+
+#include <chrono>
+#include <cstdint>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <utility>
+
+#include "crypto_utils.h"
+
+/**
+ * @brief Data keys of the envelope encryption of the RAG chunks.
+ *
+ * The chunks of a document are encrypted with AES-256-GCM under one data key per (document, recipient).
+ * The data key is wrapped for the recipient ECIES-style: it is SHA256(ECDH(ephemeral key, recipient key)),
+ * and the ephemeral public key stored with every chunk lets the recipient derive it again. The stored
+ * format is the one of EciesUtils::encrypt_ecies, only the ephemeral key is shared by the chunks.
+ *
+ * With the keys cached, a document costs one ECDH to encrypt and one to decrypt, instead of one per chunk.
+ * The keys are kept in the OpenSSL secure heap (locked in memory, never swapped out, wiped when freed)
+ * and expire after a TTL.
+ */
+class data_key_cache {
+public:
+    using key_ptr = std::shared_ptr<const aes256_key>;
+
+    struct sealing_key {
+        ecc256_public_key ephemeral_public_key; // to store with the chunks
+        key_ptr key;
+    };
+
+    explicit data_key_cache(std::chrono::seconds ttl = std::chrono::seconds(300), size_t max_entries = 4096);
+
+    // The cache shared by the rag_database backends and the server.
+    static data_key_cache& get();
+
+    /**
+     * @brief Data key to encrypt the chunks of a document for a recipient.
+     * A new ephemeral key pair is drawn when there is no live key for the pair; its private key is dropped right away.
+     * @throws std::runtime_error if the key agreement fails.
+     */
+    sealing_key sealingKey(const std::string& document_id, const ecc256_public_key& recipient_public_key);
+
+    /**
+     * @brief Data key of the chunks encrypted with the given ephemeral public key.
+     * The entries are also keyed by a hash of the recipient private key, so that a key is only handed out
+     * to a caller that could derive it.
+     * @throws std::runtime_error if the key agreement fails (e.g. malformed ephemeral key).
+     */
+    key_ptr openingKey(const ecc256_public_key& ephemeral_public_key, const ecc256_private_key& recipient_private_key);
+
+    void setTtl(std::chrono::seconds ttl);
+    void clear();
+    size_t size() const;
+
+    // Lookups (sealingKey and openingKey) answered from the cache, and the ones that needed a key agreement.
+    uint64_t hits() const;
+    uint64_t misses() const;
+
+private:
+    using clock = std::chrono::steady_clock;
+
+    struct entry {
+        ecc256_public_key ephemeral_public_key;
+        key_ptr key;
+        clock::time_point expiry;
+    };
+
+    // copy of the key in the secure heap
+    static key_ptr secureKey(const aes256_key& key);
+
+    // the callers hold mutex_
+    template <class Map>
+    void insert(Map& map, const typename Map::key_type& id, entry e);
+    void purgeExpired(clock::time_point now);
+
+    std::chrono::seconds ttl_;
+    size_t max_entries_;
+
+    mutable std::mutex mutex_;
+    uint64_t hits_ = 0;
+    uint64_t misses_ = 0;
+    std::map<std::pair<std::string, ecc256_public_key>, entry> sealing_;  // (document, recipient public key)
+    std::map<std::pair<ecc256_public_key, sha256_hash>, entry> opening_;  // (ephemeral public key, hash of the recipient private key)
+};
+
+#endif // DATA_KEY_CACHE_H
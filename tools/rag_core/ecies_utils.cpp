@@ -1,5 +1,6 @@
 #include "ecies_utils.h"
 #include "crypto_utils.h" // For CryptoUtils:: functions
+#include "data_key_cache.h"
 #include <iostream> // For std::cerr
 #include <stdexcept> // For std::runtime_error
 #include <algorithm> // For std::copy
@@ -37,17 +38,38 @@ encryption_result EciesUtils::encrypt_ecies(const std::vector<uint8_t>& plaintex
     return result;
 }
 
+encryption_result EciesUtils::encrypt_envelope(const std::vector<uint8_t>& plaintext,
+                                              const std::string& document_id,
+                                              const ecc256_public_key& recipient_public_key) {
+    encryption_result result;
+
+    // 1. Data key of the document, shared with the other chunks
+    data_key_cache::sealing_key data_key = data_key_cache::get().sealingKey(document_id, recipient_public_key);
+    result.ephemeral_public_key = data_key.ephemeral_public_key;
+
+    // 2. A unique nonce per chunk, random nonces are safe far beyond the number of chunks of a document
+    result.nonce = CryptoUtils::generateNonce();
+
+    // 3. Encrypt the plaintext using AES-256-GCM, no AAD, as encrypt_ecies
+    std::vector<uint8_t> additional_authenticated_data;
+    CryptoUtils::aes256GcmEncrypt(
+        plaintext,
+        *data_key.key,
+        result.nonce,
+        additional_authenticated_data,
+        result.ciphertext,
+        result.tag);
+
+    return result;
+}
+
 std::vector<uint8_t> EciesUtils::decrypt_ecies(const std::vector<uint8_t>& ciphertext,
                                               const aes_gcm_tag& tag,
                                               const aes_gcm_nonce& nonce,
                                               const ecc256_public_key& ephemeral_public_key,
                                               const ecc256_private_key& recipient_private_key) {
-    // 1. Compute shared secret using recipient's private key and ephemeral public key
-    sha256_hash shared_secret_sha256 = CryptoUtils::computeEcdhSharedSecretSha256(
-        recipient_private_key, ephemeral_public_key);
-
-    aes256_key aes_key;
-    std::copy(shared_secret_sha256.begin(), shared_secret_sha256.end(), aes_key.begin());
+    // 1. Shared secret of the recipient's private key and the ephemeral public key, cached per ephemeral key
+    data_key_cache::key_ptr aes_key = data_key_cache::get().openingKey(ephemeral_public_key, recipient_private_key);
 
     // 2. Decrypt the ciphertext using AES-256-GCM
     std::vector<uint8_t> plaintext;
@@ -56,7 +78,7 @@ std::vector<uint8_t> EciesUtils::decrypt_ecies(const std::vector<uint8_t>& ciphe
     bool success = CryptoUtils::aes256GcmDecrypt(
         ciphertext,
         tag,
-        aes_key,
+        *aes_key,
         nonce,
         additional_authenticated_data,
         plaintext);
@@ -68,3 +90,13 @@ std::vector<uint8_t> EciesUtils::decrypt_ecies(const std::vector<uint8_t>& ciphe
 
     return plaintext;
 }
+
+bool EciesUtils::decrypt_ecies_into(const std::vector<uint8_t>& ciphertext,
+                                    const aes_gcm_tag& tag,
+                                    const aes_gcm_nonce& nonce,
+                                    const ecc256_public_key& ephemeral_public_key,
+                                    const ecc256_private_key& recipient_private_key,
+                                    uint8_t* plaintext) {
+    data_key_cache::key_ptr aes_key = data_key_cache::get().openingKey(ephemeral_public_key, recipient_private_key);
+    return CryptoUtils::aes256GcmDecrypt(ciphertext.data(), ciphertext.size(), tag, *aes_key, nonce, {}, plaintext);
+}
@@ -32,12 +32,30 @@ public:
     static encryption_result encrypt_ecies(const std::vector<uint8_t>& plaintext,
                                            const ecc256_public_key& recipient_public_key);
 
+    /**
+     * @brief Encrypts a chunk of a document with the document's data key (envelope encryption).
+     *
+     * Same output as encrypt_ecies, but the ephemeral key pair, and so the AES key, is shared by the
+     * chunks of the document for the same recipient while it stays in data_key_cache: one ECDH per
+     * document instead of one per chunk.
+     *
+     * @param plaintext The data to encrypt.
+     * @param document_id The document the chunk belongs to.
+     * @param recipient_public_key The recipient's public key (ecc256_public_key).
+     * @return An `encryption_result` struct containing ciphertext, tag, nonce, and the ephemeral public key.
+     * @throws std::runtime_error if any cryptographic operation fails.
+     */
+    static encryption_result encrypt_envelope(const std::vector<uint8_t>& plaintext,
+                                              const std::string& document_id,
+                                              const ecc256_public_key& recipient_public_key);
+
     /**
      * @brief Decrypts data using an ECIES-like scheme (ECDH + AES-256-GCM) and verifies the authentication tag.
      *
      * This function uses the recipient's private key and the ephemeral public key (from encryption)
      * to re-derive the shared secret, and then uses that secret to decrypt the ciphertext
-     * and verify its integrity.
+     * and verify its integrity. The derived key is cached in data_key_cache, so the chunks of a
+     * document encrypted with encrypt_envelope only cost one ECDH.
      *
      * @param ciphertext The encrypted data.
      * @param tag The authentication tag received with the ciphertext.
@@ -52,6 +70,23 @@ public:
                                               const aes_gcm_nonce& nonce,
                                               const ecc256_public_key& ephemeral_public_key,
                                               const ecc256_private_key& recipient_private_key);
+
+    /**
+     * @brief Same as decrypt_ecies, but decrypts into a caller-owned buffer instead of a new vector.
+     *
+     * Lets a reader decrypt the chunks of a query back to back into one reusable arena.
+     *
+     * @param plaintext Output parameter: at least ciphertext.size() bytes, receives exactly
+     *        ciphertext.size() bytes (wiped if the tag does not match).
+     * @return true if decryption and tag verification succeed, false otherwise.
+     * @throws std::runtime_error if the key agreement or the decryption setup fails.
+     */
+    static bool decrypt_ecies_into(const std::vector<uint8_t>& ciphertext,
+                                   const aes_gcm_tag& tag,
+                                   const aes_gcm_nonce& nonce,
+                                   const ecc256_public_key& ephemeral_public_key,
+                                   const ecc256_private_key& recipient_private_key,
+                                   uint8_t* plaintext);
 };
 
 #endif // ECIES_UTILS_H
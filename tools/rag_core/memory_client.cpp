@@ -0,0 +1,360 @@
+#include "memory_client.h"
+#include <algorithm>
+#include <cmath>
+#include <stdexcept>
+
+#include "postgres_client.h" // bytes_to_hex
+
+memory_client::memory_client(const std::string& collection)
+    : collection_(collection) {
+}
+
+void memory_client::connect(const std::string& /*user*/, const std::string& /*password*/) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    connected_ = true;
+}
+
+void memory_client::setUser(const std::string& /*user*/) {
+}
+
+void memory_client::setPassword(const std::string& /*password*/) {
+}
+
+void memory_client::disconnect() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    connected_ = false;
+}
+
+bool memory_client::isConnected() const {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return connected_;
+}
+
+std::string memory_client::get_host_name() const {
+    return "memory";
+}
+
+int memory_client::get_port() const {
+    return 0;
+}
+
+std::string memory_client::get_name() const {
+    return "memory";
+}
+
+void memory_client::checkReady() const {
+    if (!connected_) {
+        throw std::runtime_error("Not connected to the database.");
+    }
+    if (!has_schema_) {
+        throw std::runtime_error("Schema has not been created.");
+    }
+}
+
+bool memory_client::hasSchema() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return connected_ && has_schema_;
+}
+
+void memory_client::createSchema(size_t embedding_size) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (!connected_) {
+        throw std::runtime_error("Not connected to the database.");
+    }
+    if (has_schema_) {
+        return;
+    }
+    has_schema_ = true;
+    embedding_size_ = embedding_size;
+}
+
+void memory_client::destroySchema() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (!connected_) {
+        throw std::runtime_error("Not connected to the database.");
+    }
+    has_schema_ = false;
+    has_shadow_ = false;
+    embedding_size_ = 0;
+    next_id_ = 1;
+    entries_.clear();
+    documents_.clear();
+    contents_.clear();
+    fingerprints_.clear();
+}
+
+std::string memory_client::getCollection() const {
+    return collection_.empty() ? "default" : collection_;
+}
+
+std::vector<std::string> memory_client::listCollections() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (!connected_) {
+        throw std::runtime_error("Not connected to the database.");
+    }
+    if (!has_schema_) {
+        return {};
+    }
+    return {getCollection()};
+}
+
+void memory_client::createIndex(const rag_index_params& params) {
+    if (params.type != "hnsw" && params.type != "ivfflat") {
+        throw std::runtime_error("Unsupported index type: " + params.type);
+    }
+    // searches are always exact: the index is accepted for API compatibility only
+}
+
+void memory_client::dropIndex() {
+}
+
+void memory_client::setSearchParams(int /*ef_search*/, int /*probes*/) {
+}
+
+void memory_client::setFingerprint(const embedding_fingerprint& fingerprint) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    checkReady();
+    if (embedding_size_ != 0 && (int) embedding_size_ != fingerprint.n_embd) {
+        throw std::runtime_error("Embedding size mismatch: collection " + getCollection() + " has " + std::to_string(embedding_size_) +
+                                 " dimensions, model produces " + std::to_string(fingerprint.n_embd));
+    }
+    fingerprints_["active"] = fingerprint;
+}
+
+bool memory_client::getFingerprint(embedding_fingerprint& fingerprint, bool shadow) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    checkReady();
+    auto it = fingerprints_.find(shadow ? "shadow" : "active");
+    if (it != fingerprints_.end()) {
+        fingerprint = it->second;
+        return true;
+    }
+    fingerprint = embedding_fingerprint();
+    if (!shadow) {
+        fingerprint.n_embd = (int) embedding_size_;
+    }
+    return false;
+}
+
+void memory_client::beginShadowMigration(const embedding_fingerprint& fingerprint) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    checkReady();
+    if (fingerprint.n_embd <= 0) {
+        throw std::runtime_error("Invalid embedding size for shadow migration.");
+    }
+    // restarting a migration discards whatever the previous one had computed
+    for (auto& e : entries_) {
+        e.shadow_embedding.clear();
+    }
+    has_shadow_ = true;
+    fingerprints_["shadow"] = fingerprint;
+}
+
+std::vector<shadow_entry> memory_client::fetchShadowBatch(int after_id, int max_entries) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    checkReady();
+    if (!has_shadow_) {
+        throw std::runtime_error("Failed to fetch shadow migration batch: no migration in progress");
+    }
+    std::vector<shadow_entry> batch;
+    for (const auto& e : entries_) {
+        if ((int) batch.size() >= max_entries) {
+            break;
+        }
+        if (e.id <= after_id || !e.shadow_embedding.empty()) {
+            continue;
+        }
+        const auto& content = contents_.at(e.hash);
+        shadow_entry se;
+        se.id = e.id;
+        se.encrypted_content = content.ciphertext;
+        se.tag = content.tag;
+        se.nonce = content.nonce;
+        se.ephemeral_public_key = content.ephemeral_public_key;
+        se.encryption_public_key = e.encryption_public_key;
+        batch.emplace_back(std::move(se));
+    }
+    return batch;
+}
+
+void memory_client::updateShadowEmbedding(int id, const std::vector<float>& embedding) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    checkReady();
+    if (!has_shadow_) {
+        throw std::runtime_error("Failed to update shadow embedding: no migration in progress");
+    }
+    auto it = std::find_if(entries_.begin(), entries_.end(), [id](const entry& e) { return e.id == id; });
+    if (it != entries_.end()) {
+        it->shadow_embedding = embedding;
+    }
+}
+
+void memory_client::promoteShadow() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    checkReady();
+    if (!has_shadow_) {
+        throw std::runtime_error("Failed to promote shadow: no migration in progress");
+    }
+    long pending = std::count_if(entries_.begin(), entries_.end(), [](const entry& e) { return e.shadow_embedding.empty(); });
+    if (pending > 0) {
+        throw std::runtime_error(std::to_string(pending) + " rag entries still lack a shadow embedding");
+    }
+    for (auto& e : entries_) {
+        e.embedding = std::move(e.shadow_embedding);
+        e.shadow_embedding.clear();
+    }
+    fingerprints_["active"] = fingerprints_["shadow"];
+    fingerprints_.erase("shadow");
+    embedding_size_ = fingerprints_["active"].n_embd;
+    has_shadow_ = false;
+}
+
+void memory_client::abortShadowMigration() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    checkReady();
+    for (auto& e : entries_) {
+        e.shadow_embedding.clear();
+    }
+    fingerprints_.erase("shadow");
+    has_shadow_ = false;
+}
+
+document_entry memory_client::createOrRetrieveDocument(
+    const std::string& date,
+    const std::string& version,
+    const std::string& content_type,
+    const std::string& url,
+    int length) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    checkReady();
+
+    // same identity as the postgres backend
+    std::string unique_string_for_hash = url + date + version + content_type + std::to_string(length);
+    std::vector<uint8_t> hash_input(unique_string_for_hash.begin(), unique_string_for_hash.end());
+    sha256_hash hash = CryptoUtils::computeSha256Bytes(hash_input);
+    std::string document_id_hash_hex = postgres_client::bytes_to_hex(hash.data(), hash.size());
+
+    auto it = documents_.find(document_id_hash_hex);
+    if (it != documents_.end()) {
+        return it->second;
+    }
+    document_entry doc(document_id_hash_hex, date, version, content_type, url, length);
+    documents_.emplace(document_id_hash_hex, doc);
+    return doc;
+}
+
+void memory_client::deleteDocument(const std::string& document_id) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    checkReady();
+    // rag entries reference their document, as the foreign key does in postgres
+    if (std::any_of(entries_.begin(), entries_.end(), [&](const entry& e) { return e.document_id == document_id; })) {
+        throw std::runtime_error("Failed to delete document with ID " + document_id + ": still referenced by rag entries");
+    }
+    documents_.erase(document_id);
+}
+
+void memory_client::insertRagEntry(const std::string& document_id_hash,
+                                   const std::vector<float>& embedding,
+                                   const std::vector<uint8_t>& contents,
+                                   const ecc256_public_key& controller_public_key,
+                                   const ecc256_private_key& recipient_private_key,
+                                   bool use_shadow) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    checkReady();
+    if (documents_.find(document_id_hash) == documents_.end()) {
+        throw std::runtime_error("Failed to insert rag entry: unknown document " + document_id_hash);
+    }
+    if (use_shadow && !has_shadow_) {
+        throw std::runtime_error("Failed to insert rag entry: no shadow migration in progress");
+    }
+    if (!use_shadow && embedding_size_ != 0 && embedding.size() != embedding_size_) {
+        throw std::runtime_error("Failed to insert rag entry: expected " + std::to_string(embedding_size_) +
+                                 " dimensions, not " + std::to_string(embedding.size()));
+    }
+
+    // dedup within the recipient only, like the postgres backend does
+    std::string content_hash_hex = postgres_client::contentHashHex(contents, recipient_private_key);
+
+    // contents are encrypted with the document's data key, like the postgres backend does
+    ecc256_public_key recipient_public_key = CryptoUtils::computePublicKey(recipient_private_key);
+    if (contents_.find(content_hash_hex) == contents_.end()) {
+        contents_.emplace(content_hash_hex, EciesUtils::encrypt_envelope(contents, document_id_hash, recipient_public_key));
+    }
+
+    entry e;
+    e.id = next_id_++;
+    e.document_id = document_id_hash;
+    (use_shadow ? e.shadow_embedding : e.embedding) = embedding;
+    e.hash = content_hash_hex;
+    e.length = (int) contents.size();
+    e.controller_public_key = controller_public_key;
+    e.encryption_public_key = recipient_public_key;
+    entries_.emplace_back(std::move(e));
+}
+
+float memory_client::distance(const std::vector<float>& a, const std::vector<float>& b, DistanceMetric metric) {
+    const size_t n = std::min(a.size(), b.size());
+    double dot = 0.0, na = 0.0, nb = 0.0, l2 = 0.0;
+    for (size_t i = 0; i < n; ++i) {
+        dot += (double) a[i] * b[i];
+        na  += (double) a[i] * a[i];
+        nb  += (double) b[i] * b[i];
+        const double d = (double) a[i] - b[i];
+        l2  += d * d;
+    }
+    switch (metric) {
+        case DistanceMetric::L2: return (float) std::sqrt(l2);
+        case DistanceMetric::IP: return (float) -dot;
+        case DistanceMetric::COSINE:
+        default:
+            if (na == 0.0 || nb == 0.0) {
+                return 1.0f;
+            }
+            return (float) (1.0 - dot / (std::sqrt(na) * std::sqrt(nb)));
+    }
+}
+
+std::vector<rag_database::nearest_result>
+memory_client::searchNearest(const std::vector<float>& query_embedding, int n_retrievals, const additional_filtering_clause& filter_clause, DistanceMetric distance_metric, bool use_shadow) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    checkReady();
+    if (filter_clause) {
+        throw std::runtime_error("Nearest neighbor search failed: SQL filter clauses are not supported by the in-memory backend");
+    }
+
+    std::vector<std::pair<float, const entry*>> scored;
+    scored.reserve(entries_.size());
+    for (const auto& e : entries_) {
+        const auto& embedding = use_shadow ? e.shadow_embedding : e.embedding;
+        if (embedding.empty()) {
+            continue;
+        }
+        scored.emplace_back(distance(embedding, query_embedding, distance_metric), &e);
+    }
+    const size_t n = std::min(scored.size(), (size_t) std::max(0, n_retrievals));
+    std::partial_sort(scored.begin(), scored.begin() + n, scored.end(),
+                      [](const auto& a, const auto& b) { return a.first < b.first; });
+
+    std::vector<rag_database::nearest_result> results;
+    results.reserve(n);
+    for (size_t i = 0; i < n; ++i) {
+        const entry& e = *scored[i].second;
+        const document_entry& doc = documents_.at(e.document_id);
+        const encryption_result& content = contents_.at(e.hash);
+        results.emplace_back(
+            e.document_id,
+            use_shadow ? e.shadow_embedding : e.embedding,
+            e.hash,
+            0,
+            e.length,
+            e.controller_public_key,
+            e.encryption_public_key,
+            doc.date, doc.version, doc.content_type, doc.url, doc.length,
+            content.ciphertext,
+            content.tag,
+            content.nonce,
+            content.ephemeral_public_key,
+            scored[i].first);
+    }
+    return results;
+}
@@ -0,0 +1,107 @@
+#ifndef MEMORY_CLIENT_H
+#define MEMORY_CLIENT_H
+
+#include <vector>
+#include <string>
+#include <map>
+#include <mutex>
+#include <memory>
+
+#include "crypto_utils.h"
+#include "ecies_utils.h"
+#include "rag_database.h"
+
+// In-process rag_database backend, without network nor persistence.
+// Searches are always exact (brute force), so it also serves as the ground truth for recall measurements.
+// SQL filter clauses are not supported.
+class memory_client : public rag_database {
+public:
+    explicit memory_client(const std::string& collection = "");
+
+    void connect(const std::string& user = "", const std::string& password = "") override;
+    void setUser(const std::string& user) override;
+    void setPassword(const std::string& password) override;
+    void disconnect() override;
+    bool isConnected() const override;
+
+    std::string get_host_name() const override;
+    int get_port() const override;
+    std::string get_name() const override;
+
+    // Schema management
+    bool hasSchema() override;
+    void createSchema(size_t embedding_size) override;
+    void destroySchema() override;
+
+    // Collections (a memory_client holds a single collection)
+    std::string getCollection() const override;
+    std::vector<std::string> listCollections() override;
+    void createIndex(const rag_index_params& params) override;
+    void dropIndex() override;
+    void setSearchParams(int ef_search, int probes) override;
+
+    // Embedding model fingerprint
+    void setFingerprint(const embedding_fingerprint& fingerprint) override;
+    bool getFingerprint(embedding_fingerprint& fingerprint, bool shadow = false) override;
+
+    // Shadow re-embedding
+    void beginShadowMigration(const embedding_fingerprint& fingerprint) override;
+    std::vector<shadow_entry> fetchShadowBatch(int after_id, int max_entries) override;
+    void updateShadowEmbedding(int id, const std::vector<float>& embedding) override;
+    void promoteShadow() override;
+    void abortShadowMigration() override;
+
+    // Document management
+    document_entry createOrRetrieveDocument(
+        const std::string& date,
+        const std::string& version,
+        const std::string& content_type,
+        const std::string& url,
+        int length) override;
+
+    void deleteDocument(const std::string& document_id) override;
+
+    // RAG entry management
+    void insertRagEntry(const std::string& document_id_hash,
+                        const std::vector<float>& embedding,
+                        const std::vector<uint8_t>& contents,
+                        const ecc256_public_key& controller_public_key,
+                        const ecc256_private_key& recipient_private_key,
+                        bool use_shadow = false) override;
+
+    // Search
+    std::vector<nearest_result> searchNearest(const std::vector<float>& query_embedding, int n_retrievals, const additional_filtering_clause& filter_clause = nullptr, DistanceMetric distance_metric = DistanceMetric::COSINE, bool use_shadow = false) override;
+
+    // Same distances as the pgvector operators (<=>, <->, <#>)
+    static float distance(const std::vector<float>& a, const std::vector<float>& b, DistanceMetric metric);
+
+private:
+    struct entry {
+        int id;
+        std::string document_id;
+        std::vector<float> embedding;        // empty = NULL
+        std::vector<float> shadow_embedding; // empty = NULL
+        std::string hash;
+        int length;
+        ecc256_public_key controller_public_key;
+        ecc256_public_key encryption_public_key;
+    };
+
+    std::string collection_;
+    bool connected_ = false;
+    bool has_schema_ = false;
+    bool has_shadow_ = false;
+    size_t embedding_size_ = 0;
+    int next_id_ = 1;
+
+    std::vector<entry> entries_;
+    std::map<std::string, document_entry> documents_;
+    std::map<std::string, encryption_result> contents_;
+    std::map<std::string, embedding_fingerprint> fingerprints_; // "active" / "shadow"
+
+    mutable std::mutex mutex_;
+
+    void checkReady() const;
+};
+
+#endif // MEMORY_CLIENT_H
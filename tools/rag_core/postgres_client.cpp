@@ -17,6 +17,15 @@ std::string postgres_client::getDistanceOperator(DistanceMetric metric) {
         default: return "<->"; // Default to cosine
     }
 }
+std::string postgres_client::getOperatorClass(DistanceMetric metric) {
+    switch (metric) {
+        case DistanceMetric::COSINE: return "vector_cosine_ops";
+        case DistanceMetric::L2:     return "vector_l2_ops";
+        case DistanceMetric::IP:     return "vector_ip_ops";
+        default: return "vector_cosine_ops";
+    }
+}
+
 // Helper function to convert a float vector to a PostgreSQL array string
 std::string postgres_client::vectorToString(const std::vector<float>& vec) const {
     std::stringstream ss;
@@ -97,6 +106,20 @@ std::string postgres_client::computeSha256HexString(const std::vector<uint8_t>&
     return bytes_to_hex(hash.data(), hash.size());
 }
 
+std::string postgres_client::contentHashHex(const std::vector<uint8_t>& contents, const ecc256_private_key& recipient_private_key) {
+    static const std::string label = "rag content hash";
+    std::vector<uint8_t> mac_key_input(label.begin(), label.end());
+    mac_key_input.insert(mac_key_input.end(), recipient_private_key.begin(), recipient_private_key.end());
+    sha256_hash mac_key = CryptoUtils::computeSha256Bytes(mac_key_input);
+    OPENSSL_cleanse(mac_key_input.data(), mac_key_input.size());
+
+    std::vector<uint8_t> mac_key_bytes(mac_key.begin(), mac_key.end());
+    OPENSSL_cleanse(mac_key.data(), mac_key.size());
+    sha256_hash mac = CryptoUtils::computeHmacSha256(mac_key_bytes, contents);
+    OPENSSL_cleanse(mac_key_bytes.data(), mac_key_bytes.size());
+    return bytes_to_hex(mac.data(), mac.size());
+}
+
 
 postgres_client::postgres_client(const std::string& host,
                                 int port,
@@ -109,6 +132,7 @@ postgres_client::postgres_client(const std::string& host,
     : host_(host), port_(port), dbname_(dbname), user_(user),
       rag_table_name_(rag_table), rag_embedding_column_(rag_embedding_col),
       document_table_name_(doc_table), encrypted_content_table_name_(encrypted_content_table),
+      meta_table_name_(rag_table + "_meta"), shadow_embedding_column_(rag_embedding_col + "_shadow"),
       conn_(nullptr) {
 }
 
@@ -116,6 +140,38 @@ postgres_client::~postgres_client() {
     disconnect();
 }
 
+// Collection names end up in table names, so only plain lowercase identifiers are accepted
+bool postgres_client::is_valid_collection_name(const std::string& collection) {
+    if (collection.empty() || collection.size() > 32) {
+        return false;
+    }
+    if (collection[0] < 'a' || collection[0] > 'z') {
+        return false;
+    }
+    return std::all_of(collection.begin(), collection.end(), [](char c) {
+        return (c >= 'a' && c <= 'z') || (c >= '0' && c <= '9') || c == '_';
+    });
+}
+
+std::shared_ptr<postgres_client> postgres_client::for_collection(const std::string& host, int port, const std::string& dbname,
+                                                                 const std::string& collection) {
+    if (collection.empty() || collection == "default") {
+        return std::make_shared<postgres_client>(host, port, dbname);
+    }
+    if (!is_valid_collection_name(collection)) {
+        throw std::runtime_error("Invalid collection name '" + collection + "' (expected [a-z][a-z0-9_]*, at most 32 characters)");
+    }
+    auto client = std::make_shared<postgres_client>(host, port, dbname, "postgres",
+                                                    collection + "_rag_entries", "embedding",
+                                                    collection + "_documents", collection + "_encrypted_rag_contents");
+    client->collection_ = collection;
+    return client;
+}
+
+std::string postgres_client::getCollection() const {
+    return collection_.empty() ? "default" : collection_;
+}
+
 std::string postgres_client::connection_string(const std::string & host, int port, const std::string & dbname, const std::string & user, const std::string & password) const
 {
     std::stringstream conn_string;
@@ -131,6 +187,11 @@ std::string postgres_client::connection_string(const std::string & host, int por
     return conn_string.str();
 }
 void postgres_client::connect(const std::string& user, const std::string& password) {
+    // other credentials, or a connection the server has dropped, need a new session
+    if (conn_ != nullptr &&
+        ((!user.empty() && user != user_) || (!password.empty() && password != password_) || PQstatus(conn_) != CONNECTION_OK)) {
+        disconnect();
+    }
     if (conn_ == nullptr) {
         if(!user.empty())
             user_ = user;
@@ -148,6 +209,12 @@ void postgres_client::connect(const std::string& user, const std::string& passwo
         else if(conn_status == CONNECTION_OK)
         {
             std::cerr<<"connection to:"<<host_<<":"<<port_<<"/"<< dbname_<<" is OK"<<std::endl;
+            // a new session starts from the server defaults: apply the knobs set before connecting
+            const int ef_search = ef_search_;
+            const int probes = probes_;
+            ef_search_ = 0;
+            probes_ = 0;
+            setSearchParams(ef_search, probes);
         }
         else
         {
@@ -292,6 +359,7 @@ void postgres_client::createSchema(size_t embedding_size) {
     }
     PQclear(res_rag);
 
+    createMetaTable();
 }
 
 void postgres_client::destroySchema() {
@@ -299,6 +367,13 @@ void postgres_client::destroySchema() {
         throw std::runtime_error("Not connected to the database.");
     }
 
+    const std::string drop_meta_table = "DROP TABLE IF EXISTS " + meta_table_name_ + ";";
+    PGresult* res_meta = PQexec(conn_, drop_meta_table.c_str());
+    if (PQresultStatus(res_meta) != PGRES_COMMAND_OK) {
+        std::cerr << "Failed to drop schema metadata table: " << PQerrorMessage(conn_) << std::endl;
+    }
+    PQclear(res_meta);
+
     const std::string drop_rag_entries_table = "DROP TABLE IF EXISTS " + rag_table_name_ + ";";
     PGresult* res_rag = PQexec(conn_, drop_rag_entries_table.c_str());
     if (PQresultStatus(res_rag) != PGRES_COMMAND_OK) {
@@ -452,32 +527,22 @@ void postgres_client::deleteDocument(const std::string& document_id) {
     PQclear(res_delete);
 }
 
-encryption_result no_encryption(const std::vector<uint8_t>& contents)
-{
-    encryption_result res
-    {
-        contents,//ciphertext=cleartext
-        aes_gcm_tag(),
-        aes_gcm_nonce(),
-        ecc256_public_key()
-    };
-    return res;
-}
 void postgres_client::insertRagEntry(const std::string& document_id_hash,
                                     const std::vector<float>& embedding,
                                     const std::vector<uint8_t>& contents,
                                     const ecc256_public_key& controller_public_key,
-                                    const ecc256_private_key& recipient_private_key) { // Renamed for clarity
+                                    const ecc256_private_key& recipient_private_key, // Renamed for clarity
+                                    bool use_shadow) {
     if (!isConnected()) {
         throw std::runtime_error("Not connected to the database.");
     }
 
-    std::string content_hash_hex = computeSha256HexString(contents);
+    // dedup within the recipient only, see contentHashHex
+    std::string content_hash_hex = contentHashHex(contents, recipient_private_key);
 
-    // ECIES encryption using recipient's public key (derived from their private key)
+    // Envelope encryption: the document's data key, wrapped for the recipient's public key (derived from their private key)
     ecc256_public_key recipient_public_key = CryptoUtils::computePublicKey(recipient_private_key);
-    //encryption_result enc_result = EciesUtils::encrypt_ecies(contents, recipient_public_key); // Call EciesUtils
-    encryption_result enc_result = no_encryption(contents);
+    encryption_result enc_result = EciesUtils::encrypt_envelope(contents, document_id_hash, recipient_public_key);
 
     // Parameters for encrypted_content_table insertion
     const char* enc_param_values[5];
@@ -572,9 +637,12 @@ void postgres_client::insertRagEntry(const std::string& document_id_hash,
     rag_param_lengths[6] = 0;
     rag_param_formats[6] = 0;
 
+    // While a shadow migration is in progress, embeddings from the new model go to the shadow column
+    // (the active column is left NULL; those rows become searchable once the shadow is promoted)
+    const std::string& embedding_column = use_shadow ? shadow_embedding_column_ : rag_embedding_column_;
     PGresult* resRag = PQexecParams(conn_,
         ("INSERT INTO " + rag_table_name_ +
-         " (document_id, embedding, hash, loffset, length, controller_public_key, encryption_public_key)"
+         " (document_id, " + embedding_column + ", hash, loffset, length, controller_public_key, encryption_public_key)"
          " VALUES ($1, $2, $3, $4, $5, $6, $7)").c_str(),
         7, nullptr, rag_param_values, rag_param_lengths, rag_param_formats, 0);
 
@@ -587,28 +655,29 @@ void postgres_client::insertRagEntry(const std::string& document_id_hash,
 }
 
 std::vector<rag_database::nearest_result>
-postgres_client::searchNearest(const std::vector<float>& query_embedding, int n_retrievals, const additional_filtering_clause& filter_clause, DistanceMetric distance_metric ) {
+postgres_client::searchNearest(const std::vector<float>& query_embedding, int n_retrievals, const additional_filtering_clause& filter_clause, DistanceMetric distance_metric, bool use_shadow) {
     if (!isConnected()) {
         throw std::runtime_error("Not connected to the database.");
     }
 
-    std::string where_clause = "";
+    const std::string& embedding_column = use_shadow ? shadow_embedding_column_ : rag_embedding_column_;
+    std::string where_clause = " WHERE r." + embedding_column + " IS NOT NULL ";
     if (filter_clause) {
-        where_clause = " WHERE " + filter_clause("r", "d", "ec");
+        where_clause += " AND (" + filter_clause("r", "d", "ec") + ") ";
     }
     std::string distance_operator = getDistanceOperator(distance_metric);
     std::string query_vector_str = vectorToString(query_embedding);
     std::string query =
-        "SELECT r.document_id, r.embedding, r.hash, r.loffset, r.length, "
+        "SELECT r.document_id, r." + embedding_column + ", r.hash, r.loffset, r.length, "
         "       r.controller_public_key, r.encryption_public_key, " // encryption_public_key is recipient's public key
         "       d.date, d.version, d.content_type, d.url, d.length AS doc_length, "
         "       ec.encrypted_content, ec.tag, ec.nonce, ec.ephemeral_public_key " // Added ephemeral_public_key
-        "," + rag_embedding_column_ + " " + distance_operator + " '" + query_vector_str + "' as distance "
+        ", r." + embedding_column + " " + distance_operator + " '" + query_vector_str + "' as distance "
         "FROM " + rag_table_name_ + " r "
         "JOIN " + document_table_name_ + " d ON r.document_id = d.document_id "
         "JOIN " + encrypted_content_table_name_ + " ec ON r.hash = ec.hash "
         + where_clause +
-        "ORDER BY r." + rag_embedding_column_ + " " + distance_operator + " '" + query_vector_str + "' "
+        "ORDER BY r." + embedding_column + " " + distance_operator + " '" + query_vector_str + "' "
         "LIMIT " + std::to_string(n_retrievals) + ";";
 
     PGresult* res = PQexec(conn_, query.c_str());
@@ -722,3 +791,369 @@ postgres_client::searchNearest(const std::vector<float>& query_embedding, int n_
     PQclear(res);
     return results;
 }
+
+void postgres_client::execCommand(const std::string& query, const std::string& error_context) {
+    PGresult* res = PQexec(conn_, query.c_str());
+    if (PQresultStatus(res) != PGRES_COMMAND_OK) {
+        std::string errorMessage = error_context + ": " + std::string(PQerrorMessage(conn_));
+        PQclear(res);
+        throw std::runtime_error(errorMessage);
+    }
+    PQclear(res);
+}
+
+bool postgres_client::hasTable(const std::string& table_name) {
+    const char* param_values[1] = { table_name.c_str() };
+    PGresult* res = PQexecParams(conn_,
+        "SELECT EXISTS (SELECT 1 FROM pg_tables WHERE tablename = $1);",
+        1, nullptr, param_values, nullptr, nullptr, 0);
+    if (PQresultStatus(res) != PGRES_TUPLES_OK) {
+        std::string errorMessage = "Error checking for table " + table_name + ": " + std::string(PQerrorMessage(conn_));
+        PQclear(res);
+        throw std::runtime_error(errorMessage);
+    }
+    char* value = PQgetvalue(res, 0, 0);
+    bool exists = (value != nullptr && value[0] == 't');
+    PQclear(res);
+    return exists;
+}
+
+bool postgres_client::hasColumn(const std::string& table_name, const std::string& column_name) {
+    const char* param_values[2] = { table_name.c_str(), column_name.c_str() };
+    PGresult* res = PQexecParams(conn_,
+        "SELECT EXISTS (SELECT 1 FROM information_schema.columns WHERE table_name = $1 AND column_name = $2);",
+        2, nullptr, param_values, nullptr, nullptr, 0);
+    if (PQresultStatus(res) != PGRES_TUPLES_OK) {
+        std::string errorMessage = "Error checking for column " + table_name + "." + column_name + ": " + std::string(PQerrorMessage(conn_));
+        PQclear(res);
+        throw std::runtime_error(errorMessage);
+    }
+    char* value = PQgetvalue(res, 0, 0);
+    bool exists = (value != nullptr && value[0] == 't');
+    PQclear(res);
+    return exists;
+}
+
+// pgvector stores the dimension of a VECTOR(n) column in its type modifier
+int postgres_client::getEmbeddingColumnSize(const std::string& column_name) {
+    const char* param_values[2] = { rag_table_name_.c_str(), column_name.c_str() };
+    PGresult* res = PQexecParams(conn_,
+        "SELECT atttypmod FROM pg_attribute "
+        "WHERE attrelid = to_regclass($1) AND attname = $2 AND NOT attisdropped;",
+        2, nullptr, param_values, nullptr, nullptr, 0);
+    if (PQresultStatus(res) != PGRES_TUPLES_OK) {
+        std::string errorMessage = "Failed to read embedding column size: " + std::string(PQerrorMessage(conn_));
+        PQclear(res);
+        throw std::runtime_error(errorMessage);
+    }
+    int size = (PQntuples(res) > 0) ? std::atoi(PQgetvalue(res, 0, 0)) : 0;
+    PQclear(res);
+    return size > 0 ? size : 0;
+}
+
+void postgres_client::createMetaTable() {
+    const std::string create_meta_table =
+        "CREATE TABLE IF NOT EXISTS " + meta_table_name_ + " ("
+        "    role VARCHAR(16) PRIMARY KEY," // 'active' or 'shadow'
+        "    model_hash CHAR(" + std::to_string(sha256_hash{}.size() * 2) + "),"
+        "    model_desc TEXT,"
+        "    n_embd INTEGER,"
+        "    pooling INTEGER,"
+        "    normalize INTEGER,"
+        "    updated_at TIMESTAMP DEFAULT now()"
+        ");";
+    execCommand(create_meta_table, "Failed to create schema metadata table");
+}
+
+static void upsert_fingerprint(PGconn* conn, const std::string& meta_table, const std::string& role, const embedding_fingerprint& fingerprint) {
+    const std::string n_embd_str = std::to_string(fingerprint.n_embd);
+    const std::string pooling_str = std::to_string(fingerprint.pooling);
+    const std::string normalize_str = std::to_string(fingerprint.normalize);
+    const char* param_values[6] = {
+        role.c_str(),
+        fingerprint.model_hash.c_str(),
+        fingerprint.model_desc.c_str(),
+        n_embd_str.c_str(),
+        pooling_str.c_str(),
+        normalize_str.c_str()
+    };
+    PGresult* res = PQexecParams(conn,
+        ("INSERT INTO " + meta_table + " (role, model_hash, model_desc, n_embd, pooling, normalize)"
+         " VALUES ($1, $2, $3, $4, $5, $6)"
+         " ON CONFLICT (role) DO UPDATE SET model_hash = EXCLUDED.model_hash, model_desc = EXCLUDED.model_desc,"
+         " n_embd = EXCLUDED.n_embd, pooling = EXCLUDED.pooling, normalize = EXCLUDED.normalize, updated_at = now()").c_str(),
+        6, nullptr, param_values, nullptr, nullptr, 0);
+    if (PQresultStatus(res) != PGRES_COMMAND_OK) {
+        std::string errorMessage = "Failed to record " + role + " embedding fingerprint: " + std::string(PQerrorMessage(conn));
+        PQclear(res);
+        throw std::runtime_error(errorMessage);
+    }
+    PQclear(res);
+}
+
+void postgres_client::setFingerprint(const embedding_fingerprint& fingerprint) {
+    if (!isConnected()) {
+        throw std::runtime_error("Not connected to the database.");
+    }
+    int column_size = getEmbeddingColumnSize(rag_embedding_column_);
+    if (column_size != 0 && column_size != fingerprint.n_embd) {
+        throw std::runtime_error("Embedding size mismatch: column " + rag_table_name_ + "." + rag_embedding_column_ +
+                                 " has " + std::to_string(column_size) + " dimensions, model produces " + std::to_string(fingerprint.n_embd));
+    }
+    createMetaTable();
+    upsert_fingerprint(conn_, meta_table_name_, "active", fingerprint);
+}
+
+bool postgres_client::getFingerprint(embedding_fingerprint& fingerprint, bool shadow) {
+    if (!isConnected()) {
+        throw std::runtime_error("Not connected to the database.");
+    }
+    fingerprint = embedding_fingerprint();
+    if (hasTable(meta_table_name_)) {
+        const char* param_values[1] = { shadow ? "shadow" : "active" };
+        PGresult* res = PQexecParams(conn_,
+            ("SELECT model_hash, model_desc, n_embd, pooling, normalize FROM " + meta_table_name_ + " WHERE role = $1;").c_str(),
+            1, nullptr, param_values, nullptr, nullptr, 0);
+        if (PQresultStatus(res) != PGRES_TUPLES_OK) {
+            std::string errorMessage = "Failed to read embedding fingerprint: " + std::string(PQerrorMessage(conn_));
+            PQclear(res);
+            throw std::runtime_error(errorMessage);
+        }
+        if (PQntuples(res) > 0) {
+            fingerprint.model_hash = PQgetvalue(res, 0, 0);
+            fingerprint.model_desc = PQgetvalue(res, 0, 1);
+            fingerprint.n_embd = std::atoi(PQgetvalue(res, 0, 2));
+            fingerprint.pooling = std::atoi(PQgetvalue(res, 0, 3));
+            fingerprint.normalize = std::atoi(PQgetvalue(res, 0, 4));
+            PQclear(res);
+            return true;
+        }
+        PQclear(res);
+    }
+    if (!shadow) {
+        fingerprint.n_embd = getEmbeddingColumnSize(rag_embedding_column_);
+    }
+    return false;
+}
+
+void postgres_client::beginShadowMigration(const embedding_fingerprint& fingerprint) {
+    if (!isConnected()) {
+        throw std::runtime_error("Not connected to the database.");
+    }
+    if (fingerprint.n_embd <= 0) {
+        throw std::runtime_error("Invalid embedding size for shadow migration.");
+    }
+    createMetaTable();
+    execCommand("BEGIN;", "Failed to start shadow migration");
+    try {
+        // restarting a migration discards whatever the previous one had computed
+        execCommand("ALTER TABLE " + rag_table_name_ + " DROP COLUMN IF EXISTS " + shadow_embedding_column_ + ";",
+                    "Failed to drop previous shadow column");
+        execCommand("ALTER TABLE " + rag_table_name_ + " ADD COLUMN " + shadow_embedding_column_ +
+                    " VECTOR(" + std::to_string(fingerprint.n_embd) + ");",
+                    "Failed to add shadow column");
+        upsert_fingerprint(conn_, meta_table_name_, "shadow", fingerprint);
+        execCommand("COMMIT;", "Failed to commit shadow migration start");
+    } catch (const std::exception&) {
+        PQclear(PQexec(conn_, "ROLLBACK;"));
+        throw;
+    }
+}
+
+std::vector<shadow_entry> postgres_client::fetchShadowBatch(int after_id, int max_entries) {
+    if (!isConnected()) {
+        throw std::runtime_error("Not connected to the database.");
+    }
+    std::string query =
+        "SELECT r.id, ec.encrypted_content, ec.tag, ec.nonce, ec.ephemeral_public_key, r.encryption_public_key "
+        "FROM " + rag_table_name_ + " r "
+        "JOIN " + encrypted_content_table_name_ + " ec ON r.hash = ec.hash "
+        "WHERE r." + shadow_embedding_column_ + " IS NULL AND r.id > " + std::to_string(after_id) + " "
+        "ORDER BY r.id LIMIT " + std::to_string(max_entries) + ";";
+    PGresult* res = PQexec(conn_, query.c_str());
+    if (PQresultStatus(res) != PGRES_TUPLES_OK) {
+        std::string errorMessage = "Failed to fetch shadow migration batch: " + std::string(PQerrorMessage(conn_));
+        PQclear(res);
+        throw std::runtime_error(errorMessage);
+    }
+
+    std::vector<shadow_entry> entries;
+    int num_rows = PQntuples(res);
+    entries.reserve(num_rows);
+    for (int i = 0; i < num_rows; ++i) {
+        shadow_entry entry;
+        entry.id = std::stoi(PQgetvalue(res, i, 0));
+        // BYTEA comes back in text format as "\x<hex>"
+        std::string encrypted_content_hex = PQgetvalue(res, i, 1);
+        if (encrypted_content_hex.rfind("\\x", 0) == 0) {
+            encrypted_content_hex = encrypted_content_hex.substr(2);
+        }
+        entry.encrypted_content = hex_to_bytes(encrypted_content_hex);
+        entry.tag = hex_to_byte_array<std::tuple_size<aes_gcm_tag>::value>(PQgetvalue(res, i, 2), true);
+        entry.nonce = hex_to_byte_array<std::tuple_size<aes_gcm_nonce>::value>(PQgetvalue(res, i, 3), true);
+        entry.ephemeral_public_key = hex_to_byte_array<std::tuple_size<ecc256_public_key>::value>(PQgetvalue(res, i, 4), true);
+        entry.encryption_public_key = hex_to_byte_array<std::tuple_size<ecc256_public_key>::value>(PQgetvalue(res, i, 5), true);
+        entries.emplace_back(std::move(entry));
+    }
+    PQclear(res);
+    return entries;
+}
+
+void postgres_client::updateShadowEmbedding(int id, const std::vector<float>& embedding) {
+    if (!isConnected()) {
+        throw std::runtime_error("Not connected to the database.");
+    }
+    const std::string id_str = std::to_string(id);
+    const std::string embedding_str = vectorToString(embedding);
+    const char* param_values[2] = { embedding_str.c_str(), id_str.c_str() };
+    PGresult* res = PQexecParams(conn_,
+        ("UPDATE " + rag_table_name_ + " SET " + shadow_embedding_column_ + " = $1 WHERE id = $2;").c_str(),
+        2, nullptr, param_values, nullptr, nullptr, 0);
+    if (PQresultStatus(res) != PGRES_COMMAND_OK) {
+        std::string errorMessage = "Failed to update shadow embedding: " + std::string(PQerrorMessage(conn_));
+        PQclear(res);
+        throw std::runtime_error(errorMessage);
+    }
+    PQclear(res);
+}
+
+void postgres_client::promoteShadow() {
+    if (!isConnected()) {
+        throw std::runtime_error("Not connected to the database.");
+    }
+    execCommand("BEGIN;", "Failed to start shadow promotion");
+    try {
+        // block concurrent inserts so that no row can slip in without a shadow embedding
+        execCommand("LOCK TABLE " + rag_table_name_ + " IN SHARE ROW EXCLUSIVE MODE;", "Failed to lock rag table");
+        PGresult* res = PQexec(conn_,
+            ("SELECT count(*) FROM " + rag_table_name_ + " WHERE " + shadow_embedding_column_ + " IS NULL;").c_str());
+        if (PQresultStatus(res) != PGRES_TUPLES_OK) {
+            std::string errorMessage = "Failed to count pending shadow entries: " + std::string(PQerrorMessage(conn_));
+            PQclear(res);
+            throw std::runtime_error(errorMessage);
+        }
+        long pending = std::atol(PQgetvalue(res, 0, 0));
+        PQclear(res);
+        if (pending > 0) {
+            throw rag_shadow_pending_error(std::to_string(pending) + " rag entries still lack a shadow embedding");
+        }
+        // dropping the active column drops its index too: keep its definition to build it again on the promoted column
+        const std::string index_def = getIndexDefinition();
+        execCommand("ALTER TABLE " + rag_table_name_ + " DROP COLUMN " + rag_embedding_column_ + ";",
+                    "Failed to drop active embedding column");
+        execCommand("ALTER TABLE " + rag_table_name_ + " RENAME COLUMN " + shadow_embedding_column_ + " TO " + rag_embedding_column_ + ";",
+                    "Failed to rename shadow embedding column");
+        if (!index_def.empty()) {
+            execCommand(index_def + ";", "Failed to rebuild index on promoted embedding column");
+        }
+        execCommand("DELETE FROM " + meta_table_name_ + " WHERE role = 'active';", "Failed to retire active fingerprint");
+        execCommand("UPDATE " + meta_table_name_ + " SET role = 'active', updated_at = now() WHERE role = 'shadow';",
+                    "Failed to promote shadow fingerprint");
+        execCommand("COMMIT;", "Failed to commit shadow promotion");
+    } catch (const std::exception&) {
+        PQclear(PQexec(conn_, "ROLLBACK;"));
+        throw;
+    }
+}
+
+void postgres_client::abortShadowMigration() {
+    if (!isConnected()) {
+        throw std::runtime_error("Not connected to the database.");
+    }
+    execCommand("ALTER TABLE " + rag_table_name_ + " DROP COLUMN IF EXISTS " + shadow_embedding_column_ + ";",
+                "Failed to drop shadow column");
+    if (hasTable(meta_table_name_)) {
+        execCommand("DELETE FROM " + meta_table_name_ + " WHERE role = 'shadow';", "Failed to remove shadow fingerprint");
+    }
+}
+
+std::vector<std::string> postgres_client::listCollections() {
+    if (!isConnected()) {
+        throw std::runtime_error("Not connected to the database.");
+    }
+    PGresult* res = PQexec(conn_,
+        "SELECT tablename FROM pg_tables WHERE tablename = 'rag_entries' OR tablename LIKE '%\\_rag\\_entries' ORDER BY tablename;");
+    if (PQresultStatus(res) != PGRES_TUPLES_OK) {
+        std::string errorMessage = "Failed to list collections: " + std::string(PQerrorMessage(conn_));
+        PQclear(res);
+        throw std::runtime_error(errorMessage);
+    }
+    static const std::string suffix = "_rag_entries";
+    std::vector<std::string> collections;
+    for (int i = 0; i < PQntuples(res); ++i) {
+        std::string table_name = PQgetvalue(res, i, 0);
+        if (table_name == "rag_entries") {
+            collections.push_back("default");
+        } else {
+            collections.push_back(table_name.substr(0, table_name.size() - suffix.size()));
+        }
+    }
+    PQclear(res);
+    return collections;
+}
+
+void postgres_client::createIndex(const rag_index_params& params) {
+    if (!isConnected()) {
+        throw std::runtime_error("Not connected to the database.");
+    }
+    std::string with_clause;
+    if (params.type == "hnsw") {
+        with_clause = "WITH (m = " + std::to_string(params.m) + ", ef_construction = " + std::to_string(params.ef_construction) + ")";
+    } else if (params.type == "ivfflat") {
+        with_clause = "WITH (lists = " + std::to_string(params.lists) + ")";
+    } else {
+        throw std::runtime_error("Unsupported index type: " + params.type);
+    }
+    // one index per collection: replacing it lets a tenant retune without touching the others
+    const std::string index_name = indexName();
+    execCommand("DROP INDEX IF EXISTS " + index_name + ";", "Failed to drop previous index");
+    execCommand("CREATE INDEX " + index_name + " ON " + rag_table_name_ +
+                " USING " + params.type + " (" + rag_embedding_column_ + " " + getOperatorClass(params.metric) + ") " + with_clause + ";",
+                "Failed to create " + params.type + " index");
+}
+
+std::string postgres_client::indexName() const {
+    return rag_table_name_ + "_" + rag_embedding_column_ + "_idx";
+}
+
+std::string postgres_client::getIndexDefinition() {
+    if (!isConnected()) {
+        throw std::runtime_error("Not connected to the database.");
+    }
+    const std::string index_name = indexName();
+    const char* param_values[2] = { rag_table_name_.c_str(), index_name.c_str() };
+    PGresult* res = PQexecParams(conn_,
+        "SELECT indexdef FROM pg_indexes WHERE tablename = $1 AND indexname = $2;",
+        2, nullptr, param_values, nullptr, nullptr, 0);
+    if (PQresultStatus(res) != PGRES_TUPLES_OK) {
+        std::string errorMessage = "Failed to read index definition: " + std::string(PQerrorMessage(conn_));
+        PQclear(res);
+        throw std::runtime_error(errorMessage);
+    }
+    std::string index_def = PQntuples(res) > 0 ? PQgetvalue(res, 0, 0) : "";
+    PQclear(res);
+    return index_def;
+}
+
+void postgres_client::dropIndex() {
+    if (!isConnected()) {
+        throw std::runtime_error("Not connected to the database.");
+    }
+    execCommand("DROP INDEX IF EXISTS " + indexName() + ";", "Failed to drop index");
+}
+
+// session settings, sent once rather than with every search; 0 goes back to the server default
+void postgres_client::setSearchParams(int ef_search, int probes) {
+    if (isConnected()) {
+        if (ef_search != ef_search_) {
+            execCommand(ef_search > 0 ? "SET hnsw.ef_search = " + std::to_string(ef_search) + ";" : std::string("RESET hnsw.ef_search;"),
+                        "Failed to set hnsw.ef_search");
+        }
+        if (probes != probes_) {
+            execCommand(probes > 0 ? "SET ivfflat.probes = " + std::to_string(probes) + ";" : std::string("RESET ivfflat.probes;"),
+                        "Failed to set ivfflat.probes");
+        }
+    }
+    ef_search_ = ef_search;
+    probes_ = probes;
+}
@@ -7,6 +7,7 @@
 #include <array>
 #include <tuple> // For std::tuple in searchNearest
 #include <vector> // For std::vector<uint8_t> parameters
+#include <memory>
 
 #include "crypto_utils.h" // Include the refactored crypto utilities
 #include "ecies_utils.h"  // Include the new ECIES utilities
@@ -29,6 +30,12 @@ public:
                     const std::string& encrypted_content_table = "encrypted_rag_contents");
     ~postgres_client();
 
+    // Client bound to the tables of a named collection ("" or "default" is the unprefixed legacy set).
+    // Throws std::runtime_error if the name is not a plain SQL identifier.
+    static std::shared_ptr<postgres_client> for_collection(const std::string& host, int port, const std::string& dbname,
+                                                           const std::string& collection);
+    static bool is_valid_collection_name(const std::string& collection);
+
     void connect(const std::string& user = "", const std::string& password = "") override;
     void setUser(const std::string& user) override;
     void setPassword(const std::string& password) override;
@@ -44,6 +51,26 @@ public:
     void createSchema(size_t embedding_size) override;
     void destroySchema() override;
 
+    // Collections
+    std::string getCollection() const override;
+    std::vector<std::string> listCollections() override;
+    void createIndex(const rag_index_params& params) override;
+    void dropIndex() override;
+    void setSearchParams(int ef_search, int probes) override;
+    // CREATE INDEX statement of the index built by createIndex(), "" if there is none
+    std::string getIndexDefinition();
+
+    // Embedding model fingerprint
+    void setFingerprint(const embedding_fingerprint& fingerprint) override;
+    bool getFingerprint(embedding_fingerprint& fingerprint, bool shadow = false) override;
+
+    // Shadow re-embedding
+    void beginShadowMigration(const embedding_fingerprint& fingerprint) override;
+    std::vector<shadow_entry> fetchShadowBatch(int after_id, int max_entries) override;
+    void updateShadowEmbedding(int id, const std::vector<float>& embedding) override;
+    void promoteShadow() override;
+    void abortShadowMigration() override;
+
     // Document management
     document_entry createOrRetrieveDocument(
         const std::string& date,
@@ -59,12 +86,13 @@ public:
                         const std::vector<float>& embedding,
                         const std::vector<uint8_t>& contents, // Changed to vector<uint8_t> for raw bytes
                         const ecc256_public_key& controller_public_key, // Changed to ecc256_public_key
-                        const ecc256_private_key& recipient_private_key) override; // Changed to ecc256_private_key for decryption
+                        const ecc256_private_key& recipient_private_key, // Changed to ecc256_private_key for decryption
+                        bool use_shadow = false) override;
 
     // Search
     // The tuple return type is updated to reflect the new column types and order,
     // especially for the crypto-related fields.
-    std::vector<nearest_result> searchNearest(const std::vector<float>& query_embedding, int n_retrievals, const additional_filtering_clause& filter_clause = nullptr, DistanceMetric distance_metric = DistanceMetric::COSINE ) override;
+    std::vector<nearest_result> searchNearest(const std::vector<float>& query_embedding, int n_retrievals, const additional_filtering_clause& filter_clause = nullptr, DistanceMetric distance_metric = DistanceMetric::COSINE, bool use_shadow = false) override;
 
 
     // Crypto functions - now using CryptoUtils
@@ -82,11 +110,24 @@ private:
     std::string rag_embedding_column_;
     std::string document_table_name_;
     std::string encrypted_content_table_name_;
+    std::string meta_table_name_;
+    std::string shadow_embedding_column_;
+    std::string collection_;
+    int ef_search_ = 0;
+    int probes_ = 0;
     PGconn* conn_;
 
+    void execCommand(const std::string& query, const std::string& error_context);
+    std::string indexName() const;
+    void createMetaTable();
+    bool hasTable(const std::string& table_name);
+    bool hasColumn(const std::string& table_name, const std::string& column_name);
+    int getEmbeddingColumnSize(const std::string& column_name);
+
     std::string connection_string(const std::string& host, int port, const std::string& dbname,
                                   const std::string& user, const std::string& password) const;
     static std::string getDistanceOperator(DistanceMetric metric);
+    static std::string getOperatorClass(DistanceMetric metric);
     std::string vectorToString(const std::vector<float>& vec) const;
     std::vector<float> stringToVector(const std::string& str) const; // Helper to parse vector string
 
@@ -109,6 +150,11 @@ public:
     // Helper to convert bytes to hex string (needed for DB insertion/retrieval and display)
     static std::string bytes_to_hex(const std::vector<uint8_t>& bytes);
     static std::string bytes_to_hex(const uint8_t* bytes, size_t len);
+
+    // Key of the encrypted content table: HMAC-SHA256 of the content under a key derived from the recipient's private
+    // key. Equal contents share a row only when they are sealed for the same recipient, and the key tells nothing about
+    // the content, nor whether two recipients hold the same one, to whoever cannot decrypt it.
+    static std::string contentHashHex(const std::vector<uint8_t>& contents, const ecc256_private_key& recipient_private_key);
 };
 
 #endif // POSTGRES_CLIENT_H
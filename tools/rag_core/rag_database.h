@@ -5,6 +5,7 @@
 #include <vector>
 #include <tuple>
 #include <memory>
+#include <stdexcept>
 
 #include "common.h" // Assuming this provides llama_tokens and nlohmann::json
 #include "utils.hpp" // Assuming this provides general utilities
@@ -50,6 +51,41 @@ struct document_entry {
           content_type(std::move(ct)), url(std::move(u)), length(l) {}
 };
 
+// Identity of the embedding model that produced the vectors stored in a RAG table.
+// Vectors from two models are not comparable, even when n_embd happens to match.
+struct embedding_fingerprint {
+    std::string model_hash;  // SHA256 hex string identifying the model
+    std::string model_desc;  // human readable description (not compared)
+    int n_embd = 0;
+    int pooling = -1;        // llama_pooling_type
+    int normalize = -1;      // embd_normalize norm (-1 = none, 2 = euclidean, ...)
+
+    bool matches(const embedding_fingerprint& other) const {
+        return model_hash == other.model_hash && n_embd == other.n_embd &&
+               pooling == other.pooling && normalize == other.normalize;
+    }
+
+    inline json to_json() const {
+        return json {
+            {"model_hash", model_hash},
+            {"model_desc", model_desc},
+            {"n_embd",     n_embd},
+            {"pooling",    pooling},
+            {"normalize",  normalize},
+        };
+    }
+};
+
+// A RAG entry still waiting to be re-embedded by a shadow migration
+struct shadow_entry {
+    int id = 0;
+    std::vector<uint8_t> encrypted_content;
+    aes_gcm_tag tag;
+    aes_gcm_nonce nonce;
+    ecc256_public_key ephemeral_public_key;
+    ecc256_public_key encryption_public_key;
+};
+
 // Enum for distance metrics
 enum class DistanceMetric {
     COSINE, // <-> operator
@@ -57,6 +93,21 @@ enum class DistanceMetric {
     IP      // <%> operator (Inner Product - usually 1 - cosine_similarity for normalized vectors, or negative dot product)
 };
 
+// Approximate nearest neighbour index on the embedding column of a collection (pgvector)
+struct rag_index_params {
+    std::string type = "hnsw";   // "hnsw" or "ivfflat"
+    DistanceMetric metric = DistanceMetric::COSINE;
+    int m = 16;                  // hnsw: max connections per layer
+    int ef_construction = 64;    // hnsw: candidate list size at build time
+    int lists = 100;             // ivfflat: number of inverted lists
+};
+
+// Thrown by promoteShadow() when rows were inserted without a shadow embedding since the last scan:
+// the migration has to go over the table again, any other error is final
+struct rag_shadow_pending_error : public std::runtime_error {
+    using std::runtime_error::runtime_error;
+};
+
 using additional_filtering_clause = std::function<std::string(const std::string& r_alias, const std::string& d_alias, const std::string& ec_alias)>;
 
 class rag_database {
@@ -70,9 +121,32 @@ public:
     virtual void createSchema(size_t embedding_size) = 0;
     virtual bool hasSchema() = 0;
     virtual void destroySchema() = 0;
+
+    // Collections: each collection owns its own set of tables (and therefore its own index and dimension)
+    virtual std::string getCollection() const = 0;
+    virtual std::vector<std::string> listCollections() = 0;
+    virtual void createIndex(const rag_index_params& params) = 0;
+    virtual void dropIndex() = 0;
+    // Query-time index knobs (0 is the server default): hnsw.ef_search, ivfflat.probes
+    // They are settings of this client's session, which must not be shared between requests.
+    virtual void setSearchParams(int ef_search, int probes) = 0;
     virtual void setUser(const std::string& user) = 0;
     virtual void setPassword(const std::string& password) = 0;
 
+    // Embedding model fingerprint (metadata table)
+    // getFingerprint returns false when no fingerprint has been recorded for the requested role; for the
+    // active role, n_embd is still filled from the vector column so legacy schemas can be dimension-checked.
+    virtual void setFingerprint(const embedding_fingerprint& fingerprint) = 0;
+    virtual bool getFingerprint(embedding_fingerprint& fingerprint, bool shadow = false) = 0;
+
+    // Shadow re-embedding: a second vector column is filled in the background with the new model's
+    // embeddings while searches keep using the active column, then both are swapped atomically.
+    virtual void beginShadowMigration(const embedding_fingerprint& fingerprint) = 0;
+    virtual std::vector<shadow_entry> fetchShadowBatch(int after_id, int max_entries) = 0;
+    virtual void updateShadowEmbedding(int id, const std::vector<float>& embedding) = 0;
+    virtual void promoteShadow() = 0;
+    virtual void abortShadowMigration() = 0;
+
     virtual std::string get_host_name() const = 0;
     virtual int get_port() const = 0;
     virtual std::string get_name() const = 0;
@@ -92,7 +166,8 @@ public:
                                 const std::vector<float>& embedding,
                                 const std::vector<uint8_t>& contents, // Raw binary content
                                 const ecc256_public_key& controller_public_key, // Controller's public key
-                                const ecc256_private_key& recipient_private_key) = 0; // Recipient's private key for ECIES
+                                const ecc256_private_key& recipient_private_key, // Recipient's private key for ECIES
+                                bool use_shadow = false) = 0; // Store the embedding in the shadow column (migration in progress)
 
     // Updated return tuple to match postgres_client's search results
     // (document_id, embedding, hash, offset, length, controller_public_key, encryption_public_key (recipient's),
@@ -106,7 +181,7 @@ public:
                            float //distance
                            >;
     virtual std::vector<nearest_result>
-    searchNearest(const std::vector<float>& query_embedding, int n_retrievals, const additional_filtering_clause& filter_clause = nullptr, DistanceMetric distance_metric = DistanceMetric::COSINE) = 0;
+    searchNearest(const std::vector<float>& query_embedding, int n_retrievals, const additional_filtering_clause& filter_clause = nullptr, DistanceMetric distance_metric = DistanceMetric::COSINE, bool use_shadow = false) = 0;
 
     // // Search methods below also need their return types updated to match searchNearest
     // virtual std::vector<nearest_result>
@@ -122,6 +197,9 @@ public:
     // searchByControllerKeyAndDocumentDateRange(const std::string& controller_key, const std::string& start_date, const std::string& end_date) = 0;
 };
 
-std::shared_ptr<rag_database> create_rag_database(const std::string& host_name = "localhost", int port = 5432, const std::string& db_name = "klave_rag");
+// Connected client checked out of a pool for the caller's exclusive use; it returns to the pool when released.
+// Throws std::runtime_error if the connection fails.
+std::shared_ptr<rag_database> create_rag_database(const std::string& host_name, int port, const std::string& db_name,
+                                                  const std::string& collection, const std::string& user, const std::string& password);
 
 #endif // RAG_DATABASE_H
@@ -3,6 +3,8 @@
 #include "crypto_utils.h"
 #include "ecies_utils.h"
 #include "postgres_client.h" // <--- NEW: Include your PostgreSQL client header
+#include "memory_client.h"
+#include "data_key_cache.h"
 #include "rag_database.h"    // <--- NEW: Include the rag_database interface
 
 #include <iostream>
@@ -15,11 +17,15 @@
 #include <algorithm> // For std::equal, std::fill
 #include <tuple> // For std::tuple in search results
 #include <limits> // For numeric_limits (float comparison)
+#include <atomic>
+#include <thread>
 
 
 std::shared_ptr<postgres_client> rag_db_ = nullptr;
-std::shared_ptr<rag_database> create_rag_database(const std::string& host_name, int port, const std::string& db_name)
+std::shared_ptr<rag_database> create_rag_database(const std::string& host_name, int port, const std::string& db_name, const std::string& collection = "")
 {
+    if(!collection.empty())
+        return postgres_client::for_collection(host_name, port, db_name, collection);
     if(!rag_db_)
         return rag_db_ = std::make_shared<postgres_client>(host_name, port, db_name);
     if((rag_db_->get_host_name() == host_name) && (rag_db_->get_port() == port) && (rag_db_->get_name() == db_name))
@@ -290,6 +296,152 @@ static bool test_aes256GcmEncrypt_Decrypt_consistency() {
     TEST_SUCCESS("aes256GcmEncrypt_Decrypt_consistency");
 }
 
+static std::vector<uint8_t> generate_random_bytes(size_t size); // defined with the DB helpers
+
+static bool test_aes256Gcm_context_reuse() {
+    // the per-thread context keeps the key schedule between calls: alternate keys, and use several threads
+    aes256_key key_a = CryptoUtils::computeSha256Bytes({1});
+    aes256_key key_b = CryptoUtils::computeSha256Bytes({2});
+    std::vector<uint8_t> aad = {9, 8, 7};
+    std::vector<std::vector<uint8_t>> plaintexts;
+    std::vector<aes_gcm_nonce> nonces;
+    std::vector<std::vector<uint8_t>> ciphertexts;
+    std::vector<aes_gcm_tag> tags;
+    for (int i = 0; i < 8; ++i) {
+        plaintexts.push_back(generate_random_bytes(100 + i));
+        nonces.push_back(CryptoUtils::generateNonce());
+        std::vector<uint8_t> ciphertext;
+        aes_gcm_tag tag;
+        CryptoUtils::aes256GcmEncrypt(plaintexts[i], i % 2 ? key_b : key_a, nonces[i], aad, ciphertext, tag);
+        ciphertexts.push_back(ciphertext);
+        tags.push_back(tag);
+    }
+
+    std::atomic<int> failures{0};
+    std::vector<std::thread> threads;
+    for (int t = 0; t < 4; ++t) {
+        threads.emplace_back([&]() {
+            for (int round = 0; round < 50; ++round) {
+                for (size_t i = 0; i < plaintexts.size(); ++i) {
+                    std::vector<uint8_t> decrypted;
+                    if (!CryptoUtils::aes256GcmDecrypt(ciphertexts[i], tags[i], i % 2 ? key_b : key_a, nonces[i], aad, decrypted) || decrypted != plaintexts[i]) {
+                        failures++;
+                    }
+                    // the wrong key must still fail, and must not break the next call
+                    if (CryptoUtils::aes256GcmDecrypt(ciphertexts[i], tags[i], i % 2 ? key_a : key_b, nonces[i], aad, decrypted)) {
+                        failures++;
+                    }
+                }
+            }
+        });
+    }
+    for (auto& thread : threads) {
+        thread.join();
+    }
+    TEST_ASSERT(failures == 0, "Decryption should succeed with the right key and fail with the wrong one, on every thread.");
+
+    // the batch path produces the same output as the single one
+    std::vector<std::vector<uint8_t>> batch_ciphertexts;
+    std::vector<aes_gcm_tag> batch_tags;
+    CryptoUtils::aes256GcmEncryptBatch(plaintexts, key_a, nonces, aad, batch_ciphertexts, batch_tags);
+    for (size_t i = 0; i < plaintexts.size(); i += 2) {
+        TEST_ASSERT(batch_ciphertexts[i] == ciphertexts[i] && batch_tags[i] == tags[i], "Batch encryption should match single encryption.");
+    }
+    std::vector<std::vector<uint8_t>> batch_plaintexts;
+    TEST_ASSERT(CryptoUtils::aes256GcmDecryptBatch(batch_ciphertexts, batch_tags, key_a, nonces, aad, batch_plaintexts), "Batch decryption should succeed.");
+    TEST_ASSERT(batch_plaintexts == plaintexts, "Batch decryption should return the plaintexts.");
+    batch_tags[3][0] ^= 1;
+    TEST_ASSERT(!CryptoUtils::aes256GcmDecryptBatch(batch_ciphertexts, batch_tags, key_a, nonces, aad, batch_plaintexts), "Batch decryption should report a modified tag.");
+    TEST_ASSERT(batch_plaintexts[3].empty() && batch_plaintexts[4] == plaintexts[4], "Only the modified entry should be rejected.");
+    TEST_SUCCESS("aes256Gcm_context_reuse");
+}
+
+// Throughput of the crypto primitives used on the RAG paths, against a context built for every call
+static bool test_crypto_throughput() {
+    using clock = std::chrono::steady_clock;
+    auto per_second = [](int n, clock::duration d) {
+        return n / std::max(1e-9, std::chrono::duration<double>(d).count());
+    };
+
+    const int n_chunks = 2000;
+    const size_t chunk_size = 4096;
+    aes256_key key = CryptoUtils::computeSha256Bytes({42});
+    std::vector<uint8_t> aad = {1, 2, 3, 4};
+    std::vector<std::vector<uint8_t>> plaintexts(n_chunks, generate_random_bytes(chunk_size));
+    std::vector<aes_gcm_nonce> nonces(n_chunks);
+    for (auto& nonce : nonces) {
+        nonce = CryptoUtils::generateNonce();
+    }
+
+    // baseline: a new cipher context (and implicit cipher fetch) for every chunk
+    std::vector<uint8_t> ciphertext(chunk_size);
+    aes_gcm_tag tag;
+    auto t0 = clock::now();
+    for (int i = 0; i < n_chunks; ++i) {
+        std::unique_ptr<EVP_CIPHER_CTX, EVP_CIPHER_CTX_Deleter> ctx(EVP_CIPHER_CTX_new());
+        int len;
+        EVP_EncryptInit_ex(ctx.get(), EVP_aes_256_gcm(), nullptr, nullptr, nullptr);
+        EVP_EncryptInit_ex(ctx.get(), nullptr, nullptr, key.data(), nonces[i].data());
+        EVP_EncryptUpdate(ctx.get(), nullptr, &len, aad.data(), aad.size());
+        EVP_EncryptUpdate(ctx.get(), ciphertext.data(), &len, plaintexts[i].data(), chunk_size);
+        EVP_EncryptFinal_ex(ctx.get(), ciphertext.data() + len, &len);
+        EVP_CIPHER_CTX_ctrl(ctx.get(), EVP_CTRL_GCM_GET_TAG, tag.size(), tag.data());
+    }
+    auto t_baseline = clock::now() - t0;
+
+    t0 = clock::now();
+    for (int i = 0; i < n_chunks; ++i) {
+        CryptoUtils::aes256GcmEncrypt(plaintexts[i], key, nonces[i], aad, ciphertext, tag);
+    }
+    auto t_single = clock::now() - t0;
+
+    // the outputs of a batch are all kept: allocate them before timing
+    std::vector<std::vector<uint8_t>> ciphertexts(n_chunks, std::vector<uint8_t>(chunk_size));
+    std::vector<aes_gcm_tag> tags(n_chunks);
+    t0 = clock::now();
+    CryptoUtils::aes256GcmEncryptBatch(plaintexts, key, nonces, aad, ciphertexts, tags);
+    auto t_batch = clock::now() - t0;
+    TEST_ASSERT(ciphertexts.back() == ciphertext && tags.back() == tag, "Batch encryption should match single encryption.");
+
+    std::vector<std::vector<uint8_t>> decrypted(n_chunks, std::vector<uint8_t>(chunk_size));
+    t0 = clock::now();
+    TEST_ASSERT(CryptoUtils::aes256GcmDecryptBatch(ciphertexts, tags, key, nonces, aad, decrypted), "Batch decryption should succeed.");
+    auto t_decrypt = clock::now() - t0;
+    TEST_ASSERT(decrypted == plaintexts, "Batch decryption should return the plaintexts.");
+
+    const double mb = double(n_chunks) * chunk_size / (1024.0 * 1024.0);
+    TEST_LOG_RAW("AES-256-GCM %zu B chunks: new context %.0f chunks/s, reused context %.0f chunks/s, batch %.0f chunks/s (%.1f MB/s), batch decrypt %.0f chunks/s",
+                 chunk_size, per_second(n_chunks, t_baseline), per_second(n_chunks, t_single), per_second(n_chunks, t_batch),
+                 mb / std::chrono::duration<double>(t_batch).count(), per_second(n_chunks, t_decrypt));
+
+    const int n_keys = 200;
+    std::vector<ecc256_private_key> private_keys(n_keys);
+    t0 = clock::now();
+    for (auto& private_key : private_keys) {
+        private_key = CryptoUtils::generatePrivateKey();
+    }
+    auto t_generate = clock::now() - t0;
+
+    std::vector<ecc256_public_key> public_keys(n_keys);
+    t0 = clock::now();
+    for (int i = 0; i < n_keys; ++i) {
+        public_keys[i] = CryptoUtils::computePublicKey(private_keys[i]);
+    }
+    auto t_public = clock::now() - t0;
+
+    t0 = clock::now();
+    for (int i = 0; i < n_keys; ++i) {
+        sha256_hash ab = CryptoUtils::computeEcdhSharedSecretSha256(private_keys[i], public_keys[(i + 1) % n_keys]);
+        sha256_hash ba = CryptoUtils::computeEcdhSharedSecretSha256(private_keys[(i + 1) % n_keys], public_keys[i]);
+        TEST_ASSERT(ab == ba, "ECDH should agree on both sides.");
+    }
+    auto t_ecdh = clock::now() - t0;
+
+    TEST_LOG_RAW("secp256r1: generatePrivateKey %.0f/s, computePublicKey %.0f/s, computeEcdhSharedSecretSha256 %.0f/s",
+                 per_second(n_keys, t_generate), per_second(n_keys, t_public), per_second(2 * n_keys, t_ecdh));
+    TEST_SUCCESS("crypto_throughput");
+}
+
 // =========================================================================
 // ECIES Tests
 // =========================================================================
@@ -366,6 +518,80 @@ static bool test_ecies_encrypt_decrypt_consistency() {
     TEST_SUCCESS("ecies_encrypt_decrypt_consistency");
 }
 
+static bool test_envelope_encryption() {
+    ecc256_private_key recipient_sk = CryptoUtils::generatePrivateKey();
+    ecc256_public_key recipient_pk = CryptoUtils::computePublicKey(recipient_sk);
+    std::vector<uint8_t> chunk_1 = {'c', 'h', 'u', 'n', 'k', ' ', '1'};
+    std::vector<uint8_t> chunk_2 = {'c', 'h', 'u', 'n', 'k', ' ', '2'};
+
+    // the chunks of a document share the wrapped data key, not the nonce
+    encryption_result enc_1 = EciesUtils::encrypt_envelope(chunk_1, "doc_a", recipient_pk);
+    encryption_result enc_2 = EciesUtils::encrypt_envelope(chunk_2, "doc_a", recipient_pk);
+    encryption_result enc_other = EciesUtils::encrypt_envelope(chunk_1, "doc_b", recipient_pk);
+    TEST_ASSERT(enc_1.ephemeral_public_key == enc_2.ephemeral_public_key, "Chunks of a document should share the ephemeral public key.");
+    TEST_ASSERT(enc_1.nonce != enc_2.nonce, "Chunks of a document should not share the nonce.");
+    TEST_ASSERT(enc_1.ephemeral_public_key != enc_other.ephemeral_public_key, "Documents should not share data keys.");
+    TEST_ASSERT(enc_1.ciphertext != chunk_1, "Contents should be encrypted.");
+
+    // the envelope format is the ECIES one, and decrypts without the cache too
+    data_key_cache::get().clear();
+    TEST_ASSERT(EciesUtils::decrypt_ecies(enc_1.ciphertext, enc_1.tag, enc_1.nonce, enc_1.ephemeral_public_key, recipient_sk) == chunk_1,
+                "Envelope encrypted chunk should decrypt.");
+    TEST_ASSERT(EciesUtils::decrypt_ecies(enc_2.ciphertext, enc_2.tag, enc_2.nonce, enc_2.ephemeral_public_key, recipient_sk) == chunk_2,
+                "Second chunk should decrypt with the cached data key.");
+    TEST_ASSERT(data_key_cache::get().size() == 1, "The chunks of a document should need a single unwrapped data key.");
+
+    // a cached data key is not handed out to another recipient
+    ecc256_private_key other_sk = CryptoUtils::generatePrivateKey();
+    TEST_ASSERT(EciesUtils::decrypt_ecies(enc_1.ciphertext, enc_1.tag, enc_1.nonce, enc_1.ephemeral_public_key, other_sk).empty(),
+                "Another recipient should not decrypt the chunk.");
+
+    // expired keys are replaced
+    data_key_cache short_lived(std::chrono::seconds(0));
+    auto key_1 = short_lived.sealingKey("doc_a", recipient_pk);
+    auto key_2 = short_lived.sealingKey("doc_a", recipient_pk);
+    TEST_ASSERT(key_1.ephemeral_public_key != key_2.ephemeral_public_key, "An expired data key should not be reused.");
+    TEST_ASSERT(short_lived.hits() == 0 && short_lived.misses() == 2, "Expired data keys should count as misses.");
+    TEST_ASSERT(*short_lived.openingKey(key_1.ephemeral_public_key, recipient_sk) == *key_1.key, "The recipient should unwrap the data key.");
+
+    // the cache is bounded
+    data_key_cache small(std::chrono::seconds(60), 2);
+    for (int i = 0; i < 5; ++i) {
+        small.sealingKey("doc_" + std::to_string(i), recipient_pk);
+    }
+    TEST_ASSERT(small.size() == 2, "The cache should not grow beyond its capacity.");
+    small.sealingKey("doc_4", recipient_pk);
+    TEST_ASSERT(small.hits() == 1 && small.misses() == 5, "A live data key should count as a hit.");
+    TEST_SUCCESS("envelope_encryption");
+}
+
+static bool test_ecies_decrypt_into_arena() {
+    ecc256_private_key recipient_sk = CryptoUtils::generatePrivateKey();
+    ecc256_public_key recipient_pk = CryptoUtils::computePublicKey(recipient_sk);
+    std::vector<uint8_t> chunk_1 = {'f', 'i', 'r', 's', 't'};
+    std::vector<uint8_t> chunk_2 = {'s', 'e', 'c', 'o', 'n', 'd', ' ', 'c', 'h', 'u', 'n', 'k'};
+    encryption_result enc_1 = EciesUtils::encrypt_envelope(chunk_1, "doc_arena", recipient_pk);
+    encryption_result enc_2 = EciesUtils::encrypt_ecies(chunk_2, recipient_pk);
+
+    // the chunks are decrypted back to back in one buffer
+    std::vector<uint8_t> arena(chunk_1.size() + chunk_2.size(), 0xAA);
+    TEST_ASSERT(EciesUtils::decrypt_ecies_into(enc_1.ciphertext, enc_1.tag, enc_1.nonce, enc_1.ephemeral_public_key, recipient_sk, arena.data()),
+                "First chunk should decrypt into the arena.");
+    TEST_ASSERT(EciesUtils::decrypt_ecies_into(enc_2.ciphertext, enc_2.tag, enc_2.nonce, enc_2.ephemeral_public_key, recipient_sk, arena.data() + chunk_1.size()),
+                "Second chunk should decrypt into the arena.");
+    TEST_ASSERT(std::equal(chunk_1.begin(), chunk_1.end(), arena.begin()), "First chunk should be at the start of the arena.");
+    TEST_ASSERT(std::equal(chunk_2.begin(), chunk_2.end(), arena.begin() + chunk_1.size()), "Second chunk should follow the first one.");
+
+    // a chunk that does not verify leaves no plaintext behind, and does not touch its neighbours
+    aes_gcm_tag bad_tag = enc_2.tag;
+    bad_tag[0] ^= 0x01;
+    TEST_ASSERT(!EciesUtils::decrypt_ecies_into(enc_2.ciphertext, bad_tag, enc_2.nonce, enc_2.ephemeral_public_key, recipient_sk, arena.data() + chunk_1.size()),
+                "Tampered chunk should not decrypt.");
+    TEST_ASSERT(std::all_of(arena.begin() + chunk_1.size(), arena.end(), [](uint8_t b) { return b == 0; }), "Tampered chunk should be wiped.");
+    TEST_ASSERT(std::equal(chunk_1.begin(), chunk_1.end(), arena.begin()), "First chunk should be left as is.");
+    TEST_SUCCESS("ecies_decrypt_into_arena");
+}
+
 
 // =========================================================================
 // PostgreSQL Client (rag_database implementation) Tests
@@ -920,6 +1146,242 @@ bool test_db_search_nearest() {
     TEST_SUCCESS("DB: searchNearest");
     return true;
 }
+
+static bool test_db_fingerprint_and_shadow_migration() {
+    TEST_LOG_RAW("Testing DB: embedding fingerprint and shadow migration...");
+    std::shared_ptr<rag_database> db = create_rag_database("localhost",5432,"klave_rag");
+    clean_db_schema(db); // Start from a schema without fingerprint
+    if (!ensure_schema_exists(db)) return false;
+
+    try {
+        db->connect(PG_USER, PG_PASSWORD);
+
+        // 1. Fingerprint of the model that builds the table
+        embedding_fingerprint old_model;
+        old_model.model_hash = std::string(64, 'a');
+        old_model.model_desc = "old model";
+        old_model.n_embd = EMBEDDING_SIZE;
+        old_model.pooling = 0;
+        old_model.normalize = -1;
+
+        embedding_fingerprint read_back;
+        TEST_ASSERT(!db->getFingerprint(read_back), "No fingerprint should be recorded on a fresh schema.");
+        TEST_ASSERT(read_back.n_embd == (int)EMBEDDING_SIZE, "Legacy lookup should report the vector column size.");
+
+        embedding_fingerprint wrong_size = old_model;
+        wrong_size.n_embd = EMBEDDING_SIZE / 2;
+        bool threw = false;
+        try {
+            db->setFingerprint(wrong_size);
+        } catch (const std::runtime_error&) {
+            threw = true;
+        }
+        TEST_ASSERT(threw, "Recording a fingerprint with the wrong n_embd should fail.");
+
+        db->setFingerprint(old_model);
+        TEST_ASSERT(db->getFingerprint(read_back), "Active fingerprint should be recorded.");
+        TEST_ASSERT(read_back.matches(old_model), "Active fingerprint should round-trip.");
+        TEST_ASSERT(!db->getFingerprint(read_back, true), "No shadow fingerprint before migration.");
+
+        // 2. One entry embedded with the old model
+        document_entry doc = db->createOrRetrieveDocument(generate_random_date(), "v1.0", "text/plain", "http://example.com/migration_doc", 42);
+        std::vector<uint8_t> content = generate_random_bytes(64);
+        std::vector<float> old_emb(EMBEDDING_SIZE);
+        old_emb[0] = 1.0f;
+        ecc256_public_key controller_pk = CryptoUtils::computePublicKey(CryptoUtils::generatePrivateKey());
+        ecc256_private_key recipient_sk = CryptoUtils::generatePrivateKey();
+        db->insertRagEntry(doc.document_id, old_emb, content, controller_pk, recipient_sk);
+        auto pg_db = std::dynamic_pointer_cast<postgres_client>(db);
+        rag_index_params index_params;
+        index_params.m = 8;
+        db->createIndex(index_params);
+        TEST_ASSERT(pg_db && !pg_db->getIndexDefinition().empty(), "Active column should be indexed.");
+
+        // 3. Shadow migration to a smaller model
+        embedding_fingerprint new_model = old_model;
+        new_model.model_hash = std::string(64, 'b');
+        new_model.model_desc = "new model";
+        new_model.n_embd = 8;
+        db->beginShadowMigration(new_model);
+        TEST_ASSERT(db->getFingerprint(read_back, true) && read_back.matches(new_model), "Shadow fingerprint should be recorded.");
+
+        auto batch = db->fetchShadowBatch(0, 10);
+        TEST_ASSERT(batch.size() == 1, "Exactly one entry should be waiting for migration.");
+        TEST_ASSERT(batch[0].encrypted_content == content, "Migration batch should carry the stored content.");
+
+        // the old index keeps serving while the shadow is not promoted
+        TEST_ASSERT(db->searchNearest(old_emb, 1).size() == 1, "Active column should still be searchable.");
+        TEST_ASSERT(db->searchNearest(std::vector<float>(8, 1.0f), 1, nullptr, DistanceMetric::COSINE, true).empty(),
+                    "Shadow column should have no searchable entry yet.");
+
+        std::vector<float> new_emb(8);
+        new_emb[3] = 1.0f;
+        db->updateShadowEmbedding(batch[0].id, new_emb);
+        TEST_ASSERT(db->fetchShadowBatch(0, 10).empty(), "No entry should be left to migrate.");
+        TEST_ASSERT(db->searchNearest(new_emb, 1, nullptr, DistanceMetric::COSINE, true).size() == 1, "Shadow column should be searchable.");
+
+        // 4. Promotion swaps columns and fingerprints
+        db->promoteShadow();
+        TEST_ASSERT(db->getFingerprint(read_back) && read_back.matches(new_model), "New model should be the active fingerprint.");
+        TEST_ASSERT(!db->getFingerprint(read_back, true), "Shadow fingerprint should be gone after promotion.");
+        auto results = db->searchNearest(new_emb, 1);
+        TEST_ASSERT(results.size() == 1 && compare_float_vectors(std::get<1>(results[0]), new_emb), "Active column should hold the new embeddings.");
+        const std::string index_def = pg_db->getIndexDefinition();
+        TEST_ASSERT(index_def.find("hnsw") != std::string::npos && index_def.find("m='8'") != std::string::npos,
+                    "Promotion should rebuild the index, with its parameters, on the promoted column.");
+
+        db->disconnect();
+    } catch (const std::exception& e) {
+        TEST_ASSERT(false, ("Exception during fingerprint/migration test: " + std::string(e.what())).c_str());
+    }
+    clean_db_schema(db); // Leave a schema with the default embedding size behind
+    TEST_SUCCESS("DB: embedding fingerprint and shadow migration");
+}
+static bool test_db_collections() {
+    TEST_LOG_RAW("Testing DB: collections...");
+
+    TEST_ASSERT(postgres_client::is_valid_collection_name("tenant_a1"), "Plain identifier should be a valid collection name.");
+    TEST_ASSERT(!postgres_client::is_valid_collection_name("1tenant"), "Collection name must start with a letter.");
+    TEST_ASSERT(!postgres_client::is_valid_collection_name("tenant; DROP TABLE documents"), "Collection name must not carry SQL.");
+    bool threw = false;
+    try {
+        create_rag_database("localhost", 5432, "klave_rag", "Tenant-A");
+    } catch (const std::runtime_error&) {
+        threw = true;
+    }
+    TEST_ASSERT(threw, "Invalid collection name should be rejected.");
+
+    std::shared_ptr<rag_database> tenant_a = create_rag_database("localhost", 5432, "klave_rag", "tenant_a");
+    std::shared_ptr<rag_database> tenant_b = create_rag_database("localhost", 5432, "klave_rag", "tenant_b");
+    clean_db_schema(tenant_a);
+    clean_db_schema(tenant_b);
+
+    try {
+        tenant_a->connect(PG_USER, PG_PASSWORD);
+        tenant_b->connect(PG_USER, PG_PASSWORD);
+
+        // collections do not need to share a dimension
+        tenant_a->createSchema(16);
+        tenant_b->createSchema(32);
+        auto collections = tenant_a->listCollections();
+        TEST_ASSERT(std::find(collections.begin(), collections.end(), "tenant_a") != collections.end(), "tenant_a should be listed.");
+        TEST_ASSERT(std::find(collections.begin(), collections.end(), "tenant_b") != collections.end(), "tenant_b should be listed.");
+
+        ecc256_public_key controller_pk = CryptoUtils::computePublicKey(CryptoUtils::generatePrivateKey());
+        ecc256_private_key recipient_sk = CryptoUtils::generatePrivateKey();
+        document_entry doc = tenant_a->createOrRetrieveDocument(generate_random_date(), "v1.0", "text/plain", "http://example.com/tenant_a", 10);
+        std::vector<float> emb = generate_random_embedding(16);
+        tenant_a->insertRagEntry(doc.document_id, emb, generate_random_bytes(32), controller_pk, recipient_sk);
+
+        rag_index_params index_params;
+        index_params.type = "hnsw";
+        tenant_a->createIndex(index_params);
+        tenant_a->setSearchParams(40, 0);
+        TEST_ASSERT(tenant_a->searchNearest(emb, 5).size() == 1, "tenant_a should find its own entry.");
+        TEST_ASSERT(tenant_b->searchNearest(generate_random_embedding(32), 5).empty(), "tenant_b should not see tenant_a entries.");
+
+        // dropping a tenant leaves the others untouched
+        tenant_b->destroySchema();
+        TEST_ASSERT(!tenant_b->hasSchema(), "tenant_b should be dropped.");
+        TEST_ASSERT(tenant_a->hasSchema(), "tenant_a should survive dropping tenant_b.");
+        tenant_a->destroySchema();
+
+        tenant_a->disconnect();
+        tenant_b->disconnect();
+    } catch (const std::exception& e) {
+        TEST_ASSERT(false, ("Exception during collections test: " + std::string(e.what())).c_str());
+    }
+    TEST_SUCCESS("DB: collections");
+}
+static bool test_memory_db_search_nearest() {
+    TEST_LOG_RAW("Testing in-memory DB: search nearest...");
+    std::shared_ptr<rag_database> db = std::make_shared<memory_client>("bench");
+
+    try {
+        db->connect("", "");
+        TEST_ASSERT(!db->hasSchema(), "Fresh in-memory backend should have no schema.");
+        db->createSchema(4);
+
+        ecc256_public_key controller_pk = CryptoUtils::computePublicKey(CryptoUtils::generatePrivateKey());
+        ecc256_private_key recipient_sk = CryptoUtils::generatePrivateKey();
+        document_entry doc = db->createOrRetrieveDocument("2025-01-01", "v1.0", "text/plain", "http://example.com/memory_doc", 3);
+        TEST_ASSERT(db->createOrRetrieveDocument("2025-01-01", "v1.0", "text/plain", "http://example.com/memory_doc", 3).document_id == doc.document_id,
+                    "Same document metadata should retrieve the same document.");
+
+        const std::vector<std::vector<float>> embeddings = {{1, 0, 0, 0}, {0, 1, 0, 0}, {0.9f, 0.1f, 0, 0}};
+        for (size_t i = 0; i < embeddings.size(); ++i) {
+            std::string text = "memory chunk " + std::to_string(i);
+            db->insertRagEntry(doc.document_id, embeddings[i], std::vector<uint8_t>(text.begin(), text.end()), controller_pk, recipient_sk);
+        }
+
+        auto results = db->searchNearest({1, 0, 0, 0}, 2);
+        TEST_ASSERT(results.size() == 2, "Two nearest entries should be returned.");
+        TEST_ASSERT(compare_float_vectors(std::get<1>(results[0]), embeddings[0]), "Exact match should rank first.");
+        TEST_ASSERT(compare_float_vectors(std::get<1>(results[1]), embeddings[2]), "Closest neighbour should rank second.");
+        TEST_ASSERT(std::get<16>(results[0]) <= std::get<16>(results[1]), "Results should be ordered by distance.");
+        std::string expected = "memory chunk 0";
+        std::vector<uint8_t> decrypted = EciesUtils::decrypt_ecies(std::get<12>(results[0]), std::get<13>(results[0]), std::get<14>(results[0]),
+                                                                   std::get<15>(results[0]), recipient_sk);
+        TEST_ASSERT(decrypted == std::vector<uint8_t>(expected.begin(), expected.end()), "Stored content should decrypt to the inserted chunk.");
+        TEST_ASSERT(std::get<15>(results[0]) == std::get<15>(results[1]), "Chunks of a document should share their data key.");
+        TEST_ASSERT(std::get<6>(results[0]) == CryptoUtils::computePublicKey(recipient_sk), "Recipient public key should be recorded.");
+
+        bool threw = false;
+        try {
+            db->deleteDocument(doc.document_id);
+        } catch (const std::runtime_error&) {
+            threw = true;
+        }
+        TEST_ASSERT(threw, "Deleting a document still referenced by rag entries should fail.");
+
+        db->destroySchema();
+        TEST_ASSERT(!db->hasSchema(), "Schema should be dropped.");
+        db->disconnect();
+    } catch (const std::exception& e) {
+        TEST_ASSERT(false, ("Exception during in-memory search test: " + std::string(e.what())).c_str());
+    }
+    TEST_SUCCESS("In-memory DB: search nearest");
+}
+
+static bool test_memory_db_content_dedup() {
+    TEST_LOG_RAW("Testing in-memory DB: content dedup is scoped to the recipient...");
+    std::shared_ptr<rag_database> db = std::make_shared<memory_client>("dedup");
+
+    try {
+        db->connect("", "");
+        db->createSchema(4);
+
+        ecc256_public_key controller_pk = CryptoUtils::computePublicKey(CryptoUtils::generatePrivateKey());
+        ecc256_private_key recipient_sk_a = CryptoUtils::generatePrivateKey();
+        ecc256_private_key recipient_sk_b = CryptoUtils::generatePrivateKey();
+        document_entry doc = db->createOrRetrieveDocument("2025-01-01", "v1.0", "text/plain", "http://example.com/dedup_doc", 1);
+
+        const std::string text = "same chunk";
+        const std::vector<uint8_t> contents(text.begin(), text.end());
+        db->insertRagEntry(doc.document_id, {1, 0, 0, 0}, contents, controller_pk, recipient_sk_a);
+        db->insertRagEntry(doc.document_id, {0, 1, 0, 0}, contents, controller_pk, recipient_sk_a);
+        db->insertRagEntry(doc.document_id, {0, 0, 1, 0}, contents, controller_pk, recipient_sk_b);
+
+        auto a1 = db->searchNearest({1, 0, 0, 0}, 1);
+        auto a2 = db->searchNearest({0, 1, 0, 0}, 1);
+        auto b  = db->searchNearest({0, 0, 1, 0}, 1);
+        TEST_ASSERT(a1.size() == 1 && a2.size() == 1 && b.size() == 1, "Each entry should be found.");
+        TEST_ASSERT(std::get<2>(a1[0]) == std::get<2>(a2[0]), "Equal contents for one recipient should share their encrypted row.");
+        TEST_ASSERT(std::get<2>(a1[0]) != std::get<2>(b[0]), "Equal contents for two recipients should not share their encrypted row.");
+        const sha256_hash plain = CryptoUtils::computeSha256Bytes(contents);
+        TEST_ASSERT(std::get<2>(a1[0]) != postgres_client::bytes_to_hex(plain.data(), plain.size()), "The row key should not be the plain content hash.");
+
+        std::vector<uint8_t> decrypted_b = EciesUtils::decrypt_ecies(std::get<12>(b[0]), std::get<13>(b[0]), std::get<14>(b[0]),
+                                                                     std::get<15>(b[0]), recipient_sk_b);
+        TEST_ASSERT(decrypted_b == contents, "Each recipient should decrypt its own copy.");
+
+        db->destroySchema();
+        db->disconnect();
+    } catch (const std::exception& e) {
+        TEST_ASSERT(false, ("Exception during in-memory dedup test: " + std::string(e.what())).c_str());
+    }
+    TEST_SUCCESS("In-memory DB: content dedup is scoped to the recipient");
+}
 // Main test runner
 // =========================================================================
 
@@ -940,9 +1402,15 @@ int main() {
 
     std::cout << "\nRunning AES-256 GCM Tests..." << std::endl;
     if (!test_aes256GcmEncrypt_Decrypt_consistency()) failed_tests++;
+    if (!test_aes256Gcm_context_reuse()) failed_tests++;
+
+    std::cout << "\nRunning Crypto Throughput Benchmark..." << std::endl;
+    if (!test_crypto_throughput()) failed_tests++;
 
     std::cout << "\nRunning ECIES Tests..." << std::endl;
     if (!test_ecies_encrypt_decrypt_consistency()) failed_tests++;
+    if (!test_envelope_encryption()) failed_tests++;
+    if (!test_ecies_decrypt_into_arena()) failed_tests++;
 
     // =========================================================================
     // PostgreSQL Client (rag_database implementation) Tests
@@ -955,6 +1423,12 @@ int main() {
     if (!test_db_document_deletion()) failed_tests++;
     if (!test_db_rag_entry_insertion_and_decryption()) failed_tests++;
     if (!test_db_search_nearest()) failed_tests++;
+    if (!test_db_fingerprint_and_shadow_migration()) failed_tests++;
+    if (!test_db_collections()) failed_tests++;
+
+    std::cout << "\nRunning In-memory Client (rag_database) Tests..." << std::endl;
+    if (!test_memory_db_search_nearest()) failed_tests++;
+    if (!test_memory_db_content_dedup()) failed_tests++;
 
 
     if (failed_tests == 0) {
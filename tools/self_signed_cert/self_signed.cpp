@@ -6,6 +6,7 @@
 #include <openssl/err.h>
 #include <openssl/x509.h> // For X.509 certificates
 #include <openssl/x509v3.h> // For X.509 extensions
+#include <algorithm>
 #include <iostream>
 #include <fstream>
 #include <string>
@@ -358,13 +359,17 @@ bool self_signed::createSelfSignedTdxCertificate(EVP_PKEY* pkey, const std::stri
 bool self_signed::createSelfSignedTdxCertificateAsString(EVP_PKEY* pkey, std::string& certificate)
 {
         // Write the certificate to a PEM file
+    // errors are reported to the caller rather than through handleOpenSSLError, which exits: the server
+    // asks for attested certificates at runtime
     std::unique_ptr<BIO, decltype(BIO_free_all)*> cert_bio(BIO_new(BIO_s_mem()), BIO_free_all);
     if (!cert_bio) {
-        handleOpenSSLError("Failed to create buffer.");
+        std::cerr << "OpenSSL Error: Failed to create buffer." << std::endl;
+        ERR_print_errors_fp(stderr);
         return false;
     }
     if(!_createSelfSignedTdxCertificate(pkey,cert_bio.get())) {
-        handleOpenSSLError("Failed to create BIO for certificate file.");
+        std::cerr << "Failed to create the attested certificate." << std::endl;
+        ERR_print_errors_fp(stderr);
         return false;
     }
     auto v = to_vector(cert_bio.get());
@@ -438,4 +443,119 @@ EVP_PKEY* self_signed::load_private_key(const std::string& privateKeyPath)
     return pkey;
 }
 
+bool self_signed::certificateRemainingValidity(const std::string& certificate, long& seconds)
+{
+    std::unique_ptr<BIO, decltype(BIO_free_all)*> bio(BIO_new_mem_buf(certificate.data(), (int)certificate.size()), BIO_free_all);
+    if (!bio)
+        return false;
+    std::unique_ptr<X509, decltype(X509_free)*> x509(PEM_read_bio_X509(bio.get(), nullptr, nullptr, nullptr), X509_free);
+    if (!x509)
+        return false;
+    int days = 0;
+    int secs = 0;
+    if (ASN1_TIME_diff(&days, &secs, nullptr, X509_get0_notAfter(x509.get())) != 1)
+        return false;
+    seconds = (long)days * 86400 + secs;
+    return true;
+}
+
+self_signed::attested_certificate_cache::attested_certificate_cache(const std::string& privateKeyPath, std::chrono::seconds validity)
+    : privateKeyPath(privateKeyPath), validity(validity)
+{
+    refresher = std::thread(&attested_certificate_cache::refresh_loop, this);
+}
+
+self_signed::attested_certificate_cache::~attested_certificate_cache()
+{
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        stopping = true;
+    }
+    cv.notify_all();
+    refresher.join();
+}
+
+bool self_signed::attested_certificate_cache::get(std::string& certificate_out)
+{
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        if (!certificate.empty() && clock::now() < expires_at)
+        {
+            certificate_out = certificate;
+            return true;
+        }
+    }
+    if (!refresh())
+        return false;
+    std::lock_guard<std::mutex> lock(mutex);
+    certificate_out = certificate;
+    return true;
+}
+
+void self_signed::attested_certificate_cache::invalidate()
+{
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        expires_at = clock::time_point::min();
+        refresh_at = clock::now();
+    }
+    cv.notify_all();
+}
+
+bool self_signed::attested_certificate_cache::refresh()
+{
+    std::lock_guard<std::mutex> generating(generate_mutex);
+    const auto started = clock::now();
+    {
+        // another caller may have generated it while this one waited
+        std::lock_guard<std::mutex> lock(mutex);
+        if (!certificate.empty() && started < refresh_at && started < expires_at)
+            return true;
+    }
+
+    // the key is read for every certificate, so that a new key in the file is picked up
+    std::unique_ptr<EVP_PKEY, decltype(EVP_PKEY_free)*> pkey(load_private_key(privateKeyPath), EVP_PKEY_free);
+    std::string generated;
+    long remaining = 0;
+    if (!pkey || !createSelfSignedTdxCertificateAsString(pkey.get(), generated) || !certificateRemainingValidity(generated, remaining) || remaining <= 0)
+    {
+        std::cerr << "attested certificate generation failed" << std::endl;
+        return false;
+    }
+
+    // used for the configured window at most, never past its notAfter, and renewed after 80% of the window
+    const auto window = std::min<std::chrono::seconds>(validity, std::chrono::seconds(remaining));
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        certificate = std::move(generated);
+        expires_at = started + window;
+        refresh_at = started + window * 4 / 5;
+    }
+    cv.notify_all();
+    return true;
+}
 
+void self_signed::attested_certificate_cache::refresh_loop()
+{
+    std::unique_lock<std::mutex> lock(mutex);
+    while (!stopping)
+    {
+        // nothing to refresh until the first certificate was asked for
+        if (certificate.empty())
+        {
+            cv.wait(lock, [this] { return stopping || !certificate.empty(); });
+            continue;
+        }
+        if (cv.wait_until(lock, refresh_at, [this] { return stopping || clock::now() >= refresh_at; }) && !stopping)
+        {
+            lock.unlock();
+            const bool refreshed = refresh();
+            lock.lock();
+            if (!refreshed)
+            {
+                // keep serving the current certificate while it is valid, and retry
+                refresh_at = clock::now() + std::chrono::seconds(30);
+            }
+        }
+    }
+}
@@ -1,11 +1,15 @@
 #pragma once
 
 
+#include <chrono>
+#include <condition_variable>
 #include <ctime>
 #include <functional>
 #include <list>
 #include <memory>
+#include <mutex>
 #include <string>
+#include <thread>
 typedef struct evp_pkey_st EVP_PKEY;
 
 namespace self_signed
@@ -18,4 +22,45 @@ namespace self_signed
     bool createKeyAndSelfSignedCertificate(const std::string& privateKeyPath, const std::string& publicKeyPath, const std::string& certPath, const std::string& commonName);
     EVP_PKEY* load_private_key(const std::string& privateKeyPath);
 
+    // Seconds until the notAfter date of a PEM certificate (negative once expired), false if it does not parse.
+    bool certificateRemainingValidity(const std::string& certificate, long& seconds);
+
+    // The TDX attested certificate of a private key, generated once and then served from memory: a quote
+    // costs far more than the request asking for it. The certificate is used for at most `validity` (and
+    // never past its own notAfter), and a background thread regenerates it before that window ends.
+    class attested_certificate_cache
+    {
+    public:
+        attested_certificate_cache(const std::string& privateKeyPath, std::chrono::seconds validity);
+        ~attested_certificate_cache();
+
+        // The current certificate. Generated synchronously when there is none yet, or when the background
+        // refresh could not keep it valid; false if that generation fails.
+        bool get(std::string& certificate);
+
+        // Drop the current certificate, e.g. after the private key was replaced: the next get() generates a new one.
+        void invalidate();
+
+    private:
+        using clock = std::chrono::steady_clock;
+
+        // generate a certificate and publish it, serialized on generate_mutex
+        bool refresh();
+        void refresh_loop();
+
+        std::string privateKeyPath;
+        std::chrono::seconds validity;
+
+        std::mutex generate_mutex;
+
+        std::mutex mutex;
+        std::condition_variable cv;
+        std::string certificate;
+        clock::time_point expires_at;
+        clock::time_point refresh_at = clock::time_point::max();
+        bool stopping = false;
+
+        std::thread refresher;
+    };
+
 };
\ No newline at end of file
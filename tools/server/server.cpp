@@ -28,8 +28,11 @@
 #include <cstddef>
 #include <cinttypes>
 #include <deque>
+#include <list>
+#include <map>
 #include <memory>
 #include <mutex>
+#include <random>
 #include <signal.h>
 #include <thread>
 #include <unordered_map>
@@ -38,19 +41,55 @@
 
 #include "rag_database.h"
 #include "postgres_client.h"
+#include "data_key_cache.h"
 #include "self_signed.h"
+#ifdef CPPHTTPLIB_OPENSSL_SUPPORT
+#include "acme-renewal.h"
+#endif
 
 namespace fs = std::filesystem;
 
-std::shared_ptr<postgres_client> rag_db_ = nullptr;
-std::shared_ptr<rag_database> create_rag_database(const std::string & host_name, int port, const std::string & db_name)
+// idle connections per (host, port, database, collection, credentials): a libpq connection is not thread safe,
+// so a request checks one out for itself and hands it back when it releases the client
+static constexpr size_t RAG_DB_POOL_MAX_IDLE = 4;
+std::mutex rag_db_mutex_;
+std::map<std::string, std::vector<std::shared_ptr<postgres_client>>> rag_dbs_idle_;
+std::shared_ptr<rag_database> create_rag_database(const std::string & host_name, int port, const std::string & db_name, const std::string & collection,
+                                                  const std::string & user, const std::string & password)
 {
-    if(!rag_db_)
-        return rag_db_ = std::make_shared<postgres_client>(host_name, port, db_name);
-    if((rag_db_->get_host_name() == host_name) && (rag_db_->get_port() == port) && (rag_db_->get_name() == db_name))
-        return rag_db_;
-    std::cerr<<"rebuilding database";
-    return rag_db_ = std::make_shared<postgres_client>(host_name, port, db_name);
+    // the password is part of the key so that a wrong one never gets a session opened with the right one
+    const auto password_hash = CryptoUtils::computeSha256Bytes(std::vector<uint8_t>(password.begin(), password.end()));
+    const std::string key = host_name + ":" + std::to_string(port) + "/" + db_name + "#" + (collection.empty() ? "default" : collection) +
+                            "@" + user + ":" + postgres_client::bytes_to_hex(password_hash.data(), password_hash.size());
+    std::shared_ptr<postgres_client> client;
+    {
+        std::lock_guard<std::mutex> lock(rag_db_mutex_);
+        auto & idle = rag_dbs_idle_[key];
+        if (!idle.empty()) {
+            client = std::move(idle.back());
+            idle.pop_back();
+        }
+    }
+    if (!client) {
+        client = postgres_client::for_collection(host_name, port, db_name, collection);
+    }
+    client->connect(user, password); // reconnects if the pooled session was dropped
+
+    return std::shared_ptr<rag_database>(client.get(), [key, client](rag_database *) mutable {
+        try {
+            client->setSearchParams(0, 0);
+        } catch (const std::exception &) {
+            return; // a session that cannot be reset is not handed to the next request
+        }
+        if (!client->isConnected()) {
+            return;
+        }
+        std::lock_guard<std::mutex> lock(rag_db_mutex_);
+        auto & idle = rag_dbs_idle_[key];
+        if (idle.size() < RAG_DB_POOL_MAX_IDLE) {
+            idle.push_back(std::move(client));
+        }
+    });
 }
 using json = nlohmann::ordered_json;
 
@@ -89,8 +128,53 @@ enum server_task_type {
     SERVER_TASK_TYPE_SLOT_RESTORE,
     SERVER_TASK_TYPE_SLOT_ERASE,
     SERVER_TASK_TYPE_SET_LORA,
+    SERVER_TASK_TYPE_MODEL_SWAP,
+    SERVER_TASK_TYPE_CHUNK_VECTOR, //OWL WAS HERE
+};
+
+// scheduling class of a task: a deferred task waits behind all the deferred tasks of the higher classes,
+// and a background task can be preempted before it generates to make room for an interactive one
+enum server_task_priority {
+    SERVER_TASK_PRIORITY_INTERACTIVE, // chat and completions
+    SERVER_TASK_PRIORITY_BATCH,       // embeddings and reranking requested by clients
+    SERVER_TASK_PRIORITY_BACKGROUND,  // RAG ingestion and migration
+    SERVER_TASK_PRIORITY_COUNT,
 };
 
+static const char * server_task_priority_name(server_task_priority priority) {
+    switch (priority) {
+        case SERVER_TASK_PRIORITY_INTERACTIVE: return "interactive";
+        case SERVER_TASK_PRIORITY_BATCH:       return "batch";
+        case SERVER_TASK_PRIORITY_BACKGROUND:  return "background";
+        default:                               return "unknown";
+    }
+}
+
+// endpoint of the request of a task, the label of its latency metrics
+enum server_endpoint {
+    SERVER_ENDPOINT_COMPLETION,
+    SERVER_ENDPOINT_CHAT,
+    SERVER_ENDPOINT_INFILL,
+    SERVER_ENDPOINT_EMBEDDING,
+    SERVER_ENDPOINT_RERANK,
+    SERVER_ENDPOINT_RAG,    // RAG chat completions
+    SERVER_ENDPOINT_INGEST, // RAG ingestion, chunking and migration
+    SERVER_ENDPOINT_COUNT,
+};
+
+static const char * server_endpoint_name(server_endpoint endpoint) {
+    switch (endpoint) {
+        case SERVER_ENDPOINT_COMPLETION: return "completion";
+        case SERVER_ENDPOINT_CHAT:       return "chat";
+        case SERVER_ENDPOINT_INFILL:     return "infill";
+        case SERVER_ENDPOINT_EMBEDDING:  return "embedding";
+        case SERVER_ENDPOINT_RERANK:     return "rerank";
+        case SERVER_ENDPOINT_RAG:        return "rag";
+        case SERVER_ENDPOINT_INGEST:     return "ingest";
+        default:                         return "unknown";
+    }
+}
+
 enum oaicompat_type {
     OAICOMPAT_TYPE_NONE,
     OAICOMPAT_TYPE_CHAT,
@@ -98,6 +182,51 @@ enum oaicompat_type {
     OAICOMPAT_TYPE_EMBEDDING,
 };
 
+//OWL BEGIN
+// how SERVER_TASK_TYPE_CHUNK_VECTOR reduces the token embeddings of a range to a single vector
+enum chunk_pooling_type {
+    CHUNK_POOLING_MEAN,
+    CHUNK_POOLING_MAX,
+    CHUNK_POOLING_MIN,
+    CHUNK_POOLING_MEDIAN,
+    CHUNK_POOLING_FIRST,     // CLS token
+    CHUNK_POOLING_LAST,
+    CHUNK_POOLING_ATTENTION, // softmax(e_i . mean / sqrt(n_embd)) weighted sum
+};
+
+static bool chunk_pooling_from_str(const std::string & str, chunk_pooling_type & type) {
+    if (str == "mean" || str == "average") { type = CHUNK_POOLING_MEAN;      return true; }
+    if (str == "max")                      { type = CHUNK_POOLING_MAX;       return true; }
+    if (str == "min")                      { type = CHUNK_POOLING_MIN;       return true; }
+    if (str == "median")                   { type = CHUNK_POOLING_MEDIAN;    return true; }
+    if (str == "first" || str == "cls")    { type = CHUNK_POOLING_FIRST;     return true; }
+    if (str == "last")                     { type = CHUNK_POOLING_LAST;      return true; }
+    if (str == "attention")                { type = CHUNK_POOLING_ATTENTION; return true; }
+    return false;
+}
+
+// median of every dimension over the rows (the mean of the two middle values for an even count)
+static std::vector<float> chunk_pooling_median(const std::vector<std::vector<float>> & rows) {
+    const size_t n_rows = rows.size();
+    const size_t n_embd = n_rows > 0 ? rows[0].size() : 0;
+    std::vector<float> pooled(n_embd);
+    std::vector<float> column(n_rows);
+    for (size_t j = 0; j < n_embd; j++) {
+        for (size_t r = 0; r < n_rows; r++) {
+            column[r] = rows[r][j];
+        }
+        const size_t mid = n_rows / 2;
+        std::nth_element(column.begin(), column.begin() + mid, column.end());
+        float median = column[mid];
+        if (n_rows % 2 == 0) {
+            median = (median + *std::max_element(column.begin(), column.begin() + mid)) / 2.0f;
+        }
+        pooled[j] = median;
+    }
+    return pooled;
+}
+//OWL END
+
 // https://community.openai.com/t/openai-chat-list-of-error-codes-and-types/357791/11
 enum error_type {
     ERROR_TYPE_INVALID_REQUEST,
@@ -122,6 +251,12 @@ struct slot_params {
     int64_t t_max_prompt_ms  = -1; // TODO: implement
     int64_t t_max_predict_ms = -1; // if positive, limit the generation phase to this time limit
 
+    // used by SERVER_TASK_TYPE_CHUNK_VECTOR: pool the token range [pooling_begin, pooling_end)
+    // negative bounds count from the end of the prompt, pooling_end = 0 means the end of the prompt
+    chunk_pooling_type pooling = CHUNK_POOLING_MEAN;
+    int32_t pooling_begin = 0;
+    int32_t pooling_end   = 0;
+
     std::vector<common_adapter_lora_info> lora;
 
     std::vector<std::string> antiprompt;
@@ -222,6 +357,14 @@ struct server_task {
     server_tokens prompt_tokens;
     int id_selected_slot = -1;
 
+    // scheduling of the inference tasks
+    server_task_priority priority = SERVER_TASK_PRIORITY_INTERACTIVE;
+    std::string tenant;       // hash of the API key of the request, fair queuing unit within a priority class
+    int64_t t_queued = 0;     // first post, kept when the task is deferred or preempted
+    bool admitted    = false; // already passed the admission control
+    server_endpoint endpoint = SERVER_ENDPOINT_COMPLETION;
+    uint64_t trace_id = 0;    // of the request, 0 if not traced (--trace)
+
     // used by SERVER_TASK_TYPE_SLOT_SAVE, SERVER_TASK_TYPE_SLOT_RESTORE, SERVER_TASK_TYPE_SLOT_ERASE
     struct slot_action {
         int slot_id;
@@ -236,6 +379,9 @@ struct server_task {
     // used by SERVER_TASK_TYPE_SET_LORA
     std::vector<common_adapter_lora_info> set_lora;
 
+    // used by SERVER_TASK_TYPE_MODEL_SWAP
+    bool keep_previous_model = false;
+
     server_task(server_task_type type) : type(type) {}
 
     static slot_params params_from_json_cmpl(
@@ -539,6 +685,51 @@ struct result_timings {
     }
 };
 
+// scheduling class of the tasks of a request: the endpoint sets the priority, which the request can only
+// lower with "priority"; the API key (see request_tenant) is the tenant for the fair queuing within the class
+static void server_tasks_set_class(std::vector<server_task> & tasks, const std::string & tenant, const json & data, server_task_priority priority, server_endpoint endpoint, uint64_t trace_id) {
+    const std::string requested = data.is_object() ? json_value(data, "priority", std::string()) : std::string();
+    for (int i = priority + 1; i < SERVER_TASK_PRIORITY_COUNT; i++) {
+        if (requested == server_task_priority_name((server_task_priority) i)) {
+            priority = (server_task_priority) i;
+        }
+    }
+    for (auto & task : tasks) {
+        task.priority = priority;
+        task.tenant   = tenant;
+        task.endpoint = endpoint;
+        task.trace_id = trace_id;
+    }
+}
+
+// tenants of the fair queuing: one per configured API key, named by a hash of the key so that the key itself
+// is not copied to every task and slot
+struct server_tenants {
+    std::unordered_map<std::string, std::string> ids; // API key -> tenant
+
+    void init(const std::vector<std::string> & api_keys) {
+        for (const auto & key : api_keys) {
+            const sha256_hash hash = CryptoUtils::computeSha256Bytes(std::vector<uint8_t>(key.begin(), key.end()));
+            ids[key] = postgres_client::bytes_to_hex(hash.data(), 8);
+        }
+    }
+};
+
+// process-wide, filled before the HTTP threads start
+static server_tenants tenants;
+
+// the tenant of the request, empty when it does not carry a configured API key: any other bearer value would
+// open a queue of its own
+static std::string request_tenant(const httplib::Request & req) {
+    const std::string prefix = "Bearer ";
+    const std::string auth_header = req.get_header_value("Authorization");
+    if (auth_header.rfind(prefix, 0) != 0) {
+        return std::string();
+    }
+    const auto it = tenants.ids.find(auth_header.substr(prefix.size()));
+    return it != tenants.ids.end() ? it->second : std::string();
+}
+
 struct server_task_result {
     int id           = -1;
     int id_slot      = -1;
@@ -1247,6 +1438,71 @@ struct server_task_result_error : server_task_result {
     }
 };
 
+// upper bounds of the histogram buckets, +Inf excluded
+static const std::vector<double> server_histogram_bounds_latency = { // s
+    0.005, 0.01, 0.025, 0.05, 0.1, 0.25, 0.5, 1, 2.5, 5, 10, 30, 60, 120, 300,
+};
+static const std::vector<double> server_histogram_bounds_itl = { // s
+    0.001, 0.0025, 0.005, 0.01, 0.02, 0.04, 0.06, 0.08, 0.1, 0.25, 0.5, 1,
+};
+static const std::vector<double> server_histogram_bounds_tokens = {
+    1, 4, 16, 64, 256, 1024, 4096, 16384, 65536,
+};
+
+// distribution of a latency or a size, exported as a Prometheus histogram
+struct server_histogram {
+    const std::vector<double> * bounds;
+    std::vector<uint64_t> counts; // per bucket, not cumulative; the last one is +Inf
+    double   sum   = 0;
+    uint64_t count = 0;
+
+    server_histogram(const std::vector<double> & bounds = server_histogram_bounds_latency)
+        : bounds(&bounds), counts(bounds.size() + 1, 0) {}
+
+    void observe(double value, uint64_t n = 1) {
+        // the buckets include their upper bound ("le")
+        const size_t i = std::lower_bound(bounds->begin(), bounds->end(), value) - bounds->begin();
+        counts[i] += n;
+        sum       += value * n;
+        count     += n;
+    }
+
+    json to_json(const std::string & labels) const {
+        return json {
+            {"labels", labels},
+            {"bounds", *bounds},
+            {"counts", counts},
+            {"sum",    sum},
+            {"count",  count},
+        };
+    }
+};
+
+// latency metrics of the tasks of an endpoint
+struct server_endpoint_metrics {
+    server_histogram queue       { server_histogram_bounds_latency }; // from the post to a slot
+    server_histogram ttft        { server_histogram_bounds_latency }; // from the post to the first token (or to the result)
+    server_histogram itl         { server_histogram_bounds_itl };     // between two generated tokens
+    server_histogram duration    { server_histogram_bounds_latency }; // from the post to the release of the slot
+    server_histogram prefill     { server_histogram_bounds_latency }; // prompt processing
+    server_histogram n_prompt    { server_histogram_bounds_tokens };
+    server_histogram n_predicted { server_histogram_bounds_tokens };
+};
+
+// scheduling metrics of a priority class
+struct server_class_metrics {
+    uint64_t n_started     = 0; // tasks that got a slot (preempted tasks count again when they resume)
+    uint64_t t_queue_total = 0; // us waited for a slot
+    uint64_t n_ttft        = 0;
+    uint64_t t_ttft_total  = 0; // us from the post to the first token (or to the result of non-generating tasks)
+    uint64_t n_rejected    = 0;
+    uint64_t n_preempted   = 0;
+
+    // recent averages in us, for the admission control
+    double t_ttft_avg    = 0;
+    double t_service_avg = 0;
+};
+
 struct server_task_result_metrics : server_task_result {
     int n_idle_slots;
     int n_processing_slots;
@@ -1271,6 +1527,27 @@ struct server_task_result_metrics : server_task_result {
     uint64_t n_decode_total     = 0;
     uint64_t n_busy_slots_total = 0;
 
+    int32_t n_prefill_budget = 0;
+
+    int32_t  n_kv_pages_total   = 0;
+    int32_t  n_kv_pages_used    = 0;
+    uint64_t n_kv_pages_evicted = 0;
+
+    uint64_t n_prefix_cache_hits   = 0;
+    uint64_t n_prefix_cache_tokens = 0;
+
+    bool     kv_spill = false;
+    size_t   n_kv_spill_ram_bytes  = 0;
+    size_t   n_kv_spill_disk_bytes = 0;
+    uint64_t n_kv_spilled          = 0;
+    uint64_t n_kv_spill_restored      = 0;
+    uint64_t n_kv_spill_restored_disk = 0;
+
+    server_class_metrics classes[SERVER_TASK_PRIORITY_COUNT];
+    size_t n_deferred_classes[SERVER_TASK_PRIORITY_COUNT] = {};
+
+    server_endpoint_metrics endpoints[SERVER_ENDPOINT_COUNT];
+
     // while we can also use std::vector<server_slot> this requires copying the slot object which can be quite messy
     // therefore, we use json to temporarily store the slot.to_json() result
     json slots_data = json::array();
@@ -1294,6 +1571,18 @@ struct server_task_result_metrics : server_task_result {
 
             { "n_decode_total",                  n_decode_total },
             { "n_busy_slots_total",              n_busy_slots_total },
+            { "n_prefill_budget",                n_prefill_budget },
+            { "n_kv_pages_total",                n_kv_pages_total },
+            { "n_kv_pages_used",                 n_kv_pages_used },
+            { "n_kv_pages_evicted",              n_kv_pages_evicted },
+            { "n_prefix_cache_hits",             n_prefix_cache_hits },
+            { "n_prefix_cache_tokens",           n_prefix_cache_tokens },
+            { "n_kv_spill_ram_bytes",            n_kv_spill_ram_bytes },
+            { "n_kv_spill_disk_bytes",           n_kv_spill_disk_bytes },
+            { "n_kv_spilled",                    n_kv_spilled },
+            { "n_kv_spill_restored",             n_kv_spill_restored },
+            { "n_kv_spill_restored_disk",        n_kv_spill_restored_disk },
+            { "priorities",                      priorities_to_json() },
 
             { "kv_cache_tokens_count",           kv_cache_tokens_count },
             { "kv_cache_used_cells",             kv_cache_used_cells },
@@ -1301,6 +1590,23 @@ struct server_task_result_metrics : server_task_result {
             { "slots",                           slots_data },
         };
     }
+
+    json priorities_to_json() const {
+        json priorities = json::object();
+        for (int i = 0; i < SERVER_TASK_PRIORITY_COUNT; i++) {
+            const auto & cls = classes[i];
+            priorities[server_task_priority_name((server_task_priority) i)] = json {
+                { "n_started",     cls.n_started },
+                { "t_queue_total", cls.t_queue_total },
+                { "n_ttft",        cls.n_ttft },
+                { "t_ttft_total",  cls.t_ttft_total },
+                { "n_rejected",    cls.n_rejected },
+                { "n_preempted",   cls.n_preempted },
+                { "deferred",      n_deferred_classes[i] },
+            };
+        }
+        return priorities;
+    }
 };
 
 struct server_task_result_slot_save_load : server_task_result {
@@ -1353,6 +1659,28 @@ struct server_task_result_apply_lora : server_task_result {
     }
 };
 
+struct server_task_result_model_swap : server_task_result {
+    std::string model_path;
+    std::string model_standby; // the previous model, if it is kept resident
+    bool from_standby = false;
+
+    double t_drain_ms = 0.0;
+    double t_swap_ms  = 0.0;
+
+    virtual json to_json() override {
+        return json {
+            { "success",        true },
+            { "new_model_path", model_path },
+            { "standby_model",  model_standby },
+            { "from_standby",   from_standby },
+            { "timings", {
+                { "drain_ms", t_drain_ms },
+                { "swap_ms",  t_swap_ms },
+            }},
+        };
+    }
+};
+
 struct server_slot {
     int id;
     int id_task = -1;
@@ -1377,6 +1705,16 @@ struct server_slot {
 
     struct slot_params params;
 
+    // scheduling class of the task, see server_task
+    server_task_priority priority = SERVER_TASK_PRIORITY_INTERACTIVE;
+    std::string tenant;
+    server_endpoint endpoint = SERVER_ENDPOINT_COMPLETION;
+    uint64_t trace_id  = 0;
+    int64_t t_queued   = 0;
+    int64_t t_launched = 0;
+    int64_t t_last_token = 0;  // for the inter-token latency
+    bool    preempted  = false; // released to resume later, the request is not over
+
     slot_state state = SLOT_STATE_IDLE;
 
     // used to determine the slot that has been used the longest
@@ -1385,6 +1723,8 @@ struct server_slot {
     // generation props
     int32_t n_ctx       = 0;  // context size per slot
     int32_t n_past      = 0;
+    int32_t n_kv_pages  = 0;  // KV cache pages held by the slot (with --kv-page-size)
+    int32_t n_shared    = 0;  // the KV cells of the first n_shared cached tokens may be shared with other slots
     int32_t n_decoded   = 0;
     int32_t n_remaining = -1;
     int32_t i_batch     = -1;
@@ -1460,7 +1800,7 @@ struct server_slot {
     }
 
     bool is_non_causal() const {
-        return task_type == SERVER_TASK_TYPE_EMBEDDING || task_type == SERVER_TASK_TYPE_RERANK;
+        return task_type == SERVER_TASK_TYPE_EMBEDDING || task_type == SERVER_TASK_TYPE_RERANK || task_type == SERVER_TASK_TYPE_CHUNK_VECTOR;
     }
 
     bool can_batch_with(server_slot & other_slot) const {
@@ -1592,9 +1932,11 @@ struct server_slot {
             {"id",            id},
             {"id_task",       id_task},
             {"n_ctx",         n_ctx},
+            {"n_kv_pages",    n_kv_pages},
             {"speculative",   can_speculate()},
             {"is_processing", is_processing()},
             {"non_causal",    is_non_causal()},
+            {"priority",      server_task_priority_name(priority)},
             {"params",        params.to_json()},
             {"prompt",        prompt_tokens.detokenize(ctx, true)},
             {"next_token",
@@ -1627,15 +1969,64 @@ struct server_metrics {
     uint64_t n_decode_total     = 0;
     uint64_t n_busy_slots_total = 0;
 
+    uint64_t n_kv_pages_evicted = 0; // cached prompts evicted to free KV pages
+
+    uint64_t n_prefix_cache_hits   = 0; // prompts started from the cache of another slot
+    uint64_t n_prefix_cache_tokens = 0; // prompt tokens reused from the cache of another slot
+
+    server_class_metrics classes[SERVER_TASK_PRIORITY_COUNT];
+
+    server_endpoint_metrics endpoints[SERVER_ENDPOINT_COUNT];
+
     void init() {
         t_start = ggml_time_us();
     }
 
+    void on_launched(const server_slot & slot) {
+        auto & cls = classes[slot.priority];
+        cls.n_started++;
+        cls.t_queue_total += slot.t_launched - slot.t_queued;
+        endpoints[slot.endpoint].queue.observe((slot.t_launched - slot.t_queued) / 1e6);
+    }
+
+    void on_first_token(const server_slot & slot) {
+        auto & cls = classes[slot.priority];
+        const int64_t t_ttft = ggml_time_us() - slot.t_queued;
+        cls.n_ttft++;
+        cls.t_ttft_total += t_ttft;
+        cls.t_ttft_avg = cls.n_ttft == 1 ? t_ttft : 0.9 * cls.t_ttft_avg + 0.1 * t_ttft;
+        endpoints[slot.endpoint].ttft.observe(t_ttft / 1e6);
+    }
+
+    // n_tokens generated at t_current since the previous ones, e.g. the accepted tokens of a draft
+    void on_tokens(const server_slot & slot, int64_t t_current, size_t n_tokens) {
+        if (n_tokens > 0) {
+            endpoints[slot.endpoint].itl.observe((t_current - slot.t_last_token) / 1e6 / n_tokens, n_tokens);
+        }
+    }
+
+    void on_released(const server_slot & slot) {
+        auto & cls = classes[slot.priority];
+        const int64_t t_current = ggml_time_us();
+        const int64_t t_service = t_current - slot.t_launched;
+        cls.t_service_avg = cls.t_service_avg == 0 ? t_service : 0.9 * cls.t_service_avg + 0.1 * t_service;
+
+        if (!slot.preempted) {
+            auto & ep = endpoints[slot.endpoint];
+            ep.duration.observe((t_current - slot.t_queued) / 1e6);
+            ep.n_prompt.observe(slot.n_prompt_tokens);
+            if (slot.n_decoded > 0) {
+                ep.n_predicted.observe(slot.n_decoded);
+            }
+        }
+    }
+
     void on_prompt_eval(const server_slot & slot) {
         n_prompt_tokens_processed_total += slot.n_prompt_tokens_processed;
         n_prompt_tokens_processed       += slot.n_prompt_tokens_processed;
         t_prompt_processing             += slot.t_prompt_processing;
         t_prompt_processing_total       += slot.t_prompt_processing;
+        endpoints[slot.endpoint].prefill.observe(slot.t_prompt_processing / 1e3);
     }
 
     void on_prediction(const server_slot & slot) {
@@ -1662,197 +2053,874 @@ struct server_metrics {
     }
 };
 
-struct server_queue {
-    int id = 0;
-    bool running;
-
-    // queues
-    std::deque<server_task> queue_tasks;
-    std::deque<server_task> queue_tasks_deferred;
+// a timed step of a request; the name is a string literal
+struct server_trace_span {
+    uint64_t     trace_id = 0;
+    const char * name     = nullptr;
+    int64_t      t_start  = 0; // us
+    int64_t      t_end    = 0; // us
+    int32_t      id_slot  = -1;
+    int32_t      n_batch  = 0; // tokens of the decoded batch
+    int32_t      n_tokens = 0; // tokens of the request in the batch
+
+    // complete event of the Chrome trace format, a slot per thread lane (0 for the HTTP threads)
+    json to_json() const {
+        return json {
+            {"name", name},
+            {"cat",  "llama-server"},
+            {"ph",   "X"},
+            {"ts",   t_start},
+            {"dur",  t_end - t_start},
+            {"pid",  1},
+            {"tid",  id_slot + 1},
+            {"args", {
+                {"trace_id", string_format("%016" PRIx64, trace_id)},
+                {"id_slot",  id_slot},
+                {"n_batch",  n_batch},
+                {"n_tokens", n_tokens},
+            }},
+        };
+    }
+};
 
-    std::mutex mutex_tasks;
-    std::condition_variable condition_tasks;
+// spans of the requests (--trace), in a lock-free ring buffer: the HTTP threads and the slot loops record without
+// waiting on each other, the oldest spans are overwritten; with --trace-file, a thread appends the new spans to
+// a Chrome trace file every second. Without --trace, the requests have no trace id and nothing is recorded.
+struct server_tracer {
+    // a seqlock per entry: odd while written, 2 * (index + 1) once the span of the index is complete
+    struct entry {
+        std::atomic<uint64_t>     seq      {0};
+        std::atomic<uint64_t>     trace_id {0};
+        std::atomic<const char *> name     {nullptr};
+        std::atomic<int64_t>      t_start  {0};
+        std::atomic<int64_t>      t_end    {0};
+        std::atomic<int32_t>      id_slot  {-1};
+        std::atomic<int32_t>      n_batch  {0};
+        std::atomic<int32_t>      n_tokens {0};
+    };
 
-    // callback functions
-    std::function<void(server_task &&)> callback_new_task;
-    std::function<void(void)>           callback_update_slots;
+    size_t n_entries = 0; // 0 = disabled
+    std::unique_ptr<entry[]> entries;
+    std::atomic<uint64_t> head {0}; // index of the next span
+
+    std::atomic<uint64_t> n_ids {0};
+    uint64_t seed = 0;
+
+    // flush to the file
+    std::string path;
+    std::ofstream file;
+    uint64_t n_flushed = 0;
+    uint64_t n_dropped = 0; // overwritten before they were flushed
+    std::mutex mutex;
+    std::condition_variable cv;
+    bool stopping = false;
+    std::thread thread;
+
+    ~server_tracer() {
+        stop();
+    }
 
-    // Add a new task to the end of the queue
-    int post(server_task && task, bool front = false) {
-        std::unique_lock<std::mutex> lock(mutex_tasks);
-        GGML_ASSERT(task.id != -1);
-        // if this is cancel task make sure to clean up pending tasks
-        if (task.type == SERVER_TASK_TYPE_CANCEL) {
-            cleanup_pending_task(task.id_target);
+    void init(size_t n_spans, const std::string & trace_file) {
+        if (n_spans == 0) {
+            return;
         }
-        const int task_id = task.id;
-        QUE_DBG("new task, id = %d, front = %d\n", task_id, front);
-        if (front) {
-            queue_tasks.push_front(std::move(task));
-        } else {
-            queue_tasks.push_back(std::move(task));
+        n_entries = n_spans;
+        entries.reset(new entry[n_entries]);
+        seed = std::random_device()();
+        seed = (seed << 32) ^ std::random_device()();
+
+        if (!trace_file.empty()) {
+            path = trace_file;
+            // JSON array format: the closing bracket is optional, the events are appended as they come
+            file.open(path, std::ios::out | std::ios::trunc);
+            if (!file) {
+                SRV_ERR("failed to open the trace file %s, the spans are kept in memory only\n", path.c_str());
+                return;
+            }
+            file << "[\n";
+            thread = std::thread([this]() {
+                std::unique_lock<std::mutex> lock(mutex);
+                while (!stopping) {
+                    cv.wait_for(lock, std::chrono::seconds(1));
+                    flush();
+                }
+            });
         }
-        condition_tasks.notify_one();
-        return task_id;
+        SRV_INF("tracing the requests, %zu spans in memory%s%s\n", n_entries, path.empty() ? "" : ", flushed to ", path.c_str());
     }
 
-    // multi-task version of post()
-    int post(std::vector<server_task> && tasks, bool front = false) {
-        std::unique_lock<std::mutex> lock(mutex_tasks);
-        for (auto & task : tasks) {
-            if (task.id == -1) {
-                task.id = id++;
-            }
-            // if this is cancel task make sure to clean up pending tasks
-            if (task.type == SERVER_TASK_TYPE_CANCEL) {
-                cleanup_pending_task(task.id_target);
-            }
-            QUE_DBG("new task, id = %d/%d, front = %d\n", task.id, (int) tasks.size(), front);
-            if (front) {
-                queue_tasks.push_front(std::move(task));
-            } else {
-                queue_tasks.push_back(std::move(task));
+    void stop() {
+        if (thread.joinable()) {
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                stopping = true;
             }
+            cv.notify_all();
+            thread.join();
+            std::lock_guard<std::mutex> lock(mutex);
+            flush();
         }
-        condition_tasks.notify_one();
-        return 0;
     }
 
-    // Add a new task, but defer until one slot is available
-    void defer(server_task && task) {
-        std::unique_lock<std::mutex> lock(mutex_tasks);
-        QUE_DBG("defer task, id = %d\n", task.id);
-        queue_tasks_deferred.push_back(std::move(task));
-        condition_tasks.notify_one();
+    bool enabled() const {
+        return n_entries > 0;
     }
 
-    // Get the next id for creating a new task
-    int get_new_id() {
-        std::unique_lock<std::mutex> lock(mutex_tasks);
-        int new_id = id++;
-        return new_id;
+    // 0 when disabled
+    uint64_t new_trace_id() {
+        if (!enabled()) {
+            return 0;
+        }
+        // splitmix64 of a counter: unique and not guessable from the previous ids
+        uint64_t z = seed + (n_ids.fetch_add(1, std::memory_order_relaxed) + 1) * 0x9e3779b97f4a7c15ULL;
+        z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+        z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+        z =  z ^ (z >> 31);
+        return z != 0 ? z : 1;
     }
 
-    // Register function to process a new task
-    void on_new_task(std::function<void(server_task &&)> callback) {
-        callback_new_task = std::move(callback);
+    void record(const server_trace_span & span) {
+        if (span.trace_id == 0 || !enabled()) {
+            return;
+        }
+        const uint64_t i = head.fetch_add(1, std::memory_order_relaxed);
+        entry & e = entries[i % n_entries];
+        e.seq.store(2 * i + 1, std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_release);
+        e.trace_id.store(span.trace_id, std::memory_order_relaxed);
+        e.name    .store(span.name,     std::memory_order_relaxed);
+        e.t_start .store(span.t_start,  std::memory_order_relaxed);
+        e.t_end   .store(span.t_end,    std::memory_order_relaxed);
+        e.id_slot .store(span.id_slot,  std::memory_order_relaxed);
+        e.n_batch .store(span.n_batch,  std::memory_order_relaxed);
+        e.n_tokens.store(span.n_tokens, std::memory_order_relaxed);
+        e.seq.store(2 * i + 2, std::memory_order_release);
     }
 
-    // Register the function to be called when all slots data is ready to be processed
-    void on_update_slots(std::function<void(void)> callback) {
-        callback_update_slots = std::move(callback);
+    // the span started at t_start ends now
+    void record(uint64_t trace_id, const char * name, int64_t t_start, int32_t id_slot = -1, int32_t n_batch = 0, int32_t n_tokens = 0) {
+        if (trace_id == 0) {
+            return;
+        }
+        server_trace_span span;
+        span.trace_id = trace_id;
+        span.name     = name;
+        span.t_start  = t_start;
+        span.t_end    = ggml_time_us();
+        span.id_slot  = id_slot;
+        span.n_batch  = n_batch;
+        span.n_tokens = n_tokens;
+        record(span);
     }
 
-    // Call when the state of one slot is changed, it will move one task from deferred to main queue
-    void pop_deferred_task() {
-        std::unique_lock<std::mutex> lock(mutex_tasks);
-        if (!queue_tasks_deferred.empty()) {
-            queue_tasks.emplace_back(std::move(queue_tasks_deferred.front()));
-            queue_tasks_deferred.pop_front();
+    // false if the span of index i is not complete, or was overwritten
+    bool read(uint64_t i, server_trace_span & span) const {
+        const entry & e = entries[i % n_entries];
+        const uint64_t seq = e.seq.load(std::memory_order_acquire);
+        if (seq != 2 * i + 2) {
+            return false;
         }
-        condition_tasks.notify_one();
+        span.trace_id = e.trace_id.load(std::memory_order_relaxed);
+        span.name     = e.name    .load(std::memory_order_relaxed);
+        span.t_start  = e.t_start .load(std::memory_order_relaxed);
+        span.t_end    = e.t_end   .load(std::memory_order_relaxed);
+        span.id_slot  = e.id_slot .load(std::memory_order_relaxed);
+        span.n_batch  = e.n_batch .load(std::memory_order_relaxed);
+        span.n_tokens = e.n_tokens.load(std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_acquire);
+        return e.seq.load(std::memory_order_relaxed) == seq;
     }
 
-    // end the start_loop routine
-    void terminate() {
-        std::unique_lock<std::mutex> lock(mutex_tasks);
-        running = false;
-        condition_tasks.notify_all();
+    // the spans of a request still in the buffer, in the order they ended
+    std::vector<server_trace_span> find(uint64_t trace_id) const {
+        std::vector<server_trace_span> spans;
+        if (!enabled()) {
+            return spans;
+        }
+        const uint64_t end = head.load(std::memory_order_acquire);
+        server_trace_span span;
+        for (uint64_t i = end > n_entries ? end - n_entries : 0; i < end; i++) {
+            if (read(i, span) && span.trace_id == trace_id) {
+                spans.push_back(span);
+            }
+        }
+        return spans;
     }
 
-    /**
-     * Main loop consists of these steps:
-     * - Wait until a new task arrives
-     * - Process the task (i.e. maybe copy data into slot)
-     * - Check if multitask is finished
-     * - Update all slots
-     */
-    void start_loop() {
-        running = true;
-
-        while (true) {
-            QUE_DBG("%s", "processing new tasks\n");
-
-            while (true) {
-                std::unique_lock<std::mutex> lock(mutex_tasks);
-                if (!running) {
-                    QUE_DBG("%s", "terminate\n");
-                    return;
-                }
-                if (queue_tasks.empty()) {
-                    lock.unlock();
+    // the caller holds mutex
+    void flush() {
+        const uint64_t end = head.load(std::memory_order_acquire);
+        if (end - n_flushed > n_entries) {
+            n_dropped += end - n_entries - n_flushed;
+            n_flushed  = end - n_entries;
+        }
+        server_trace_span span;
+        for (; n_flushed < end; n_flushed++) {
+            if (!read(n_flushed, span)) {
+                // still being written: the next flush picks it up, unless it is overwritten by then
+                if (entries[n_flushed % n_entries].seq.load(std::memory_order_acquire) < 2 * n_flushed + 2) {
                     break;
                 }
-                server_task task = std::move(queue_tasks.front());
-                queue_tasks.pop_front();
-                lock.unlock();
-
-                QUE_DBG("processing task, id = %d\n", task.id);
-                callback_new_task(std::move(task));
-            }
-
-            // all tasks in the current loop is processed, slots data is now ready
-            QUE_DBG("%s", "update slots\n");
-
-            callback_update_slots();
-
-            QUE_DBG("%s", "waiting for new tasks\n");
-            {
-                std::unique_lock<std::mutex> lock(mutex_tasks);
-                if (!running) {
-                    QUE_DBG("%s", "terminate\n");
-                    return;
-                }
-                if (queue_tasks.empty()) {
-                    condition_tasks.wait(lock, [&]{
-                        return (!queue_tasks.empty() || !running);
-                    });
-                }
+                n_dropped++;
+                continue;
             }
+            file << span.to_json().dump() << ",\n";
         }
-    }
-
-private:
-    void cleanup_pending_task(int id_target) {
-        // no need lock because this is called exclusively by post()
-        auto rm_func = [id_target](const server_task & task) {
-            return task.id_target == id_target;
-        };
-        queue_tasks.erase(
-            std::remove_if(queue_tasks.begin(),          queue_tasks.end(),          rm_func),
-            queue_tasks.end());
-        queue_tasks_deferred.erase(
-            std::remove_if(queue_tasks_deferred.begin(), queue_tasks_deferred.end(), rm_func),
-            queue_tasks_deferred.end());
+        file.flush();
     }
 };
 
-struct server_response {
-    bool running = true;
+// process-wide: the slots of every context (generation, RAG models, model pool) record in the same buffer
+static server_tracer tracer;
 
-    // for keeping track of all tasks waiting for the result
-    std::unordered_set<int> waiting_task_ids;
+// the trace id of a request, from its X-Trace-Id response header (set by the pre-routing handler), 0 if not traced
+static uint64_t request_trace_id(const httplib::Response & res) {
+    if (!tracer.enabled()) {
+        return 0;
+    }
+    const std::string id = res.get_header_value("X-Trace-Id");
+    return id.empty() ? 0 : std::strtoull(id.c_str(), nullptr, 16);
+}
 
-    // the main result queue (using ptr for polymorphism)
-    std::vector<server_task_result_ptr> queue_results;
+// max number of prompt tokens in a batch that also decodes the tokens of generating slots, so that a long
+// prompt is prefilled in chunks between their tokens rather than stalling them for a full n_batch
+// with a target inter-token latency, the budget follows the measured duration of those batches
+struct server_prefill_budget {
+    int32_t n_min     = 0; // the prompts always make progress
+    int32_t n_max     = 0;
+    int32_t n_current = 0;
+    int64_t t_target_us = 0; // 0 = fixed budget
+
+    void init(int32_t n_budget, int32_t n_batch, int32_t n_ubatch, int32_t target_itl_ms) {
+        n_max       = n_budget < 0 ? n_batch : std::min(n_budget == 0 ? n_ubatch : n_budget, n_batch);
+        n_min       = std::min(n_max, 32);
+        n_current   = n_max;
+        t_target_us = (int64_t) target_itl_ms * 1000;
+    }
 
-    std::mutex mutex_results;
-    std::condition_variable condition_results;
+    // prompt tokens allowed in a batch that already holds n_decode tokens of generating slots
+    int32_t limit(int32_t n_decode) const {
+        return n_decode > 0 ? n_current : INT32_MAX;
+    }
 
-    // add the id_task to the list of tasks waiting for response
+    // duration of a batch holding both n_decode generation tokens and n_prompt prompt tokens
+    void on_batch(int32_t n_decode, int32_t n_prompt, int64_t t_us) {
+        if (t_target_us <= 0 || n_decode == 0 || n_prompt == 0) {
+            return;
+        }
+        if (t_us > t_target_us) {
+            // the prompt share of the batch is what can be cut: scale it down in proportion of the overshoot
+            n_current = std::max(n_min, (int32_t) (n_current * t_target_us / t_us));
+        } else if (t_us < t_target_us * 9 / 10 && n_prompt >= n_current) {
+            // grow slowly, and only when the budget was the limit
+            n_current = std::min(n_max, n_current + std::max(n_min, n_current / 8));
+        }
+    }
+};
+
+// spill tier of the KV cache: the cached prompts that the slots drop are kept in host RAM, then written to disk
+// (optionally encrypted with a key held in memory only) by a background thread, and loaded back into a slot when
+// a later prompt starts with them
+struct server_kv_spill {
+    // a spilled prompt shorter than this (or that saves less than this) is not worth the copy
+    static constexpr size_t n_min_tokens = 64;
+
+    struct entry {
+        uint64_t id = 0;
+        llama_tokens tokens;
+        std::vector<common_adapter_lora_info> lora;
+        std::vector<uint8_t> state; // llama_state_seq_get_data, empty once on disk
+        size_t n_bytes = 0;
+        int64_t t_last_used = 0;
+
+        bool on_disk = false;
+        bool writing = false;
+        bool taken   = false; // loaded back or dropped, while the writer had it
+        aes_gcm_nonce nonce = {};
+        aes_gcm_tag   tag   = {};
+    };
+
+    size_t ram_max  = 0; // 0 = disabled
+    size_t disk_max = 0;
+    std::string dir;
+    bool encrypt = false;
+    aes256_key key = {};
+
+    size_t   ram_used  = 0;
+    size_t   disk_used = 0;
+    uint64_t n_spilled       = 0;
+    uint64_t n_restored      = 0;
+    uint64_t n_restored_disk = 0;
+
+    std::mutex mutex;
+    std::condition_variable cv;
+    std::list<std::shared_ptr<entry>> entries; // least recently used first
+    uint64_t id_next = 0;
+    bool stopping = false;
+    std::thread writer;
+
+    ~server_kv_spill() {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            stopping = true;
+        }
+        cv.notify_all();
+        if (writer.joinable()) {
+            writer.join();
+        }
+        for (const auto & e : entries) {
+            if (e->on_disk) {
+                std::error_code ec;
+                std::filesystem::remove(path(*e), ec);
+            }
+        }
+    }
+
+    void init(size_t ram_mib, const std::string & spill_dir, size_t disk_mib, bool spill_encrypt) {
+        ram_max  = ram_mib  * 1024 * 1024;
+        disk_max = disk_mib * 1024 * 1024;
+        dir      = spill_dir;
+        encrypt  = spill_encrypt;
+        if (ram_max == 0) {
+            return;
+        }
+        if (encrypt && RAND_bytes(key.data(), key.size()) != 1) {
+            throw std::runtime_error("RAND_bytes failed");
+        }
+        if (!dir.empty() && disk_max > 0) {
+            std::filesystem::create_directories(dir);
+            writer = std::thread([this]() { write_loop(); });
+        }
+    }
+
+    bool enabled() const {
+        return ram_max > 0;
+    }
+
+    // keep the KV cache of seq, which holds tokens
+    void spill(llama_context * ctx, llama_seq_id seq, const llama_tokens & tokens, const std::vector<common_adapter_lora_info> & lora) {
+        auto e = std::make_shared<entry>();
+        e->state.resize(llama_state_seq_get_size(ctx, seq));
+        if (e->state.empty() || e->state.size() > ram_max || llama_state_seq_get_data(ctx, e->state.data(), e->state.size(), seq) != e->state.size()) {
+            return;
+        }
+        e->tokens      = tokens;
+        e->lora        = lora;
+        e->n_bytes     = e->state.size();
+        e->t_last_used = ggml_time_us();
+
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            e->id = id_next++;
+            ram_used += e->n_bytes;
+            n_spilled++;
+            entries.push_back(e);
+
+            // without a disk tier, the least recently used prompts are dropped right away
+            if (!writer.joinable()) {
+                for (auto it = entries.begin(); it != entries.end() && ram_used > ram_max; ) {
+                    ram_used -= (*it)->n_bytes;
+                    it = entries.erase(it);
+                }
+            }
+        }
+        cv.notify_all();
+    }
+
+    // take out the spilled prompt that shares the longest prefix with prompt, if it is at least n_min tokens
+    std::shared_ptr<entry> take(const llama_tokens & prompt, size_t n_min, const std::vector<common_adapter_lora_info> & lora, size_t & n_match) {
+        std::unique_lock<std::mutex> lock(mutex);
+
+        auto best = entries.end();
+        n_match = 0;
+        for (auto it = entries.begin(); it != entries.end(); ++it) {
+            const llama_tokens & tokens = (*it)->tokens;
+            size_t n = 0;
+            while (n < tokens.size() && n < prompt.size() && tokens[n] == prompt[n]) {
+                n++;
+            }
+            if (n >= n_min && n > n_match && are_lora_equal((*it)->lora, lora)) {
+                n_match = n;
+                best = it;
+            }
+        }
+        if (best == entries.end()) {
+            return nullptr;
+        }
+
+        std::shared_ptr<entry> e = *best;
+        entries.erase(best);
+        e->taken = true;
+        if (e->on_disk) {
+            disk_used -= e->n_bytes;
+        } else {
+            ram_used -= e->n_bytes;
+        }
+
+        // the state being written is kept in RAM, wait for the writer to let go of it
+        cv.wait(lock, [&e]() { return !e->writing; });
+
+        return e;
+    }
+
+    // load a taken entry into the (empty) sequence seq
+    bool load(llama_context * ctx, llama_seq_id seq, entry & e) {
+        std::vector<uint8_t> state;
+        if (e.on_disk) {
+            const std::string file_path = path(e);
+            {
+                std::ifstream file(file_path, std::ios::binary);
+                state.assign(std::istreambuf_iterator<char>(file), std::istreambuf_iterator<char>());
+            }
+            std::error_code ec;
+            std::filesystem::remove(file_path, ec);
+
+            if (encrypt) {
+                std::vector<uint8_t> plaintext;
+                if (!CryptoUtils::aes256GcmDecrypt(state, e.tag, key, e.nonce, aad(e), plaintext)) {
+                    return false;
+                }
+                state.swap(plaintext);
+            }
+            if (state.size() != e.n_bytes) {
+                return false;
+            }
+        } else {
+            // the writer never touches a taken entry
+            state.swap(e.state);
+        }
+
+        const bool ok = llama_state_seq_set_data(ctx, state.data(), state.size(), seq) != 0;
+        if (encrypt) {
+            OPENSSL_cleanse(state.data(), state.size());
+        }
+
+        std::lock_guard<std::mutex> lock(mutex);
+        n_restored++;
+        n_restored_disk += e.on_disk;
+        return ok;
+    }
+
+    // drop all the spilled prompts, e.g. when the model changes
+    void clear() {
+        std::lock_guard<std::mutex> lock(mutex);
+        for (const auto & e : entries) {
+            // the writer removes the file of an entry it is writing
+            e->taken = true;
+            if (e->on_disk) {
+                std::error_code ec;
+                std::filesystem::remove(path(*e), ec);
+            }
+        }
+        entries.clear();
+        ram_used  = 0;
+        disk_used = 0;
+    }
+
+    void get_usage(size_t & ram, size_t & disk) {
+        std::lock_guard<std::mutex> lock(mutex);
+        ram  = ram_used;
+        disk = disk_used;
+    }
+
+private:
+    std::string path(const entry & e) const {
+        return (std::filesystem::path(dir) / string_format("%d-%" PRIu64 ".kv", (int) getpid(), e.id)).string();
+    }
+
+    // the id of the entry is authenticated, so that a spill file cannot be swapped for another one
+    static std::vector<uint8_t> aad(const entry & e) {
+        return std::vector<uint8_t>((const uint8_t *) &e.id, (const uint8_t *) &e.id + sizeof(e.id));
+    }
+
+    // move the least recently used prompts to disk while the RAM is over its limit, and drop the least recently
+    // used ones from disk while the disk is
+    void write_loop() {
+        std::unique_lock<std::mutex> lock(mutex);
+        while (true) {
+            cv.wait(lock, [this]() { return stopping || ram_used > ram_max; });
+            if (stopping) {
+                break;
+            }
+
+            std::shared_ptr<entry> e;
+            for (const auto & it : entries) {
+                if (!it->on_disk) {
+                    e = it;
+                    break;
+                }
+            }
+            if (!e) {
+                continue;
+            }
+            e->writing = true;
+            lock.unlock();
+
+            const std::string file_path = path(*e);
+            bool ok = true;
+            try {
+                std::vector<uint8_t> ciphertext;
+                if (encrypt) {
+                    e->nonce = CryptoUtils::generateNonce();
+                    CryptoUtils::aes256GcmEncrypt(e->state, key, e->nonce, aad(*e), ciphertext, e->tag);
+                }
+                const std::vector<uint8_t> & data = encrypt ? ciphertext : e->state;
+                std::ofstream file(file_path, std::ios::binary | std::ios::trunc);
+                file.write((const char *) data.data(), data.size());
+                ok = (bool) file;
+            } catch (const std::exception & ex) {
+                SRV_WRN("failed to spill a cached prompt to disk: %s\n", ex.what());
+                ok = false;
+            }
+
+            lock.lock();
+            e->writing = false;
+            cv.notify_all();
+            if (e->taken || !ok) {
+                // loaded back in the meantime, or not written: the entry leaves the RAM either way
+                std::error_code ec;
+                std::filesystem::remove(file_path, ec);
+                if (!e->taken) {
+                    entries.remove(e);
+                    ram_used -= e->n_bytes;
+                }
+                continue;
+            }
+
+            std::vector<uint8_t>().swap(e->state);
+            e->on_disk = true;
+            ram_used  -= e->n_bytes;
+            disk_used += e->n_bytes;
+
+            for (auto it = entries.begin(); it != entries.end() && disk_used > disk_max; ) {
+                if (!(*it)->on_disk) {
+                    ++it;
+                    continue;
+                }
+                std::error_code ec;
+                std::filesystem::remove(path(**it), ec);
+                disk_used -= (*it)->n_bytes;
+                it = entries.erase(it);
+            }
+        }
+    }
+};
+
+// tasks waiting for a slot: the classes are served by strict priority, and the tenants (API keys) of a class
+// by start-time fair queuing with the prompt size as cost, so that a tenant posting many or long prompts
+// does not hold back the others
+struct server_deferred_queue {
+    struct tenant_queue {
+        std::deque<server_task> tasks;
+        double t_virtual = 0; // virtual start time of the head task
+    };
+
+    struct class_queue {
+        std::map<std::string, tenant_queue> tenants;
+        double t_virtual = 0; // virtual time of the class: start time of the last task served
+        size_t n_tasks   = 0;
+    };
+
+    class_queue classes[SERVER_TASK_PRIORITY_COUNT];
+
+    // front: a preempted task, resumed before the other tasks of its tenant
+    void push(server_task && task, bool front = false) {
+        auto & cls    = classes[task.priority];
+        auto & tenant = cls.tenants[task.tenant];
+        if (tenant.tasks.empty()) {
+            // a tenant does not build up credit while it has nothing queued
+            tenant.t_virtual = std::max(tenant.t_virtual, cls.t_virtual);
+        }
+        if (front) {
+            tenant.tasks.push_front(std::move(task));
+        } else {
+            tenant.tasks.push_back(std::move(task));
+        }
+        cls.n_tasks++;
+    }
+
+    // move the next task to 'queue', false if there is none
+    bool pop(std::deque<server_task> & queue) {
+        for (auto & cls : classes) {
+            if (cls.n_tasks == 0) {
+                continue;
+            }
+            auto next = cls.tenants.end();
+            for (auto it = cls.tenants.begin(); it != cls.tenants.end(); ++it) {
+                if (!it->second.tasks.empty() && (next == cls.tenants.end() || it->second.t_virtual < next->second.t_virtual)) {
+                    next = it;
+                }
+            }
+            auto & tenant = next->second;
+            server_task & task = tenant.tasks.front();
+            cls.t_virtual     = tenant.t_virtual;
+            tenant.t_virtual += std::max<size_t>(1, task.prompt_tokens.size());
+            queue.emplace_back(std::move(task));
+            tenant.tasks.pop_front();
+            cls.n_tasks--;
+            if (tenant.tasks.empty()) {
+                // an idle tenant is forgotten, its next task starts at the virtual time of the class
+                cls.tenants.erase(next);
+            }
+            return true;
+        }
+        return false;
+    }
+
+    template <typename F>
+    void erase_if(F && pred) {
+        for (auto & cls : classes) {
+            for (auto it = cls.tenants.begin(); it != cls.tenants.end();) {
+                auto & tasks = it->second.tasks;
+                const size_t n = tasks.size();
+                tasks.erase(std::remove_if(tasks.begin(), tasks.end(), pred), tasks.end());
+                cls.n_tasks -= n - tasks.size();
+                it = tasks.empty() ? cls.tenants.erase(it) : std::next(it);
+            }
+        }
+    }
+
+    size_t size() const {
+        size_t n = 0;
+        for (const auto & cls : classes) {
+            n += cls.n_tasks;
+        }
+        return n;
+    }
+
+    size_t size(server_task_priority priority) const {
+        return classes[priority].n_tasks;
+    }
+
+    // number of tasks served before a new task of this priority
+    size_t n_ahead(server_task_priority priority) const {
+        size_t n = 0;
+        for (int i = 0; i <= priority; i++) {
+            n += classes[i].n_tasks;
+        }
+        return n;
+    }
+};
+
+struct server_queue {
+    int id = 0;
+    bool running;
+
+    // queues
+    std::deque<server_task> queue_tasks;
+    server_deferred_queue   queue_tasks_deferred;
+
+    std::mutex mutex_tasks;
+    std::condition_variable condition_tasks;
+
+    // callback functions
+    std::function<void(server_task &&)> callback_new_task;
+    std::function<void(void)>           callback_update_slots;
+
+    // Add a new task to the end of the queue
+    int post(server_task && task, bool front = false) {
+        std::unique_lock<std::mutex> lock(mutex_tasks);
+        GGML_ASSERT(task.id != -1);
+        // if this is cancel task make sure to clean up pending tasks
+        if (task.type == SERVER_TASK_TYPE_CANCEL) {
+            cleanup_pending_task(task.id_target);
+        }
+        const int task_id = task.id;
+        if (task.t_queued == 0) {
+            task.t_queued = ggml_time_us();
+        }
+        QUE_DBG("new task, id = %d, front = %d\n", task_id, front);
+        if (front) {
+            queue_tasks.push_front(std::move(task));
+        } else {
+            queue_tasks.push_back(std::move(task));
+        }
+        condition_tasks.notify_one();
+        return task_id;
+    }
+
+    // multi-task version of post()
+    int post(std::vector<server_task> && tasks, bool front = false) {
+        std::unique_lock<std::mutex> lock(mutex_tasks);
+        for (auto & task : tasks) {
+            if (task.id == -1) {
+                task.id = id++;
+            }
+            // if this is cancel task make sure to clean up pending tasks
+            if (task.type == SERVER_TASK_TYPE_CANCEL) {
+                cleanup_pending_task(task.id_target);
+            }
+            if (task.t_queued == 0) {
+                task.t_queued = ggml_time_us();
+            }
+            QUE_DBG("new task, id = %d/%d, front = %d\n", task.id, (int) tasks.size(), front);
+            if (front) {
+                queue_tasks.push_front(std::move(task));
+            } else {
+                queue_tasks.push_back(std::move(task));
+            }
+        }
+        condition_tasks.notify_one();
+        return 0;
+    }
+
+    // Add a new task, but defer until one slot is available
+    // front: the task was preempted, it resumes before the other tasks of its tenant
+    void defer(server_task && task, bool front = false) {
+        std::unique_lock<std::mutex> lock(mutex_tasks);
+        QUE_DBG("defer task, id = %d, priority = %s\n", task.id, server_task_priority_name(task.priority));
+        queue_tasks_deferred.push(std::move(task), front);
+        condition_tasks.notify_one();
+    }
+
+    size_t n_deferred() {
+        std::unique_lock<std::mutex> lock(mutex_tasks);
+        return queue_tasks_deferred.size();
+    }
+
+    size_t n_deferred(server_task_priority priority) {
+        std::unique_lock<std::mutex> lock(mutex_tasks);
+        return queue_tasks_deferred.size(priority);
+    }
+
+    size_t n_deferred_ahead(server_task_priority priority) {
+        std::unique_lock<std::mutex> lock(mutex_tasks);
+        return queue_tasks_deferred.n_ahead(priority);
+    }
+
+    // Get the next id for creating a new task
+    int get_new_id() {
+        std::unique_lock<std::mutex> lock(mutex_tasks);
+        int new_id = id++;
+        return new_id;
+    }
+
+    // Register function to process a new task
+    void on_new_task(std::function<void(server_task &&)> callback) {
+        callback_new_task = std::move(callback);
+    }
+
+    // Register the function to be called when all slots data is ready to be processed
+    void on_update_slots(std::function<void(void)> callback) {
+        callback_update_slots = std::move(callback);
+    }
+
+    // Call when the state of one slot is changed, it will move one task from deferred to main queue
+    void pop_deferred_task() {
+        std::unique_lock<std::mutex> lock(mutex_tasks);
+        queue_tasks_deferred.pop(queue_tasks);
+        condition_tasks.notify_one();
+    }
+
+    // end the start_loop routine
+    void terminate() {
+        std::unique_lock<std::mutex> lock(mutex_tasks);
+        running = false;
+        condition_tasks.notify_all();
+    }
+
+    /**
+     * Main loop consists of these steps:
+     * - Wait until a new task arrives
+     * - Process the task (i.e. maybe copy data into slot)
+     * - Check if multitask is finished
+     * - Update all slots
+     */
+    void start_loop() {
+        running = true;
+
+        while (true) {
+            QUE_DBG("%s", "processing new tasks\n");
+
+            while (true) {
+                std::unique_lock<std::mutex> lock(mutex_tasks);
+                if (!running) {
+                    QUE_DBG("%s", "terminate\n");
+                    return;
+                }
+                if (queue_tasks.empty()) {
+                    lock.unlock();
+                    break;
+                }
+                server_task task = std::move(queue_tasks.front());
+                queue_tasks.pop_front();
+                lock.unlock();
+
+                QUE_DBG("processing task, id = %d\n", task.id);
+                callback_new_task(std::move(task));
+            }
+
+            // all tasks in the current loop is processed, slots data is now ready
+            QUE_DBG("%s", "update slots\n");
+
+            callback_update_slots();
+
+            QUE_DBG("%s", "waiting for new tasks\n");
+            {
+                std::unique_lock<std::mutex> lock(mutex_tasks);
+                if (!running) {
+                    QUE_DBG("%s", "terminate\n");
+                    return;
+                }
+                if (queue_tasks.empty()) {
+                    condition_tasks.wait(lock, [&]{
+                        return (!queue_tasks.empty() || !running);
+                    });
+                }
+            }
+        }
+    }
+
+private:
+    void cleanup_pending_task(int id_target) {
+        // no need lock because this is called exclusively by post()
+        auto rm_func = [id_target](const server_task & task) {
+            return task.id_target == id_target;
+        };
+        queue_tasks.erase(
+            std::remove_if(queue_tasks.begin(),          queue_tasks.end(),          rm_func),
+            queue_tasks.end());
+        queue_tasks_deferred.erase_if(rm_func);
+    }
+};
+
+// results of one request (one or more tasks registered together), consumed by the HTTP thread of the request
+struct server_result_channel {
+    std::mutex mutex;
+    std::condition_variable cv;
+    std::deque<server_task_result_ptr> results;
+    bool waiting = false; // the consumer is blocked on cv
+};
+
+using server_result_channel_ptr = std::shared_ptr<server_result_channel>;
+
+struct server_response {
+    std::atomic<bool> running = true;
+
+    // for keeping track of all tasks waiting for the result: the channel of each waiting task,
+    // shared by the tasks registered together
+    std::unordered_map<int, server_result_channel_ptr> waiting_task_ids;
+
+    // only guards the lookup of the channels; the results are queued under the lock of their channel,
+    // so that a result only wakes up the thread waiting for it
+    std::mutex mutex_results;
+
+    // add the id_task to the list of tasks waiting for response
     void add_waiting_task_id(int id_task) {
         SRV_DBG("add task %d to waiting list. current waiting = %d (before add)\n", id_task, (int) waiting_task_ids.size());
 
+        auto channel = std::make_shared<server_result_channel>();
         std::unique_lock<std::mutex> lock(mutex_results);
-        waiting_task_ids.insert(id_task);
+        waiting_task_ids[id_task] = std::move(channel);
     }
 
     void add_waiting_tasks(const std::vector<server_task> & tasks) {
+        auto channel = std::make_shared<server_result_channel>();
         std::unique_lock<std::mutex> lock(mutex_results);
 
         for (const auto & task : tasks) {
             SRV_DBG("add task %d to waiting list. current waiting = %d (before add)\n", task.id, (int) waiting_task_ids.size());
-            waiting_task_ids.insert(task.id);
+            waiting_task_ids[task.id] = channel;
         }
     }
 
@@ -1860,14 +2928,23 @@ struct server_response {
     void remove_waiting_task_id(int id_task) {
         SRV_DBG("remove task %d from waiting list. current waiting = %d (before remove)\n", id_task, (int) waiting_task_ids.size());
 
-        std::unique_lock<std::mutex> lock(mutex_results);
-        waiting_task_ids.erase(id_task);
+        server_result_channel_ptr channel;
+        {
+            std::unique_lock<std::mutex> lock(mutex_results);
+            auto it = waiting_task_ids.find(id_task);
+            if (it == waiting_task_ids.end()) {
+                return;
+            }
+            channel = std::move(it->second);
+            waiting_task_ids.erase(it);
+        }
         // make sure to clean up all pending results
-        queue_results.erase(
-            std::remove_if(queue_results.begin(), queue_results.end(), [id_task](const server_task_result_ptr & res) {
+        std::unique_lock<std::mutex> lock(channel->mutex);
+        channel->results.erase(
+            std::remove_if(channel->results.begin(), channel->results.end(), [id_task](const server_task_result_ptr & res) {
                 return res->id == id_task;
             }),
-            queue_results.end());
+            channel->results.end());
     }
 
     void remove_waiting_task_ids(const std::unordered_set<int> & id_tasks) {
@@ -1879,55 +2956,34 @@ struct server_response {
         }
     }
 
+    size_t n_waiting() {
+        std::unique_lock<std::mutex> lock(mutex_results);
+        return waiting_task_ids.size();
+    }
+
     // This function blocks the thread until there is a response for one of the id_tasks
     server_task_result_ptr recv(const std::unordered_set<int> & id_tasks) {
-        while (true) {
-            std::unique_lock<std::mutex> lock(mutex_results);
-            condition_results.wait(lock, [&]{
-                if (!running) {
-                    SRV_DBG("%s : queue result stop\n", __func__);
-                    std::terminate(); // we cannot return here since the caller is HTTP code
-                }
-                return !queue_results.empty();
-            });
-
-            for (size_t i = 0; i < queue_results.size(); i++) {
-                if (id_tasks.find(queue_results[i]->id) != id_tasks.end()) {
-                    server_task_result_ptr res = std::move(queue_results[i]);
-                    queue_results.erase(queue_results.begin() + i);
-                    return res;
-                }
-            }
-        }
-
-        // should never reach here
+        std::vector<server_task_result_ptr> results;
+        wait_results(id_tasks, nullptr, results, 1);
+        return std::move(results.front());
     }
 
     // same as recv(), but have timeout in seconds
     // if timeout is reached, nullptr is returned
     server_task_result_ptr recv_with_timeout(const std::unordered_set<int> & id_tasks, int timeout) {
-        while (true) {
-            std::unique_lock<std::mutex> lock(mutex_results);
-
-            for (int i = 0; i < (int) queue_results.size(); i++) {
-                if (id_tasks.find(queue_results[i]->id) != id_tasks.end()) {
-                    server_task_result_ptr res = std::move(queue_results[i]);
-                    queue_results.erase(queue_results.begin() + i);
-                    return res;
-                }
-            }
-
-            std::cv_status cr_res = condition_results.wait_for(lock, std::chrono::seconds(timeout));
-            if (!running) {
-                SRV_DBG("%s : queue result stop\n", __func__);
-                std::terminate(); // we cannot return here since the caller is HTTP code
-            }
-            if (cr_res == std::cv_status::timeout) {
-                return nullptr;
-            }
+        std::vector<server_task_result_ptr> results;
+        const auto deadline = std::chrono::steady_clock::now() + std::chrono::seconds(timeout);
+        if (!wait_results(id_tasks, &deadline, results, 1)) {
+            return nullptr;
         }
+        return std::move(results.front());
+    }
 
-        // should never reach here
+    // same as recv_with_timeout(), but takes all the results already queued for id_tasks, e.g. the tokens
+    // generated since the last call of a streaming request; false if the timeout is reached
+    bool recv_all_with_timeout(const std::unordered_set<int> & id_tasks, int timeout, std::vector<server_task_result_ptr> & results) {
+        const auto deadline = std::chrono::steady_clock::now() + std::chrono::seconds(timeout);
+        return wait_results(id_tasks, &deadline, results, SIZE_MAX);
     }
 
     // single-task version of recv()
@@ -1940,22 +2996,287 @@ struct server_response {
     void send(server_task_result_ptr && result) {
         SRV_DBG("sending result for task id = %d\n", result->id);
 
-        std::unique_lock<std::mutex> lock(mutex_results);
-        for (const auto & id_task : waiting_task_ids) {
-            if (result->id == id_task) {
-                SRV_DBG("task id = %d pushed to result queue\n", result->id);
-
-                queue_results.emplace_back(std::move(result));
-                condition_results.notify_all();
+        server_result_channel_ptr channel;
+        {
+            std::unique_lock<std::mutex> lock(mutex_results);
+            auto it = waiting_task_ids.find(result->id);
+            if (it == waiting_task_ids.end()) {
                 return;
             }
+            channel = it->second;
+        }
+
+        SRV_DBG("task id = %d pushed to result queue\n", result->id);
+
+        bool wake_up;
+        {
+            std::unique_lock<std::mutex> lock(channel->mutex);
+            channel->results.emplace_back(std::move(result));
+            wake_up = channel->waiting;
+            channel->waiting = false;
+        }
+        // the results sent while the consumer is busy are picked up with its next recv, without a wake up
+        if (wake_up) {
+            channel->cv.notify_one();
         }
     }
 
     // terminate the waiting loop
     void terminate() {
         running = false;
-        condition_results.notify_all();
+
+        std::vector<server_result_channel_ptr> channels;
+        {
+            std::unique_lock<std::mutex> lock(mutex_results);
+            for (const auto & it : waiting_task_ids) {
+                channels.push_back(it.second);
+            }
+        }
+        for (auto & channel : channels) {
+            // taken so that a consumer cannot miss the notification between its check of running and its wait
+            std::unique_lock<std::mutex> lock(channel->mutex);
+            channel->cv.notify_all();
+        }
+    }
+
+private:
+    server_result_channel_ptr find_channel(const std::unordered_set<int> & id_tasks) {
+        std::unique_lock<std::mutex> lock(mutex_results);
+        for (const auto & id_task : id_tasks) {
+            auto it = waiting_task_ids.find(id_task);
+            if (it != waiting_task_ids.end()) {
+                return it->second;
+            }
+        }
+        return nullptr;
+    }
+
+    // move up to max_results results of id_tasks to results, waiting until deadline (forever if null)
+    // for the first one; false if the deadline is reached
+    bool wait_results(const std::unordered_set<int> & id_tasks, const std::chrono::steady_clock::time_point * deadline,
+            std::vector<server_task_result_ptr> & results, size_t max_results) {
+        server_result_channel_ptr channel = find_channel(id_tasks);
+        if (channel == nullptr) {
+            // nothing can be sent to tasks that are not waiting
+            if (deadline == nullptr) {
+                GGML_ABORT("recv on tasks that are not waiting for a result");
+            }
+            std::this_thread::sleep_until(*deadline);
+            return false;
+        }
+
+        std::unique_lock<std::mutex> lock(channel->mutex);
+        while (true) {
+            if (!running) {
+                SRV_DBG("%s : queue result stop\n", __func__);
+                std::terminate(); // we cannot return here since the caller is HTTP code
+            }
+
+            // all the tasks of a channel were registered together, but some of them may have been removed since
+            for (auto it = channel->results.begin(); it != channel->results.end() && results.size() < max_results; ) {
+                if (id_tasks.find((*it)->id) != id_tasks.end()) {
+                    results.push_back(std::move(*it));
+                    it = channel->results.erase(it);
+                } else {
+                    ++it;
+                }
+            }
+            if (!results.empty()) {
+                return true;
+            }
+
+            channel->waiting = true;
+            if (deadline == nullptr) {
+                channel->cv.wait(lock);
+            } else if (channel->cv.wait_until(lock, *deadline) == std::cv_status::timeout) {
+                channel->waiting = false;
+                if (!running) {
+                    SRV_DBG("%s : queue result stop\n", __func__);
+                    std::terminate(); // we cannot return here since the caller is HTTP code
+                }
+                return false;
+            }
+        }
+    }
+};
+
+// a model and what is loaded along with it (draft model, chat templates, multimodal projector): the one in use
+// by a server_context, or one loaded next to it for a model swap
+struct server_model {
+    common_params params;
+
+    common_init_result llama_init;
+    common_init_result llama_init_dft;
+
+    llama_context_params cparams_dft;
+
+    common_chat_templates_ptr chat_templates;
+
+    mtmd::context_ptr mctx;
+
+    bool load(const common_params & params_load) {
+        SRV_INF("loading model '%s'\n", params_load.model.path.c_str());
+
+        params = params_load;
+
+        llama_init = common_init_from_params(params);
+
+        llama_model   * model = llama_init.model.get();
+        llama_context * ctx   = llama_init.context.get();
+
+        if (model == nullptr) {
+            SRV_ERR("failed to load model, '%s'\n", params.model.path.c_str());
+            return false;
+        }
+
+        if (!params.speculative.model.path.empty() || !params.speculative.model.hf_repo.empty()) {
+            SRV_INF("loading draft model '%s'\n", params.speculative.model.path.c_str());
+
+            auto params_dft = params;
+
+            params_dft.devices      = params.speculative.devices;
+            params_dft.model        = params.speculative.model;
+            params_dft.n_ctx        = params.speculative.n_ctx == 0 ? params.n_ctx / (params.kv_page_size > 0 ? 1 : params.n_parallel) : params.speculative.n_ctx;
+            params_dft.n_gpu_layers = params.speculative.n_gpu_layers;
+            params_dft.n_parallel   = 1;
+
+            // force F16 KV cache for the draft model for extra performance
+            params_dft.cache_type_k = GGML_TYPE_F16;
+            params_dft.cache_type_v = GGML_TYPE_F16;
+
+            llama_init_dft = common_init_from_params(params_dft);
+
+            if (llama_init_dft.model == nullptr) {
+                SRV_ERR("failed to load draft model, '%s'\n", params.speculative.model.path.c_str());
+                return false;
+            }
+
+            if (!common_speculative_are_compatible(ctx, llama_init_dft.context.get())) {
+                SRV_ERR("the draft model '%s' is not compatible with the target model '%s'\n", params.speculative.model.path.c_str(), params.model.path.c_str());
+
+                return false;
+            }
+
+            const int n_ctx_dft = llama_n_ctx(llama_init_dft.context.get());
+
+            cparams_dft = common_context_params_to_llama(params_dft);
+            cparams_dft.n_batch = n_ctx_dft;
+
+            // the context is not needed - we will create one for each slot
+            llama_init_dft.context.reset();
+        }
+
+        chat_templates = common_chat_templates_init(model, params.chat_template);
+        try {
+            common_chat_format_example(chat_templates.get(), params.use_jinja);
+        } catch (const std::exception & e) {
+            SRV_WRN("%s: Chat template parsing error: %s\n", __func__, e.what());
+            SRV_WRN("%s: The chat template that comes with this model is not yet supported, falling back to chatml. This may cause the model to output suboptimal responses\n", __func__);
+            chat_templates = common_chat_templates_init(model, "chatml");
+        }
+
+        std::string & mmproj_path = params.mmproj.path;
+        if (!mmproj_path.empty()) {
+            mtmd_context_params mparams = mtmd_context_params_default();
+            mparams.use_gpu       = params.mmproj_use_gpu;
+            mparams.print_timings = false;
+            mparams.n_threads     = params.cpuparams.n_threads;
+            mparams.verbosity     = params.verbosity > 0 ? GGML_LOG_LEVEL_DEBUG : GGML_LOG_LEVEL_INFO;
+            mctx.reset(mtmd_init_from_file(mmproj_path.c_str(), model, mparams));
+            if (mctx == nullptr) {
+                SRV_ERR("failed to load multimodal model, '%s'\n", mmproj_path.c_str());
+                return false;
+            }
+            SRV_INF("loaded multimodal model, '%s'\n", mmproj_path.c_str());
+
+            if (params.ctx_shift) {
+                params.ctx_shift = false;
+                SRV_WRN("%s\n", "ctx_shift is not supported by multimodal, it will be disabled");
+            }
+
+            if (params.n_cache_reuse) {
+                params.n_cache_reuse = 0;
+                SRV_WRN("%s\n", "cache_reuse is not supported by multimodal, it will be disabled");
+            }
+
+            if (!params.speculative.model.path.empty()) {
+                SRV_ERR("%s\n", "err: speculative decode is not supported by multimodal");
+                return false;
+            }
+        }
+
+        return true;
+    }
+};
+
+// the HTTP threads use the model of a server_context inside the gate: a model swap closes it, which waits for the
+// requests inside to leave (for a bounded time) and turns the new ones away until the swap is done
+struct server_model_gate {
+    struct guard {
+        server_model_gate * gate;
+        bool closed;
+
+        guard(server_model_gate * gate, bool closed) : gate(gate), closed(closed) {}
+        guard(const guard &) = delete;
+        guard & operator=(const guard &) = delete;
+
+        ~guard() {
+            std::lock_guard<std::mutex> lock(gate->mutex);
+            if (closed) {
+                gate->closed = false;
+            } else {
+                gate->n_inside--;
+            }
+            gate->cv.notify_all();
+        }
+    };
+
+    // shared, so that a streamed response keeps it until its chunked content provider is done
+    using guard_ptr = std::shared_ptr<guard>;
+
+    std::mutex mutex;
+    std::condition_variable cv;
+    int  n_inside = 0;
+    bool closed   = false;
+    int64_t t_reopen_us = 0; // when a closed gate is expected to open again
+
+    // the model can be used until the guard is released, waiting for a pending swap to be done
+    guard_ptr use() {
+        std::unique_lock<std::mutex> lock(mutex);
+        cv.wait(lock, [this]() { return !closed; });
+        n_inside++;
+        return std::make_shared<guard>(this, false);
+    }
+
+    // same, without waiting: nullptr while a swap is pending
+    guard_ptr try_use() {
+        std::lock_guard<std::mutex> lock(mutex);
+        if (closed) {
+            return nullptr;
+        }
+        n_inside++;
+        return std::make_shared<guard>(this, false);
+    }
+
+    // seconds after which a request turned away by try_use() can be retried
+    int retry_after() {
+        std::lock_guard<std::mutex> lock(mutex);
+        return std::max<int64_t>(1, (t_reopen_us - ggml_time_us() + 999999) / 1000000);
+    }
+
+    // no request uses the model until the guard is released; nullptr if the requests inside did not leave within
+    // t_drain_ms, in which case the gate opens again
+    guard_ptr close(int t_drain_ms) {
+        std::unique_lock<std::mutex> lock(mutex);
+        cv.wait(lock, [this]() { return !closed; });
+        closed = true;
+        t_reopen_us = ggml_time_us() + (int64_t) t_drain_ms * 1000;
+        if (!cv.wait_for(lock, std::chrono::milliseconds(t_drain_ms), [this]() { return n_inside == 0; })) {
+            closed = false;
+            cv.notify_all();
+            return nullptr;
+        }
+        return std::make_shared<guard>(this, true);
     }
 };
 
@@ -1995,14 +3316,43 @@ struct server_context {
 
     server_metrics metrics;
 
+    server_prefill_budget prefill_budget;
+
+    int32_t n_kv_pages_total = 0; // KV cache pages shared by the slots, 0 if each slot has a fixed context
+
+    // cached prefixes of all the slots, a prompt starts from the longest one whatever the slot that holds it
+    bool prefix_cache = false;
+    server_prefix_tree prefix_tree;
+
+    // cached prompts dropped by the slots, in host RAM and on disk
+    server_kv_spill kv_spill;
+
     // Necessary similarity of prompt for slot selection
     float slot_prompt_similarity = 0.0f;
 
     common_chat_templates_ptr chat_templates;
 
+    // model swap: the next model is loaded by an HTTP thread while this one serves, and swapped in by the main
+    // loop once the slots have drained; the previous model can be kept resident to swap back without loading it
+    server_model_gate model_gate;
+    std::mutex model_swap_mutex;
+    std::unique_ptr<server_model> model_next;    // guarded by model_swap_mutex
+    std::string model_standby_path;              // guarded by model_swap_mutex
+    std::string model_path_in_use;               // guarded by model_swap_mutex, for the threads outside of the gate
+    std::unique_ptr<server_model> model_standby;
+    int  model_swap_id_task = -1;
+    bool model_swap_keep_previous = false;
+    int64_t t_model_swap_start = 0;
+
     ~server_context() {
         mtmd_free(mctx);
 
+        free_slots();
+
+        llama_batch_free(batch);
+    }
+
+    void free_slots() {
         // Clear any sampling context
         for (server_slot & slot : slots) {
             common_sampler_free(slot.smpl);
@@ -2017,23 +3367,34 @@ struct server_context {
             llama_batch_free(slot.batch_spec);
         }
 
-        llama_batch_free(batch);
+        slots.clear();
     }
 
     bool load_model(const common_params & params) {
-        SRV_INF("loading model '%s'\n", params.model.path.c_str());
-
-        params_base = params;
-
-        llama_init = common_init_from_params(params_base);
-
-        model = llama_init.model.get();
-        ctx   = llama_init.context.get();
-
-        if (model == nullptr) {
-            SRV_ERR("failed to load model, '%s'\n", params_base.model.path.c_str());
+        server_model loaded;
+        if (!loaded.load(params)) {
             return false;
         }
+        use_model(std::move(loaded));
+        return true;
+    }
+
+    // make m the model of the context, which must not hold one
+    void use_model(server_model && m) {
+        {
+            std::lock_guard<std::mutex> lock(model_swap_mutex);
+            model_path_in_use = m.params.model.path;
+        }
+        params_base    = std::move(m.params);
+        llama_init     = std::move(m.llama_init);
+        llama_init_dft = std::move(m.llama_init_dft);
+        cparams_dft    = m.cparams_dft;
+        chat_templates = std::move(m.chat_templates);
+        mctx           = m.mctx.release();
+
+        model     = llama_init.model.get();
+        ctx       = llama_init.context.get();
+        model_dft = llama_init_dft.model.get();
 
         vocab = llama_model_get_vocab(model);
 
@@ -2041,90 +3402,138 @@ struct server_context {
 
         add_bos_token = llama_vocab_get_add_bos(vocab);
         has_eos_token = llama_vocab_eos(vocab) != LLAMA_TOKEN_NULL;
+    }
 
-        if (!params_base.speculative.model.path.empty() || !params_base.speculative.model.hf_repo.empty()) {
-            SRV_INF("loading draft model '%s'\n", params_base.speculative.model.path.c_str());
+    // take the model out of the context, which must have no slots
+    server_model take_model() {
+        server_model m;
+        m.params         = params_base;
+        m.llama_init     = std::move(llama_init);
+        m.llama_init_dft = std::move(llama_init_dft);
+        m.cparams_dft    = cparams_dft;
+        m.chat_templates = std::move(chat_templates);
+        m.mctx.reset(mctx);
+
+        mctx      = nullptr;
+        model     = nullptr;
+        ctx       = nullptr;
+        model_dft = nullptr;
+        vocab     = nullptr;
+
+        return m;
+    }
 
-            auto params_dft = params_base;
+    // load the model of params next to the one in use, for the next SERVER_TASK_TYPE_MODEL_SWAP; nothing is loaded
+    // if it is the model kept resident by the last swap
+    bool load_model_next(const common_params & params) {
+        {
+            std::lock_guard<std::mutex> lock(model_swap_mutex);
+            if (!model_standby_path.empty() && model_standby_path == params.model.path) {
+                model_next.reset();
+                return true;
+            }
+        }
 
-            params_dft.devices      = params_base.speculative.devices;
-            params_dft.model        = params_base.speculative.model;
-            params_dft.n_ctx        = params_base.speculative.n_ctx == 0 ? params_base.n_ctx / params_base.n_parallel : params_base.speculative.n_ctx;
-            params_dft.n_gpu_layers = params_base.speculative.n_gpu_layers;
-            params_dft.n_parallel   = 1;
+        auto loaded = std::make_unique<server_model>();
+        if (!loaded->load(params)) {
+            return false;
+        }
 
-            // force F16 KV cache for the draft model for extra performance
-            params_dft.cache_type_k = GGML_TYPE_F16;
-            params_dft.cache_type_v = GGML_TYPE_F16;
+        std::lock_guard<std::mutex> lock(model_swap_mutex);
+        model_next = std::move(loaded);
+        return true;
+    }
 
-            llama_init_dft = common_init_from_params(params_dft);
+    // path of the model in use, without entering the gate
+    std::string model_path() {
+        std::lock_guard<std::mutex> lock(model_swap_mutex);
+        return model_path_in_use;
+    }
 
-            model_dft = llama_init_dft.model.get();
+    // free the model loaded by load_model_next() for a change that did not happen
+    void drop_model_next() {
+        std::unique_ptr<server_model> next;
+        {
+            std::lock_guard<std::mutex> lock(model_swap_mutex);
+            next = std::move(model_next);
+        }
+    }
 
-            if (model_dft == nullptr) {
-                SRV_ERR("failed to load draft model, '%s'\n", params_base.speculative.model.path.c_str());
-                return false;
-            }
+    // swap the next model in, once all the slots are idle
+    void swap_model() {
+        const int64_t t_start = ggml_time_us();
 
-            if (!common_speculative_are_compatible(ctx, llama_init_dft.context.get())) {
-                SRV_ERR("the draft model '%s' is not compatible with the target model '%s'\n", params_base.speculative.model.path.c_str(), params_base.model.path.c_str());
+        const int id_task = model_swap_id_task;
+        model_swap_id_task = -1;
 
-                return false;
-            }
+        std::unique_ptr<server_model> next;
+        {
+            std::lock_guard<std::mutex> lock(model_swap_mutex);
+            next = std::move(model_next);
+        }
+        const bool from_standby = next == nullptr;
+        if (from_standby) {
+            next = std::move(model_standby);
+        }
+        if (next == nullptr) {
+            send_error(id_task, "no model to swap in");
+            return;
+        }
 
-            const int n_ctx_dft = llama_n_ctx(llama_init_dft.context.get());
+        SRV_INF("swapping model '%s' for '%s'%s\n", params_base.model.path.c_str(), next->params.model.path.c_str(), from_standby ? " (standby)" : "");
 
-            cparams_dft = common_context_params_to_llama(params_dft);
-            cparams_dft.n_batch = n_ctx_dft;
+        free_slots();
+        llama_batch_free(batch);
+        batch = {};
 
-            // the context is not needed - we will create one for each slot
-            llama_init_dft.context.reset();
-        }
+        auto previous = std::make_unique<server_model>(take_model());
+        use_model(std::move(*next));
+        next.reset();
 
-        chat_templates = common_chat_templates_init(model, params_base.chat_template);
-        try {
-            common_chat_format_example(chat_templates.get(), params.use_jinja);
-        } catch (const std::exception & e) {
-            SRV_WRN("%s: Chat template parsing error: %s\n", __func__, e.what());
-            SRV_WRN("%s: The chat template that comes with this model is not yet supported, falling back to chatml. This may cause the model to output suboptimal responses\n", __func__);
-            chat_templates = common_chat_templates_init(model, "chatml");
+        // at most one model stands by: the one that was not swapped in is freed
+        model_standby = model_swap_keep_previous ? std::move(previous) : nullptr;
+        previous.reset();
+        {
+            std::lock_guard<std::mutex> lock(model_swap_mutex);
+            model_standby_path = model_standby ? model_standby->params.model.path : "";
         }
 
-        std::string & mmproj_path = params_base.mmproj.path;
-        if (!mmproj_path.empty()) {
-            mtmd_context_params mparams = mtmd_context_params_default();
-            mparams.use_gpu       = params_base.mmproj_use_gpu;
-            mparams.print_timings = false;
-            mparams.n_threads     = params_base.cpuparams.n_threads;
-            mparams.verbosity     = params_base.verbosity > 0 ? GGML_LOG_LEVEL_DEBUG : GGML_LOG_LEVEL_INFO;
-            mctx = mtmd_init_from_file(mmproj_path.c_str(), model, mparams);
-            if (mctx == nullptr) {
-                SRV_ERR("failed to load multimodal model, '%s'\n", mmproj_path.c_str());
-                return false;
-            }
-            SRV_INF("loaded multimodal model, '%s'\n", mmproj_path.c_str());
+        // the cached prompts belong to the previous model
+        prefix_tree = server_prefix_tree();
+        kv_spill.clear();
 
-            if (params_base.ctx_shift) {
-                params_base.ctx_shift = false;
-                SRV_WRN("%s\n", "ctx_shift is not supported by multimodal, it will be disabled");
-            }
+        init();
 
-            if (params_base.n_cache_reuse) {
-                params_base.n_cache_reuse = 0;
-                SRV_WRN("%s\n", "cache_reuse is not supported by multimodal, it will be disabled");
-            }
+        auto res = std::make_unique<server_task_result_model_swap>();
+        res->id            = id_task;
+        res->model_path    = params_base.model.path;
+        res->model_standby = model_standby ? model_standby->params.model.path : "";
+        res->from_standby  = from_standby;
+        res->t_drain_ms    = (t_start - t_model_swap_start) / 1e3;
+        res->t_swap_ms     = (ggml_time_us() - t_start) / 1e3;
 
-            if (!params_base.speculative.model.path.empty()) {
-                SRV_ERR("%s\n", "err: speculative decode is not supported by multimodal");
-                return false;
-            }
-        }
+        SRV_INF("model swapped, drain = %.2f ms, swap = %.2f ms\n", res->t_drain_ms, res->t_swap_ms);
 
-        return true;
+        queue_results.send(std::move(res));
     }
 
     void init() {
-        const int32_t n_ctx_slot = n_ctx / params_base.n_parallel;
+        // with KV pages, every slot can grow up to the whole context, as long as there are free pages
+        const int32_t n_ctx_slot = params_base.kv_page_size > 0 ? n_ctx : n_ctx / params_base.n_parallel;
+
+        // the KV cells of a prefix are shared with seq_cp, which needs a KV cache with cells per token
+        prefix_cache = params_base.prefix_cache && mctx == nullptr && !llama_model_is_recurrent(model);
+
+        if (params_base.kv_spill_ram_mib > 0 && mctx == nullptr && !kv_spill.enabled()) {
+            kv_spill.init(params_base.kv_spill_ram_mib, params_base.kv_spill_dir, params_base.kv_spill_disk_mib, params_base.kv_spill_encrypt);
+            SRV_INF("spilling the dropped prompt caches, ram = %d MiB, dir = '%s', disk = %d MiB, encrypt = %d\n",
+                    params_base.kv_spill_ram_mib, params_base.kv_spill_dir.c_str(), params_base.kv_spill_disk_mib, params_base.kv_spill_encrypt);
+        }
+
+        if (params_base.kv_page_size > 0) {
+            n_kv_pages_total = std::max(1, n_ctx / params_base.kv_page_size);
+            SRV_INF("sharing the KV cache between the slots, n_kv_pages = %d, kv_page_size = %d\n", n_kv_pages_total, params_base.kv_page_size);
+        }
 
         SRV_INF("initializing slots, n_slots = %d\n", params_base.n_parallel);
 
@@ -2158,7 +3567,10 @@ struct server_context {
 
             slot.params.sampling = params_base.sampling;
 
-            slot.callback_on_release = [this](int) {
+            slot.callback_on_release = [this](int id_slot) {
+                metrics.on_released(slots[id_slot]);
+                kv_pages_trim(slots[id_slot]);
+                prefix_cache_update(slots[id_slot]);
                 queue_tasks.pop_deferred_task();
             };
 
@@ -2174,11 +3586,75 @@ struct server_context {
         {
             const int32_t n_batch = llama_n_batch(ctx);
             batch = llama_batch_init(std::max(n_batch, params_base.n_parallel), 0, 1);
+
+            prefill_budget.init(params_base.n_prefill_budget, n_batch, llama_n_ubatch(ctx), params_base.target_itl_ms);
         }
 
         metrics.init();
     }
 
+    //OWL BEGIN
+    // identifies the embedding space of the loaded model, recorded alongside the RAG tables
+    // note: hashing the whole GGUF would take seconds for large models, so the hash covers the
+    //       model description, size and parameter count, which change whenever the weights do
+    embedding_fingerprint get_embedding_fingerprint() const {
+        embedding_fingerprint fingerprint;
+        char desc[256] = {0};
+        llama_model_desc(model, desc, sizeof(desc));
+        char name[256] = {0};
+        llama_model_meta_val_str(model, "general.name", name, sizeof(name));
+
+        fingerprint.n_embd    = llama_model_n_embd(model);
+        fingerprint.pooling   = llama_pooling_type(ctx);
+        // see send_embedding(): embeddings are only normalized when there is pooling
+        fingerprint.normalize = fingerprint.pooling != LLAMA_POOLING_TYPE_NONE ? 2 : -1;
+        fingerprint.model_desc = std::string(name) + " (" + desc + ")";
+
+        const std::string identity = fingerprint.model_desc
+            + "|" + std::to_string(llama_model_n_params(model))
+            + "|" + std::to_string(llama_model_size(model))
+            + "|" + fs::path(params_base.model.path).filename().string();
+        const sha256_hash hash = CryptoUtils::computeSha256Bytes(std::vector<uint8_t>(identity.begin(), identity.end()));
+        fingerprint.model_hash = postgres_client::bytes_to_hex(hash.data(), hash.size());
+        return fingerprint;
+    }
+
+    // decide which vector column of a RAG table is comparable with the loaded model's embeddings
+    // returns false with an error message when neither the active nor the shadow column matches
+    bool route_rag_embeddings(rag_database & rag_db, bool & use_shadow, std::string & error) const {
+        const embedding_fingerprint current = get_embedding_fingerprint();
+        use_shadow = false;
+
+        embedding_fingerprint active;
+        const bool has_active = rag_db.getFingerprint(active, false);
+        if (has_active && active.matches(current)) {
+            return true;
+        }
+
+        embedding_fingerprint shadow;
+        if (rag_db.getFingerprint(shadow, true) && shadow.matches(current)) {
+            SRV_INF("routing RAG query to shadow embeddings of '%s'\n", shadow.model_desc.c_str());
+            use_shadow = true;
+            return true;
+        }
+
+        if (!has_active) {
+            if (active.n_embd != 0 && active.n_embd != current.n_embd) {
+                error = "RAG table holds " + std::to_string(active.n_embd) + "-dimensional embeddings, loaded model produces "
+                      + std::to_string(current.n_embd);
+                return false;
+            }
+            SRV_WRN("%s", "RAG table has no embedding fingerprint, cannot verify the model that produced it\n");
+            return true;
+        }
+
+        error = "RAG table was embedded with '" + active.model_desc + "' (" + active.model_hash.substr(0, 16)
+              + "), loaded model is '" + current.model_desc + "' (" + current.model_hash.substr(0, 16)
+              + "); run the \"migrate\" rag_db_admin action first";
+        return false;
+    }
+    //OWL END
+
     server_slot * get_slot_by_id(int id) {
         for (server_slot & slot : slots) {
             if (slot.id == id) {
@@ -2261,8 +3737,10 @@ struct server_context {
 
         if (!are_lora_equal(slot.params.lora, slot.lora)) {
             // if lora is changed, we cannot reuse cached tokens
+            kv_spill_slot(slot, 0);
             slot.cache_tokens.clear();
             slot.lora = slot.params.lora;
+            prefix_cache_update(slot);
         }
 
         if (!slot.prompt_tokens.validate(ctx)) {
@@ -2300,9 +3778,326 @@ struct server_context {
             slot.batch_spec = llama_batch_init(slot.params.speculative.n_max + 1, 0, 1);
         }
 
+        slot.priority   = task.priority;
+        slot.tenant     = std::move(task.tenant);
+        slot.endpoint   = task.endpoint;
+        slot.trace_id   = task.trace_id;
+        slot.t_queued   = task.t_queued;
+        slot.t_launched = ggml_time_us();
+        slot.preempted  = false;
+        metrics.on_launched(slot);
+        tracer.record(slot.trace_id, "queue", slot.t_queued, slot.id);
+
         slot.state = SLOT_STATE_STARTED;
 
-        SLT_INF(slot, "%s", "processing task\n");
+        SLT_INF(slot, "processing task, priority = %s\n", server_task_priority_name(slot.priority));
+
+        return true;
+    }
+
+    // free the slot of a background task that has not started generating, for an interactive task:
+    // the preempted task goes back to the front of the deferred queue, and resumes from the cached part of its prompt
+    server_slot * preempt_background_slot() {
+        server_slot * ret = nullptr;
+        for (server_slot & slot : slots) {
+            if (!slot.is_processing() || slot.priority != SERVER_TASK_PRIORITY_BACKGROUND || slot.state == SLOT_STATE_GENERATING) {
+                continue;
+            }
+            // the most recent one has the least work to lose
+            if (ret == nullptr || slot.t_launched > ret->t_launched) {
+                ret = &slot;
+            }
+        }
+        if (ret == nullptr) {
+            return nullptr;
+        }
+
+        server_slot & slot = *ret;
+        server_task task(slot.task_type);
+        task.id            = slot.id_task;
+        task.index         = slot.index;
+        task.params        = std::move(slot.params);
+        task.prompt_tokens = std::move(slot.prompt_tokens);
+        task.priority      = slot.priority;
+        task.tenant        = slot.tenant;
+        task.endpoint      = slot.endpoint;
+        task.trace_id      = slot.trace_id;
+        task.t_queued      = slot.t_queued;
+        task.admitted      = true;
+
+        SLT_INF(slot, "preempted by an interactive task, id_task = %d, n_past = %d\n", slot.id_task, slot.n_past);
+        metrics.classes[slot.priority].n_preempted++;
+
+        slot.preempted = true;
+        slot.release();
+        queue_tasks.defer(std::move(task), true);
+
+        return ret;
+    }
+
+    // a span per traced slot of the batch: its prompt tokens, or the token it generates
+    void trace_batch(const llama_batch & batch_view, int64_t t_start) {
+        for (server_slot & slot : slots) {
+            if (slot.trace_id == 0) {
+                continue;
+            }
+            int32_t n_tokens = 0;
+            for (int32_t i = 0; i < batch_view.n_tokens; i++) {
+                n_tokens += batch_view.seq_id[i][0] == slot.id;
+            }
+            if (n_tokens > 0) {
+                tracer.record(slot.trace_id, slot.state == SLOT_STATE_GENERATING ? "decode" : "prefill", t_start, slot.id, batch_view.n_tokens, n_tokens);
+            }
+        }
+    }
+
+    //
+    // KV pages (--kv-page-size): the slots share the KV cache, a slot takes pages from the pool as its
+    // sequence grows and keeps the pages of its cached tokens when idle, until another slot needs them
+    //
+
+    int32_t kv_pages_for(int32_t n_tokens) const {
+        const int32_t page = params_base.kv_page_size;
+        return std::min(n_kv_pages_total, (n_tokens + page - 1) / page);
+    }
+
+    int32_t kv_pages_used() const {
+        int32_t n_used = 0;
+        for (const server_slot & slot : slots) {
+            n_used += slot.n_kv_pages;
+        }
+        return n_used;
+    }
+
+    // number of tokens the slot can hold in the KV cache without taking new pages
+    int32_t kv_pages_capacity(const server_slot & slot) const {
+        return n_kv_pages_total > 0 ? slot.n_kv_pages * params_base.kv_page_size : slot.n_ctx;
+    }
+
+    // make sure that the slot holds the pages of n_tokens, taking them from the cache of the idle slots
+    // (least recently used first) when the pool is empty - false if the pages are held by running slots
+    bool kv_pages_fit(server_slot & slot, int32_t n_tokens) {
+        if (n_kv_pages_total == 0) {
+            return true;
+        }
+
+        const int32_t n_needed = kv_pages_for(n_tokens);
+        if (n_needed <= slot.n_kv_pages) {
+            return true;
+        }
+
+        while (n_kv_pages_total - kv_pages_used() < n_needed - slot.n_kv_pages) {
+            server_slot * lru = nullptr;
+            for (server_slot & other : slots) {
+                if (&other == &slot || other.is_processing() || other.n_kv_pages == 0) {
+                    continue;
+                }
+                if (lru == nullptr || other.t_last_used < lru->t_last_used) {
+                    lru = &other;
+                }
+            }
+            if (lru == nullptr) {
+                return false;
+            }
+
+            SLT_INF(*lru, "evicting the cached prompt to free %d KV pages, n_cached = %d\n", lru->n_kv_pages, (int) lru->cache_tokens.size());
+            kv_spill_slot(*lru, 0);
+            llama_kv_self_seq_rm(ctx, lru->id, -1, -1);
+            lru->cache_tokens.clear();
+            lru->n_kv_pages = 0;
+            lru->n_shared   = 0;
+            prefix_cache_update(*lru);
+            metrics.n_kv_pages_evicted++;
+        }
+
+        slot.n_kv_pages = n_needed;
+        return true;
+    }
+
+    // give back the pages that the slot holds beyond its cached tokens
+    void kv_pages_trim(server_slot & slot) {
+        if (n_kv_pages_total > 0) {
+            slot.n_kv_pages = kv_pages_for(slot.cache_tokens.size());
+        }
+    }
+
+    //
+    // prefix cache: the KV cells of a cached prefix are shared by copying them to the sequence of another slot
+    // (llama_kv_self_seq_cp adds the sequence to the cells, which are freed when no sequence holds them anymore)
+    //
+
+    // publish the cached tokens of the slot, they must all be in its KV cache
+    void prefix_cache_update(const server_slot & slot) {
+        if (prefix_cache) {
+            prefix_tree.insert(slot.id, slot.cache_tokens.get_text_tokens());
+        }
+    }
+
+    // keep the KV cache of the slot in the spill tier before it drops what it holds after n_keep tokens
+    void kv_spill_slot(const server_slot & slot, size_t n_keep) {
+        if (!kv_spill.enabled() || mctx != nullptr || slot.cache_tokens.size() < n_keep + server_kv_spill::n_min_tokens) {
+            return;
+        }
+        kv_spill.spill(ctx, slot.id, slot.cache_tokens.get_text_tokens(), slot.lora);
+        SLT_DBG(slot, "spilled the cached prompt, n_tokens = %zu\n", slot.cache_tokens.size());
+    }
+
+    // load the spilled prompt that shares the longest prefix with the prompt, if it saves more than the KV cache
+    // of the slot
+    void kv_spill_restore(server_slot & slot, const server_tokens & prompt_tokens) {
+        if (!kv_spill.enabled() || mctx != nullptr || slot.is_non_causal()) {
+            return;
+        }
+
+        const size_t n_cached = slot.cache_tokens.get_common_prefix(prompt_tokens);
+        size_t n_match = 0;
+        auto e = kv_spill.take(prompt_tokens.get_text_tokens(), n_cached + server_kv_spill::n_min_tokens, slot.lora, n_match);
+        if (!e) {
+            return;
+        }
+
+        const int64_t t_start = ggml_time_us();
+
+        kv_spill_slot(slot, n_cached);
+        llama_kv_self_seq_rm(ctx, slot.id, -1, -1);
+        slot.cache_tokens.clear();
+        slot.n_shared = 0;
+
+        if (kv_spill.load(ctx, slot.id, *e)) {
+            slot.cache_tokens.insert(e->tokens);
+            SLT_INF(slot, "restored a spilled prompt from %s, n_match = %zu, n_tokens = %zu, %.2f ms\n",
+                    e->on_disk ? "disk" : "ram", n_match, e->tokens.size(), (ggml_time_us() - t_start) / 1e3);
+        } else {
+            llama_kv_self_seq_rm(ctx, slot.id, -1, -1);
+            SLT_WRN(slot, "failed to restore a spilled prompt, n_tokens = %zu\n", e->tokens.size());
+        }
+        prefix_cache_update(slot);
+    }
+
+    // start the slot from the longest cached prefix of its prompt, if another slot holds more of it
+    void prefix_cache_borrow(server_slot & slot, const server_tokens & prompt_tokens) {
+        if (!prefix_cache || slot.is_non_causal()) {
+            return;
+        }
+
+        const llama_tokens & tokens = prompt_tokens.get_text_tokens();
+        llama_seq_id id_holder = -1;
+        const size_t n_match = prefix_tree.match(tokens, slot.id, [&](llama_seq_id id) {
+            // the KV computed with other adapters cannot be reused
+            return are_lora_equal(slots[id].lora, slot.lora);
+        }, id_holder);
+
+        if (id_holder < 0 || id_holder == slot.id || n_match <= slot.cache_tokens.get_common_prefix(prompt_tokens)) {
+            return;
+        }
+
+        server_slot & holder = slots[id_holder];
+
+        kv_spill_slot(slot, slot.cache_tokens.get_common_prefix(prompt_tokens));
+        llama_kv_self_seq_rm(ctx, slot.id, -1, -1);
+        llama_kv_self_seq_cp(ctx, holder.id, slot.id, 0, n_match);
+
+        slot.cache_tokens.clear();
+        slot.cache_tokens.insert(llama_tokens(tokens.begin(), tokens.begin() + n_match));
+        slot.n_shared   = n_match;
+        holder.n_shared = std::max(holder.n_shared, (int32_t) n_match);
+        prefix_cache_update(slot);
+
+        // a prefix that keeps being reused is not the least recently used one
+        if (!holder.is_processing()) {
+            holder.t_last_used = ggml_time_us();
+        }
+
+        metrics.n_prefix_cache_hits++;
+        metrics.n_prefix_cache_tokens += n_match;
+
+        SLT_INF(slot, "reusing %zu prompt tokens cached by slot %d\n", n_match, holder.id);
+    }
+
+    // make sure that no other slot shares the KV cells of the slot from pos on, before they are shifted:
+    // the idle slots drop them from their cache, and the slot copies its own cells if a running slot uses them
+    // (with copy) - false if they are still shared, or if the copy failed (the KV cache of the slot is then lost)
+    bool prefix_cache_unshare(server_slot & slot, int32_t pos, bool copy) {
+        if (slot.n_shared <= pos) {
+            return true;
+        }
+
+        bool shared_with_running = false;
+        for (server_slot & other : slots) {
+            if (&other == &slot || other.n_shared <= pos || (int32_t) other.cache_tokens.get_common_prefix(slot.cache_tokens) <= pos) {
+                continue;
+            }
+            if (other.is_processing()) {
+                shared_with_running = true;
+                continue;
+            }
+            llama_kv_self_seq_rm(ctx, other.id, pos, -1);
+            other.cache_tokens.keep_first(pos);
+            other.n_shared = pos;
+            kv_pages_trim(other);
+            prefix_cache_update(other);
+        }
+
+        if (!shared_with_running) {
+            slot.n_shared = pos;
+            return true;
+        }
+        if (!copy) {
+            return false;
+        }
+
+        SLT_INF(slot, "copying the KV cache shared with running slots, n_shared = %d\n", slot.n_shared);
+
+        std::vector<uint8_t> state(llama_state_seq_get_size(ctx, slot.id));
+        bool ok = llama_state_seq_get_data(ctx, state.data(), state.size(), slot.id) == state.size();
+        if (ok) {
+            llama_kv_self_seq_rm(ctx, slot.id, -1, -1);
+            ok = llama_state_seq_set_data(ctx, state.data(), state.size(), slot.id) != 0;
+        }
+        if (!ok) {
+            llama_kv_self_seq_rm(ctx, slot.id, -1, -1);
+            slot.cache_tokens.clear();
+        }
+        slot.n_shared = 0;
+        prefix_cache_update(slot);
+
+        return ok;
+    }
+
+    // admission control of a task that has to wait for a slot: false, with the reason, if it is rejected
+    bool admit_task(const server_task & task, std::string & reason) {
+        if (task.admitted) {
+            return true;
+        }
+
+        const char * priority_name = server_task_priority_name(task.priority);
+        if (params_base.n_queue_max > 0 && queue_tasks.n_deferred(task.priority) >= (size_t) params_base.n_queue_max) {
+            reason = string_format("too many %s requests are waiting, try again later", priority_name);
+            return false;
+        }
+
+        if (params_base.slo_ttft_ms > 0) {
+            const double t_slo = params_base.slo_ttft_ms * 1e3;
+            const auto & interactive = metrics.classes[SERVER_TASK_PRIORITY_INTERACTIVE];
+            if (task.priority == SERVER_TASK_PRIORITY_INTERACTIVE) {
+                // a slot frees up every t_service_avg / n_slots on average
+                const double t_wait = (queue_tasks.n_deferred_ahead(task.priority) + 1) * interactive.t_service_avg / slots.size();
+                if (t_wait > t_slo) {
+                    reason = string_format("the request cannot start within %d ms, try again later", params_base.slo_ttft_ms);
+                    return false;
+                }
+            } else if (interactive.t_ttft_avg > t_slo) {
+                // shed the lower classes while the interactive requests miss their objective
+                bool interactive_busy = queue_tasks.n_deferred(SERVER_TASK_PRIORITY_INTERACTIVE) > 0;
+                for (const server_slot & slot : slots) {
+                    interactive_busy |= slot.is_processing() && slot.priority == SERVER_TASK_PRIORITY_INTERACTIVE;
+                }
+                if (interactive_busy) {
+                    reason = string_format("the server is saturated by interactive requests, %s requests are rejected, try again later", priority_name);
+                    return false;
+                }
+            }
+        }
 
         return true;
     }
@@ -2424,8 +4219,8 @@ struct server_context {
             }
         }
 
-        // if context shift is disabled, we stop when it reaches the context limit
-        if (slot.n_past >= slot.n_ctx) {
+        // if context shift is disabled, we stop when it reaches the context limit (or when the KV pages run out)
+        if (slot.n_past >= slot.n_ctx || (!params_base.ctx_shift && !kv_pages_fit(slot, slot.n_past + 1))) {
             slot.truncated      = true;
             slot.stop           = STOP_TYPE_LIMIT;
             slot.has_next_token = false;
@@ -2652,10 +4447,147 @@ struct server_context {
             }
         }
 
-        SLT_DBG(slot, "%s", "sending embeddings\n");
+        SLT_DBG(slot, "%s", "sending embeddings\n");
+
+        queue_results.send(std::move(res));
+    }
+
+    //OWL BEGIN
+    // runs on the server loop right after the chunk has been encoded, so the embeddings read here
+    // cannot be overwritten by another batch
+    void send_chunk_vector(const server_slot & slot, const llama_batch & batch) {
+        const int n_embd   = llama_model_n_embd(model);
+        const int n_prompt = slot.n_prompt_tokens;
+
+        int32_t begin = slot.params.pooling_begin < 0 ? n_prompt + slot.params.pooling_begin : slot.params.pooling_begin;
+        int32_t end   = slot.params.pooling_end  <= 0 ? n_prompt + slot.params.pooling_end   : slot.params.pooling_end;
+        begin = std::max(0, begin);
+        end   = std::min(n_prompt, end);
+        if (begin >= end) {
+            send_error(slot, "empty pooling range", ERROR_TYPE_INVALID_REQUEST);
+            return;
+        }
+
+        auto res = std::make_unique<server_task_result_embd>();
+        res->id        = slot.id_task;
+        res->index     = slot.index;
+        res->n_tokens  = end - begin;
+        res->oaicompat = slot.params.oaicompat;
+
+        const enum llama_pooling_type pooling_ctx = llama_pooling_type(slot.ctx);
+        if (pooling_ctx != LLAMA_POOLING_TYPE_NONE) {
+            // the context pools in the model graph: only usable when it computes what was asked for
+            const bool same_rule = (pooling_ctx == LLAMA_POOLING_TYPE_MEAN && slot.params.pooling == CHUNK_POOLING_MEAN)
+                                || (pooling_ctx == LLAMA_POOLING_TYPE_CLS  && slot.params.pooling == CHUNK_POOLING_FIRST)
+                                || (pooling_ctx == LLAMA_POOLING_TYPE_LAST && slot.params.pooling == CHUNK_POOLING_LAST);
+            const float * embd = llama_get_embeddings_seq(ctx, slot.id);
+            if (!same_rule || begin != 0 || end != n_prompt || embd == nullptr) {
+                send_error(slot, "this pooling rule or token range requires the server to be started with `--pooling none`", ERROR_TYPE_NOT_SUPPORTED);
+                return;
+            }
+            res->embedding.push_back({ embd, embd + n_embd });
+            queue_results.send(std::move(res));
+            return;
+        }
+
+        // gather the token embeddings of the range, in prompt order
+        std::vector<const float *> rows(end - begin, nullptr);
+        for (int i = 0; i < batch.n_tokens; ++i) {
+            if (!batch.logits[i] || batch.seq_id[i][0] != slot.id || batch.pos[i] < begin || batch.pos[i] >= end) {
+                continue;
+            }
+            rows[batch.pos[i] - begin] = llama_get_embeddings_ith(ctx, i);
+        }
+        for (const float * row : rows) {
+            if (row == nullptr) {
+                send_error(slot, "failed to get token embeddings for the pooling range", ERROR_TYPE_SERVER);
+                return;
+            }
+        }
+
+        const size_t n_rows = rows.size();
+        if (slot.params.pooling == CHUNK_POOLING_MEDIAN) {
+            // one selection per dimension would stall every other slot: the rows are only copied here and the
+            // HTTP thread reduces them with chunk_pooling_median()
+            res->embedding.reserve(n_rows);
+            for (const float * row : rows) {
+                res->embedding.emplace_back(row, row + n_embd);
+            }
+            queue_results.send(std::move(res));
+            return;
+        }
+
+        std::vector<float> pooled(n_embd, 0.0f);
+        switch (slot.params.pooling) {
+            case CHUNK_POOLING_MEAN:
+            case CHUNK_POOLING_ATTENTION:
+                {
+                    for (const float * row : rows) {
+                        for (int j = 0; j < n_embd; j++) {
+                            pooled[j] += row[j];
+                        }
+                    }
+                    for (int j = 0; j < n_embd; j++) {
+                        pooled[j] /= (float) n_rows;
+                    }
+                    if (slot.params.pooling == CHUNK_POOLING_MEAN) {
+                        break;
+                    }
+
+                    // the mean acts as the query of a single attention head over the range
+                    std::vector<float> weights(n_rows);
+                    const float scale = 1.0f / std::sqrt((float) n_embd);
+                    float max_score = -INFINITY;
+                    for (size_t r = 0; r < n_rows; r++) {
+                        float score = 0.0f;
+                        for (int j = 0; j < n_embd; j++) {
+                            score += rows[r][j] * pooled[j];
+                        }
+                        weights[r] = score * scale;
+                        max_score = std::max(max_score, weights[r]);
+                    }
+                    float sum = 0.0f;
+                    for (auto & w : weights) {
+                        w = std::exp(w - max_score);
+                        sum += w;
+                    }
+                    std::fill(pooled.begin(), pooled.end(), 0.0f);
+                    for (size_t r = 0; r < n_rows; r++) {
+                        const float w = weights[r] / sum;
+                        for (int j = 0; j < n_embd; j++) {
+                            pooled[j] += w * rows[r][j];
+                        }
+                    }
+                } break;
+            case CHUNK_POOLING_MAX:
+            case CHUNK_POOLING_MIN:
+                {
+                    const bool is_max = slot.params.pooling == CHUNK_POOLING_MAX;
+                    pooled.assign(rows[0], rows[0] + n_embd);
+                    for (size_t r = 1; r < n_rows; r++) {
+                        for (int j = 0; j < n_embd; j++) {
+                            pooled[j] = is_max ? std::max(pooled[j], rows[r][j]) : std::min(pooled[j], rows[r][j]);
+                        }
+                    }
+                } break;
+            case CHUNK_POOLING_MEDIAN:
+                // sent unpooled above
+                break;
+            case CHUNK_POOLING_FIRST:
+                pooled.assign(rows.front(), rows.front() + n_embd);
+                break;
+            case CHUNK_POOLING_LAST:
+                pooled.assign(rows.back(), rows.back() + n_embd);
+                break;
+        }
+
+        res->embedding.push_back(std::move(pooled));
+
+        SLT_DBG(slot, "sending chunk vector, range = [%d, %d)\n", begin, end);
 
         queue_results.send(std::move(res));
     }
+    //OWL END
 
     void send_rerank(const server_slot & slot, const llama_batch & batch) {
         auto res = std::make_unique<server_task_result_rerank>();
@@ -2787,36 +4719,41 @@ struct server_context {
             const std::function<void(json)> & error_handler,
             const std::function<bool()> & is_connection_closed) {
         size_t n_finished = 0;
+        // the partial results generated while the previous batch was written out are handled with a single wake up
+        std::vector<server_task_result_ptr> results;
         while (true) {
-            server_task_result_ptr result = queue_results.recv_with_timeout(id_tasks, HTTP_POLLING_SECONDS);
+            results.clear();
+            const bool received = queue_results.recv_all_with_timeout(id_tasks, HTTP_POLLING_SECONDS, results);
 
             if (is_connection_closed()) {
                 cancel_tasks(id_tasks);
                 return;
             }
 
-            if (result == nullptr) {
+            if (!received) {
                 continue; // retry
             }
 
-            if (result->is_error()) {
-                error_handler(result->to_json());
-                cancel_tasks(id_tasks);
-                return;
-            }
+            for (auto & result : results) {
+                if (result->is_error()) {
+                    error_handler(result->to_json());
+                    cancel_tasks(id_tasks);
+                    return;
+                }
 
-            GGML_ASSERT(
-                dynamic_cast<server_task_result_cmpl_partial*>(result.get()) != nullptr
-                || dynamic_cast<server_task_result_cmpl_final*>(result.get()) != nullptr
-            );
-            if (!result_handler(result)) {
-                cancel_tasks(id_tasks);
-                break;
-            }
+                GGML_ASSERT(
+                    dynamic_cast<server_task_result_cmpl_partial*>(result.get()) != nullptr
+                    || dynamic_cast<server_task_result_cmpl_final*>(result.get()) != nullptr
+                );
+                if (!result_handler(result)) {
+                    cancel_tasks(id_tasks);
+                    return;
+                }
 
-            if (result->is_stop()) {
-                if (++n_finished == id_tasks.size()) {
-                    break;
+                if (result->is_stop()) {
+                    if (++n_finished == id_tasks.size()) {
+                        return;
+                    }
                 }
             }
         }
@@ -2832,12 +4769,25 @@ struct server_context {
             case SERVER_TASK_TYPE_INFILL:
             case SERVER_TASK_TYPE_EMBEDDING:
             case SERVER_TASK_TYPE_RERANK:
+            case SERVER_TASK_TYPE_CHUNK_VECTOR:
                 {
                     const int id_slot = task.id_selected_slot;
 
                     server_slot * slot = id_slot != -1 ? get_slot_by_id(id_slot) : get_available_slot(task);
 
+                    if (slot == nullptr && id_slot == -1 && task.priority == SERVER_TASK_PRIORITY_INTERACTIVE) {
+                        slot = preempt_background_slot();
+                    }
+
                     if (slot == nullptr) {
+                        std::string reason;
+                        if (!admit_task(task, reason)) {
+                            metrics.classes[task.priority].n_rejected++;
+                            send_error(task, reason, ERROR_TYPE_UNAVAILABLE);
+                            break;
+                        }
+                        task.admitted = true;
+
                         // if no slot is available, we defer this task for processing later
                         SRV_DBG("no slot is available, defer task, id_task = %d\n", task.id);
                         queue_tasks.defer(std::move(task));
@@ -2850,6 +4800,13 @@ struct server_context {
                         break;
                     }
 
+                    // the prompt (and its first generated token) must fit in the pages that are not held by running slots
+                    if (!kv_pages_fit(*slot, task.prompt_tokens.size() + 1)) {
+                        SRV_DBG("not enough free KV pages, defer task, id_task = %d\n", task.id);
+                        queue_tasks.defer(std::move(task));
+                        break;
+                    }
+
                     if (!launch_slot_with_task(*slot, std::move(task))) {
                         SRV_ERR("failed to launch slot with task, id_task = %d\n", task.id);
                         break;
@@ -2894,7 +4851,7 @@ struct server_context {
                     res->slots_data          = std::move(slots_data);
                     res->n_idle_slots        = n_idle_slots;
                     res->n_processing_slots  = n_processing_slots;
-                    res->n_tasks_deferred    = queue_tasks.queue_tasks_deferred.size();
+                    res->n_tasks_deferred    = queue_tasks.n_deferred();
                     res->t_start             = metrics.t_start;
 
                     res->kv_cache_tokens_count = llama_kv_self_n_tokens(ctx);
@@ -2912,6 +4869,26 @@ struct server_context {
 
                     res->n_decode_total          = metrics.n_decode_total;
                     res->n_busy_slots_total      = metrics.n_busy_slots_total;
+                    res->n_prefill_budget        = prefill_budget.n_current;
+                    res->n_kv_pages_total        = n_kv_pages_total;
+                    res->n_kv_pages_used         = kv_pages_used();
+                    res->n_kv_pages_evicted      = metrics.n_kv_pages_evicted;
+                    res->n_prefix_cache_hits     = metrics.n_prefix_cache_hits;
+                    res->n_prefix_cache_tokens   = metrics.n_prefix_cache_tokens;
+                    if (kv_spill.enabled()) {
+                        res->kv_spill = true;
+                        kv_spill.get_usage(res->n_kv_spill_ram_bytes, res->n_kv_spill_disk_bytes);
+                        res->n_kv_spilled             = kv_spill.n_spilled;
+                        res->n_kv_spill_restored      = kv_spill.n_restored;
+                        res->n_kv_spill_restored_disk = kv_spill.n_restored_disk;
+                    }
+                    for (int i = 0; i < SERVER_TASK_PRIORITY_COUNT; i++) {
+                        res->classes[i]            = metrics.classes[i];
+                        res->n_deferred_classes[i] = queue_tasks.n_deferred((server_task_priority) i);
+                    }
+                    for (int i = 0; i < SERVER_ENDPOINT_COUNT; i++) {
+                        res->endpoints[i] = metrics.endpoints[i];
+                    }
 
                     if (task.metrics_reset_bucket) {
                         metrics.reset_bucket();
@@ -2986,12 +4963,24 @@ struct server_context {
                     size_t nread = llama_state_seq_load_file(ctx, filepath.c_str(), slot->id, tokens.data(), tokens.size(), &token_count);
                     if (nread == 0) {
                         slot->cache_tokens.clear(); // KV may already been invalidated?
+                        slot->n_shared = 0;
+                        prefix_cache_update(*slot);
                         send_error(task, "Unable to restore slot, no available space in KV cache or invalid slot save file", ERROR_TYPE_INVALID_REQUEST);
                         break;
                     }
                     tokens.resize(token_count);
                     slot->cache_tokens.clear();
                     slot->cache_tokens.insert(tokens);
+                    slot->n_kv_pages = 0;
+                    slot->n_shared   = 0;
+                    if (!kv_pages_fit(*slot, token_count)) {
+                        llama_kv_self_seq_rm(ctx, slot->id, -1, -1);
+                        slot->cache_tokens.clear();
+                        prefix_cache_update(*slot);
+                        send_error(task, "Unable to restore slot, not enough free KV pages", ERROR_TYPE_INVALID_REQUEST);
+                        break;
+                    }
+                    prefix_cache_update(*slot);
 
                     const int64_t t_end = ggml_time_us();
                     const double t_restore_ms = (t_end - t_start) / 1000.0;
@@ -3026,6 +5015,9 @@ struct server_context {
                     const size_t n_erased = slot->cache_tokens.size();
                     llama_kv_self_seq_rm(ctx, slot->id, -1, -1);
                     slot->cache_tokens.clear();
+                    slot->n_kv_pages = 0;
+                    slot->n_shared   = 0;
+                    prefix_cache_update(*slot);
 
                     auto res = std::make_unique<server_task_result_slot_erase>();
                     res->id       = task.id;
@@ -3040,6 +5032,14 @@ struct server_context {
                     res->id = task.id;
                     queue_results.send(std::move(res));
                 } break;
+            case SERVER_TASK_TYPE_MODEL_SWAP:
+                {
+                    // the slots finish their tasks first, update_slots() swaps the model once they are all idle
+                    model_swap_id_task       = task.id;
+                    model_swap_keep_previous = task.keep_previous_model;
+                    t_model_swap_start       = ggml_time_us();
+                    SRV_INF("%s", "model swap requested, draining the slots\n");
+                } break;
 
         }
     }
@@ -3058,6 +5058,10 @@ struct server_context {
 
             if (all_idle) {
                 SRV_INF("%s", "all slots are idle\n");
+                if (model_swap_id_task != -1 && queue_tasks.n_deferred() == 0) {
+                    swap_model();
+                    return;
+                }
                 if (clean_kv_cache) {
                     kv_cache_clear();
                 }
@@ -3077,7 +5081,9 @@ struct server_context {
         // apply context-shift if needed
         // TODO: simplify and improve
         for (server_slot & slot : slots) {
-            if (slot.is_processing() && slot.n_past + 1 >= slot.n_ctx) {
+            // with KV pages, a generating slot also shifts its context when it cannot take a new page
+            const bool out_of_pages = slot.state == SLOT_STATE_GENERATING && !kv_pages_fit(slot, slot.n_past + 1);
+            if (slot.is_processing() && (slot.n_past + 1 >= slot.n_ctx || out_of_pages)) {
                 if (!params_base.ctx_shift) {
                     // this check is redundant (for good)
                     // we should never get here, because generation should already stopped in process_token()
@@ -3099,6 +5105,13 @@ struct server_context {
 
                 SLT_WRN(slot, "slot context shift, n_keep = %d, n_left = %d, n_discard = %d\n", n_keep, n_left, n_discard);
 
+                // the shifted cells must not move under another slot
+                if (!prefix_cache_unshare(slot, n_keep + n_discard, true)) {
+                    slot.release();
+                    send_error(slot, "failed to copy the shared KV cache for the context shift", ERROR_TYPE_SERVER);
+                    continue;
+                }
+
                 llama_kv_self_seq_rm (ctx, slot.id, n_keep            , n_keep + n_discard);
                 llama_kv_self_seq_add(ctx, slot.id, n_keep + n_discard, slot.n_past,        -n_discard);
 
@@ -3115,6 +5128,8 @@ struct server_context {
                 }
 
                 slot.n_past -= n_discard;
+                kv_pages_trim(slot);
+                prefix_cache_update(slot);
 
                 slot.truncated = true;
             }
@@ -3158,6 +5173,11 @@ struct server_context {
         int32_t n_batch  = llama_n_batch(ctx);
         int32_t n_ubatch = llama_n_ubatch(ctx);
 
+        // the decode tokens are already in: the prompts share what is left of the batch, up to the prefill
+        // budget while other slots are generating
+        const int32_t n_decode_tokens = batch.n_tokens;
+        const int32_t n_prompt_batch  = std::min(n_batch, n_decode_tokens + std::min(prefill_budget.limit(n_decode_tokens), n_batch));
+
         // next, batch any pending prompts without exceeding n_batch
         if (params_base.cont_batching || batch.n_tokens == 0) {
             for (auto & slot : slots) {
@@ -3272,11 +5292,18 @@ struct server_context {
                             }
 
                             if (slot.params.cache_prompt) {
+                                prefix_cache_borrow(slot, prompt_tokens);
+                                kv_spill_restore(slot, prompt_tokens);
+
                                 // reuse any previously computed tokens that are common with the new prompt
                                 slot.n_past = slot.cache_tokens.get_common_prefix(prompt_tokens);
 
+                                // the part of the cache that the prompt drops is kept in the spill tier
+                                kv_spill_slot(slot, slot.n_past);
+
                                 // reuse chunks from the cached prompt by shifting their KV cache in the new position
-                                if (params_base.n_cache_reuse > 0) {
+                                // (not if other slots still use the cells to shift)
+                                if (params_base.n_cache_reuse > 0 && prefix_cache_unshare(slot, slot.n_past, false)) {
                                     size_t head_c = slot.n_past; // cache
                                     size_t head_p = slot.n_past; // current prompt
 
@@ -3362,6 +5389,8 @@ struct server_context {
 
                     // remove the non-common part from the cache
                     slot.cache_tokens.keep_first(slot.n_past);
+                    slot.n_shared = std::min(slot.n_shared, slot.n_past);
+                    prefix_cache_update(slot);
 
                     // check if we should process the image
                     if (slot.n_past < slot.n_prompt_tokens
@@ -3389,7 +5418,9 @@ struct server_context {
                     }
 
                     // add prompt tokens for processing in the current batch
-                    while (slot.n_past < slot.n_prompt_tokens && batch.n_tokens < n_batch) {
+                    // (non-causal prompts are evaluated at once, their size was checked against n_batch above)
+                    const int32_t n_slot_batch = slot.is_non_causal() ? n_batch : n_prompt_batch;
+                    while (slot.n_past < slot.n_prompt_tokens && batch.n_tokens < n_slot_batch) {
                         // get next token to process
                         llama_token cur_tok = slot.prompt_tokens[slot.n_past];
                         if (cur_tok == LLAMA_TOKEN_NULL) {
@@ -3397,7 +5428,8 @@ struct server_context {
                         }
 
                         // without pooling, we want to output the embeddings for all the tokens in the batch
-                        const bool need_embd = slot.task_type == SERVER_TASK_TYPE_EMBEDDING && llama_pooling_type(slot.ctx) == LLAMA_POOLING_TYPE_NONE;
+                        const bool need_embd = (slot.task_type == SERVER_TASK_TYPE_EMBEDDING || slot.task_type == SERVER_TASK_TYPE_CHUNK_VECTOR)
+                                             && llama_pooling_type(slot.ctx) == LLAMA_POOLING_TYPE_NONE;
 
                         common_batch_add(batch, cur_tok, slot.n_past, { slot.id }, need_embd);
                         slot.cache_tokens.push_back(cur_tok);
@@ -3437,7 +5469,7 @@ struct server_context {
                     }
                 }
 
-                if (batch.n_tokens >= n_batch) {
+                if (batch.n_tokens >= n_prompt_batch) {
                     break;
                 }
             }
@@ -3457,7 +5489,12 @@ struct server_context {
             common_set_adapter_lora(ctx, slot_batched->lora);
         }
 
+        const int64_t t_batch_start = ggml_time_us();
+        const int32_t n_prompt_tokens_batched = batch.n_tokens - n_decode_tokens;
+
         // process the created batch of tokens
+        bool kv_defragmented = false;
+
         for (int32_t i = 0; i < batch.n_tokens; i += n_batch) {
             const int32_t n_tokens = std::min(n_batch, batch.n_tokens - i);
 
@@ -3473,6 +5510,8 @@ struct server_context {
 
             int ret = 0;
 
+            const int64_t t_decode_start = ggml_time_us();
+
             if (params_base.embedding || params_base.reranking) {
                 ret = llama_encode(ctx, batch_view);
             } else {
@@ -3481,6 +5520,10 @@ struct server_context {
 
             metrics.on_decoded(slots);
 
+            if (tracer.enabled()) {
+                trace_batch(batch_view, t_decode_start);
+            }
+
             if (ret != 0) {
                 if (n_batch == 1 || ret < 0) {
                     // if you get here, it means the KV cache is full - try increasing it via the context size
@@ -3492,6 +5535,16 @@ struct server_context {
                     break; // break loop of n_batch
                 }
 
+                // the KV pages leave enough free cells, but they may be scattered: defragment once before splitting the batch
+                if (n_kv_pages_total > 0 && !kv_defragmented) {
+                    SRV_WRN("failed to find free space in the KV cache, defragmenting, i = %d, n_batch = %d, ret = %d\n", i, n_batch, ret);
+                    llama_kv_self_defrag(ctx);
+                    llama_kv_self_update(ctx);
+                    kv_defragmented = true;
+                    i -= n_batch;
+                    continue;
+                }
+
                 // retry with half the batch size to try to find a free slot in the KV cache
                 n_batch /= 2;
                 i -= n_batch;
@@ -3510,6 +5563,7 @@ struct server_context {
                     if (slot.task_type == SERVER_TASK_TYPE_EMBEDDING) {
                         // prompt evaluated for embedding
                         send_embedding(slot, batch_view);
+                        metrics.on_first_token(slot);
                         slot.release();
                         slot.i_batch = -1;
                         continue; // continue loop of slots
@@ -3517,6 +5571,15 @@ struct server_context {
 
                     if (slot.task_type == SERVER_TASK_TYPE_RERANK) {
                         send_rerank(slot, batch_view);
+                        metrics.on_first_token(slot);
+                        slot.release();
+                        slot.i_batch = -1;
+                        continue; // continue loop of slots
+                    }
+
+                    if (slot.task_type == SERVER_TASK_TYPE_CHUNK_VECTOR) {
+                        send_chunk_vector(slot, batch_view);
+                        metrics.on_first_token(slot);
                         slot.release();
                         slot.i_batch = -1;
                         continue; // continue loop of slots
@@ -3524,6 +5587,9 @@ struct server_context {
 
                     // prompt evaluated for next-token prediction
                     slot.state = SLOT_STATE_GENERATING;
+
+                    // the prompt is in the KV cache, the next requests can start from it
+                    prefix_cache_update(slot);
                 } else if (slot.state != SLOT_STATE_GENERATING) {
                     continue; // continue loop of slots
                 }
@@ -3541,10 +5607,14 @@ struct server_context {
                 const int64_t t_current = ggml_time_us();
 
                 if (slot.n_decoded == 1) {
+                    metrics.on_first_token(slot);
                     slot.t_start_generation = t_current;
                     slot.t_prompt_processing = (slot.t_start_generation - slot.t_start_process_prompt) / 1e3;
                     metrics.on_prompt_eval(slot);
+                } else {
+                    metrics.on_tokens(slot, t_current, 1);
                 }
+                slot.t_last_token = t_current;
 
                 slot.t_token_generation = (t_current - slot.t_start_generation) / 1e3;
 
@@ -3582,108 +5652,611 @@ struct server_context {
                     GGML_ABORT("not supported by multimodal");
                 }
 
-                // determine the max draft that fits the current slot state
-                int n_draft_max = slot.params.speculative.n_max;
+                // determine the max draft that fits the current slot state
+                int n_draft_max = slot.params.speculative.n_max;
+
+                // note: n_past is not yet increased for the `id` token sampled above
+                //       also, need to leave space for 1 extra token to allow context shifts
+                n_draft_max = std::min(n_draft_max, slot.n_ctx - slot.n_past - 2);
+
+                // the draft does not take new KV pages
+                n_draft_max = std::min(n_draft_max, kv_pages_capacity(slot) - slot.n_past - 2);
+
+                if (slot.n_remaining > 0) {
+                    n_draft_max = std::min(n_draft_max, slot.n_remaining - 1);
+                }
+
+                SLT_DBG(slot, "max possible draft: %d\n", n_draft_max);
+
+                if (n_draft_max < slot.params.speculative.n_min) {
+                    SLT_DBG(slot, "the max possible draft is too small: %d < %d - skipping speculative decoding\n", n_draft_max, slot.params.speculative.n_min);
+
+                    continue;
+                }
+
+                llama_token id = slot.sampled;
+
+                struct common_speculative_params params_spec;
+                params_spec.n_draft   = n_draft_max;
+                params_spec.n_reuse   = llama_n_ctx(slot.ctx_dft) - slot.params.speculative.n_max;
+                params_spec.p_min     = slot.params.speculative.p_min;
+
+                const llama_tokens & cached_text_tokens = slot.cache_tokens.get_text_tokens();
+                llama_tokens draft = common_speculative_gen_draft(slot.spec, params_spec, cached_text_tokens, id);
+
+                // keep track of total number of tokens generated in the draft
+                slot.n_draft_total += draft.size();
+
+                // ignore small drafts
+                if (slot.params.speculative.n_min > (int) draft.size()) {
+                    SLT_DBG(slot, "ignoring small draft: %d < %d\n", (int) draft.size(), slot.params.speculative.n_min);
+
+                    continue;
+                }
+
+                // construct the speculation batch
+                common_batch_clear(slot.batch_spec);
+                common_batch_add  (slot.batch_spec, id, slot.n_past, { slot.id }, true);
+
+                for (size_t i = 0; i < draft.size(); ++i) {
+                    common_batch_add(slot.batch_spec, draft[i], slot.n_past + 1 + i, { slot.id }, true);
+                }
+
+                SLT_DBG(slot, "decoding speculative batch, size = %d\n", slot.batch_spec.n_tokens);
+
+                llama_decode(ctx, slot.batch_spec);
+
+                // the accepted tokens from the speculation
+                const auto ids = common_sampler_sample_and_accept_n(slot.smpl, ctx, draft);
+
+                slot.n_past    += ids.size();
+                slot.n_decoded += ids.size();
+
+                {
+                    const int64_t t_current = ggml_time_us();
+                    metrics.on_tokens(slot, t_current, ids.size());
+                    slot.t_last_token = t_current;
+                }
+
+                // update how many tokens out of draft was accepted
+                slot.n_draft_accepted += ids.size() - 1;
+
+                slot.cache_tokens.push_back(id);
+                slot.cache_tokens.insert({ids.begin(), ids.end() - 1});
+
+                llama_kv_self_seq_rm(ctx, slot.id, slot.n_past, -1);
+
+                for (size_t i = 0; i < ids.size(); ++i) {
+                    completion_token_output result;
+
+                    result.tok          = ids[i];
+                    result.text_to_send = common_token_to_piece(ctx, result.tok, accept_special_token(slot, result.tok));
+                    result.prob         = 1.0f; // set later
+
+                    // TODO: set result.probs
+
+                    if (!process_token(result, slot)) {
+                        // release slot because of stop condition
+                        slot.release();
+                        slot.print_timings();
+                        send_final_response(slot);
+                        metrics.on_prediction(slot);
+                        break;
+                    }
+                }
+
+                SLT_DBG(slot, "accepted %d/%d draft tokens, new n_past = %d\n", (int) ids.size() - 1, (int) draft.size(), slot.n_past);
+            }
+        }
+
+        // the generating slots waited for the whole batch to get their token
+        prefill_budget.on_batch(n_decode_tokens, n_prompt_tokens_batched, ggml_time_us() - t_batch_start);
+
+        SRV_DBG("%s", "run slots completed\n");
+    }
+
+    json model_meta() const {
+        return json {
+            {"vocab_type",  llama_vocab_type       (vocab)},
+            {"n_vocab",     llama_vocab_n_tokens   (vocab)},
+            {"n_ctx_train", llama_model_n_ctx_train(model)},
+            {"n_embd",      llama_model_n_embd     (model)},
+            {"n_params",    llama_model_n_params   (model)},
+            {"size",        llama_model_size       (model)},
+        };
+    }
+};
+
+//OWL BEGIN
+// background re-embedding of a RAG table with the loaded model
+// the new vectors are written to a shadow column; searches keep using the active column until
+// every entry has been migrated, then the shadow column is promoted in a single transaction
+struct server_rag_migration {
+    // rows inserted during the migration make the promotion fail; the table is scanned again after a
+    // growing pause, and the migration gives up if writers keep it from ever catching up
+    static constexpr int n_promote_retries  = 8;
+    static constexpr int t_backoff_start_ms = 500;
+    static constexpr int t_backoff_max_ms   = 30000;
+
+    std::mutex mutex;
+    std::thread worker;
+    std::atomic<bool> running   = false;
+    std::atomic<bool> cancelled = false;
+
+    std::atomic<int> n_migrated = 0;
+    std::atomic<int> n_skipped  = 0;
+    std::string state = "idle"; // idle, running, done, cancelled, failed
+    std::string error;
+
+    ~server_rag_migration() {
+        stop();
+    }
+
+    bool start(server_context & ctx_server, const std::string & host, int port, const std::string & name, const std::string & collection,
+               const std::string & user, const std::string & password, const ecc256_private_key & recipient_sk, int n_batch) {
+        std::lock_guard<std::mutex> lock(mutex);
+        if (running) {
+            return false;
+        }
+        if (worker.joinable()) {
+            worker.join();
+        }
+        running    = true;
+        cancelled  = false;
+        n_migrated = 0;
+        n_skipped  = 0;
+        state      = "running";
+        error.clear();
+
+        worker = std::thread([this, &ctx_server, host, port, name, collection, user, password, recipient_sk, n_batch]() {
+            try {
+                run(ctx_server, host, port, name, collection, user, password, recipient_sk, n_batch);
+            } catch (const std::exception & e) {
+                std::lock_guard<std::mutex> lock(mutex);
+                state = "failed";
+                error = e.what();
+                SRV_ERR("RAG migration failed: %s\n", e.what());
+            }
+            running = false;
+        });
+        return true;
+    }
+
+    void stop() {
+        cancelled = true;
+        if (worker.joinable()) {
+            worker.join();
+        }
+    }
+
+    json to_json() {
+        std::lock_guard<std::mutex> lock(mutex);
+        return json {
+            {"state",      state},
+            {"error",      error},
+            {"n_migrated", n_migrated.load()},
+            {"n_skipped",  n_skipped.load()},
+        };
+    }
+
+private:
+    void set_state(const std::string & new_state, const std::string & new_error = "") {
+        std::lock_guard<std::mutex> lock(mutex);
+        state = new_state;
+        error = new_error;
+    }
+
+    void run(server_context & ctx_server, const std::string & host, int port, const std::string & name, const std::string & collection,
+             const std::string & user, const std::string & password, const ecc256_private_key & recipient_sk, int n_batch) {
+        // own connection, outside the request pool: it is held for the whole migration
+        auto rag_db = postgres_client::for_collection(host, port, name, collection);
+        rag_db->connect(user, password);
+
+        const embedding_fingerprint target = ctx_server.get_embedding_fingerprint();
+        embedding_fingerprint shadow;
+        if (rag_db->getFingerprint(shadow, true) && shadow.matches(target)) {
+            SRV_INF("resuming RAG migration to '%s'\n", target.model_desc.c_str());
+        } else {
+            SRV_INF("starting RAG migration to '%s'\n", target.model_desc.c_str());
+            rag_db->beginShadowMigration(target);
+        }
+
+        const auto recipient_pk = CryptoUtils::computePublicKey(recipient_sk);
+        int last_id = 0;
+        int n_retries = 0;
+        int t_backoff_ms = 0;
+        while (!cancelled) {
+            // wait before rescanning, without holding the model gate so that a swap is not held up
+            for (int t = 0; t < t_backoff_ms && !cancelled; t += 50) {
+                std::this_thread::sleep_for(std::chrono::milliseconds(50));
+            }
+            if (cancelled) {
+                break;
+            }
+            t_backoff_ms = 0;
+
+            // a model swap waits for the batch, which is re-embedded by the model it was checked against
+            const auto model_use = ctx_server.model_gate.use();
+            if (!ctx_server.get_embedding_fingerprint().matches(target)) {
+                set_state("failed", "model changed while migrating");
+                return;
+            }
+
+            auto batch = rag_db->fetchShadowBatch(last_id, n_batch);
+            if (batch.empty()) {
+                if (n_skipped > 0) {
+                    set_state("failed", std::to_string(n_skipped.load()) + " entries could not be decrypted, shadow not promoted");
+                    return;
+                }
+                try {
+                    rag_db->promoteShadow();
+                } catch (const rag_shadow_pending_error & e) {
+                    // entries were inserted behind us, go over the table again
+                    if (++n_retries > n_promote_retries) {
+                        set_state("failed", std::string("shadow not promoted after ") + std::to_string(n_promote_retries) + " rescans: " + e.what());
+                        return;
+                    }
+                    t_backoff_ms = std::min(t_backoff_max_ms, t_backoff_start_ms << (n_retries - 1));
+                    SRV_WRN("RAG migration not promoted yet (%s), rescanning in %d ms\n", e.what(), t_backoff_ms);
+                    last_id = 0;
+                    continue;
+                }
+                SRV_INF("RAG migration done, %d entries re-embedded\n", n_migrated.load());
+                set_state("done");
+                return;
+            }
+            last_id = batch.back().id;
+
+            std::vector<int> entry_ids;
+            std::vector<server_task> tasks;
+            for (const auto & entry : batch) {
+                std::vector<uint8_t> contents;
+                if (entry.encryption_public_key == recipient_pk) {
+                    if (entry.ephemeral_public_key == ecc256_public_key()) {
+                        contents = entry.encrypted_content;
+                    } else {
+                        contents = EciesUtils::decrypt_ecies(entry.encrypted_content, entry.tag, entry.nonce,
+                                                             entry.ephemeral_public_key, recipient_sk);
+                    }
+                }
+                if (contents.empty()) {
+                    n_skipped++;
+                    continue;
+                }
+
+                // stored contents are document text: special token markup in them must not be parsed
+                llama_tokens tokens = common_tokenize(ctx_server.vocab, std::string(contents.begin(), contents.end()), true, false);
+
+                server_task task = server_task(SERVER_TASK_TYPE_EMBEDDING);
+                task.id            = ctx_server.queue_tasks.get_new_id();
+                task.index         = tasks.size();
+                task.prompt_tokens = server_tokens(tokens, ctx_server.mctx != nullptr);
+                task.params.oaicompat = OAICOMPAT_TYPE_NONE;
+
+                entry_ids.push_back(entry.id);
+                tasks.push_back(std::move(task));
+            }
+            server_tasks_set_class(tasks, "", json(), SERVER_TASK_PRIORITY_BACKGROUND, SERVER_ENDPOINT_INGEST, 0);
+            if (tasks.empty()) {
+                continue;
+            }
+
+            std::string task_error;
+            const auto task_ids = server_task::get_list_id(tasks);
+            ctx_server.queue_results.add_waiting_tasks(tasks);
+            ctx_server.queue_tasks.post(std::move(tasks));
+            ctx_server.receive_multi_results(task_ids, [&](std::vector<server_task_result_ptr> & results) {
+                for (size_t i = 0; i < results.size(); i++) {
+                    auto * res_embd = dynamic_cast<server_task_result_embd*>(results[i].get());
+                    GGML_ASSERT(res_embd != nullptr && !res_embd->embedding.empty());
+
+                    // same aggregation as /chunking: average of the per-token embeddings (a single row with pooling)
+                    std::vector<float> embedding(res_embd->embedding[0].size(), 0.0f);
+                    for (const auto & row : res_embd->embedding) {
+                        for (size_t j = 0; j < embedding.size(); j++) {
+                            embedding[j] += row[j];
+                        }
+                    }
+                    for (auto & v : embedding) {
+                        v /= (float) res_embd->embedding.size();
+                    }
+                    rag_db->updateShadowEmbedding(entry_ids[i], embedding);
+                    n_migrated++;
+                }
+            }, [&](const json & error_data) {
+                task_error = error_data.dump();
+            }, [this]() {
+                return cancelled.load();
+            });
+            ctx_server.queue_results.remove_waiting_task_ids(task_ids);
+
+            if (!task_error.empty()) {
+                set_state("failed", task_error);
+                return;
+            }
+        }
+        set_state("cancelled");
+    }
+};
 
-                // note: n_past is not yet increased for the `id` token sampled above
-                //       also, need to leave space for 1 extra token to allow context shifts
-                n_draft_max = std::min(n_draft_max, slot.n_ctx - slot.n_past - 2);
+// one migration per collection: re-embedding a collection does not block or report on the others
+struct server_rag_migrations {
+    std::mutex mutex;
+    std::map<std::string, std::unique_ptr<server_rag_migration>> migrations;
 
-                if (slot.n_remaining > 0) {
-                    n_draft_max = std::min(n_draft_max, slot.n_remaining - 1);
-                }
+    server_rag_migration & get(const std::string & host, int port, const std::string & name, const std::string & collection) {
+        const std::string key = host + ":" + std::to_string(port) + "/" + name + "#" + (collection.empty() ? "default" : collection);
+        std::lock_guard<std::mutex> lock(mutex);
+        auto & migration = migrations[key];
+        if (!migration) {
+            migration = std::make_unique<server_rag_migration>();
+        }
+        return *migration;
+    }
 
-                SLT_DBG(slot, "max possible draft: %d\n", n_draft_max);
+    void stop() {
+        std::lock_guard<std::mutex> lock(mutex);
+        for (auto & it : migrations) {
+            it.second->stop();
+        }
+    }
+};
 
-                if (n_draft_max < slot.params.speculative.n_min) {
-                    SLT_DBG(slot, "the max possible draft is too small: %d < %d - skipping speculative decoding\n", n_draft_max, slot.params.speculative.n_min);
+// models loaded on demand next to the generation model, each with its own context, slots and task loop (as the
+// dedicated RAG models); the least recently used ones are unloaded to keep their GGUF files within the budget
+struct server_model_pool {
+    struct entry {
+        std::string name;      // GGUF file in the directory of the generation model
+        server_task_type type; // completion, embedding or rerank: the model is loaded for one kind of task
+        size_t n_bytes = 0;
+        int64_t t_last_used = 0;
 
-                    continue;
-                }
+        server_context ctx;
+        std::thread loop;
 
-                llama_token id = slot.sampled;
+        ~entry() {
+            ctx.queue_tasks.terminate();
+            ctx.queue_results.terminate();
+            if (loop.joinable()) {
+                loop.join();
+            }
+        }
+    };
 
-                struct common_speculative_params params_spec;
-                params_spec.n_draft   = n_draft_max;
-                params_spec.n_reuse   = llama_n_ctx(slot.ctx_dft) - slot.params.speculative.n_max;
-                params_spec.p_min     = slot.params.speculative.p_min;
+    // a request holds the entry of its model until its response is sent, which keeps it loaded
+    using entry_ptr = std::shared_ptr<entry>;
 
-                const llama_tokens & cached_text_tokens = slot.cache_tokens.get_text_tokens();
-                llama_tokens draft = common_speculative_gen_draft(slot.spec, params_spec, cached_text_tokens, id);
+    common_params params; // of the generation model
+    size_t budget = 0;    // 0 = disabled
 
-                // keep track of total number of tokens generated in the draft
-                slot.n_draft_total += draft.size();
+    std::mutex mutex;      // guards the entries
+    std::mutex mutex_load; // a single model is loaded at a time
+    std::vector<entry_ptr> entries;
+    size_t n_used = 0;
 
-                // ignore small drafts
-                if (slot.params.speculative.n_min > (int) draft.size()) {
-                    SLT_DBG(slot, "ignoring small draft: %d < %d\n", (int) draft.size(), slot.params.speculative.n_min);
+    void init(const common_params & params_base) {
+        params = params_base;
+        budget = (size_t) std::max(0, params.model_pool_mib) * 1024 * 1024;
+    }
 
-                    continue;
-                }
+    bool enabled() const {
+        return budget > 0;
+    }
 
-                // construct the speculation batch
-                common_batch_clear(slot.batch_spec);
-                common_batch_add  (slot.batch_spec, id, slot.n_past, { slot.id }, true);
+    // the model of the file name in dir for the tasks of type, loaded if needed
+    entry_ptr get(const std::string & dir, const std::string & name, server_task_type type, std::string & error, error_type & type_error) {
+        if (entry_ptr e = find(name, type)) {
+            return e;
+        }
 
-                for (size_t i = 0; i < draft.size(); ++i) {
-                    common_batch_add(slot.batch_spec, draft[i], slot.n_past + 1 + i, { slot.id }, true);
-                }
+        std::lock_guard<std::mutex> lock_load(mutex_load);
+        if (entry_ptr e = find(name, type)) {
+            return e;
+        }
 
-                SLT_DBG(slot, "decoding speculative batch, size = %d\n", slot.batch_spec.n_tokens);
+        const fs::path path = fs::path(dir) / name;
+        std::error_code ec;
+        const size_t n_bytes = fs::is_regular_file(path, ec) ? (size_t) fs::file_size(path, ec) : 0;
+        if (ec || n_bytes == 0) {
+            error = "Model not found: " + name;
+            type_error = ERROR_TYPE_NOT_FOUND;
+            return nullptr;
+        }
+        if (n_bytes > budget) {
+            error = "The model is larger than the model pool: " + name;
+            type_error = ERROR_TYPE_INVALID_REQUEST;
+            return nullptr;
+        }
+        if (!unload_lru(n_bytes)) {
+            error = "The model pool is full of models in use, retry later";
+            type_error = ERROR_TYPE_UNAVAILABLE;
+            return nullptr;
+        }
 
-                llama_decode(ctx, slot.batch_spec);
+        auto e = std::make_shared<entry>();
+        e->name    = name;
+        e->type    = type;
+        e->n_bytes = n_bytes;
 
-                // the accepted tokens from the speculation
-                const auto ids = common_sampler_sample_and_accept_n(slot.smpl, ctx, draft);
+        server_context & ctx = e->ctx;
+        if (!ctx.load_model(params_for(path.string(), type))) {
+            error = "The model could not be loaded: " + name;
+            type_error = ERROR_TYPE_SERVER;
+            return nullptr;
+        }
+        ctx.init();
 
-                slot.n_past    += ids.size();
-                slot.n_decoded += ids.size();
+        ctx.queue_tasks.on_new_task([&ctx](server_task && task) {
+            ctx.process_single_task(std::move(task));
+        });
+        ctx.queue_tasks.on_update_slots([&ctx]() {
+            ctx.update_slots();
+        });
+        e->loop = std::thread([&ctx]() { ctx.queue_tasks.start_loop(); });
+        e->t_last_used = ggml_time_us();
 
-                // update how many tokens out of draft was accepted
-                slot.n_draft_accepted += ids.size() - 1;
+        SRV_INF("model pool: loaded '%s' for %s tasks, %zu MiB\n", name.c_str(), type_name(type), n_bytes / 1024 / 1024);
 
-                slot.cache_tokens.push_back(id);
-                slot.cache_tokens.insert({ids.begin(), ids.end() - 1});
+        std::lock_guard<std::mutex> lock(mutex);
+        entries.push_back(e);
+        n_used += n_bytes;
+        return e;
+    }
 
-                llama_kv_self_seq_rm(ctx, slot.id, slot.n_past, -1);
+    json to_json() {
+        std::lock_guard<std::mutex> lock(mutex);
+        json loaded = json::array();
+        for (const auto & e : entries) {
+            loaded.push_back({
+                {"model", e->name},
+                {"type",  type_name(e->type)},
+                {"size",  e->n_bytes},
+            });
+        }
+        return json {
+            {"budget",  budget},
+            {"used",    n_used},
+            {"loaded",  loaded},
+        };
+    }
 
-                for (size_t i = 0; i < ids.size(); ++i) {
-                    completion_token_output result;
+    void clear() {
+        std::vector<entry_ptr> unloaded;
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            unloaded.swap(entries);
+            n_used = 0;
+        }
+    }
 
-                    result.tok          = ids[i];
-                    result.text_to_send = common_token_to_piece(ctx, result.tok, accept_special_token(slot, result.tok));
-                    result.prob         = 1.0f; // set later
+private:
+    static const char * type_name(server_task_type type) {
+        switch (type) {
+            case SERVER_TASK_TYPE_EMBEDDING: return "embedding";
+            case SERVER_TASK_TYPE_RERANK:    return "rerank";
+            default:                         return "completion";
+        }
+    }
 
-                    // TODO: set result.probs
+    entry_ptr find(const std::string & name, server_task_type type) {
+        std::lock_guard<std::mutex> lock(mutex);
+        for (const auto & e : entries) {
+            if (e->name == name && e->type == type) {
+                e->t_last_used = ggml_time_us();
+                return e;
+            }
+        }
+        return nullptr;
+    }
 
-                    if (!process_token(result, slot)) {
-                        // release slot because of stop condition
-                        slot.release();
-                        slot.print_timings();
-                        send_final_response(slot);
-                        metrics.on_prediction(slot);
-                        break;
-                    }
+    // unload the least recently used models that no request uses, until n_bytes more fit in the budget
+    bool unload_lru(size_t n_bytes) {
+        std::vector<entry_ptr> unloaded; // their loops are joined out of the lock
+        std::lock_guard<std::mutex> lock(mutex);
+        while (n_used + n_bytes > budget) {
+            auto lru = entries.end();
+            for (auto it = entries.begin(); it != entries.end(); ++it) {
+                if (it->use_count() > 1 || (*it)->ctx.queue_results.n_waiting() > 0) {
+                    continue;
+                }
+                if (lru == entries.end() || (*it)->t_last_used < (*lru)->t_last_used) {
+                    lru = it;
                 }
-
-                SLT_DBG(slot, "accepted %d/%d draft tokens, new n_past = %d\n", (int) ids.size() - 1, (int) draft.size(), slot.n_past);
             }
+            if (lru == entries.end()) {
+                return false;
+            }
+            SRV_INF("model pool: unloading '%s'\n", (*lru)->name.c_str());
+            n_used -= (*lru)->n_bytes;
+            unloaded.push_back(std::move(*lru));
+            entries.erase(lru);
         }
+        return true;
+    }
 
-        SRV_DBG("%s", "run slots completed\n");
+    // the parameters of a pooled model are those of a dedicated RAG model, for completions as well
+    common_params params_for(const std::string & path, server_task_type type) const {
+        common_params params_pool = params;
+
+        params_pool.model        = common_params_model();
+        params_pool.model.path   = path;
+        params_pool.embedding    = type == SERVER_TASK_TYPE_EMBEDDING;
+        params_pool.reranking    = type == SERVER_TASK_TYPE_RERANK;
+        params_pool.pooling_type = type == SERVER_TASK_TYPE_RERANK ? LLAMA_POOLING_TYPE_RANK : LLAMA_POOLING_TYPE_UNSPECIFIED;
+        params_pool.n_parallel   = params.model_pool_parallel;
+        params_pool.n_ctx        = params.model_pool_n_ctx;
+        if (type != SERVER_TASK_TYPE_COMPLETION) {
+            // non-causal models must process each input in a single ubatch
+            params_pool.n_ubatch  = params_pool.n_batch;
+            params_pool.ctx_shift = false;
+        }
+
+        // the chat template, adapters and draft of the generation model are its own
+        params_pool.chat_template.clear();
+        params_pool.speculative.model = common_params_model();
+        params_pool.mmproj            = common_params_model();
+        params_pool.lora_adapters.clear();
+        params_pool.control_vectors.clear();
+
+        // the spill files are named after the process, a single context spills
+        params_pool.kv_spill_ram_mib = 0;
+
+        return params_pool;
     }
+};
 
-    json model_meta() const {
-        return json {
-            {"vocab_type",  llama_vocab_type       (vocab)},
-            {"n_vocab",     llama_vocab_n_tokens   (vocab)},
-            {"n_ctx_train", llama_model_n_ctx_train(model)},
-            {"n_embd",      llama_model_n_embd     (model)},
-            {"n_params",    llama_model_n_params   (model)},
-            {"size",        llama_model_size       (model)},
-        };
+// stages of the RAG completions that run on the HTTP threads, before the augmented prompt is posted
+// (its prefill is in the metrics of the "rag" endpoint)
+enum server_rag_stage {
+    SERVER_RAG_STAGE_EMBEDDING, // query embedding, queue wait included
+    SERVER_RAG_STAGE_SEARCH,    // nearest neighbours search, over all the collections
+    SERVER_RAG_STAGE_DECRYPT,
+    SERVER_RAG_STAGE_RERANK,
+    SERVER_RAG_STAGE_COUNT,
+};
+
+static const char * server_rag_stage_name(server_rag_stage stage) {
+    switch (stage) {
+        case SERVER_RAG_STAGE_EMBEDDING: return "embedding";
+        case SERVER_RAG_STAGE_SEARCH:    return "search";
+        case SERVER_RAG_STAGE_DECRYPT:   return "decrypt";
+        case SERVER_RAG_STAGE_RERANK:    return "rerank";
+        default:                         return "unknown";
+    }
+}
+
+struct server_rag_metrics {
+    std::mutex mutex;
+    server_histogram stages[SERVER_RAG_STAGE_COUNT];
+    uint64_t n_db_errors = 0; // failed connections and searches
+
+    // the stage started at t_start (us) is over
+    void observe(server_rag_stage stage, int64_t t_start) {
+        const double t = (ggml_time_us() - t_start) / 1e6;
+        std::lock_guard<std::mutex> lock(mutex);
+        stages[stage].observe(t);
+    }
+
+    void on_db_error() {
+        std::lock_guard<std::mutex> lock(mutex);
+        n_db_errors++;
+    }
+
+    json stages_to_json() {
+        std::lock_guard<std::mutex> lock(mutex);
+        json histograms = json::array();
+        for (int i = 0; i < SERVER_RAG_STAGE_COUNT; i++) {
+            histograms.push_back(stages[i].to_json(string_format("stage=\"%s\"", server_rag_stage_name((server_rag_stage) i))));
+        }
+        return histograms;
+    }
+
+    uint64_t db_errors() {
+        std::lock_guard<std::mutex> lock(mutex);
+        return n_db_errors;
     }
 };
+//OWL END
 
 static void log_server_request(const httplib::Request & req, const httplib::Response & res) {
     // skip GH copilot requests when using default port
@@ -3723,8 +6296,25 @@ int main(int argc, char ** argv) {
 
     common_init();
 
+    // before the HTTP threads start: they read its settings without a lock
+    tracer.init(std::max(0, params.trace_n_spans), params.trace_file);
+    tenants.init(params.api_keys);
+
     // struct that contains llama context and inference
     server_context ctx_server;
+    //OWL BEGIN
+    // optional dedicated models for the RAG endpoints, each with its own context and slots,
+    // so that ingestion and retrieval do not take decode capacity away from generation
+    server_context ctx_server_rag_embd;
+    server_context ctx_server_rag_rerank;
+    server_context & ctx_rag_embd   = params.rag_embd_model.empty()   ? ctx_server : ctx_server_rag_embd;
+    server_context & ctx_rag_rerank = params.rag_rerank_model.empty() ? ctx_server : ctx_server_rag_rerank;
+    std::vector<std::thread> rag_loops;
+    server_rag_migrations rag_migrations;
+    // other models of the directory of the generation model, loaded on demand for the requests that name them
+    server_model_pool model_pool;
+    server_rag_metrics rag_metrics;
+    //OWL END
 
     llama_backend_init();
     llama_numa_init(params.numa);
@@ -3736,6 +6326,21 @@ int main(int argc, char ** argv) {
 
     std::unique_ptr<httplib::Server> svr;
 #ifdef CPPHTTPLIB_OPENSSL_SUPPORT
+    //OWL BEGIN
+    // certificate renewed with ACME: handshakes take it from acme_swap, so that a renewal needs no restart
+    acme_lw::CertificateSwap acme_swap;
+    const bool acme_enabled = !params.acme_domains.empty() && params.ssl_file_key != "" && params.ssl_file_cert != "";
+    if (!params.acme_domains.empty() && !acme_enabled) {
+        LOG_WRN("%s: --acme-domain requires --ssl-key-file and --ssl-cert-file, no renewal\n", __func__);
+    }
+    if (acme_enabled && params.ssl_self_cert_common == "" && !fs::exists(params.ssl_file_cert)) {
+        // the TLS server needs a certificate to start: a self-signed placeholder, replaced by the first renewal
+        if (!self_signed::createKeyAndSelfSignedCertificate(params.ssl_file_key, "", params.ssl_file_cert, params.acme_domains.front())) {
+            LOG_ERR("%s: failed to create the placeholder certificate %s\n", __func__, params.ssl_file_cert.c_str());
+            return 1;
+        }
+    }
+    //OWL END
     if (params.ssl_file_key != "" && params.ssl_file_cert != "") {
         if(params.ssl_self_cert_common != "")
         {
@@ -3747,9 +6352,20 @@ int main(int argc, char ** argv) {
 
         }
         LOG_INF("Running with SSL: key = %s, cert = %s\n", params.ssl_file_key.c_str(), params.ssl_file_cert.c_str());
-        svr.reset(
-            new httplib::SSLServer(params.ssl_file_cert.c_str(), params.ssl_file_key.c_str())
-        );
+        auto * ssl_svr = new httplib::SSLServer(params.ssl_file_cert.c_str(), params.ssl_file_key.c_str());
+        svr.reset(ssl_svr);
+        // resumable sessions: a client reconnecting within ssl_session_timeout skips the full handshake,
+        // with a session id from the server cache (TLS 1.2) or a session ticket (TLS 1.2 and 1.3)
+        if (SSL_CTX * ssl_ctx = ssl_svr->ssl_context()) {
+            static const unsigned char session_id_context[] = "llama-server";
+            SSL_CTX_set_session_cache_mode(ssl_ctx, SSL_SESS_CACHE_SERVER);
+            SSL_CTX_set_session_id_context(ssl_ctx, session_id_context, sizeof(session_id_context) - 1);
+            SSL_CTX_set_timeout(ssl_ctx, params.ssl_session_timeout);
+            SSL_CTX_clear_options(ssl_ctx, SSL_OP_NO_TICKET);
+            if (acme_enabled) {
+                acme_swap.install(ssl_ctx);
+            }
+        }
     } else {
         LOG_INF("Running without SSL\n");
         svr.reset(new httplib::Server());
@@ -3778,6 +6394,12 @@ int main(int argc, char ** argv) {
         res.status = 200;
     };
 
+    // while a model change drains the requests using the model, the new ones are turned away rather than held back
+    auto res_model_busy = [&res_error](httplib::Response & res, server_model_gate & gate) {
+        res.set_header("Retry-After", std::to_string(gate.retry_after()));
+        res_error(res, format_error_response("The model is being changed, retry later", ERROR_TYPE_UNAVAILABLE));
+    };
+
     svr->set_exception_handler([&res_error](const httplib::Request &, httplib::Response & res, const std::exception_ptr & ep) {
         std::string message;
         try {
@@ -3807,6 +6429,9 @@ int main(int argc, char ** argv) {
     // set timeouts and change hostname and port
     svr->set_read_timeout (params.timeout_read);
     svr->set_write_timeout(params.timeout_write);
+    // keep-alive spares the TCP and TLS handshakes of the next requests of a client
+    svr->set_keep_alive_timeout(params.keep_alive_timeout);
+    svr->set_keep_alive_max_count(std::max(1, params.keep_alive_max));
 
     std::unordered_map<std::string, std::string> log_data;
 
@@ -3884,6 +6509,16 @@ int main(int argc, char ** argv) {
     // register server middlewares
     svr->set_pre_routing_handler([&middleware_validate_api_key, &middleware_server_state](const httplib::Request & req, httplib::Response & res) {
         res.set_header("Access-Control-Allow-Origin", req.get_header_value("Origin"));
+        //OWL BEGIN
+        // the ACME CA fetches the http-01 challenges anonymously, possibly while the model is loading
+        if (req.path.rfind("/.well-known/acme-challenge/", 0) == 0) {
+            return httplib::Server::HandlerResponse::Unhandled;
+        }
+        //OWL END
+        // with --trace, the spans of the request are recorded under this id, see GET /trace/{id}
+        if (tracer.enabled() && req.method == "POST") {
+            res.set_header("X-Trace-Id", string_format("%016" PRIx64, tracer.new_trace_id()));
+        }
         // If this is OPTIONS request, skip validation because browsers don't include Authorization header
         if (req.method == "OPTIONS") {
             res.set_header("Access-Control-Allow-Credentials", "true");
@@ -4004,6 +6639,14 @@ int main(int argc, char ** argv) {
                     {"name",  "n_busy_slots_per_decode"},
                     {"help",  "Average number of busy slots per llama_decode() call"},
                     {"value",  (float) res_metrics->n_busy_slots_total / std::max((float) res_metrics->n_decode_total, 1.f)}
+            }, {
+                    {"name",  "prefix_cache_hits_total"},
+                    {"help",  "Number of prompts started from the prefix cached by another slot."},
+                    {"value",  res_metrics->n_prefix_cache_hits}
+            }, {
+                    {"name",  "prefix_cache_tokens_total"},
+                    {"help",  "Number of prompt tokens reused from the prefix cached by another slot."},
+                    {"value",  res_metrics->n_prefix_cache_tokens}
             }}},
             {"gauge", {{
                     {"name",  "prompt_tokens_seconds"},
@@ -4029,9 +6672,173 @@ int main(int argc, char ** argv) {
                     {"name",  "requests_deferred"},
                     {"help",  "Number of requests deferred."},
                     {"value",  (uint64_t) res_metrics->n_tasks_deferred}
+            },{
+                    {"name",  "prefill_budget_tokens"},
+                    {"help",  "Max number of prompt tokens per batch while slots are generating."},
+                    {"value",  res_metrics->n_prefill_budget}
             }}}
         };
 
+        if (res_metrics->n_kv_pages_total > 0) {
+            all_metrics_def["counter"].push_back({
+                    {"name",  "kv_pages_evicted_total"},
+                    {"help",  "Number of cached prompts evicted to free KV pages."},
+                    {"value",  res_metrics->n_kv_pages_evicted}
+            });
+            all_metrics_def["gauge"].push_back({
+                    {"name",  "kv_pages_used"},
+                    {"help",  "Number of KV pages held by the slots."},
+                    {"value",  res_metrics->n_kv_pages_used}
+            });
+            all_metrics_def["gauge"].push_back({
+                    {"name",  "kv_pages_free"},
+                    {"help",  "Number of free KV pages."},
+                    {"value",  res_metrics->n_kv_pages_total - res_metrics->n_kv_pages_used}
+            });
+        }
+
+        if (res_metrics->kv_spill) {
+            all_metrics_def["gauge"].push_back({
+                    {"name",    "kv_spill_bytes"},
+                    {"help",    "Size of the spilled prompt caches, per tier."},
+                    {"samples", json::array({
+                        {{"labels", "tier=\"ram\""},  {"value", res_metrics->n_kv_spill_ram_bytes}},
+                        {{"labels", "tier=\"disk\""}, {"value", res_metrics->n_kv_spill_disk_bytes}},
+                    })}
+            });
+            all_metrics_def["counter"].push_back({
+                    {"name",  "kv_spill_total"},
+                    {"help",  "Number of prompt caches spilled."},
+                    {"value",  res_metrics->n_kv_spilled}
+            });
+            all_metrics_def["counter"].push_back({
+                    {"name",    "kv_spill_restored_total"},
+                    {"help",    "Number of spilled prompt caches loaded back into a slot, per tier."},
+                    {"samples", json::array({
+                        {{"labels", "tier=\"ram\""},  {"value", res_metrics->n_kv_spill_restored - res_metrics->n_kv_spill_restored_disk}},
+                        {{"labels", "tier=\"disk\""}, {"value", res_metrics->n_kv_spill_restored_disk}},
+                    })}
+            });
+        }
+
+        // scheduling metrics, one sample per priority class
+        {
+            const auto per_priority = [&](const std::function<double(const server_class_metrics &, size_t)> & get) {
+                json samples = json::array();
+                for (int i = 0; i < SERVER_TASK_PRIORITY_COUNT; i++) {
+                    samples.push_back({
+                        {"labels", string_format("priority=\"%s\"", server_task_priority_name((server_task_priority) i))},
+                        {"value",  get(res_metrics->classes[i], res_metrics->n_deferred_classes[i])},
+                    });
+                }
+                return samples;
+            };
+            all_metrics_def["counter"].push_back({
+                    {"name",    "requests_started_total"},
+                    {"help",    "Number of requests that got a slot, per priority class."},
+                    {"samples", per_priority([](const server_class_metrics & cls, size_t) { return (double) cls.n_started; })}
+            });
+            all_metrics_def["counter"].push_back({
+                    {"name",    "queue_seconds_total"},
+                    {"help",    "Time the requests waited for a slot, per priority class."},
+                    {"samples", per_priority([](const server_class_metrics & cls, size_t) { return cls.t_queue_total / 1.e6; })}
+            });
+            all_metrics_def["counter"].push_back({
+                    {"name",    "time_to_first_token_seconds_total"},
+                    {"help",    "Time from the arrival of the requests to their first token, per priority class."},
+                    {"samples", per_priority([](const server_class_metrics & cls, size_t) { return cls.t_ttft_total / 1.e6; })}
+            });
+            all_metrics_def["counter"].push_back({
+                    {"name",    "time_to_first_token_requests_total"},
+                    {"help",    "Number of requests in time_to_first_token_seconds_total, per priority class."},
+                    {"samples", per_priority([](const server_class_metrics & cls, size_t) { return (double) cls.n_ttft; })}
+            });
+            all_metrics_def["counter"].push_back({
+                    {"name",    "requests_rejected_total"},
+                    {"help",    "Number of requests rejected by the admission control, per priority class."},
+                    {"samples", per_priority([](const server_class_metrics & cls, size_t) { return (double) cls.n_rejected; })}
+            });
+            all_metrics_def["counter"].push_back({
+                    {"name",    "requests_preempted_total"},
+                    {"help",    "Number of requests preempted for an interactive one, per priority class."},
+                    {"samples", per_priority([](const server_class_metrics & cls, size_t) { return (double) cls.n_preempted; })}
+            });
+            all_metrics_def["gauge"].push_back({
+                    {"name",    "requests_deferred_by_priority"},
+                    {"help",    "Number of requests waiting for a slot, per priority class."},
+                    {"samples", per_priority([](const server_class_metrics &, size_t n_deferred) { return (double) n_deferred; })}
+            });
+        }
+
+        // latency distributions, one histogram per endpoint that served requests
+        {
+            const auto per_endpoint = [&](server_histogram server_endpoint_metrics::*histogram) {
+                json histograms = json::array();
+                for (int i = 0; i < SERVER_ENDPOINT_COUNT; i++) {
+                    const auto & h = res_metrics->endpoints[i].*histogram;
+                    if (h.count > 0) {
+                        histograms.push_back(h.to_json(string_format("endpoint=\"%s\"", server_endpoint_name((server_endpoint) i))));
+                    }
+                }
+                return histograms;
+            };
+            all_metrics_def["histogram"] = json::array();
+            all_metrics_def["histogram"].push_back({
+                    {"name",       "request_queue_seconds"},
+                    {"help",       "Time the requests waited for a slot, per endpoint."},
+                    {"histograms", per_endpoint(&server_endpoint_metrics::queue)}
+            });
+            all_metrics_def["histogram"].push_back({
+                    {"name",       "time_to_first_token_seconds"},
+                    {"help",       "Time from the arrival of the requests to their first token (or result), per endpoint."},
+                    {"histograms", per_endpoint(&server_endpoint_metrics::ttft)}
+            });
+            all_metrics_def["histogram"].push_back({
+                    {"name",       "inter_token_latency_seconds"},
+                    {"help",       "Time between two generated tokens, per endpoint."},
+                    {"histograms", per_endpoint(&server_endpoint_metrics::itl)}
+            });
+            all_metrics_def["histogram"].push_back({
+                    {"name",       "request_duration_seconds"},
+                    {"help",       "Time from the arrival of the requests to their last token (or result), per endpoint."},
+                    {"histograms", per_endpoint(&server_endpoint_metrics::duration)}
+            });
+            all_metrics_def["histogram"].push_back({
+                    {"name",       "request_prompt_tokens"},
+                    {"help",       "Number of prompt tokens per request, per endpoint."},
+                    {"histograms", per_endpoint(&server_endpoint_metrics::n_prompt)}
+            });
+            all_metrics_def["histogram"].push_back({
+                    {"name",       "request_predicted_tokens"},
+                    {"help",       "Number of generated tokens per request, per endpoint."},
+                    {"histograms", per_endpoint(&server_endpoint_metrics::n_predicted)}
+            });
+
+            // the RAG stages measured on the HTTP threads, and the prefill of the augmented prompts
+            json rag_stages = rag_metrics.stages_to_json();
+            rag_stages.push_back(res_metrics->endpoints[SERVER_ENDPOINT_RAG].prefill.to_json("stage=\"prefill\""));
+            all_metrics_def["histogram"].push_back({
+                    {"name",       "rag_stage_seconds"},
+                    {"help",       "Time of the stages of the RAG completions."},
+                    {"histograms", rag_stages}
+            });
+            all_metrics_def["counter"].push_back({
+                    {"name",  "rag_db_errors_total"},
+                    {"help",  "Number of failed connections to and searches of the RAG database."},
+                    {"value",  rag_metrics.db_errors()}
+            });
+            all_metrics_def["counter"].push_back({
+                    {"name",  "rag_key_cache_hits_total"},
+                    {"help",  "Number of RAG data keys found in the key cache."},
+                    {"value",  data_key_cache::get().hits()}
+            });
+            all_metrics_def["counter"].push_back({
+                    {"name",  "rag_key_cache_misses_total"},
+                    {"help",  "Number of RAG data keys derived with a key agreement."},
+                    {"value",  data_key_cache::get().misses()}
+            });
+        }
+
         std::stringstream prometheus;
 
         for (const auto & el : all_metrics_def.items()) {
@@ -4042,10 +6849,32 @@ int main(int argc, char ** argv) {
                 const std::string name = metric_def.at("name");
                 const std::string help = metric_def.at("help");
 
-                auto value = json_value(metric_def, "value", 0.);
                 prometheus << "# HELP llamacpp:" << name << " " << help  << "\n"
-                            << "# TYPE llamacpp:" << name << " " << type  << "\n"
-                            << "llamacpp:"        << name << " " << value << "\n";
+                            << "# TYPE llamacpp:" << name << " " << type  << "\n";
+                if (metric_def.contains("histograms")) {
+                    // cumulative buckets, then the sum and the count of the observations
+                    for (const auto & histogram : metric_def.at("histograms")) {
+                        const std::string labels = histogram.at("labels");
+                        const auto & bounds = histogram.at("bounds");
+                        const auto & counts = histogram.at("counts");
+                        uint64_t cumulative = 0;
+                        for (size_t i = 0; i < counts.size(); i++) {
+                            cumulative += counts[i].get<uint64_t>();
+                            const std::string le = i < bounds.size() ? string_format("%g", bounds[i].get<double>()) : "+Inf";
+                            prometheus << "llamacpp:" << name << "_bucket{" << labels << ",le=\"" << le << "\"} " << cumulative << "\n";
+                        }
+                        prometheus << "llamacpp:" << name << "_sum{" << labels << "} " << histogram.at("sum").get<double>() << "\n";
+                        prometheus << "llamacpp:" << name << "_count{" << labels << "} " << histogram.at("count").get<uint64_t>() << "\n";
+                    }
+                } else if (metric_def.contains("samples")) {
+                    for (const auto & sample : metric_def.at("samples")) {
+                        const std::string labels = sample.at("labels");
+                        prometheus << "llamacpp:" << name << "{" << labels << "} " << json_value(sample, "value", 0.) << "\n";
+                    }
+                } else {
+                    auto value = json_value(metric_def, "value", 0.);
+                    prometheus << "llamacpp:" << name << " " << value << "\n";
+                }
             }
         }
 
@@ -4172,7 +7001,32 @@ int main(int argc, char ** argv) {
         }
     };
 
-    const auto handle_props = [&ctx_server, &res_ok](const httplib::Request &, httplib::Response & res) {
+    const auto handle_trace = [&res_error, &res_ok](const httplib::Request & req, httplib::Response & res) {
+        if (!tracer.enabled()) {
+            res_error(res, format_error_response("This server does not trace the requests. Start it with `--trace`", ERROR_TYPE_NOT_SUPPORTED));
+            return;
+        }
+
+        // the id of the X-Trace-Id header of the request
+        const uint64_t trace_id = std::strtoull(req.path_params.at("id").c_str(), nullptr, 16);
+        json events = json::array();
+        for (const auto & span : tracer.find(trace_id)) {
+            events.push_back(span.to_json());
+        }
+        if (events.empty()) {
+            res_error(res, format_error_response("No spans for this trace id, or they were overwritten", ERROR_TYPE_NOT_FOUND));
+            return;
+        }
+
+        res_ok(res, {{"traceEvents", events}});
+    };
+
+    const auto handle_props = [&ctx_server, &res_ok, &res_model_busy](const httplib::Request &, httplib::Response & res) {
+        const auto model_use = ctx_server.model_gate.try_use();
+        if (!model_use) {
+            res_model_busy(res, ctx_server.model_gate);
+            return;
+        }
         // this endpoint is publicly available, please only return what is safe to be exposed
         json data = {
             { "default_generation_settings", ctx_server.default_generation_settings_for_props },
@@ -4206,7 +7060,12 @@ int main(int argc, char ** argv) {
         res_ok(res, {{ "success", true }});
     };
 
-    const auto handle_api_show = [&ctx_server, &res_ok](const httplib::Request &, httplib::Response & res) {
+    const auto handle_api_show = [&ctx_server, &res_ok, &res_model_busy](const httplib::Request &, httplib::Response & res) {
+        const auto model_use = ctx_server.model_gate.try_use();
+        if (!model_use) {
+            res_model_busy(res, ctx_server.model_gate);
+            return;
+        }
         json data = {
             {
                 "template", common_chat_templates_source(ctx_server.chat_templates.get()),
@@ -4221,15 +7080,56 @@ int main(int argc, char ** argv) {
         res_ok(res, data);
     };
 
+    //OWL BEGIN
+    // the context of the model named by the "model" field of a request: another GGUF file of the directory of the
+    // generation model is served by the model pool, anything else (e.g. no field, an alias) by the generation model;
+    // model_use is the gate of that context, and also holds a pooled model loaded until the response is sent
+    const auto route_model = [&ctx_server, &model_pool, &res_error, &res_model_busy](const json & body, server_task_type type, server_model_gate::guard_ptr & model_use, httplib::Response & res) -> server_context * {
+        const std::string name = body.contains("model") && body.at("model").is_string() ? body.at("model").get<std::string>() : "";
+        const fs::path path(ctx_server.model_path());
+        if (!model_pool.enabled() || !string_ends_with(name, ".gguf") || name == path.filename().string()) {
+            model_use = ctx_server.model_gate.try_use();
+            if (!model_use) {
+                res_model_busy(res, ctx_server.model_gate);
+                return nullptr;
+            }
+            return &ctx_server;
+        }
+        if (!fs_validate_filename(name)) {
+            res_error(res, format_error_response("Invalid model name", ERROR_TYPE_INVALID_REQUEST));
+            return nullptr;
+        }
+
+        std::string error;
+        error_type type_error = ERROR_TYPE_SERVER;
+        server_model_pool::entry_ptr pooled = model_pool.get(path.parent_path().string(), name, type, error, type_error);
+        if (pooled == nullptr) {
+            res_error(res, format_error_response(error, type_error));
+            return nullptr;
+        }
+        // a pooled model is never swapped, its gate is always open; the entry is released after the guard, so
+        // that the model is not unloaded while a request uses it
+        server_model_gate::guard_ptr guard = pooled->ctx.model_gate.use();
+        model_use = server_model_gate::guard_ptr(guard.get(), [guard, pooled](server_model_gate::guard *) mutable {
+            guard.reset();
+            pooled.reset();
+        });
+        return &pooled->ctx;
+    };
+    //OWL END
+
     // handle completion-like requests (completion, chat, infill)
     // we can optionally provide a custom format for partial results and final results
-    const auto handle_completions_impl = [&ctx_server, &res_error, &res_ok](
+    const auto handle_completions_impl = [&res_error, &res_ok](
+            server_context & ctx_server,
             server_task_type type,
             json & data,
             const std::vector<raw_buffer> & files,
             const std::function<bool()> & is_connection_closed,
+            const std::string & tenant,
             httplib::Response & res,
-            oaicompat_type oaicompat) -> void {
+            oaicompat_type oaicompat,
+            const server_model_gate::guard_ptr & model_use) -> void {
         GGML_ASSERT(type == SERVER_TASK_TYPE_COMPLETION || type == SERVER_TASK_TYPE_INFILL);
 
         if (ctx_server.params_base.embedding) {
@@ -4237,6 +7137,8 @@ int main(int argc, char ** argv) {
             return;
         }
 
+        const uint64_t trace_id = request_trace_id(res);
+
         auto completion_id = gen_chatcmplid();
         std::unordered_set<int> task_ids;
         try {
@@ -4266,6 +7168,7 @@ int main(int argc, char ** argv) {
             }
 
             // process prompt
+            const int64_t t_tokenize = ggml_time_us();
             std::vector<server_tokens> inputs;
             if (oaicompat && !prompt.is_string()) {
                 throw std::runtime_error("prompt must be a string");
@@ -4300,6 +7203,7 @@ int main(int argc, char ** argv) {
                     inputs.push_back(std::move(tmp));
                 }
             }
+            tracer.record(trace_id, "tokenize", t_tokenize);
 
             tasks.reserve(inputs.size());
             for (size_t i = 0; i < inputs.size(); i++) {
@@ -4322,6 +7226,9 @@ int main(int argc, char ** argv) {
 
                 tasks.push_back(std::move(task));
             }
+            server_tasks_set_class(tasks, tenant, data, SERVER_TASK_PRIORITY_INTERACTIVE,
+                type == SERVER_TASK_TYPE_INFILL ? SERVER_ENDPOINT_INFILL :
+                oaicompat == OAICOMPAT_TYPE_CHAT ? SERVER_ENDPOINT_CHAT : SERVER_ENDPOINT_COMPLETION, trace_id);
 
             task_ids = server_task::get_list_id(tasks);
             ctx_server.queue_results.add_waiting_tasks(tasks);
@@ -4380,7 +7287,8 @@ int main(int argc, char ** argv) {
                 return false;
             };
 
-            auto on_complete = [task_ids, &ctx_server] (bool) {
+            // the model stays in use until the stream ends, a model change waits for it
+            auto on_complete = [task_ids, &ctx_server, model_use] (bool) {
                 ctx_server.queue_results.remove_waiting_task_ids(task_ids);
             };
 
@@ -4391,13 +7299,15 @@ int main(int argc, char ** argv) {
     //OWL BEGIN
     // handle completion-like requests (completion, chat, infill)
     // we can optionally provide a custom format for partial results and final results
-    const auto handle_completions_impl_with_rag = [&ctx_server, &res_error, &res_ok](
+    const auto handle_completions_impl_with_rag = [&ctx_server, &ctx_rag_embd, &ctx_rag_rerank, &rag_metrics, &params, &res_error, &res_ok](
             server_task_type type,
             json & data,
             const std::vector<raw_buffer> & files,
             const std::function<bool()> & is_connection_closed,
+            const std::string & tenant,
             httplib::Response & res,
-            oaicompat_type oaicompat) -> void {
+            oaicompat_type oaicompat,
+            const server_model_gate::guard_ptr & model_use) -> void {
         GGML_ASSERT(type == SERVER_TASK_TYPE_COMPLETION || type == SERVER_TASK_TYPE_INFILL);
 
         if (ctx_server.params_base.embedding) {
@@ -4405,6 +7315,8 @@ int main(int argc, char ** argv) {
             return;
         }
 
+        const uint64_t trace_id = request_trace_id(res);
+
         auto completion_id = gen_chatcmplid();
         std::unordered_set<int> task_ids;
         try {
@@ -4415,7 +7327,9 @@ int main(int argc, char ** argv) {
             //SRV_DBG("Prompt: %s\n", prompt.is_string() ? prompt.get<std::string>().c_str() : prompt.dump(2).c_str());
 
             // --- STAGE 1: Absorb Prompt, Get Embedding, RAG Query ---
-            auto tokenized_prompts = tokenize_input_prompts(ctx_server.vocab, prompt, true, true);
+            int64_t t_stage = ggml_time_us();
+            auto tokenized_prompts = tokenize_input_prompts(ctx_rag_embd.vocab, prompt, true, true);
+            tracer.record(trace_id, "tokenize", t_stage);
             for (const auto & tokens : tokenized_prompts) {
                 // this check is necessary for models that do not add BOS token to the input
                 if (tokens.empty()) {
@@ -4423,36 +7337,36 @@ int main(int argc, char ** argv) {
                     return;
                 }
             }
-            std::cerr<<"prompt tokenization done"<<std::endl;
 
             // 1. Create a temporary task for embedding extraction from the initial prompt
             // create and queue the embedding tasks
             bool error = false;
+            t_stage = ggml_time_us();
             std::unordered_set<int> embedding_task_ids;
             {
                 std::vector<server_task> tasks;
                 for (size_t i = 0; i < tokenized_prompts.size(); i++) {
                     server_task task = server_task(SERVER_TASK_TYPE_EMBEDDING);
 
-                    task.id            = ctx_server.queue_tasks.get_new_id();
+                    task.id            = ctx_rag_embd.queue_tasks.get_new_id();
                     task.index         = i;
-                    task.prompt_tokens = server_tokens(tokenized_prompts[i], ctx_server.mctx != nullptr);
+                    task.prompt_tokens = server_tokens(tokenized_prompts[i], ctx_rag_embd.mctx != nullptr);
 
                     // OAI-compat
                     task.params.oaicompat = oaicompat;
 
                     tasks.push_back(std::move(task));
                 }
+                server_tasks_set_class(tasks, tenant, data, SERVER_TASK_PRIORITY_INTERACTIVE, SERVER_ENDPOINT_EMBEDDING, trace_id);
 
                 embedding_task_ids = server_task::get_list_id(tasks);
-                ctx_server.queue_results.add_waiting_tasks(tasks);
-                ctx_server.queue_tasks.post(std::move(tasks));
+                ctx_rag_embd.queue_results.add_waiting_tasks(tasks);
+                ctx_rag_embd.queue_tasks.post(std::move(tasks));
             }
-            std::cerr<<"there are "<< embedding_task_ids.size() << "embedding tasks" << std::endl;
 
             std::vector<float> last_prompt_embedding;
             // get the result
-            ctx_server.receive_multi_results(embedding_task_ids, [&](std::vector<server_task_result_ptr> & results) {
+            ctx_rag_embd.receive_multi_results(embedding_task_ids, [&](std::vector<server_task_result_ptr> & results) {
                 for (auto & res : results) {
                     GGML_ASSERT(dynamic_cast<server_task_result_embd*>(res.get()) != nullptr);
                     last_prompt_embedding =dynamic_cast<server_task_result_embd*>(res.get())->embedding.back();
@@ -4462,7 +7376,7 @@ int main(int argc, char ** argv) {
                 error = true;
             }, is_connection_closed);
 
-            ctx_server.queue_results.remove_waiting_task_ids(embedding_task_ids);
+            ctx_rag_embd.queue_results.remove_waiting_task_ids(embedding_task_ids);
 
             if (error) {
                 return;
@@ -4473,8 +7387,8 @@ int main(int argc, char ** argv) {
                 res_error(res, format_error_response("Failed to process prompt for RAG embedding.", ERROR_TYPE_INVALID_REQUEST));
                 return;
             }
-            else
-                std::cerr << "last prompt token embedding has been found" << std::endl;
+            rag_metrics.observe(SERVER_RAG_STAGE_EMBEDDING, t_stage);
+            tracer.record(trace_id, "embedding", t_stage);
 
             // 2. Query RAG Database
             // You'll need to define 'num_chunks_to_retrieve' (e.g., from client data or server config)
@@ -4487,6 +7401,10 @@ int main(int argc, char ** argv) {
             std::string db_host = "localhost";
             int db_port = 5432;
             std::string db_name = "klave_rag";
+            // "collections" fans the query out over several collections, "collection" selects a single one
+            std::vector<std::string> collections = {""};
+            int ef_search = 0;
+            int probes = 0;
 
             if (data.count("rag_connection")) {
                 const auto & rag_connection = data.at("rag_connection");
@@ -4495,162 +7413,238 @@ int main(int argc, char ** argv) {
                 db_host = json_value(rag_connection, "host", std::string("localhost"));
                 db_port = json_value(rag_connection, "port", (int)5432);
                 db_name = json_value(rag_connection, "name", std::string("klave_rag"));
-                std::cerr << "rag_connection provided: " << rag_connection.dump(-1) << std::endl;
+                if (rag_connection.contains("collections")) {
+                    collections = rag_connection.at("collections").get<std::vector<std::string>>();
+                } else {
+                    collections = {json_value(rag_connection, "collection", std::string(""))};
+                }
+                ef_search = json_value(rag_connection, "ef_search", 0);
+                probes = json_value(rag_connection, "probes", 0);
             }
-            else
-                std::cerr << " rag_connection provided - using default" << std::endl;
 
             
-            if(use_reranking && (llama_vocab_sep(ctx_server.vocab) == LLAMA_TOKEN_NULL))
+            if(use_reranking && (llama_vocab_sep(ctx_rag_rerank.vocab) == LLAMA_TOKEN_NULL))
             {
                 use_reranking = false;
-                std::cerr << "Reranking cannot work because model does not include a separator token - deactivated" << std::endl;
+                SRV_WRN("%s", "reranking deactivated: the reranking model has no separator token\n");
             }
 
-            auto rag_db = create_rag_database(db_host, db_port, db_name);
-            try {
-                rag_db->connect(db_user, db_password);
-            } catch (const std::exception& e) {
-                res_error(res, format_error_response(std::string("Database connection error: ") + e.what(), ERROR_TYPE_SERVER));
-                error = true;
-                return; // Exit the lambda if connection fails
+            if (collections.empty()) {
+                res_error(res, format_error_response("\"collections\" must not be empty", ERROR_TYPE_INVALID_REQUEST));
+                return;
             }
-            auto nearest_chunks =  rag_db->searchNearest(last_prompt_embedding, num_chunks_to_retrieve);
-            //std::vector<std::string> retrieved_chunks ;//= query_rag_database(last_token_embedding, num_chunks_to_retrieve);
-            std::cerr<<"found " << nearest_chunks.size() << " potential chunks to use for augmnentation" << std::endl; //TODO: remove
-
-            std::string hardcoded_sk = "0123456789012345678901234567890123456789012345678901234567890123";//TODO: keep these keys secret in the database
-            ecc256_private_key recipient_sk = postgres_client::hex_to_byte_array<32>(hardcoded_sk);;
-            auto recipient_pk = CryptoUtils::computePublicKey(recipient_sk);
 
-            // 3. Reranking
-            // create and queue the reranking task
-            std::vector<std::string> documents;
-            if (!nearest_chunks.empty()) {
-                int pg_rank = 1;
-                for (const auto& chunk : nearest_chunks) {
-                    std::vector<uint8_t> retrieved_encrypted_content_default = std::get<12>(chunk);
-                    aes_gcm_tag retrieved_tag_default = std::get<13>(chunk);
-                    aes_gcm_nonce retrieved_nonce_default = std::get<14>(chunk);
-                    ecc256_public_key retrieved_ephemeral_pk_default = std::get<15>(chunk);
-                    ecc256_public_key retrieved_recipient_pk_default = std::get<6>(chunk);
-                    auto distance = std::get<16>(chunk);
-                    if(retrieved_recipient_pk_default != recipient_pk)
-                    {
-                        std::cerr << "mismatching recipient pk" << std::endl;
-                        continue;
-                    }
-                    std::vector<uint8_t> decrypted_content_default;
-                    if(retrieved_ephemeral_pk_default == ecc256_public_key())
-                        decrypted_content_default = retrieved_encrypted_content_default;
-                    else
-                        decrypted_content_default = EciesUtils::decrypt_ecies(
-                        retrieved_encrypted_content_default, retrieved_tag_default, retrieved_nonce_default,
-                        retrieved_ephemeral_pk_default, recipient_sk);
-                    if(decrypted_content_default.empty())
-                    {
-                        std::cerr << "rag entry is corrupted and does not decrypt" << std::endl;
-                        continue;
+            // each collection has its own (smaller) index: query them all for the top-k and merge by distance
+            t_stage = ggml_time_us();
+            std::vector<rag_database::nearest_result> nearest_chunks;
+            for (const auto & collection : collections) {
+                std::shared_ptr<rag_database> rag_db;
+                try {
+                    rag_db = create_rag_database(db_host, db_port, db_name, collection, db_user, db_password);
+                } catch (const std::exception& e) {
+                    rag_metrics.on_db_error();
+                    res_error(res, format_error_response(std::string("Database connection error: ") + e.what(), ERROR_TYPE_SERVER));
+                    error = true;
+                    return; // Exit the lambda if connection fails
+                }
+                bool use_shadow = false;
+                std::string route_error;
+                if (!ctx_rag_embd.route_rag_embeddings(*rag_db, use_shadow, route_error)) {
+                    if (collections.size() == 1) {
+                        res_error(res, format_error_response(route_error, ERROR_TYPE_INVALID_REQUEST));
+                        return;
                     }
-                    std::string decrypted_chunk(std::begin(decrypted_content_default),std::end(decrypted_content_default));
-                    std::cerr << "chunk[" << pg_rank << "] at distance[" << distance << "] = \n"<< decrypted_chunk.c_str() << std::endl;
-                    documents.push_back(decrypted_chunk);
-                    pg_rank++;
+                    SRV_WRN("skipping collection '%s': %s\n", rag_db->getCollection().c_str(), route_error.c_str());
+                    continue;
+                }
+                rag_db->setSearchParams(ef_search, probes);
+                std::vector<rag_database::nearest_result> collection_chunks;
+                const int64_t t_search = ggml_time_us();
+                try {
+                    collection_chunks = rag_db->searchNearest(last_prompt_embedding, num_chunks_to_retrieve, nullptr, DistanceMetric::COSINE, use_shadow);
+                } catch (const std::exception &) {
+                    rag_metrics.on_db_error();
+                    throw;
+                }
+                tracer.record(trace_id, "searchNearest", t_search, -1, 0, (int32_t) collection_chunks.size());
+                nearest_chunks.insert(nearest_chunks.end(),
+                                      std::make_move_iterator(collection_chunks.begin()),
+                                      std::make_move_iterator(collection_chunks.end()));
+            }
+            if (collections.size() > 1) {
+                std::stable_sort(nearest_chunks.begin(), nearest_chunks.end(), [](const auto & a, const auto & b) {
+                    return std::get<16>(a) < std::get<16>(b);
+                });
+                if ((int) nearest_chunks.size() > num_chunks_to_retrieve) {
+                    nearest_chunks.resize(num_chunks_to_retrieve);
                 }
-                for(int i=0;i<10;i++)
-                    std::cerr << "=======================================================================================" << std::endl;
             }
+            //std::vector<std::string> retrieved_chunks ;//= query_rag_database(last_token_embedding, num_chunks_to_retrieve);
+            SRV_DBG("retrieved %zu RAG entries\n", nearest_chunks.size());
+            rag_metrics.observe(SERVER_RAG_STAGE_SEARCH, t_stage);
+
+            // the key the chunks were encrypted for at insertion (rag_insertion_params.recipient_private_key),
+            // in "rag_connection" or at the top level of the request, else the one of --rag-recipient-key-file
+            std::string recipient_sk_hex = json_value(data, "recipient_private_key", params.rag_recipient_key);
+            if (data.count("rag_connection")) {
+                recipient_sk_hex = json_value(data.at("rag_connection"), "recipient_private_key", recipient_sk_hex);
+            }
+            if (recipient_sk_hex.empty()) {
+                res_error(res, format_error_response("\"recipient_private_key\" must be provided to decrypt the RAG entries", ERROR_TYPE_INVALID_REQUEST));
+                return;
+            }
+            ecc256_private_key recipient_sk;
+            try {
+                recipient_sk = postgres_client::hex_to_byte_array<32>(recipient_sk_hex);
+            } catch (const std::exception & e) {
+                res_error(res, format_error_response(std::string("Invalid recipient_private_key format: ") + e.what(), ERROR_TYPE_INVALID_REQUEST));
+                return;
+            }
+            auto recipient_pk = CryptoUtils::computePublicKey(recipient_sk);
 
-            std::cerr<<"within those " << nearest_chunks.size() << " potential chunks to use for augmnentation, "<< documents.size() <<" did decrypt" << std::endl; //TODO: remove
-            if(!use_reranking)
-                {
-                    std::cerr<<"will NOT rerank " << std::endl; //TODO: remove
-                    if(num_max_augmentations < num_chunks_to_retrieve)
-                        documents.resize(num_max_augmentations);
+            // 3. Decrypt the chunks back to back into the arena of this HTTP thread. The plaintext is kept as
+            // spans of the arena and tokenized from there: it is never copied into strings, nor logged, and
+            // the arena is wiped when the request leaves this scope.
+            t_stage = ggml_time_us();
+            thread_local std::vector<uint8_t> rag_arena;
+            size_t arena_size = 0;
+            for (const auto & chunk : nearest_chunks) {
+                arena_size += std::get<12>(chunk).size();
+            }
+            if (rag_arena.size() < arena_size) {
+                OPENSSL_cleanse(rag_arena.data(), rag_arena.size());
+                std::vector<uint8_t>(arena_size).swap(rag_arena);
+            }
+            size_t arena_used = 0;
+            struct arena_wipe {
+                std::vector<uint8_t> & arena;
+                const size_t & used;
+                ~arena_wipe() { OPENSSL_cleanse(arena.data(), used); }
+            } wipe_arena { rag_arena, arena_used };
+
+            std::vector<std::string_view> documents;
+            documents.reserve(nearest_chunks.size());
+            for (const auto & chunk : nearest_chunks) {
+                const auto & content = std::get<12>(chunk);
+                if (std::get<6>(chunk) != recipient_pk) {
+                    SRV_DBG("%s", "skipping a RAG entry encrypted for another recipient\n");
+                    continue;
                 }
-            else
-            {
-                std::cerr<<" using reranking"<<std::endl;
-                std::vector<std::tuple<int,float,std::string>> ranked_documents;
+                if (content.empty()) {
+                    continue;
+                }
+                if (std::get<15>(chunk) == ecc256_public_key()) {
+                    // stored in the clear: the row itself is the span
+                    documents.emplace_back(reinterpret_cast<const char *>(content.data()), content.size());
+                    continue;
+                }
+                uint8_t * dst = rag_arena.data() + arena_used;
+                if (!EciesUtils::decrypt_ecies_into(content, std::get<13>(chunk), std::get<14>(chunk), std::get<15>(chunk), recipient_sk, dst)) {
+                    SRV_WRN("%s", "RAG entry is corrupted and does not decrypt\n");
+                    continue;
+                }
+                arena_used += content.size();
+                documents.emplace_back(reinterpret_cast<const char *>(dst), content.size());
+            }
+            SRV_DBG("%zu of the %zu retrieved RAG entries decrypted\n", documents.size(), nearest_chunks.size());
+            rag_metrics.observe(SERVER_RAG_STAGE_DECRYPT, t_stage);
+            tracer.record(trace_id, "decrypt", t_stage, -1, 0, (int32_t) documents.size());
+
+            // 4. Reranking
+            // the chunks are tokenized without parsing special tokens, so that a stored chunk cannot inject control tokens
+            if (!use_reranking) {
+                if ((int) documents.size() > num_max_augmentations) {
+                    documents.resize(num_max_augmentations);
+                }
+            } else if (!documents.empty()) {
+                t_stage = ggml_time_us();
+                std::vector<std::pair<size_t, float>> ranked_documents; // index in documents, score
                 ranked_documents.reserve(documents.size());
-                for (int i = 0; i < documents.size(); ++i) {
-                    ranked_documents.emplace_back(i, 0.0f, documents[i]);
-                    }
-                if(!ranked_documents.empty()){
-                    std::unordered_set<int> reranking_task_ids;
-                    std::vector<server_task> reranking_tasks;
-                    auto tokenized_docs = tokenize_input_prompts(ctx_server.vocab, documents, /* add_special */ false, true);
-                    std::cerr<<" all of those documents correctly tokenised"<<std::endl;
-                    reranking_tasks.reserve(tokenized_docs.size());
-                    for (size_t i = 0; i < tokenized_docs.size(); i++) {
-                        llama_tokens tmp = format_rerank(ctx_server.vocab, tokenized_prompts[0], tokenized_docs[i]);
-                        server_task task   = server_task(SERVER_TASK_TYPE_RERANK);
-                        task.id            = ctx_server.queue_tasks.get_new_id();
-                        task.index         = i;
-                        task.prompt_tokens = server_tokens(tmp, ctx_server.mctx != nullptr);
-                        reranking_tasks.push_back(std::move(task));
-                        }
-                    reranking_task_ids = server_task::get_list_id(reranking_tasks);
-                    ctx_server.queue_results.add_waiting_tasks(reranking_tasks);
-                    ctx_server.queue_tasks.post(std::move(reranking_tasks));
-
-                    std::cerr<<" reranking queries sent" <<std::endl;
-                    ctx_server.receive_multi_results(reranking_task_ids, [&](std::vector<server_task_result_ptr> & results) {
-                        for (auto & res : results) {
-                            auto p_rerank = dynamic_cast<server_task_result_rerank*>(res.get());
-                            GGML_ASSERT(p_rerank != nullptr);
-                            std::get<1>(ranked_documents[p_rerank->get_index()]) =  p_rerank->score;
-                        }
-                    }, [&](const json & error_data) {
-                        res_error(res, error_data);
-                        error = true;
-                    }, is_connection_closed);
-
-                    if (error) {
-                        return;
-                    }
-                    std::cerr<<" reranking queries completed" <<std::endl;
-
-                    // document ranking
-                    std::sort(ranked_documents.begin(), ranked_documents.end(),
-                    [](const std::tuple<int,float,std::string>& a, const std::tuple<int,float,std::string>& b) {
-                        return std::get<1>(a) > std::get<1>(b); // 'a.second > b.second' for descending order
-                        });
-                    for(int n = 0; n<ranked_documents.size(); n++)
-                        std::cerr<< "rank:" << n << ", score:"<< std::get<1>(ranked_documents[n]) << ", content:\n" << std::get<2>(ranked_documents[n]) << std::endl;
+                for (size_t i = 0; i < documents.size(); ++i) {
+                    ranked_documents.emplace_back(i, 0.0f);
                 }
-                documents.resize(0);
-                int n_augmentations = 0;
-                for (const auto& ranked_document : ranked_documents) {
-                    if(n_augmentations >= num_max_augmentations)
-                        break;
-                    documents.push_back(std::get<2>(ranked_document));
+
+                std::unordered_set<int> reranking_task_ids;
+                std::vector<server_task> reranking_tasks;
+                // the reranker may not share the vocabulary of the embedding model
+                auto tokenized_query = tokenize_input_prompts(ctx_rag_rerank.vocab, prompt, true, true)[0];
+                reranking_tasks.reserve(documents.size());
+                llama_tokens tokenized_doc;
+                for (size_t i = 0; i < documents.size(); i++) {
+                    tokenized_doc.clear();
+                    tokenize_append(ctx_rag_rerank.vocab, documents[i].data(), documents[i].size(), /* add_special */ false, /* parse_special */ false, tokenized_doc);
+                    server_task task   = server_task(SERVER_TASK_TYPE_RERANK);
+                    task.id            = ctx_rag_rerank.queue_tasks.get_new_id();
+                    task.index         = i;
+                    task.prompt_tokens = server_tokens(format_rerank(ctx_rag_rerank.vocab, tokenized_query, tokenized_doc), ctx_rag_rerank.mctx != nullptr);
+                    reranking_tasks.push_back(std::move(task));
                 }
-            }
+                server_tasks_set_class(reranking_tasks, tenant, data, SERVER_TASK_PRIORITY_INTERACTIVE, SERVER_ENDPOINT_RERANK, trace_id);
+                reranking_task_ids = server_task::get_list_id(reranking_tasks);
+                ctx_rag_rerank.queue_results.add_waiting_tasks(reranking_tasks);
+                ctx_rag_rerank.queue_tasks.post(std::move(reranking_tasks));
 
+                ctx_rag_rerank.receive_multi_results(reranking_task_ids, [&](std::vector<server_task_result_ptr> & results) {
+                    for (auto & res : results) {
+                        auto p_rerank = dynamic_cast<server_task_result_rerank*>(res.get());
+                        GGML_ASSERT(p_rerank != nullptr);
+                        ranked_documents[p_rerank->get_index()].second = p_rerank->score;
+                    }
+                }, [&](const json & error_data) {
+                    res_error(res, error_data);
+                    error = true;
+                }, is_connection_closed);
 
-            // 3. Construct Augmented Prompt
-            std::string augmented_prompt_str; // Append original prompt question
-            std::string delimiter = "<|im_start|>user";
-            size_t beginPos = prompt.template get<std::string>().rfind(delimiter); // rfind finds the last occurrence
-            if (beginPos != std::string::npos)
-                augmented_prompt_str = prompt.template get<std::string>().substr(beginPos,delimiter.size()+1);
+                ctx_rag_rerank.queue_results.remove_waiting_task_ids(reranking_task_ids);
+                if (error) {
+                    return;
+                }
 
-            if (!documents.empty()) {
-                augmented_prompt_str += "Here is some relevant context to answer:\n";
-                for (const auto& document : documents) {
-                     augmented_prompt_str += "- " + document + "\n";
+                // document ranking, descending score
+                std::stable_sort(ranked_documents.begin(), ranked_documents.end(), [](const auto & a, const auto & b) {
+                    return a.second > b.second;
+                });
+                if ((int) ranked_documents.size() > num_max_augmentations) {
+                    ranked_documents.resize(num_max_augmentations);
                 }
+                std::vector<std::string_view> ranked;
+                ranked.reserve(ranked_documents.size());
+                for (const auto & ranked_document : ranked_documents) {
+                    SRV_DBG("rerank: entry %zu, score %f\n", ranked_document.first, ranked_document.second);
+                    ranked.push_back(documents[ranked_document.first]);
+                }
+                documents = std::move(ranked);
+                rag_metrics.observe(SERVER_RAG_STAGE_RERANK, t_stage);
+                tracer.record(trace_id, "rerank", t_stage, -1, 0, (int32_t) ranked_documents.size());
+            }
+
+            // 5. Construct Augmented Prompt
+            // the chunks are inserted before the last user message, after its "<|im_start|>user" header
+            const std::string & prompt_str = prompt.template get_ref<const std::string &>();
+            const std::string delimiter = "<|im_start|>user";
+            size_t beginPos = prompt_str.rfind(delimiter); // rfind finds the last occurrence
+            std::string head;
+            std::string tail;
+            if (beginPos != std::string::npos) {
+                head = prompt_str.substr(beginPos, delimiter.size() + 1);
+                tail = "\n" + prompt_str.substr(beginPos + delimiter.size() + 1);
+            } else {
+                tail = prompt_str;
             }
-            if (beginPos != std::string::npos)
-                augmented_prompt_str += "\n" + prompt.template get<std::string>().substr(beginPos+delimiter.size()+1, prompt.template get<std::string>().size()-(beginPos+delimiter.size()+1));
-            else
-                augmented_prompt_str += prompt.template get<std::string>();
-            std::cerr<<"augmented prompt is now : "<< std::endl << augmented_prompt_str.c_str() << std::endl;
-            rag_db->disconnect();
-            // You might need to add specific chat formatting for the final generation
-            // e.g., if it's a chat model:
-            // augmented_prompt_str = "<|im_start|>user\n" + augmented_prompt_str + "<|im_end|>\n<|im_start|>assistant";
+            if (!documents.empty()) {
+                head += "Here is some relevant context to answer:\n";
+            }
+
+            // the augmented prompt as (text, parse_special) pieces
+            std::vector<std::pair<std::string_view, bool>> pieces;
+            pieces.reserve(3 * documents.size() + 2);
+            pieces.emplace_back(head, true);
+            for (const auto & document : documents) {
+                pieces.emplace_back("- ", true);
+                pieces.emplace_back(document, false);
+                pieces.emplace_back("\n", true);
+            }
+            pieces.emplace_back(tail, true);
 
             // process files
             mtmd::bitmaps bitmaps;
@@ -4672,17 +7666,16 @@ int main(int argc, char ** argv) {
             }
 
             // process augmented prompt
-            nlohmann::json augmented_prompt = augmented_prompt_str;
+            t_stage = ggml_time_us();
             std::vector<server_tokens> inputs;
-            if (oaicompat && !augmented_prompt.is_string()) {
-                throw std::runtime_error("augmented_prompt must be a string");
-            }
-
             if (oaicompat && has_mtmd) {
-                // multimodal
-                std::string prompt_str = augmented_prompt.get<std::string>();
+                // multimodal: mtmd_tokenize needs the whole text, in a copy that is wiped once tokenized
+                std::string augmented_prompt_str;
+                for (const auto & piece : pieces) {
+                    augmented_prompt_str.append(piece.first);
+                }
                 mtmd_input_text inp_txt = {
-                    prompt_str.c_str(),
+                    augmented_prompt_str.c_str(),
                     /* add_special */   true,
                     /* parse_special */ true,
                 };
@@ -4693,6 +7686,7 @@ int main(int argc, char ** argv) {
                                                     &inp_txt,
                                                     bitmaps_c_ptr.data(),
                                                     bitmaps_c_ptr.size());
+                OPENSSL_cleanse(augmented_prompt_str.data(), augmented_prompt_str.size());
                 if (tokenized != 0) {
                     throw std::runtime_error("Failed to tokenize prompt");
                 }
@@ -4700,15 +7694,15 @@ int main(int argc, char ** argv) {
                 server_tokens tmp(chunks, true);
                 inputs.push_back(std::move(tmp));
             } else {
-                // non-multimodal version
-                
-                auto tokenized_prompts = tokenize_input_prompts(ctx_server.vocab, augmented_prompt, true, true);
-                for (auto & p : tokenized_prompts) {
-                    auto tmp = server_tokens(p, ctx_server.mctx != nullptr);
-                    inputs.push_back(std::move(tmp));
+                // non-multimodal version: tokenize the pieces in place, BOS with the first one
+                llama_tokens tokens;
+                tokens.reserve(prompt_str.size() + arena_used);
+                for (size_t i = 0; i < pieces.size(); i++) {
+                    tokenize_append(ctx_server.vocab, pieces[i].first.data(), pieces[i].first.size(), /* add_special */ i == 0, pieces[i].second, tokens);
                 }
-                std::cerr<< "now using rag for completions" << std::endl;
+                inputs.emplace_back(std::move(tokens), ctx_server.mctx != nullptr);
             }
+            tracer.record(trace_id, "tokenize", t_stage);
 
             tasks.reserve(inputs.size());
             for (size_t i = 0; i < inputs.size(); i++) {
@@ -4731,6 +7725,7 @@ int main(int argc, char ** argv) {
 
                 tasks.push_back(std::move(task));
             }
+            server_tasks_set_class(tasks, tenant, data, SERVER_TASK_PRIORITY_INTERACTIVE, SERVER_ENDPOINT_RAG, trace_id);
 
             task_ids = server_task::get_list_id(tasks);
             ctx_server.queue_results.add_waiting_tasks(tasks);
@@ -4743,7 +7738,7 @@ int main(int argc, char ** argv) {
         bool stream = json_value(data, "stream", false);
 
         if (!stream) {
-            std::cerr<< "using stream mode" << std::endl; //OWL WAS HERE
+            SRV_DBG("%s", "RAG completion: non-stream mode\n");
             ctx_server.receive_multi_results(task_ids, [&](std::vector<server_task_result_ptr> & results) {
                 if (results.size() == 1) {
                     // single result
@@ -4762,7 +7757,7 @@ int main(int argc, char ** argv) {
 
             ctx_server.queue_results.remove_waiting_task_ids(task_ids);
         } else {
-            std::cerr<< "using non-stream mode (chunked)" << std::endl; //OWL WAS HERE
+            SRV_DBG("%s", "RAG completion: stream mode (chunked)\n");
             const auto chunked_content_provider = [task_ids, &ctx_server, oaicompat](size_t, httplib::DataSink & sink) {
                 ctx_server.receive_cmpl_results_stream(task_ids, [&](server_task_result_ptr & result) -> bool {
                     json res_json = result->to_json();
@@ -4791,7 +7786,8 @@ int main(int argc, char ** argv) {
                 return false;
             };
 
-            auto on_complete = [task_ids, &ctx_server] (bool) {
+            // the model stays in use until the stream ends, a model change waits for it
+            auto on_complete = [task_ids, &ctx_server, model_use] (bool) {
                 ctx_server.queue_results.remove_waiting_task_ids(task_ids);
             };
 
@@ -4802,31 +7798,57 @@ int main(int argc, char ** argv) {
 
     //OWL END
 
-    const auto handle_completions = [&handle_completions_impl](const httplib::Request & req, httplib::Response & res) {
+    const auto handle_completions = [&route_model, &handle_completions_impl](const httplib::Request & req, httplib::Response & res) {
+        const int64_t t_parse = ggml_time_us();
         json data = json::parse(req.body);
+        tracer.record(request_trace_id(res), "parse", t_parse);
+        server_model_gate::guard_ptr model_use;
+        server_context * ctx = route_model(data, SERVER_TASK_TYPE_COMPLETION, model_use, res);
+        if (ctx == nullptr) {
+            return;
+        }
         std::vector<raw_buffer> files; // dummy
         handle_completions_impl(
+            *ctx,
             SERVER_TASK_TYPE_COMPLETION,
             data,
             files,
             req.is_connection_closed,
+            request_tenant(req),
             res,
-            OAICOMPAT_TYPE_NONE);
+            OAICOMPAT_TYPE_NONE,
+            model_use);
     };
 
-    const auto handle_completions_oai = [&handle_completions_impl](const httplib::Request & req, httplib::Response & res) {
-        json data = oaicompat_completion_params_parse(json::parse(req.body));
+    const auto handle_completions_oai = [&route_model, &handle_completions_impl](const httplib::Request & req, httplib::Response & res) {
+        const int64_t t_parse = ggml_time_us();
+        const json body = json::parse(req.body);
+        tracer.record(request_trace_id(res), "parse", t_parse);
+        server_model_gate::guard_ptr model_use;
+        server_context * ctx = route_model(body, SERVER_TASK_TYPE_COMPLETION, model_use, res);
+        if (ctx == nullptr) {
+            return;
+        }
+        json data = oaicompat_completion_params_parse(body);
         std::vector<raw_buffer> files; // dummy
         handle_completions_impl(
+            *ctx,
             SERVER_TASK_TYPE_COMPLETION,
             data,
             files,
             req.is_connection_closed,
+            request_tenant(req),
             res,
-            OAICOMPAT_TYPE_COMPLETION);
+            OAICOMPAT_TYPE_COMPLETION,
+            model_use);
     };
 
-    const auto handle_infill = [&ctx_server, &res_error, &handle_completions_impl](const httplib::Request & req, httplib::Response & res) {
+    const auto handle_infill = [&ctx_server, &res_error, &handle_completions_impl, &res_model_busy](const httplib::Request & req, httplib::Response & res) {
+        const auto model_use = ctx_server.model_gate.try_use();
+        if (!model_use) {
+            res_model_busy(res, ctx_server.model_gate);
+            return;
+        }
         // check model compatibility
         std::string err;
         if (llama_vocab_fim_pre(ctx_server.vocab) == LLAMA_TOKEN_NULL) {
@@ -4897,42 +7919,64 @@ int main(int argc, char ** argv) {
 
         std::vector<raw_buffer> files; // dummy
         handle_completions_impl(
+            ctx_server,
             SERVER_TASK_TYPE_INFILL,
             data,
             files,
             req.is_connection_closed,
+            request_tenant(req),
             res,
-            OAICOMPAT_TYPE_NONE); // infill is not OAI compatible
+            OAICOMPAT_TYPE_NONE, // infill is not OAI compatible
+            model_use);
     };
 
-    const auto handle_chat_completions = [&ctx_server, &params, &res_error, &handle_completions_impl](const httplib::Request & req, httplib::Response & res) {
+    const auto handle_chat_completions = [&params, &route_model, &res_error, &handle_completions_impl](const httplib::Request & req, httplib::Response & res) {
         LOG_DBG("request: %s\n", req.body.c_str());
-        if (ctx_server.params_base.embedding) {
+
+        const uint64_t trace_id = request_trace_id(res);
+        const int64_t t_parse = ggml_time_us();
+        auto body = json::parse(req.body);
+        tracer.record(trace_id, "parse", t_parse);
+        server_model_gate::guard_ptr model_use;
+        server_context * ctx = route_model(body, SERVER_TASK_TYPE_COMPLETION, model_use, res);
+        if (ctx == nullptr) {
+            return;
+        }
+        if (ctx->params_base.embedding) {
             res_error(res, format_error_response("This server does not support completions. Start it without `--embeddings`", ERROR_TYPE_NOT_SUPPORTED));
             return;
         }
 
-        auto body = json::parse(req.body);
+        const int64_t t_template = ggml_time_us();
         std::vector<raw_buffer> files;
         json data = oaicompat_completion_params_parse(
             body,
             params.use_jinja,
             params.reasoning_format,
-            ctx_server.chat_templates.get(),
-            ctx_server.mctx,
+            ctx->chat_templates.get(),
+            ctx->mctx,
             files);
+        tracer.record(trace_id, "template", t_template);
 
         handle_completions_impl(
+            *ctx,
             SERVER_TASK_TYPE_COMPLETION,
             data,
             files,
             req.is_connection_closed,
+            request_tenant(req),
             res,
-            OAICOMPAT_TYPE_CHAT);
+            OAICOMPAT_TYPE_CHAT,
+            model_use);
     };
 
     // same with handle_chat_completions, but without inference part
-    const auto handle_apply_template = [&ctx_server, &params, &res_ok](const httplib::Request & req, httplib::Response & res) {
+    const auto handle_apply_template = [&ctx_server, &params, &res_ok, &res_model_busy](const httplib::Request & req, httplib::Response & res) {
+        const auto model_use = ctx_server.model_gate.try_use();
+        if (!model_use) {
+            res_model_busy(res, ctx_server.model_gate);
+            return;
+        }
         auto body = json::parse(req.body);
         std::vector<raw_buffer> files; // dummy, unused
         json data = oaicompat_completion_params_parse(
@@ -4945,7 +7989,12 @@ int main(int argc, char ** argv) {
         res_ok(res, {{ "prompt", std::move(data.at("prompt")) }});
     };
 
-    const auto handle_models = [&params, &ctx_server, &state, &res_ok](const httplib::Request &, httplib::Response & res) {
+    const auto handle_models = [&params, &ctx_server, &state, &res_ok, &res_model_busy](const httplib::Request &, httplib::Response & res) {
+        const auto model_use = ctx_server.model_gate.try_use();
+        if (!model_use) {
+            res_model_busy(res, ctx_server.model_gate);
+            return;
+        }
         server_state current_state = state.load();
         json model_meta = nullptr;
         if (current_state == SERVER_STATE_READY) {
@@ -4968,7 +8017,12 @@ int main(int argc, char ** argv) {
         res_ok(res, models);
     };
 
-    const auto handle_tokenize = [&ctx_server, &res_ok](const httplib::Request & req, httplib::Response & res) {
+    const auto handle_tokenize = [&ctx_server, &res_ok, &res_model_busy](const httplib::Request & req, httplib::Response & res) {
+        const auto model_use = ctx_server.model_gate.try_use();
+        if (!model_use) {
+            res_model_busy(res, ctx_server.model_gate);
+            return;
+        }
         const json body = json::parse(req.body);
 
         json tokens_response = json::array();
@@ -5008,7 +8062,12 @@ int main(int argc, char ** argv) {
         res_ok(res, data);
     };
 
-    const auto handle_detokenize = [&ctx_server, &res_ok](const httplib::Request & req, httplib::Response & res) {
+    const auto handle_detokenize = [&ctx_server, &res_ok, &res_model_busy](const httplib::Request & req, httplib::Response & res) {
+        const auto model_use = ctx_server.model_gate.try_use();
+        if (!model_use) {
+            res_model_busy(res, ctx_server.model_gate);
+            return;
+        }
         const json body = json::parse(req.body);
 
         std::string content;
@@ -5021,9 +8080,7 @@ int main(int argc, char ** argv) {
         res_ok(res, data);
     };
 
-    const auto handle_embeddings_impl = [&ctx_server, &res_error, &res_ok](const httplib::Request & req, httplib::Response & res, oaicompat_type oaicompat) {
-        const json body = json::parse(req.body);
-
+    const auto handle_embeddings_impl = [&res_error, &res_ok](server_context & ctx_server, const json & body, const httplib::Request & req, httplib::Response & res, oaicompat_type oaicompat) {
         if (oaicompat != OAICOMPAT_TYPE_NONE && llama_pooling_type(ctx_server.ctx) == LLAMA_POOLING_TYPE_NONE) {
             res_error(res, format_error_response("Pooling type 'none' is not OAI compatible. Please use a different pooling type", ERROR_TYPE_INVALID_REQUEST));
             return;
@@ -5052,7 +8109,10 @@ int main(int argc, char ** argv) {
             }
         }
 
+        const uint64_t trace_id = request_trace_id(res);
+        const int64_t t_tokenize = ggml_time_us();
         auto tokenized_prompts = tokenize_input_prompts(ctx_server.vocab, prompt, true, true);
+        tracer.record(trace_id, "tokenize", t_tokenize);
         for (const auto & tokens : tokenized_prompts) {
             // this check is necessary for models that do not add BOS token to the input
             if (tokens.empty()) {
@@ -5079,6 +8139,7 @@ int main(int argc, char ** argv) {
 
                 tasks.push_back(std::move(task));
             }
+            server_tasks_set_class(tasks, request_tenant(req), body, SERVER_TASK_PRIORITY_BATCH, SERVER_ENDPOINT_EMBEDDING, trace_id);
 
             task_ids = server_task::get_list_id(tasks);
             ctx_server.queue_results.add_waiting_tasks(tasks);
@@ -5109,64 +8170,133 @@ int main(int argc, char ** argv) {
         res_ok(res, root);
     };
 
-    const auto handle_embeddings = [&handle_embeddings_impl](const httplib::Request & req, httplib::Response & res) {
-        handle_embeddings_impl(req, res, OAICOMPAT_TYPE_NONE);
+    const auto handle_embeddings = [&route_model, &handle_embeddings_impl](const httplib::Request & req, httplib::Response & res) {
+        const json body = json::parse(req.body);
+        server_model_gate::guard_ptr model_use;
+        if (server_context * ctx = route_model(body, SERVER_TASK_TYPE_EMBEDDING, model_use, res)) {
+            handle_embeddings_impl(*ctx, body, req, res, OAICOMPAT_TYPE_NONE);
+        }
     };
 
-    const auto handle_embeddings_oai = [&handle_embeddings_impl](const httplib::Request & req, httplib::Response & res) {
-        handle_embeddings_impl(req, res, OAICOMPAT_TYPE_EMBEDDING);
+    const auto handle_embeddings_oai = [&route_model, &handle_embeddings_impl](const httplib::Request & req, httplib::Response & res) {
+        const json body = json::parse(req.body);
+        server_model_gate::guard_ptr model_use;
+        if (server_context * ctx = route_model(body, SERVER_TASK_TYPE_EMBEDDING, model_use, res)) {
+            handle_embeddings_impl(*ctx, body, req, res, OAICOMPAT_TYPE_EMBEDDING);
+        }
     };
 
     //OWL BEGIN
-    const auto handle_chunk_vector = [&ctx_server, &res_error, &res_ok](const httplib::Request & req, httplib::Response & res) {
+    const auto handle_chunk_vector = [&ctx_rag_embd, &res_error, &res_ok, &res_model_busy](const httplib::Request & req, httplib::Response & res) {
+        const auto model_use = ctx_rag_embd.model_gate.try_use();
+        if (!model_use) {
+            res_model_busy(res, ctx_rag_embd.model_gate);
+            return;
+        }
         const json body = json::parse(req.body);
 
         // for the shape of input/content, see tokenize_input_prompts()
-        std::string aggregation_rule = "average";
-        if (body.count("aggregation_rule") != 0) {
-            aggregation_rule = body.at("aggregation_rule");
-        };
-        int aggregation_sample = 300;
-        if (body.count("aggregation_sample") != 0) {
-            aggregation_sample = body.at("aggregation_sample");
-        };
+        json prompt;
+        if (body.count("input") != 0) {
+            prompt = body.at("input");
+        } else if (body.contains("content")) {
+            prompt = body.at("content");
+        } else {
+            res_error(res, format_error_response("\"input\" or \"content\" must be provided", ERROR_TYPE_INVALID_REQUEST));
+            return;
+        }
 
-        // create and queue the task
-        int n_embd = llama_model_n_embd(ctx_server.model);
-        if(aggregation_rule != "average" & aggregation_rule != "last") {
+        // "aggregation_rule": mean (or "average"), max, min, median, first (or "cls"), last, attention
+        // "range": [begin, end) token range to pool, negative bounds count from the end of the prompt
+        // "aggregation_sample": shorthand for the range covering the last N tokens
+        const std::string aggregation_rule = json_value(body, "aggregation_rule", std::string("average"));
+        chunk_pooling_type pooling;
+        if (!chunk_pooling_from_str(aggregation_rule, pooling)) {
             res_error(res, format_error_response("unsupported aggregation rule: "+aggregation_rule, ERROR_TYPE_INVALID_REQUEST));
             return;
         }
-        std::vector<float> embeddings;
-        if(aggregation_rule == "last") {
-            auto embeddings_ptr = llama_get_embeddings_ith(ctx_server.ctx,-1);
-            if (!embeddings_ptr) {
-                res_error(res, format_error_response("could not get last token embedding: ", ERROR_TYPE_UNAVAILABLE));
+        int32_t pooling_begin = 0;
+        int32_t pooling_end   = 0;
+        if (body.count("range") != 0) {
+            const auto range = body.at("range").get<std::vector<int32_t>>();
+            if (range.size() != 2) {
+                res_error(res, format_error_response("\"range\" must be [begin, end)", ERROR_TYPE_INVALID_REQUEST));
                 return;
             }
-            embeddings = std::vector<float>(embeddings_ptr, embeddings_ptr + n_embd);
-        } else if(aggregation_rule == "average") {
-            std::vector<float> average(n_embd);
-            for(int i = -1; i >= -aggregation_sample; i--) {
-                auto embeddings_ptr = llama_get_embeddings_ith(ctx_server.ctx,i);
-                if (!embeddings_ptr) {
-                    res_error(res, format_error_response("could not get one of the token embedding in window: ", ERROR_TYPE_UNAVAILABLE));
-                    return;
-                    }
-                for(int j=0;j<n_embd;j++)
-                    average[j]+=embeddings_ptr[j];
+            pooling_begin = range[0];
+            pooling_end   = range[1];
+        } else if (body.count("aggregation_sample") != 0) {
+            pooling_begin = -std::abs(body.at("aggregation_sample").get<int32_t>());
+        }
+
+        auto tokenized_prompts = tokenize_input_prompts(ctx_rag_embd.vocab, prompt, true, true);
+        for (const auto & tokens : tokenized_prompts) {
+            if (tokens.empty()) {
+                res_error(res, format_error_response("Input content cannot be empty", ERROR_TYPE_INVALID_REQUEST));
+                return;
+            }
+        }
+
+        // create and queue the task
+        bool error = false;
+        std::unordered_set<int> task_ids;
+        {
+            std::vector<server_task> tasks;
+            for (size_t i = 0; i < tokenized_prompts.size(); i++) {
+                server_task task = server_task(SERVER_TASK_TYPE_CHUNK_VECTOR);
+
+                task.id            = ctx_rag_embd.queue_tasks.get_new_id();
+                task.index         = i;
+                task.prompt_tokens = server_tokens(tokenized_prompts[i], ctx_rag_embd.mctx != nullptr);
+
+                // every token of the range must be encoded by this task
+                task.params.cache_prompt  = false;
+                task.params.pooling       = pooling;
+                task.params.pooling_begin = pooling_begin;
+                task.params.pooling_end   = pooling_end;
+
+                tasks.push_back(std::move(task));
+            }
+            server_tasks_set_class(tasks, request_tenant(req), body, SERVER_TASK_PRIORITY_BACKGROUND, SERVER_ENDPOINT_INGEST, request_trace_id(res));
+
+            task_ids = server_task::get_list_id(tasks);
+            ctx_rag_embd.queue_results.add_waiting_tasks(tasks);
+            ctx_rag_embd.queue_tasks.post(std::move(tasks));
+        }
+
+        json chunk_embeddings = json::array();
+        ctx_rag_embd.receive_multi_results(task_ids, [&](std::vector<server_task_result_ptr> & results) {
+            for (auto & res : results) {
+                auto * res_embd = dynamic_cast<server_task_result_embd*>(res.get());
+                GGML_ASSERT(res_embd != nullptr);
+                if (pooling == CHUNK_POOLING_MEDIAN) {
+                    chunk_embeddings.push_back(chunk_pooling_median(res_embd->embedding));
+                } else {
+                    chunk_embeddings.push_back(res_embd->embedding[0]);
+                }
             }
-            for(int j=0;j<n_embd;j++)
-                average[j] /= aggregation_sample;
-            embeddings = std::move(average);
+        }, [&](const json & error_data) {
+            res_error(res, error_data);
+            error = true;
+        }, req.is_connection_closed);
+
+        ctx_rag_embd.queue_results.remove_waiting_task_ids(task_ids);
+
+        if (error) {
+            return;
         }
+
         //write json response
-        json root({{"chunk_embedding", embeddings}});
+        json root({{"chunk_embedding", chunk_embeddings.size() == 1 ? chunk_embeddings[0] : chunk_embeddings}});
         res_ok(res, root);
-
     };
 
-    const auto handle_ingest = [&ctx_server, &res_error, &res_ok](const httplib::Request & req, httplib::Response & res/*, oaicompat_type oaicompat*/) {
+    const auto handle_ingest = [&ctx_rag_embd, &res_error, &res_ok, &res_model_busy](const httplib::Request & req, httplib::Response & res/*, oaicompat_type oaicompat*/) {
+        const auto model_use = ctx_rag_embd.model_gate.try_use();
+        if (!model_use) {
+            res_model_busy(res, ctx_rag_embd.model_gate);
+            return;
+        }
         json body = json::parse(req.body);
         if (body.contains("messages")) {
             body = body.at("messages")[body.at("messages").size()-1];
@@ -5176,10 +8306,10 @@ int main(int argc, char ** argv) {
         std::vector<llama_tokens> tokenized_prompts;
         if (body.count("input") != 0) {
             auto prompt = body.at("input");
-            tokenized_prompts = tokenize_input_prompts(ctx_server.vocab, prompt, true, true);
+            tokenized_prompts = tokenize_input_prompts(ctx_rag_embd.vocab, prompt, true, true);
         } else if (body.contains("content")) {
             auto prompt = body.at("content");
-            tokenized_prompts = tokenize_input_prompts(ctx_server.vocab, prompt, true, true);
+            tokenized_prompts = tokenize_input_prompts(ctx_rag_embd.vocab, prompt, true, true);
         } else if (body.contains("tokens")) {
             llama_tokens tokens = body.at("tokens");
             tokenized_prompts.push_back(tokens);
@@ -5204,23 +8334,24 @@ int main(int argc, char ** argv) {
             for (size_t i = 0; i < tokenized_prompts.size(); i++) {
                 server_task task = server_task(SERVER_TASK_TYPE_EMBEDDING);
 
-                task.id            = ctx_server.queue_tasks.get_new_id();
+                task.id            = ctx_rag_embd.queue_tasks.get_new_id();
                 task.index         = i;
-                task.prompt_tokens = server_tokens(tokenized_prompts[i], ctx_server.mctx != nullptr);
+                task.prompt_tokens = server_tokens(tokenized_prompts[i], ctx_rag_embd.mctx != nullptr);
 
                 // OAI-compat
                 task.params.oaicompat = OAICOMPAT_TYPE_NONE;
 
                 tasks.push_back(std::move(task));
             }
+            server_tasks_set_class(tasks, request_tenant(req), body, SERVER_TASK_PRIORITY_BACKGROUND, SERVER_ENDPOINT_INGEST, request_trace_id(res));
 
             task_ids = server_task::get_list_id(tasks);
-            ctx_server.queue_results.add_waiting_tasks(tasks);
-            ctx_server.queue_tasks.post(std::move(tasks));
+            ctx_rag_embd.queue_results.add_waiting_tasks(tasks);
+            ctx_rag_embd.queue_tasks.post(std::move(tasks));
         }
 
         // get the result
-        ctx_server.receive_multi_results(task_ids, [&](std::vector<server_task_result_ptr> & results) {
+        ctx_rag_embd.receive_multi_results(task_ids, [&](std::vector<server_task_result_ptr> & results) {
             for (auto & res : results) {
                 GGML_ASSERT(dynamic_cast<server_task_result_embd*>(res.get()) != nullptr);
             }
@@ -5229,7 +8360,7 @@ int main(int argc, char ** argv) {
             error = true;
         }, req.is_connection_closed);
 
-        ctx_server.queue_results.remove_waiting_task_ids(task_ids);
+        ctx_rag_embd.queue_results.remove_waiting_task_ids(task_ids);
 
         if (error) {
             return;
@@ -5241,14 +8372,23 @@ int main(int argc, char ** argv) {
     };
 
 
-    const auto handle_chat_completions_rag = [&ctx_server, &params, &res_error, &handle_completions_impl_with_rag](const httplib::Request & req, httplib::Response & res) {
+    const auto handle_chat_completions_rag = [&ctx_server, &params, &res_error, &handle_completions_impl_with_rag, &res_model_busy](const httplib::Request & req, httplib::Response & res) {
+        const auto model_use = ctx_server.model_gate.try_use();
+        if (!model_use) {
+            res_model_busy(res, ctx_server.model_gate);
+            return;
+        }
         LOG_DBG("request: %s\n", req.body.c_str());
         if (ctx_server.params_base.embedding) {
             res_error(res, format_error_response("This server does not support completions. Start it without `--embeddings`", ERROR_TYPE_NOT_SUPPORTED));
             return;
         }
 
+        const uint64_t trace_id = request_trace_id(res);
+        const int64_t t_parse = ggml_time_us();
         auto body = json::parse(req.body);
+        tracer.record(trace_id, "parse", t_parse);
+        const int64_t t_template = ggml_time_us();
         std::vector<raw_buffer> files;
         json data = oaicompat_completion_params_parse(
             body,
@@ -5257,20 +8397,28 @@ int main(int argc, char ** argv) {
             ctx_server.chat_templates.get(),
             ctx_server.mctx,
             files);
+        tracer.record(trace_id, "template", t_template);
 
         handle_completions_impl_with_rag(
             SERVER_TASK_TYPE_COMPLETION,
             data,
             files,
             req.is_connection_closed,
+            request_tenant(req),
             res,
-            OAICOMPAT_TYPE_CHAT);
+            OAICOMPAT_TYPE_CHAT,
+            model_use);
     };
 
     // same with handle_chat_completions, but without inference part
     //OWL END
     //OWL BEGIN
-    const auto handle_chunking = [&ctx_server, &res_error, &res_ok](const httplib::Request & req, httplib::Response & res) {
+    const auto handle_chunking = [&ctx_rag_embd, &params, &res_error, &res_ok, &res_model_busy](const httplib::Request & req, httplib::Response & res) {
+        const auto model_use = ctx_rag_embd.model_gate.try_use();
+        if (!model_use) {
+            res_model_busy(res, ctx_rag_embd.model_gate);
+            return;
+        }
         const json body = json::parse(req.body);
 
         // for the shape of input/content, see tokenize_input_prompts()
@@ -5300,11 +8448,10 @@ int main(int argc, char ** argv) {
             const std::string db_host = json_value(rag_connection, "host", std::string("localhost"));
             int db_port = json_value(rag_connection, "rag_connection", (int)5432);
             const std::string db_name = json_value(rag_connection, "name", std::string("klave_rag"));
-            std::cerr<<"rag_connection provided:" << rag_connection.dump(-1) << std::endl;
+            const std::string collection = json_value(rag_connection, "collection", std::string(""));
 
-            rag_db = create_rag_database(db_host, db_port, db_name);
             try {
-                rag_db->connect(db_user, db_password);
+                rag_db = create_rag_database(db_host, db_port, db_name, collection, db_user, db_password);
             } catch (const std::exception& e) {
                 res_error(res, format_error_response(std::string("Database connection error: ") + e.what(), ERROR_TYPE_SERVER));
                 error = true;
@@ -5314,8 +8461,23 @@ int main(int argc, char ** argv) {
             
 
 
+        bool use_shadow = false;
         if (body.count("rag_insertion_params")) {
             perform_rag_insertion = true; // Flag to enable RAG insertion
+            if (!rag_db) {
+                res_error(res, format_error_response("\"rag_connection\" must be provided along with \"rag_insertion_params\"", ERROR_TYPE_INVALID_REQUEST));
+                return;
+            }
+            std::string route_error;
+            try {
+                if (!ctx_rag_embd.route_rag_embeddings(*rag_db, use_shadow, route_error)) {
+                    res_error(res, format_error_response(route_error, ERROR_TYPE_INVALID_REQUEST));
+                    return;
+                }
+            } catch (const std::exception& e) {
+                res_error(res, format_error_response(std::string("Database error: ") + e.what(), ERROR_TYPE_SERVER));
+                return;
+            }
             // 1. Handle document_id or document content
             const auto& rag_params = body.at("rag_insertion_params");
             if (rag_params.count("document_id") != 0) {
@@ -5352,11 +8514,10 @@ int main(int argc, char ** argv) {
                 return;
             }
 
-            // 3. Get recipient_private_key
-            if (rag_params.count("recipient_private_key") != 0) {
+            // 3. Get recipient_private_key, else the one of --rag-recipient-key-file
+            if (rag_params.count("recipient_private_key") != 0 || !params.rag_recipient_key.empty()) {
                 try {
-                    auto skey = rag_params.at("recipient_private_key");
-                    auto recipient_private_key_to_insert_str = skey.template get<std::string>();
+                    auto recipient_private_key_to_insert_str = json_value(rag_params, "recipient_private_key", params.rag_recipient_key);
                     recipient_private_key_to_insert = postgres_client::hex_to_byte_array<32>(recipient_private_key_to_insert_str);
                 } catch (const std::exception& e) {
                     std::string err_message = format_error_response(std::string("Invalid recipient_private_key format: ") + e.what(), ERROR_TYPE_INVALID_REQUEST);
@@ -5371,7 +8532,7 @@ int main(int argc, char ** argv) {
         }
 
         // Store the original tokenized prompts. We will not modify this vector.
-        auto original_tokenized_prompts = tokenize_input_prompts(ctx_server.vocab, prompt, true, true);
+        auto original_tokenized_prompts = tokenize_input_prompts(ctx_rag_embd.vocab, prompt, true, true);
         
         for (const auto & tokens : original_tokenized_prompts) {
             if (tokens.empty()) {
@@ -5437,17 +8598,18 @@ int main(int argc, char ** argv) {
 
         for (size_t i = 0; i < embedding_chunks.size(); ++i) {
             server_task task = server_task(SERVER_TASK_TYPE_EMBEDDING);
-            task.id            = ctx_server.queue_tasks.get_new_id(); // Each task gets a UNIQUE ID
+            task.id            = ctx_rag_embd.queue_tasks.get_new_id(); // Each task gets a UNIQUE ID
             task.index         = i; // This index refers to the embedding_chunks vector
-            task.prompt_tokens = server_tokens(embedding_chunks[i], ctx_server.mctx != nullptr);
+            task.prompt_tokens = server_tokens(embedding_chunks[i], ctx_rag_embd.mctx != nullptr);
             task.params.oaicompat = OAICOMPAT_TYPE_NONE;
 
             task_ids_to_wait_for.insert(task.id); // Add the new unique ID
             tasks.push_back(std::move(task));
         }
+        server_tasks_set_class(tasks, request_tenant(req), body, SERVER_TASK_PRIORITY_BACKGROUND, SERVER_ENDPOINT_INGEST, request_trace_id(res));
 
-        ctx_server.queue_results.add_waiting_tasks(tasks);
-        ctx_server.queue_tasks.post(std::move(tasks));
+        ctx_rag_embd.queue_results.add_waiting_tasks(tasks);
+        ctx_rag_embd.queue_tasks.post(std::move(tasks));
         // --- END NEW CHUNKING AND TASK CREATION LOGIC ---
 
 
@@ -5467,7 +8629,7 @@ int main(int argc, char ** argv) {
         std::vector<std::vector<float>> all_embedding;
         int position = 0;
         bool is_last_block = false;
-        ctx_server.receive_streamed_results(task_ids_to_wait_for, [&](server_task_result_ptr & result) {
+        ctx_rag_embd.receive_streamed_results(task_ids_to_wait_for, [&](server_task_result_ptr & result) {
             std::cerr<< "receiving task#" << task_n << " results" << std::endl;
             if (error) {
                 std::cerr<<"previous error, returning" <<std::endl;
@@ -5506,7 +8668,7 @@ int main(int argc, char ** argv) {
                         chunk_vector[dim] += all_embedding[j][dim];
                 for(uint32_t dim = 0; dim < embeddinz_sz; ++dim)
                     chunk_vector[dim] /= (float)chunk_sz;
-                auto contents = common_detokenize(ctx_server.ctx,llama_tokens{std::begin(all_prompt),std::begin(all_prompt)+chunk_sz},false);
+                auto contents = common_detokenize(ctx_rag_embd.ctx,llama_tokens{std::begin(all_prompt),std::begin(all_prompt)+chunk_sz},false);
 
                 std::vector<uint8_t> chunk_contents_bytes(std::begin(contents),std::end(contents));
                 try {
@@ -5516,7 +8678,8 @@ int main(int argc, char ** argv) {
                         chunk_vector,
                         chunk_contents_bytes,
                         controller_public_key_to_insert,
-                        recipient_private_key_to_insert
+                        recipient_private_key_to_insert,
+                        use_shadow
                     );
                 } catch (const std::exception& e) {
                     std::cerr << "Database insertion failed for documentId " << documentId << ": " << e.what() << std::endl;
@@ -5531,19 +8694,12 @@ int main(int argc, char ** argv) {
                 all_embedding.erase(std::begin(all_embedding),std::begin(all_embedding)+step_size_for_brutal_chunking);
                 all_prompt.erase(std::begin(all_prompt),std::begin(all_prompt)+step_size_for_brutal_chunking);
             }
-        if (rag_db) {
-                try {
-                    rag_db->disconnect();
-                } catch (const std::exception& e) {
-                    std::cerr << "Database disconnection failed: " << e.what() << std::endl;
-                }
-            }
         }, [&](const json & error_data) {
             res_error(res, error_data);
             error = true;
         }, req.is_connection_closed);
 
-        ctx_server.queue_results.remove_waiting_task_ids(task_ids_to_wait_for); // Use the new set of task IDs
+        ctx_rag_embd.queue_results.remove_waiting_task_ids(task_ids_to_wait_for); // Use the new set of task IDs
 
         if (error) {
             return;
@@ -5556,17 +8712,25 @@ int main(int argc, char ** argv) {
     // OWL END
 
 #define ERROR_TYPE_INTERNAL_SERVER_ERROR ERROR_TYPE_INVALID_REQUEST
-const auto handle_rag_db_admin = [&ctx_server, &res_error, &res_ok](const httplib::Request& req, httplib::Response& res) {
+const auto handle_rag_db_admin = [&ctx_rag_embd, &rag_migrations, &params, &res_error, &res_ok, &res_model_busy](const httplib::Request& req, httplib::Response& res) {
+        const auto model_use = ctx_rag_embd.model_gate.try_use();
+        if (!model_use) {
+            res_model_busy(res, ctx_rag_embd.model_gate);
+            return;
+        }
     try {
         // Request Body Structure:
         // {
-        //     "action": "create" | "drop" | "exists" | "create_document" | "delete_document", // Required.
+        //     "action": "create" | "drop" | "exists" | "create_document" | "delete_document"
+        //             | "fingerprint" | "migrate" | "migration_status" | "migration_abort"
+        //             | "list_collections" | "create_index", // Required.
         //     "rag_connection": {
         //          "host": "your_rag_db_host",                                             // Optional defaults to "localhost".
         //          "port": your_rag_db_port,                                                // Optional defaults to 5432.
         //          "name": "your_rag_db_name",                                             // Optional defaults to "klave_rag".
         //          "user": "your_db_user",                                                 // Optional defaults to "postgres".
         //          "password": "your_db_password",                                         // Optional defaults to "admin".
+        //          "collection": "tenant_a",                                               // Optional defaults to "default" (unprefixed tables).
         //          }
         //     // For "create_document" action:
         //     "date": "YYYY-MM-DD",
@@ -5577,6 +8741,14 @@ const auto handle_rag_db_admin = [&ctx_server, &res_error, &res_ok](const httpli
         //
         //     // For "delete_document" action:
         //     "document_id": 123
+        //
+        //     // For "migrate" action (re-embeds every entry with the loaded model):
+        //     "recipient_private_key": "hex",                                             // Defaults to --rag-recipient-key-file.
+        //     "n_batch": 32                                                               // Optional defaults to 32.
+        //
+        //     // For "create_index" action (on the collection's embedding column):
+        //     "index": { "type": "hnsw" | "ivfflat", "metric": "cosine" | "l2" | "ip",
+        //                "m": 16, "ef_construction": 64, "lists": 100 }                   // All optional.
         // }
         const json body = json::parse(req.body);
 
@@ -5593,25 +8765,27 @@ const auto handle_rag_db_admin = [&ctx_server, &res_error, &res_ok](const httpli
         const std::string db_host = json_value(rag_connection, "host", std::string("localhost"));
         int db_port = json_value(rag_connection, "port", (int)5432);
         const std::string db_name = json_value(rag_connection, "name", std::string("klave_rag"));
+        const std::string collection = json_value(rag_connection, "collection", std::string(""));
 
         // Create and connect the database instance
-        auto rag_db = create_rag_database(db_host, db_port, db_name);
-        rag_db->connect(db_user, db_password); // Connect using the set credentials
+        auto rag_db = create_rag_database(db_host, db_port, db_name, collection, db_user, db_password);
 
         // 2. Perform the requested action:
         if (action == "create") {
-            if (ctx_server.model == nullptr) {
+            if (ctx_rag_embd.model == nullptr) {
                 
                 res_error(res, format_error_response("Could not get embedding size from model. Model is not loaded yet.", ERROR_TYPE_INTERNAL_SERVER_ERROR));
                  return;
             }
-            int embeddingSize = llama_model_n_embd(ctx_server.model);
+            int embeddingSize = llama_model_n_embd(ctx_rag_embd.model);
             if (embeddingSize == 0) {
                  res_error(res, format_error_response("Could not get embedding size from model. Model does not support embeddings.", ERROR_TYPE_INTERNAL_SERVER_ERROR));
                  return;
             }
             rag_db->createSchema(embeddingSize);
-            res_ok(res, json({{"message", "Database schema created successfully"}}));
+            const auto fingerprint = ctx_rag_embd.get_embedding_fingerprint();
+            rag_db->setFingerprint(fingerprint);
+            res_ok(res, json({{"message", "Database schema created successfully"}, {"fingerprint", fingerprint.to_json()}}));
         } else if (action == "drop") {
             rag_db->destroySchema();
             res_ok(res, json({{"message", "Database schema dropped successfully"}}));
@@ -5649,9 +8823,68 @@ const auto handle_rag_db_admin = [&ctx_server, &res_error, &res_ok](const httpli
             const std::string documentId = body["document_id"].get<std::string>();
             rag_db->deleteDocument(documentId);
             res_ok(res, json({{"message", "Document deletion attempted"}}));
+        } else if (action == "fingerprint") {
+            embedding_fingerprint active;
+            embedding_fingerprint shadow;
+            const bool has_active = rag_db->getFingerprint(active, false);
+            const bool has_shadow = rag_db->getFingerprint(shadow, true);
+            bool use_shadow = false;
+            std::string route_error;
+            const bool compatible = ctx_rag_embd.route_rag_embeddings(*rag_db, use_shadow, route_error);
+            res_ok(res, json({
+                {"model",      ctx_rag_embd.get_embedding_fingerprint().to_json()},
+                {"active",     has_active ? active.to_json() : json(nullptr)},
+                {"shadow",     has_shadow ? shadow.to_json() : json(nullptr)},
+                {"compatible", compatible},
+                {"use_shadow", use_shadow},
+                {"error",      route_error}
+            }));
+        } else if (action == "migrate") {
+            const std::string recipient_sk_hex = json_value(body, "recipient_private_key", params.rag_recipient_key);
+            if (recipient_sk_hex.empty()) {
+                res_error(res, format_error_response("Missing required parameter for migrate: recipient_private_key", ERROR_TYPE_INVALID_REQUEST));
+                return;
+            }
+            const auto recipient_sk = postgres_client::hex_to_byte_array<32>(recipient_sk_hex);
+            const int n_batch = std::max(1, json_value(body, "n_batch", 32));
+            auto & rag_migration = rag_migrations.get(db_host, db_port, db_name, collection);
+            if (!rag_migration.start(ctx_rag_embd, db_host, db_port, db_name, collection, db_user, db_password, recipient_sk, n_batch)) {
+                res_error(res, format_error_response("A migration is already running on this collection", ERROR_TYPE_UNAVAILABLE));
+                return;
+            }
+            res_ok(res, json({{"message", "Migration started"}, {"target", ctx_rag_embd.get_embedding_fingerprint().to_json()}}));
+        } else if (action == "list_collections") {
+            res_ok(res, json({{"collections", rag_db->listCollections()}}));
+        } else if (action == "create_index") {
+            rag_index_params index_params;
+            const json index = json_value(body, "index", json::object());
+            index_params.type = json_value(index, "type", index_params.type);
+            const std::string metric = json_value(index, "metric", std::string("cosine"));
+            if (metric == "cosine") {
+                index_params.metric = DistanceMetric::COSINE;
+            } else if (metric == "l2") {
+                index_params.metric = DistanceMetric::L2;
+            } else if (metric == "ip") {
+                index_params.metric = DistanceMetric::IP;
+            } else {
+                res_error(res, format_error_response("Invalid metric. Must be 'cosine', 'l2' or 'ip'.", ERROR_TYPE_INVALID_REQUEST));
+                return;
+            }
+            index_params.m = json_value(index, "m", index_params.m);
+            index_params.ef_construction = json_value(index, "ef_construction", index_params.ef_construction);
+            index_params.lists = json_value(index, "lists", index_params.lists);
+            rag_db->createIndex(index_params);
+            res_ok(res, json({{"message", "Index created successfully"}, {"collection", rag_db->getCollection()}}));
+        } else if (action == "migration_status") {
+            res_ok(res, rag_migrations.get(db_host, db_port, db_name, collection).to_json());
+        } else if (action == "migration_abort") {
+            auto & rag_migration = rag_migrations.get(db_host, db_port, db_name, collection);
+            rag_migration.stop();
+            rag_db->abortShadowMigration();
+            res_ok(res, json({{"message", "Migration aborted"}, {"migration", rag_migration.to_json()}}));
         }
         else {
-            res_error(res, format_error_response("Invalid action. Must be 'create', 'drop', 'exists', 'create_document', or 'delete_document'.", ERROR_TYPE_INVALID_REQUEST));
+            res_error(res, format_error_response("Invalid action. Must be 'create', 'drop', 'exists', 'create_document', 'delete_document', 'fingerprint', 'migrate', 'migration_status', 'migration_abort', 'list_collections' or 'create_index'.", ERROR_TYPE_INVALID_REQUEST));
         }
     } catch (const std::exception& e) {
         // Handle database errors using res_error
@@ -5659,30 +8892,75 @@ const auto handle_rag_db_admin = [&ctx_server, &res_error, &res_ok](const httpli
     }
 };
 
-const auto provide_quote = [&ctx_server, &params, &res_error, &res_ok](const httplib::Request& req, httplib::Response& res) {
-    try {
-        std::cerr << "requesting attested seld-signed certificate" << std::endl;
-        std::unique_ptr<EVP_PKEY, decltype(EVP_PKEY_free)*> pkey(self_signed::load_private_key(params.ssl_file_key), EVP_PKEY_free);
-        if (pkey == nullptr)
-        {
-            std::cerr << "requesting attested seld-signed certificate: private key is null" << std::endl;
-            res_error(res, format_error_response("Failed to open private file: " + params.ssl_file_key, ERROR_TYPE_INTERNAL_SERVER_ERROR));
+// a TDX quote takes far longer than serving the request: the attested certificate is cached, and
+// refreshed in the background before its validity window ends
+std::unique_ptr<self_signed::attested_certificate_cache> attested_cert;
+if (params.attested_cert_ttl > 0 && !params.ssl_file_key.empty()) {
+    attested_cert = std::make_unique<self_signed::attested_certificate_cache>(params.ssl_file_key, std::chrono::seconds(params.attested_cert_ttl));
+}
+
+#ifdef CPPHTTPLIB_OPENSSL_SUPPORT
+// renews the certificate in the background; declared after attested_cert, which its callback uses
+std::unique_ptr<acme_lw::RenewalService> acme_renewal;
+if (acme_enabled) {
+    acme_lw::RenewalConfig acme_config;
+    acme_config.domainNames.assign(params.acme_domains.begin(), params.acme_domains.end());
+    acme_config.accountKeyPath  = params.acme_account_key.empty() ? params.ssl_file_key + ".acme-account" : params.acme_account_key;
+    acme_config.certificatePath = params.ssl_file_cert;
+    acme_config.privateKeyPath  = params.ssl_file_key;
+    acme_config.directoryUrl    = params.acme_directory;
+    acme_config.renewBefore     = std::chrono::hours(24 * params.acme_renew_before);
+    acme_renewal = std::make_unique<acme_lw::RenewalService>(acme_config, [&acme_swap, &attested_cert](const acme_lw::Certificate & certificate) {
+        try {
+            acme_swap.update(certificate.fullchain, certificate.privkey);
+        } catch (const std::exception & e) {
+            LOG_ERR("acme: the renewed certificate could not be installed: %s\n", e.what());
             return;
         }
+        // the attested certificate is bound to the TLS key, which was just replaced
+        if (attested_cert) {
+            attested_cert->invalidate();
+        }
+    });
+    svr->Get(R"(/\.well-known/acme-challenge/([A-Za-z0-9_-]+))", [&acme_renewal](const httplib::Request & req, httplib::Response & res) {
+        std::string key_authorization;
+        if (acme_renewal->challengeResponse(req.matches[1], key_authorization)) {
+            res.set_content(key_authorization, "text/plain");
+        } else {
+            res.status = 404;
+        }
+    });
+}
+#endif
+
+const auto provide_quote = [&params, &attested_cert, &res_error, &res_ok](const httplib::Request&, httplib::Response& res) {
+    try {
         std::string certificate;
-        if(!self_signed::createSelfSignedTdxCertificateAsString(pkey.get(), certificate))
-        {
-            std::cerr << "requesting attested seld-signed certificate: createSelfSignedTdxCertificateAsString failed" << std::endl;
-            res_error(res, format_error_response("Failed to generate attested certificate" , ERROR_TYPE_INTERNAL_SERVER_ERROR));
-            return;
+        if (attested_cert) {
+            if (!attested_cert->get(certificate)) {
+                res_error(res, format_error_response("Failed to generate attested certificate" , ERROR_TYPE_INTERNAL_SERVER_ERROR));
+                return;
+            }
+        } else {
+            std::unique_ptr<EVP_PKEY, decltype(EVP_PKEY_free)*> pkey(self_signed::load_private_key(params.ssl_file_key), EVP_PKEY_free);
+            if (pkey == nullptr)
+            {
+                std::cerr << "requesting attested seld-signed certificate: private key is null" << std::endl;
+                res_error(res, format_error_response("Failed to open private file: " + params.ssl_file_key, ERROR_TYPE_INTERNAL_SERVER_ERROR));
+                return;
+            }
+            if(!self_signed::createSelfSignedTdxCertificateAsString(pkey.get(), certificate))
+            {
+                std::cerr << "requesting attested seld-signed certificate: createSelfSignedTdxCertificateAsString failed" << std::endl;
+                res_error(res, format_error_response("Failed to generate attested certificate" , ERROR_TYPE_INTERNAL_SERVER_ERROR));
+                return;
+            }
         }
         res_ok(res, json({
             {"message", "TDX Attested Certificate generated successfully"},
             {"certificate_pem", certificate} // Embed the PEM string in JSON
         }));
 
-        std::cout << "Successfully served TDX Attested Certificate from private key file: " << params.ssl_file_key << std::endl;
-
     } catch (const std::exception& e) {
         std::cerr << "Error retrieving certificate: " << e.what() << std::endl;
         // Catch any other exceptions during file reading or JSON parsing
@@ -5691,7 +8969,9 @@ const auto provide_quote = [&ctx_server, &params, &res_error, &res_ok](const htt
 };
 
 
-const auto handle_model_list_models = [&ctx_server, &res_error, &res_ok, &params](const json & body, const httplib::Request& req, httplib::Response& res) {
+std::mutex model_change_mutex;
+
+const auto handle_model_list_models = [&ctx_server, &res_error, &res_ok, &params, &model_pool](const json & body, const httplib::Request& req, httplib::Response& res) {
     try {
         std::string fullyQualifiedFilePath = params.model.path;
 
@@ -5726,6 +9006,9 @@ const auto handle_model_list_models = [&ctx_server, &res_error, &res_ok, &params
         json models = {
             {"models", ggufFiles}
             };
+        if (model_pool.enabled()) {
+            models["pool"] = model_pool.to_json();
+        }
         res_ok(res, models);
 
 
@@ -5735,7 +9018,7 @@ const auto handle_model_list_models = [&ctx_server, &res_error, &res_ok, &params
     }
 };
 
-const auto handle_model_change_model = [&ctx_server, &res_error, &res_ok, &state, &params](const json & body, const httplib::Request& req, httplib::Response& res) {
+const auto handle_model_change_model = [&ctx_server, &res_error, &res_ok, &params, &model_change_mutex](const json & body, const httplib::Request& req, httplib::Response& res) {
     try {
          // 1. Validate the request body:
         if (!body.contains("model")) {
@@ -5761,33 +9044,72 @@ const auto handle_model_change_model = [&ctx_server, &res_error, &res_ok, &state
         fs::path targetFilePath = directoryPath / new_model_name ;
 
         // 3. Check if the target file exists and is a regular file
-        if (!fs::exists(targetFilePath) && fs::is_regular_file(targetFilePath)) {
+        if (!fs::exists(targetFilePath) || !fs::is_regular_file(targetFilePath)) {
             std::cerr << "Not found: File '" << targetFilePath << "' does not exist or is not a regular file." << std::endl;
             res_error(res, format_error_response("Internal Error (model could not be located)", ERROR_TYPE_INVALID_REQUEST));
             return;
         }
 
-        params.model.path = targetFilePath;
-        state.store(SERVER_STATE_LOADING_MODEL);
-        LOG_INF("%s: reloading model\n", __func__);
+        // a single change at a time: the model loaded next is swapped in by the change that loaded it
+        std::unique_lock<std::mutex> lock_change(model_change_mutex, std::try_to_lock);
+        if (!lock_change.owns_lock()) {
+            res_error(res, format_error_response("A model change is already in progress", ERROR_TYPE_UNAVAILABLE));
+            return;
+        }
 
-        if (!ctx_server.load_model(params)) {
-            LOG_ERR("%s: exiting due to model loading error\n", __func__);
+        // the new model is loaded (mmap, prefetched) while the current one keeps serving
+        const int64_t t_load_start = ggml_time_us();
+        common_params params_next = params;
+        params_next.model.path = targetFilePath;
+        LOG_INF("%s: loading model '%s' next to the current one\n", __func__, params_next.model.path.c_str());
+
+        if (!ctx_server.load_model_next(params_next)) {
+            LOG_ERR("%s: model could not be loaded, keeping the current one\n", __func__);
             res_error(res, format_error_response("Internal Error (model could not be loaded)", ERROR_TYPE_INVALID_REQUEST));
             return;
         }
-    ctx_server.slots.clear();
-    ctx_server.init();
-    state.store(SERVER_STATE_READY);
+        const double t_load_ms = (ggml_time_us() - t_load_start) / 1e3;
 
-    LOG_INF("%s: model loaded\n", __func__);
+        server_task_result_ptr result;
+        {
+            // the requests that use the model finish, streams included, while the new ones are turned away; the
+            // swap happens once the tasks already posted have drained from the slots
+            const auto model_closed = ctx_server.model_gate.close(params.model_swap_timeout * 1000);
+            if (!model_closed) {
+                LOG_WRN("%s: the requests using the model did not finish within %d s, keeping the current model\n", __func__, params.model_swap_timeout);
+                ctx_server.drop_model_next();
+                res.set_header("Retry-After", std::to_string(params.model_swap_timeout));
+                res_error(res, format_error_response("The requests using the model did not finish in time, retry later", ERROR_TYPE_UNAVAILABLE));
+                return;
+            }
 
+            int task_id = ctx_server.queue_tasks.get_new_id();
+            {
+                server_task task(SERVER_TASK_TYPE_MODEL_SWAP);
+                task.id = task_id;
+                task.keep_previous_model = json_value(body, "keep_previous", false);
 
-    json models = {
-        {"success", true},
-        {"new_model_path", (std::string)targetFilePath}
-        };
-        res_ok(res, models);
+                ctx_server.queue_results.add_waiting_task_id(task_id);
+                ctx_server.queue_tasks.post(std::move(task));
+            }
+            result = ctx_server.queue_results.recv(task_id);
+            ctx_server.queue_results.remove_waiting_task_id(task_id);
+
+            if (!result->is_error()) {
+                params.model.path = targetFilePath;
+            }
+        }
+
+        if (result->is_error()) {
+            res_error(res, result->to_json());
+            return;
+        }
+
+        LOG_INF("%s: model changed\n", __func__);
+
+        json data = result->to_json();
+        data["timings"]["load_ms"] = t_load_ms;
+        res_ok(res, data);
 
     } catch (const std::exception& e) {
         // Handle database errors using res_error
@@ -5822,14 +9144,12 @@ const auto handle_model_request = [&ctx_server, &res_error, &res_ok, &handle_mod
 
 
 
-    const auto handle_rerank = [&ctx_server, &res_error, &res_ok](const httplib::Request & req, httplib::Response & res) {
+    const auto handle_rerank_impl = [&res_error, &res_ok](server_context & ctx_server, const json & body, const httplib::Request & req, httplib::Response & res) {
         if (!ctx_server.params_base.reranking || ctx_server.params_base.embedding) {
             res_error(res, format_error_response("This server does not support reranking. Start it with `--reranking` and without `--embedding`", ERROR_TYPE_NOT_SUPPORTED));
             return;
         }
 
-        const json body = json::parse(req.body);
-
         // TODO: implement
         //int top_n = 1;
         //if (body.count("top_n") != 1) {
@@ -5863,6 +9183,8 @@ const auto handle_model_request = [&ctx_server, &res_error, &res_ok, &handle_mod
             return;
         }
 
+        const uint64_t trace_id = request_trace_id(res);
+        const int64_t t_tokenize = ggml_time_us();
         llama_tokens tokenized_query = tokenize_input_prompts(ctx_server.vocab, query, /* add_special */ false, true)[0];
 
         // create and queue the task
@@ -5881,6 +9203,8 @@ const auto handle_model_request = [&ctx_server, &res_error, &res_ok, &handle_mod
                 task.prompt_tokens = server_tokens(tmp, ctx_server.mctx != nullptr);
                 tasks.push_back(std::move(task));
             }
+            tracer.record(trace_id, "tokenize", t_tokenize);
+            server_tasks_set_class(tasks, request_tenant(req), body, SERVER_TASK_PRIORITY_BATCH, SERVER_ENDPOINT_RERANK, trace_id);
 
             task_ids = server_task::get_list_id(tasks);
             ctx_server.queue_results.add_waiting_tasks(tasks);
@@ -5897,6 +9221,7 @@ const auto handle_model_request = [&ctx_server, &res_error, &res_ok, &handle_mod
             error = true;
         }, req.is_connection_closed);
 
+        ctx_server.queue_results.remove_waiting_task_ids(task_ids);
         if (error) {
             return;
         }
@@ -5911,7 +9236,20 @@ const auto handle_model_request = [&ctx_server, &res_error, &res_ok, &handle_mod
         res_ok(res, root);
     };
 
+    const auto handle_rerank = [&route_model, &handle_rerank_impl](const httplib::Request & req, httplib::Response & res) {
+        const json body = json::parse(req.body);
+        server_model_gate::guard_ptr model_use;
+        if (server_context * ctx = route_model(body, SERVER_TASK_TYPE_RERANK, model_use, res)) {
+            handle_rerank_impl(*ctx, body, req, res);
+        }
+    };
+
     const auto handle_lora_adapters_list = [&](const httplib::Request &, httplib::Response & res) {
+        const auto model_use = ctx_server.model_gate.try_use();
+        if (!model_use) {
+            res_model_busy(res, ctx_server.model_gate);
+            return;
+        }
         json result = json::array();
         const auto & loras = ctx_server.params_base.lora_adapters;
         for (size_t i = 0; i < loras.size(); ++i) {
@@ -5927,6 +9265,11 @@ const auto handle_model_request = [&ctx_server, &res_error, &res_ok, &handle_mod
     };
 
     const auto handle_lora_adapters_apply = [&](const httplib::Request & req, httplib::Response & res) {
+        const auto model_use = ctx_server.model_gate.try_use();
+        if (!model_use) {
+            res_model_busy(res, ctx_server.model_gate);
+            return;
+        }
         const json body = json::parse(req.body);
         if (!body.is_array()) {
             res_error(res, format_error_response("Request body must be an array", ERROR_TYPE_INVALID_REQUEST));
@@ -6025,6 +9368,8 @@ const auto handle_model_request = [&ctx_server, &res_error, &res_ok, &handle_mod
     // Save & load slots
     svr->Get ("/slots",               handle_slots);
     svr->Post("/slots/:id_slot",      handle_slots_action);
+    // Request traces
+    svr->Get ("/trace/:id",           handle_trace);
 
     //
     // Start the server
@@ -6037,10 +9382,23 @@ const auto handle_model_request = [&ctx_server, &res_error, &res_ok, &handle_mod
     svr->new_task_queue = [&params] { return new httplib::ThreadPool(params.n_threads_http); };
 
     // clean up function, to be called before exit
-    auto clean_up = [&svr, &ctx_server]() {
+    auto clean_up = [&svr, &ctx_server, &ctx_server_rag_embd, &ctx_server_rag_rerank, &rag_loops, &rag_migrations, &model_pool]() {
         SRV_INF("%s: cleaning up before exit...\n", __func__);
         svr->stop();
+        //OWL BEGIN
+        rag_migrations.stop();
+        for (server_context * ctx_aux : {&ctx_server_rag_embd, &ctx_server_rag_rerank}) {
+            ctx_aux->queue_tasks.terminate();
+            ctx_aux->queue_results.terminate();
+        }
+        for (auto & loop : rag_loops) {
+            loop.join();
+        }
+        rag_loops.clear();
+        model_pool.clear();
+        //OWL END
         ctx_server.queue_results.terminate();
+        tracer.stop();
         llama_backend_free();
     };
 
@@ -6076,6 +9434,16 @@ const auto handle_model_request = [&ctx_server, &res_error, &res_ok, &handle_mod
 
     LOG_INF("%s: HTTP server is listening, hostname: %s, port: %d, http threads: %d\n", __func__, params.hostname.c_str(), params.port, params.n_threads_http);
 
+#ifdef CPPHTTPLIB_OPENSSL_SUPPORT
+    //OWL BEGIN
+    // started once the server answers the challenges; the certificate is checked right away, then before it expires
+    if (acme_renewal) {
+        LOG_INF("%s: renewing the certificate of %s with ACME\n", __func__, params.acme_domains.front().c_str());
+        acme_renewal->start();
+    }
+    //OWL END
+#endif
+
     // load the model
     LOG_INF("%s: loading model\n", __func__);
 
@@ -6087,6 +9455,67 @@ const auto handle_model_request = [&ctx_server, &res_error, &res_ok, &handle_mod
     }
 
     ctx_server.init();
+
+    //OWL BEGIN
+    // the RAG models run their own task loop, next to the main one
+    const auto load_rag_model = [&params](server_context & ctx_aux, const std::string & path, bool reranking) {
+        common_params params_aux = params;
+
+        params_aux.model        = common_params_model();
+        params_aux.model.path   = path;
+        params_aux.embedding    = !reranking;
+        params_aux.reranking    = reranking;
+        params_aux.pooling_type = reranking ? LLAMA_POOLING_TYPE_RANK : LLAMA_POOLING_TYPE_UNSPECIFIED;
+        params_aux.n_parallel   = params.rag_n_parallel;
+        params_aux.n_ctx        = params.rag_n_ctx;
+        // non-causal models must process each input in a single ubatch
+        params_aux.n_ubatch     = params_aux.n_batch;
+        if (params.rag_n_threads > 0) {
+            params_aux.cpuparams.n_threads       = params.rag_n_threads;
+            params_aux.cpuparams_batch.n_threads = params.rag_n_threads;
+        }
+
+        params_aux.speculative.model = common_params_model();
+        params_aux.mmproj            = common_params_model();
+        params_aux.lora_adapters.clear();
+        params_aux.control_vectors.clear();
+        params_aux.ctx_shift = false;
+
+        if (!ctx_aux.load_model(params_aux)) {
+            return false;
+        }
+        ctx_aux.init();
+
+        ctx_aux.queue_tasks.on_new_task([&ctx_aux](server_task && task) {
+            ctx_aux.process_single_task(std::move(task));
+        });
+        ctx_aux.queue_tasks.on_update_slots([&ctx_aux]() {
+            ctx_aux.update_slots();
+        });
+
+        SRV_INF("RAG %s model loaded, '%s'\n", reranking ? "reranking" : "embedding", path.c_str());
+        return true;
+    };
+
+    if ((!params.rag_embd_model.empty()   && !load_rag_model(ctx_server_rag_embd,   params.rag_embd_model,   false)) ||
+        (!params.rag_rerank_model.empty() && !load_rag_model(ctx_server_rag_rerank, params.rag_rerank_model, true))) {
+        clean_up();
+        t.join();
+        LOG_ERR("%s: exiting due to RAG model loading error\n", __func__);
+        return 1;
+    }
+    for (server_context * ctx_aux : {&ctx_server_rag_embd, &ctx_server_rag_rerank}) {
+        if (ctx_aux->model != nullptr) {
+            rag_loops.emplace_back([ctx_aux]() { ctx_aux->queue_tasks.start_loop(); });
+        }
+    }
+
+    model_pool.init(params);
+    if (model_pool.enabled()) {
+        SRV_INF("model pool enabled, budget = %d MiB, n_parallel = %d, n_ctx = %d\n", params.model_pool_mib, params.model_pool_parallel, params.model_pool_n_ctx);
+    }
+    //OWL END
+
     state.store(SERVER_STATE_READY);
 
     LOG_INF("%s: model loaded\n", __func__);
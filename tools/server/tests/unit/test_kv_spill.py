@@ -0,0 +1,80 @@
+import pytest
+import time
+from utils import *
+
+server = ServerPreset.tinyllama2()
+
+SUFFIX = [20 + i for i in range(20)]
+
+
+def make_prompt(i: int) -> list:
+    # token ids: the prompts only share the BOS token
+    return [1, 30 + i] + [10 + (i * 7 + j) % 400 for j in range(150)]
+
+
+@pytest.fixture(autouse=True)
+def create_server():
+    global server
+    server = ServerPreset.tinyllama2()
+    server.n_slots = 1
+    server.server_metrics = True
+    server.temperature = 0.0
+
+
+def complete(prompt: list):
+    res = server.make_request("POST", "/completion", data={
+        "prompt": prompt,
+        "n_predict": 4,
+        "cache_prompt": True,
+    })
+    assert res.status_code == 200
+    return res
+
+
+def test_spill_restore_ram():
+    global server
+    server.kv_spill_ram = 64
+    server.start()
+    complete(make_prompt(0))
+    # the slot drops the cache of the first prompt, which is spilled
+    complete(make_prompt(1))
+    res = complete(make_prompt(0) + SUFFIX)
+    assert res.body["timings"]["prompt_n"] <= len(SUFFIX) + 1
+    metrics = server.get_metrics()
+    assert metrics["llamacpp:kv_spill_total"] >= 1
+    assert metrics['llamacpp:kv_spill_restored_total{tier="ram"}'] == 1
+
+
+def test_spill_restored_output():
+    global server
+    server.kv_spill_ram = 64
+    server.start()
+    fresh = complete(make_prompt(0) + SUFFIX)
+    complete(make_prompt(1))
+    restored = complete(make_prompt(0) + SUFFIX)
+    assert restored.body["timings"]["prompt_n"] <= 1
+    assert restored.body["content"] == fresh.body["content"]
+
+
+@pytest.mark.parametrize("encrypt", [False, True])
+def test_spill_restore_disk(encrypt: bool):
+    global server
+    server.kv_spill_ram = 1
+    server.kv_spill_dir = "./tmp/kv-spill"
+    server.kv_spill_disk = 64
+    server.kv_spill_encrypt = encrypt
+    server.start()
+    fresh = complete(make_prompt(0) + SUFFIX)
+    # enough dropped caches to overflow the RAM tier, the least recently used one goes to disk first
+    for i in range(1, 24):
+        complete(make_prompt(i))
+    start = time.time()
+    while server.get_metrics()['llamacpp:kv_spill_bytes{tier="disk"}'] == 0:
+        assert time.time() - start < DEFAULT_HTTP_TIMEOUT, "nothing was written to disk"
+        time.sleep(0.1)
+
+    restored = complete(make_prompt(0) + SUFFIX)
+    assert restored.body["timings"]["prompt_n"] <= 1
+    assert restored.body["content"] == fresh.body["content"]
+    metrics = server.get_metrics()
+    assert metrics['llamacpp:kv_spill_restored_total{tier="disk"}'] == 1
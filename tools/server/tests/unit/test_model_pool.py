@@ -0,0 +1,117 @@
+import math
+import os
+import shutil
+import pytest
+from utils import *
+
+server = ServerPreset.tinyllama2()
+
+MODEL_URL = "https://huggingface.co/ggml-org/models/resolve/main/tinyllamas/stories260K.gguf"
+POOL_DIR = "./tmp/pool"
+
+
+@pytest.fixture(scope="module", autouse=True)
+def create_model_dir():
+    # the generation model and two other models in its directory, all copies of the same file
+    os.makedirs(POOL_DIR, exist_ok=True)
+    main = download_file(MODEL_URL, f"{POOL_DIR}/main.gguf")
+    for name in ["a.gguf", "b.gguf"]:
+        if not os.path.exists(f"{POOL_DIR}/{name}"):
+            shutil.copy(main, f"{POOL_DIR}/{name}")
+
+
+@pytest.fixture(autouse=True)
+def create_server():
+    global server
+    server = ServerPreset.tinyllama2()
+    server.model_hf_repo = None
+    server.model_hf_file = None
+    server.model_file = f"{POOL_DIR}/main.gguf"
+    server.model_pool_parallel = 1
+    server.model_pool_ctx_size = 256
+    server.temperature = 0.0
+
+
+def pool_budget_one_model() -> int:
+    # in MiB, enough for one of the models but not for two
+    n_bytes = os.path.getsize(f"{POOL_DIR}/main.gguf")
+    budget = math.ceil(n_bytes / 2**20)
+    assert 2 * n_bytes > budget * 2**20
+    return budget
+
+
+def complete(model: str | None):
+    data = {
+        "prompt": "Once upon a time",
+        "n_predict": 4,
+    }
+    if model is not None:
+        data["model"] = model
+    return server.make_request("POST", "/completion", data=data)
+
+
+def pool_state() -> dict:
+    res = server.make_request("POST", "/model-action", data={"action": "list-models"})
+    assert res.status_code == 200
+    assert "a.gguf" in res.body["models"]
+    return res.body["pool"]
+
+
+def test_pool_routes_by_model_name():
+    global server
+    server.model_pool = 16
+    server.start()
+    assert pool_state()["loaded"] == []
+
+    # no "model" field and the name of the generation model are served by the generation model
+    res_main = complete(None)
+    assert res_main.status_code == 200
+    assert complete("main.gguf").status_code == 200
+    assert pool_state()["loaded"] == []
+
+    # another file of the directory is loaded on demand, computes the same as the generation model
+    res = complete("a.gguf")
+    assert res.status_code == 200
+    assert res.body["content"] == res_main.body["content"]
+    pool = pool_state()
+    assert pool["loaded"] == [{"model": "a.gguf", "type": "completion", "size": os.path.getsize(f"{POOL_DIR}/a.gguf")}]
+    assert pool["used"] == os.path.getsize(f"{POOL_DIR}/a.gguf")
+
+    # and stays loaded for the next request
+    assert complete("a.gguf").status_code == 200
+    assert len(pool_state()["loaded"]) == 1
+
+
+def test_pool_rejects_unknown_models():
+    global server
+    server.model_pool = 16
+    server.start()
+    assert complete("missing.gguf").status_code == 404
+    assert complete("../main.gguf").status_code == 400
+    assert pool_state()["loaded"] == []
+
+
+def test_pool_unloads_least_recently_used():
+    global server
+    server.model_pool = pool_budget_one_model()
+    server.start()
+    assert complete("a.gguf").status_code == 200
+    assert [e["model"] for e in pool_state()["loaded"]] == ["a.gguf"]
+
+    # b does not fit next to a, which no request uses anymore
+    assert complete("b.gguf").status_code == 200
+    pool = pool_state()
+    assert [e["model"] for e in pool["loaded"]] == ["b.gguf"]
+    assert pool["used"] <= pool["budget"]
+
+    # and a comes back in place of b
+    assert complete("a.gguf").status_code == 200
+    assert [e["model"] for e in pool_state()["loaded"]] == ["a.gguf"]
+
+
+def test_pool_disabled():
+    global server
+    server.start()
+    # without a pool, the "model" field does not select a model
+    assert complete("a.gguf").status_code == 200
+    assert "pool" not in server.make_request("POST", "/model-action", data={"action": "list-models"}).body
@@ -0,0 +1,58 @@
+import pytest
+from utils import *
+
+server = ServerPreset.tinyllama2()
+
+# token ids, so that the prompts share exactly this prefix
+PREFIX = [1] + [10 + i % 400 for i in range(150)]
+SUFFIX = [20 + i for i in range(20)]
+
+
+@pytest.fixture(autouse=True)
+def create_server():
+    global server
+    server = ServerPreset.tinyllama2()
+    server.n_slots = 2
+    server.server_metrics = True
+
+
+def complete(prompt: list, id_slot: int):
+    res = server.make_request("POST", "/completion", data={
+        "prompt": prompt,
+        "n_predict": 4,
+        "cache_prompt": True,
+        "id_slot": id_slot,
+    })
+    assert res.status_code == 200
+    return res
+
+
+def test_prefix_reused_from_other_slot():
+    global server
+    server.start()
+    complete(PREFIX, 0)
+    res = complete(PREFIX + SUFFIX, 1)
+    # slot 1 starts from the KV cache of slot 0 and only evaluates the suffix
+    assert res.body["timings"]["prompt_n"] <= len(SUFFIX) + 1
+    metrics = server.get_metrics()
+    assert metrics["llamacpp:prefix_cache_hits_total"] == 1
+    assert metrics["llamacpp:prefix_cache_tokens_total"] >= len(PREFIX)
+
+
+def test_no_prefix_cache_same_output():
+    global server
+    server.temperature = 0.0
+    server.start()
+    complete(PREFIX, 0)
+    reused = complete(PREFIX + SUFFIX, 1)
+    server.stop()
+
+    # the same prompt evaluated from scratch
+    server.no_prefix_cache = True
+    server.start()
+    complete(PREFIX, 0)
+    fresh = complete(PREFIX + SUFFIX, 1)
+    assert fresh.body["timings"]["prompt_n"] == len(PREFIX) + len(SUFFIX)
+    assert reused.body["content"] == fresh.body["content"]
+    metrics = server.get_metrics()
+    assert metrics["llamacpp:prefix_cache_hits_total"] == 0
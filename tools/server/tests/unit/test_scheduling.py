@@ -0,0 +1,124 @@
+import pytest
+import threading
+import time
+from utils import *
+
+server = ServerPreset.tinyllama2()
+
+TENANT_A_KEY = "sk-tenant-a"
+TENANT_B_KEY = "sk-tenant-b"
+
+
+@pytest.fixture(autouse=True)
+def create_server():
+    global server
+    server = ServerPreset.tinyllama2()
+    server.n_slots = 1
+    server.api_key = TENANT_A_KEY
+    server.api_keys = [TENANT_B_KEY]
+    server.server_metrics = True
+
+
+def complete(api_key: str, n_predict: int, tag: str, order: list, lock: threading.Lock, extra: dict | None = None):
+    res = server.make_request("POST", "/completion", data={
+        "prompt": "Once upon a time",
+        "n_predict": n_predict,
+        "ignore_eos": True,
+        "cache_prompt": False,
+        **(extra or {}),
+    }, headers={
+        "Authorization": f"Bearer {api_key}",
+    })
+    with lock:
+        order.append((tag, res.status_code))
+
+
+def test_fair_queuing_between_api_keys():
+    global server
+    server.start()
+    order = []
+    lock = threading.Lock()
+    # tenant A holds the only slot and queues a backlog
+    threads = [threading.Thread(target=complete, args=(TENANT_A_KEY, 400, f"a{i}", order, lock)) for i in range(8)]
+    for t in threads:
+        t.start()
+    time.sleep(0.1)
+    # tenant B does not wait behind the whole backlog of A
+    t_b = threading.Thread(target=complete, args=(TENANT_B_KEY, 8, "b", order, lock))
+    t_b.start()
+    for t in threads + [t_b]:
+        t.join()
+    assert all(status == 200 for _, status in order)
+    tags = [tag for tag, _ in order]
+    assert len(tags) - 1 - tags.index("b") >= 3, f"tenant B completed after {tags.index('b')} tasks of tenant A"
+
+
+def test_priority_class_served_first():
+    global server
+    server.start()
+    order = []
+    lock = threading.Lock()
+    threads = [threading.Thread(target=complete, args=(TENANT_A_KEY, 400, f"bg{i}", order, lock, {"priority": "background"})) for i in range(6)]
+    for t in threads:
+        t.start()
+    time.sleep(0.1)
+    # same tenant, but the interactive class goes before the background backlog
+    t_i = threading.Thread(target=complete, args=(TENANT_A_KEY, 8, "interactive", order, lock))
+    t_i.start()
+    for t in threads + [t_i]:
+        t.join()
+    tags = [tag for tag, _ in order]
+    assert len(tags) - 1 - tags.index("interactive") >= 3
+    metrics = server.get_metrics()
+    assert metrics['llamacpp:requests_started_total{priority="background"}'] >= 6
+
+
+def test_queue_max_rejects():
+    global server
+    server.queue_max = 1
+    server.start()
+    order = []
+    lock = threading.Lock()
+    threads = [threading.Thread(target=complete, args=(TENANT_A_KEY, 400, f"a{i}", order, lock)) for i in range(4)]
+    for t in threads:
+        t.start()
+    for t in threads:
+        t.join()
+    statuses = [status for _, status in order]
+    assert statuses.count(200) >= 2  # the running task and the queued one
+    assert statuses.count(503) >= 1
+    metrics = server.get_metrics()
+    assert metrics['llamacpp:requests_rejected_total{priority="interactive"}'] >= 1
+
+
+@pytest.mark.skipif(not is_slow_test_allowed(), reason="skipping slow test")
+def test_interactive_preempts_background_prefill():
+    global server
+    server = ServerPreset.stories15m_moe()
+    server.n_slots = 1
+    server.n_batch = 16
+    server.n_ubatch = 16
+    server.server_metrics = True
+    server.start(timeout_seconds=DEFAULT_HTTP_TIMEOUT * 10)
+    results = {}
+
+    def run(tag: str, data: dict):
+        results[tag] = server.make_request("POST", "/completion", data=data)
+
+    # a long prompt prefilled 16 tokens at a time, as background work
+    background = threading.Thread(target=run, args=("background", {
+        "prompt": [1] + [10 + i % 400 for i in range(1500)],
+        "n_predict": 4,
+        "priority": "background",
+    }))
+    background.start()
+    time.sleep(0.3)
+    run("interactive", {"prompt": "Once upon a time", "n_predict": 4})
+    background.join()
+
+    assert results["interactive"].status_code == 200
+    # the preempted task resumes and completes
+    assert results["background"].status_code == 200
+    assert results["background"].body["tokens_predicted"] == 4
+    metrics = server.get_metrics()
+    assert metrics['llamacpp:requests_preempted_total{priority="background"}'] >= 1
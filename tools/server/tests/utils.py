@@ -78,6 +78,16 @@ class ServerProcess:
     pooling: str | None = None
     draft: int | None = None
     api_key: str | None = None
+    api_keys: List[str] | None = None # in addition to api_key
+    queue_max: int | None = None
+    no_prefix_cache: bool | None = None
+    kv_spill_ram: int | None = None
+    kv_spill_dir: str | None = None
+    kv_spill_disk: int | None = None
+    kv_spill_encrypt: bool | None = None
+    model_pool: int | None = None
+    model_pool_parallel: int | None = None
+    model_pool_ctx_size: int | None = None
     lora_files: List[str] | None = None
     disable_ctx_shift: int | None = False
     draft_min: int | None = None
@@ -181,6 +191,27 @@ class ServerProcess:
             server_args.extend(["--no-context-shift"])
         if self.api_key:
             server_args.extend(["--api-key", self.api_key])
+        if self.api_keys:
+            for api_key in self.api_keys:
+                server_args.extend(["--api-key", api_key])
+        if self.queue_max:
+            server_args.extend(["--queue-max", self.queue_max])
+        if self.no_prefix_cache:
+            server_args.append("--no-prefix-cache")
+        if self.kv_spill_ram:
+            server_args.extend(["--kv-spill-ram", self.kv_spill_ram])
+        if self.kv_spill_dir:
+            server_args.extend(["--kv-spill-dir", self.kv_spill_dir])
+        if self.kv_spill_disk:
+            server_args.extend(["--kv-spill-disk", self.kv_spill_disk])
+        if self.kv_spill_encrypt:
+            server_args.append("--kv-spill-encrypt")
+        if self.model_pool:
+            server_args.extend(["--model-pool", self.model_pool])
+        if self.model_pool_parallel:
+            server_args.extend(["--model-pool-parallel", self.model_pool_parallel])
+        if self.model_pool_ctx_size:
+            server_args.extend(["--model-pool-ctx-size", self.model_pool_ctx_size])
         if self.draft_max:
             server_args.extend(["--draft-max", self.draft_max])
         if self.draft_min:
@@ -273,6 +304,23 @@ class ServerProcess:
         print("Response from server", json.dumps(result.body, indent=2))
         return result
 
+    def get_metrics(self) -> dict[str, float]:
+        """
+        Fetch /metrics (requires server_metrics) and return the samples by name, with their labels if any,
+        e.g. "llamacpp:requests_preempted_total{priority=\"background\"}".
+        """
+        url = f"http://{self.server_host}:{self.server_port}/metrics"
+        headers = {"Authorization": f"Bearer {self.api_key}"} if self.api_key else None
+        response = requests.get(url, headers=headers)
+        assert response.status_code == 200
+        metrics = {}
+        for line in response.text.splitlines():
+            if line.startswith("#") or not line.strip():
+                continue
+            name, value = line.rsplit(" ", 1)
+            metrics[name] = float(value)
+        return metrics
+
     def make_stream_request(
         self,
         method: str,
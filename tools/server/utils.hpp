@@ -18,7 +18,10 @@
 #include "json.hpp"
 #include "chat.h"
 
+#include <functional>
+#include <map>
 #include <random>
+#include <set>
 #include <sstream>
 #include <string>
 #include <vector>
@@ -226,6 +229,27 @@ static std::vector<llama_tokens> tokenize_input_prompts(const llama_vocab * voca
     return result;
 }
 
+/**
+ * tokenize a span of text straight into the tail of `tokens`, without a std::string copy of the text
+ * (e.g. a decrypted RAG chunk in an arena)
+ */
+static void tokenize_append(const llama_vocab * vocab, const char * text, size_t len, bool add_special, bool parse_special, llama_tokens & tokens) {
+    const size_t n_past = tokens.size();
+    // upper limit for the number of tokens
+    tokens.resize(n_past + len + 2 * add_special);
+    int32_t n_tokens = llama_tokenize(vocab, text, len, tokens.data() + n_past, tokens.size() - n_past, add_special, parse_special);
+    if (n_tokens < 0) {
+        tokens.resize(n_past - n_tokens);
+        n_tokens = llama_tokenize(vocab, text, len, tokens.data() + n_past, tokens.size() - n_past, add_special, parse_special);
+        GGML_ASSERT(n_tokens >= 0);
+    }
+    tokens.resize(n_past + n_tokens);
+}
+
+static void tokenize_append(const llama_vocab * vocab, const std::string & text, bool add_special, bool parse_special, llama_tokens & tokens) {
+    tokenize_append(vocab, text.data(), text.size(), add_special, parse_special, tokens);
+}
+
 // return the last index of character that can form a valid string
 // if the last character is potentially cut in half, return the index before the cut
 // if validate_utf8(text) == text.size(), then the whole text is valid utf8
@@ -1063,6 +1087,7 @@ public:
     }
 
     server_tokens(llama_tokens & tokens, bool has_mtmd) : has_mtmd(has_mtmd), tokens(tokens) {}
+    server_tokens(llama_tokens && tokens, bool has_mtmd) : has_mtmd(has_mtmd), tokens(std::move(tokens)) {}
 
     // for debugging
     std::string str() const {
@@ -1283,6 +1308,140 @@ public:
     }
 };
 
+// radix tree of the token sequences held in the KV cache, to find the longest cached prefix of a prompt
+// whatever the sequence (slot) that holds it
+struct server_prefix_tree {
+    struct node {
+        llama_tokens edge; // tokens from the parent to this node
+        std::map<llama_token, std::unique_ptr<node>> children;
+        std::set<llama_seq_id> seqs; // the sequences that hold the tokens up to the end of the edge
+    };
+
+    node root;
+    std::map<llama_seq_id, llama_tokens> paths;
+
+    // the KV cache of seq holds tokens (replaces what it held before)
+    void insert(llama_seq_id seq, const llama_tokens & tokens) {
+        remove(seq);
+        if (tokens.empty()) {
+            return;
+        }
+        paths[seq] = tokens;
+
+        node * cur = &root;
+        size_t i = 0;
+        while (i < tokens.size()) {
+            auto it = cur->children.find(tokens[i]);
+            if (it == cur->children.end()) {
+                auto leaf = std::make_unique<node>();
+                leaf->edge.assign(tokens.begin() + i, tokens.end());
+                leaf->seqs.insert(seq);
+                cur->children[tokens[i]] = std::move(leaf);
+                break;
+            }
+
+            node * child = it->second.get();
+            const size_t k = common_length(child->edge, tokens, i);
+            if (k < child->edge.size()) {
+                // split the edge: the tokens after the common part go to a new child
+                auto mid = std::make_unique<node>();
+                mid->edge.assign(child->edge.begin(), child->edge.begin() + k);
+                mid->seqs = child->seqs;
+                child->edge.erase(child->edge.begin(), child->edge.begin() + k);
+                mid->children[child->edge[0]] = std::move(it->second);
+                it->second = std::move(mid);
+                child = it->second.get();
+            }
+            child->seqs.insert(seq);
+            cur = child;
+            i += k;
+        }
+    }
+
+    // the KV cache of seq does not hold its tokens anymore
+    void remove(llama_seq_id seq) {
+        auto it = paths.find(seq);
+        if (it == paths.end()) {
+            return;
+        }
+        remove(root, it->second, 0, seq);
+        paths.erase(it);
+    }
+
+    // length of the longest prefix of tokens held by a sequence accepted by usable, and that sequence
+    // (prefer, if it holds it)
+    size_t match(const llama_tokens & tokens, llama_seq_id prefer, const std::function<bool(llama_seq_id)> & usable, llama_seq_id & seq) const {
+        seq = -1;
+        size_t n_match = 0;
+        const node * cur = &root;
+        while (n_match < tokens.size()) {
+            auto it = cur->children.find(tokens[n_match]);
+            if (it == cur->children.end()) {
+                break;
+            }
+            const node * child = it->second.get();
+
+            // the sequences of a node also hold all the tokens above it
+            llama_seq_id holder = -1;
+            if (child->seqs.count(prefer) && usable(prefer)) {
+                holder = prefer;
+            } else {
+                for (llama_seq_id s : child->seqs) {
+                    if (usable(s)) {
+                        holder = s;
+                        break;
+                    }
+                }
+            }
+            if (holder == -1) {
+                break;
+            }
+
+            const size_t k = common_length(child->edge, tokens, n_match);
+            seq = holder;
+            n_match += k;
+            if (k < child->edge.size()) {
+                break;
+            }
+            cur = child;
+        }
+        return n_match;
+    }
+
+private:
+    static size_t common_length(const llama_tokens & edge, const llama_tokens & tokens, size_t offset) {
+        size_t k = 0;
+        while (k < edge.size() && offset + k < tokens.size() && edge[k] == tokens[offset + k]) {
+            k++;
+        }
+        return k;
+    }
+
+    void remove(node & cur, const llama_tokens & tokens, size_t i, llama_seq_id seq) {
+        if (i >= tokens.size()) {
+            return;
+        }
+        auto it = cur.children.find(tokens[i]);
+        if (it == cur.children.end()) {
+            return;
+        }
+        node & child = *it->second;
+        child.seqs.erase(seq);
+        remove(child, tokens, i + child.edge.size(), seq);
+
+        if (child.seqs.empty()) {
+            // no sequence goes through the node anymore, nor through its children
+            cur.children.erase(it);
+        } else if (child.children.size() == 1 && child.children.begin()->second->seqs == child.seqs) {
+            // merge the node with its only child, to keep the tree compressed
+            std::unique_ptr<node> grandchild = std::move(child.children.begin()->second);
+            child.children.clear();
+            child.edge.insert(child.edge.end(), grandchild->edge.begin(), grandchild->edge.end());
+            child.children = std::move(grandchild->children);
+        }
+    }
+};
+
 // Computes FNV-1a hash of the data
 static std::string fnv_hash(const uint8_t * data, size_t len) {
     const uint64_t fnv_prime = 0x100000001b3ULL;
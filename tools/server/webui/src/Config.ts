@@ -22,6 +22,7 @@ export const CONFIG_DEFAULT = {
   // Note: in order not to introduce breaking changes, please keep the same data type (number, string, etc) if you want to change the default value. Do not use null or undefined for default value.
   // Do not use nested objects, keep it single level. Prefix the key if you need to group them.
   apiKey: '',
+  ragRecipientKey: '',
   systemMessage: '',
   showTokensPerSecond: false,
   showThoughtInProgress: false,
@@ -61,6 +62,8 @@ export const CONFIG_DEFAULT = {
 };
 export const CONFIG_INFO: Record<string, string> = {
   apiKey: 'Set the API Key if you are using --api-key option for the server.',
+  ragRecipientKey:
+    'Hex private key the RAG chunks are encrypted for. Leave empty to use the one of the --rag-recipient-key-file option of the server.',
   systemMessage: 'The starting message that defines how model should behave.',
   samplers:
     'The order at which samplers are applied, in simplified way. Default is "dkypmxt": dry->top_k->typ_p->top_p->min_p->xtc->temperature',
@@ -121,6 +121,11 @@ export default function SettingDialog({
           label: 'API Key',
           key: 'apiKey',
         },
+        {
+          type: SettingInputType.SHORT_INPUT,
+          label: 'RAG Recipient Key',
+          key: 'ragRecipientKey',
+        },
         {
           type: SettingInputType.LONG_INPUT,
           label: 'System Message (will be disabled if left empty)',
@@ -88,8 +88,9 @@ export default function Sidebar() {
             },
             controller_public_key:
               '012345678901234567890123456789012345678901234567890123456789012345', // TODO: Replace with actual keys
-            recipient_private_key:
-              '0123456789012345678901234567890123456789012345678901234567890123', // TODO: Replace with actual keys
+            ...(gconfig.ragRecipientKey
+              ? { recipient_private_key: gconfig.ragRecipientKey }
+              : {}),
           },
         };
 
@@ -175,8 +175,9 @@ export function NavAdmin() {
         },
         controller_public_key:
           '012345678901234567890123456789012345678901234567890123456789012345',
-        recipient_private_key:
-          '0123456789012345678901234567890123456789012345678901234567890123',
+        ...(gconfig.ragRecipientKey
+          ? { recipient_private_key: gconfig.ragRecipientKey }
+          : {}),
       },
     };
 
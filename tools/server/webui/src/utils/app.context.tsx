@@ -245,6 +245,10 @@ export const AppContextProvider = ({
           host: getSelectedRagConnection(config).host,
           port: getSelectedRagConnection(config).port,
           name: getSelectedRagConnection(config).name,
+          // must match the key used at insertion, the server falls back to its --rag-recipient-key-file
+          ...(config.ragRecipientKey
+            ? { recipient_private_key: config.ragRecipientKey }
+            : {}),
         },
 
         ...(config.custom.length ? JSON.parse(config.custom) : {}),